@@ -0,0 +1,136 @@
+"""
+Live admission counters of a running server.
+
+Reads the shared memory segment every server process counts its connections
+in (/dev/shm/cftp_server.<port>) and prints the limits, the connections and
+logged in sessions right now, how many were admitted and refused since the
+server started, and the addresses and users holding the most connections.
+It also shows the transfer buffer chunks TLS downloads hold against
+transfer_chunks_total. Nothing is locked, the numbers may be off by a
+connection that is just coming or going. The segment is readable by the
+server's user only, run this as that user (root for a server started as
+root).
+
+    sudo python3 benchmarks/admission_stats.py --port 21 --top 10
+
+`--interval` keeps printing, e.g. while bench_accept_rate.py runs.
+"""
+
+import argparse
+import ipaddress
+import mmap
+import pwd
+import struct
+import time
+
+MAGIC = 0x41544643
+VERSION = 2
+HEADER = struct.Struct("=12I4Q2I")
+HEADER_FIELDS = (
+    "magic",
+    "version",
+    "max_total",
+    "max_per_ip",
+    "max_per_user",
+    "tickets",
+    "count_slots",
+    "tickets_offset",
+    "ips_offset",
+    "users_offset",
+    "active",
+    "logged_in",
+    "admitted",
+    "rejected_total",
+    "rejected_ip",
+    "rejected_user",
+    "max_buffer_chunks",
+    "buffer_chunks",
+)
+COUNT = struct.Struct("=16sI")
+
+
+def read_counts(segment, offset, slots):
+    counts = []
+    for slot in range(slots):
+        key, count = COUNT.unpack_from(segment, offset + slot * COUNT.size)
+        if count:
+            counts.append((count, key))
+    counts.sort(reverse=True)
+    return counts
+
+
+def address(key):
+    ip = ipaddress.IPv6Address(key)
+    return str(ip.ipv4_mapped or ip)
+
+
+def user(key):
+    uid = struct.unpack_from("=I", key)[0]
+    try:
+        return pwd.getpwuid(uid).pw_name
+    except KeyError:
+        return str(uid)
+
+
+def limit(value):
+    return str(value) if value else "unlimited"
+
+
+def report(segment, top):
+    header = dict(zip(HEADER_FIELDS, HEADER.unpack_from(segment, 0)))
+    if header["magic"] != MAGIC or header["version"] != VERSION:
+        raise SystemExit("not an admission segment of a known version")
+
+    print(
+        f"connections {header['active']}/{header['max_total']}  "
+        f"logged in {header['logged_in']}  "
+        f"per address {limit(header['max_per_ip'])}  "
+        f"per user {limit(header['max_per_user'])}"
+    )
+    print(
+        f"admitted {header['admitted']}  refused: "
+        f"total {header['rejected_total']} "
+        f"address {header['rejected_ip']} "
+        f"user {header['rejected_user']}"
+    )
+    print(
+        f"transfer buffer chunks {header['buffer_chunks']}/"
+        f"{limit(header['max_buffer_chunks'])}"
+    )
+
+    slots = header["count_slots"]
+    for title, offset, name in (
+        ("address", header["ips_offset"], address),
+        ("user", header["users_offset"], user),
+    ):
+        counts = read_counts(segment, offset, slots)[:top]
+        if counts:
+            print(f"  {title:<40} connections")
+        for count, key in counts:
+            print(f"  {name(key):<40} {count}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--top", type=int, default=10)
+    parser.add_argument("--interval", type=float, default=0)
+    args = parser.parse_args()
+
+    path = f"/dev/shm/cftp_server.{args.port}"
+    try:
+        with open(path, "rb") as file:
+            segment = mmap.mmap(file.fileno(), 0, prot=mmap.PROT_READ)
+    except PermissionError:
+        raise SystemExit(f"{path} is readable by the server's user only")
+
+    while True:
+        report(segment, args.top)
+        if not args.interval:
+            break
+        time.sleep(args.interval)
+        print()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,92 @@
+"""
+Accept-rate benchmark for the control listener.
+
+Opens many control connections in parallel, waits for the `220` greeting and
+sends QUIT, then reports connections per second and greeting latency.
+
+Compare process models by running it against the same server once with
+`worker_processes=0` (accept and fork in the main process) and once with
+`worker_processes=N` (prefork acceptor workers) in /etc/cftp_server.conf:
+
+    python3 benchmarks/bench_accept_rate.py --connections 5000 --concurrency 200
+
+The same goes for `session_zygote=0` and `1`. `--background-sessions` keeps
+that many idle sessions open during the storm, so the accepting process
+carries the per-session state it has in production.
+"""
+
+import argparse
+import socket
+import statistics
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+
+def one_session(host, port, timeout):
+    start = time.perf_counter()
+    try:
+        with socket.create_connection((host, port), timeout=timeout) as sock:
+            greeting = sock.recv(512)
+            elapsed = time.perf_counter() - start
+            if not greeting.startswith(b"220"):
+                return None
+            sock.sendall(b"QUIT\r\n")
+            return elapsed
+    except OSError:
+        return None
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    index = min(len(samples) - 1, int(round(pct / 100.0 * (len(samples) - 1))))
+    return samples[index]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--connections", type=int, default=2000)
+    parser.add_argument("--concurrency", type=int, default=100)
+    parser.add_argument("--timeout", type=float, default=10.0)
+    parser.add_argument("--background-sessions", type=int, default=0,
+                        help="Idle sessions kept open during the storm")
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+
+    background = []
+    for _ in range(args.background_sessions):
+        try:
+            sock = socket.create_connection((args.host, args.port),
+                                            timeout=args.timeout)
+            sock.recv(512)
+            background.append(sock)
+        except OSError:
+            break
+
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        results = list(pool.map(
+            lambda _: one_session(args.host, args.port, args.timeout),
+            range(args.connections)))
+    wall = time.perf_counter() - start
+
+    for sock in background:
+        sock.close()
+
+    latencies = sorted(r for r in results if r is not None)
+    failed = len(results) - len(latencies)
+
+    print(f"{args.label or 'accept-rate'}: {len(latencies)} sessions "
+          f"({failed} failed) in {wall:.2f}s -> "
+          f"{len(latencies) / wall:.0f} conn/s")
+    if latencies:
+        print(f"  time-to-220 ms: mean {statistics.mean(latencies) * 1e3:.2f} "
+              f"p50 {percentile(latencies, 50) * 1e3:.2f} "
+              f"p99 {percentile(latencies, 99) * 1e3:.2f} "
+              f"max {latencies[-1] * 1e3:.2f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,131 @@
+"""
+Server CPU and login latency during a password spray.
+
+Sends wrong passwords for --spray-user from --sources local addresses
+(127.0.0.2, 127.0.0.3, ...) on --concurrency connections while a few good
+logins of --user from 127.0.0.1 measure how long a login takes. Prints the
+spray attempts answered, the CPU seconds the host spent less what the
+client spent, and the good login latencies. Run it on the server host while
+nothing else is busy.
+Compare `auth_failure_delay=0` with the default backoff, or a small
+`auth_crypt_concurrency` with `0`:
+
+    python3 benchmarks/bench_auth_spray.py --user ftpuser --password secret \\
+        --spray-user other --sources 64 --duration 20
+
+Spraying --user itself backs off its good logins as well.
+"""
+
+import argparse
+import os
+import resource
+import socket
+import statistics
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+
+def server_cpu_seconds():
+    # Session processes come and go, count the whole host and take out
+    # what this client spent
+    with open("/proc/stat") as stat:
+        fields = [int(value) for value in stat.readline().split()[1:]]
+    busy = sum(fields) - fields[3] - fields[4]  # Without idle and iowait
+    client = resource.getrusage(resource.RUSAGE_SELF)
+    return (busy / os.sysconf("SC_CLK_TCK") -
+            client.ru_utime - client.ru_stime)
+
+
+def read_reply(sock):
+    data = b""
+    while not data.endswith(b"\r\n"):
+        chunk = sock.recv(512)
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def login(args, source, user, password):
+    """Returns the seconds PASS took to answer and whether it was 230."""
+    try:
+        with socket.create_connection((args.host, args.port), args.timeout,
+                                      source_address=(source, 0)) as sock:
+            read_reply(sock)
+            sock.sendall(f"USER {user}\r\n".encode())
+            read_reply(sock)
+            start = time.perf_counter()
+            sock.sendall(f"PASS {password}\r\n".encode())
+            ok = read_reply(sock).startswith(b"230")
+            elapsed = time.perf_counter() - start
+            sock.sendall(b"QUIT\r\n")
+            return elapsed, ok
+    except OSError:
+        return None, False
+
+
+def spray(args, index, stop, attempts):
+    source = f"127.0.0.{2 + index % args.sources}"
+    while not stop.is_set():
+        elapsed, _ = login(args, source, args.spray_user, "spray-wrong")
+        if elapsed is not None:
+            attempts.append(elapsed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--spray-user", help="Defaults to --user")
+    parser.add_argument("--sources", type=int, default=16,
+                        help="Local addresses the spray comes from, max 250")
+    parser.add_argument("--concurrency", type=int, default=64)
+    parser.add_argument("--duration", type=float, default=10.0)
+    parser.add_argument("--logins", type=int, default=20,
+                        help="Good logins during the spray, one at a time")
+    parser.add_argument("--timeout", type=float, default=60.0)
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+    args.spray_user = args.spray_user or args.user
+    args.sources = max(1, min(args.sources, 250))
+
+    stop = threading.Event()
+    attempts = []
+    latencies = []
+    cpu_before = server_cpu_seconds()
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        for index in range(args.concurrency):
+            pool.submit(spray, args, index, stop, attempts)
+
+        pause = args.duration / (args.logins + 1)
+        for _ in range(args.logins):
+            time.sleep(pause)
+            elapsed, ok = login(args, "127.0.0.1", args.user, args.password)
+            if ok:
+                latencies.append(elapsed)
+
+        remaining = args.duration - (time.perf_counter() - start)
+        time.sleep(max(0.0, remaining))
+        stop.set()
+        wall = time.perf_counter() - start
+        cpu = server_cpu_seconds() - cpu_before
+
+    print(f"{args.label or 'auth-spray'}: {len(attempts)} wrong passwords "
+          f"answered from {args.sources} addresses in {wall:.2f}s, "
+          f"{len(attempts) / wall:.1f}/s")
+    print(f"  server CPU {cpu:.2f}s, {cpu / wall * 100:.0f}% of one CPU")
+    if latencies:
+        latencies.sort()
+        print(f"  {len(latencies)}/{args.logins} good logins, PASS took "
+              f"median {statistics.median(latencies) * 1000:.1f}ms "
+              f"max {latencies[-1] * 1000:.1f}ms")
+    else:
+        print(f"  0/{args.logins} good logins")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,232 @@
+/*
+    Cost of reading, parsing and dispatching control commands, see
+    src/engine/command_parser.h.
+
+    Times parse_command_line alone on a mix of command lines, looking their
+    verbs up with find_command_action against a flat_table keyed by the
+    same verbs, then execute_ftp_input on batches of --batch pipelined
+    commands of a logged in session over a bufferevent pair, with the
+    replies flushed and read after every batch. Heap
+    allocations are counted around each of them, those of
+    execute_ftp_input include queueing the replies. Built with the server,
+    run from the build directory:
+
+        ./bench_command_parser 1000000 8
+*/
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "command_actions.h"
+#include "command_parser.h"
+#include "connection.h"
+#include "logger.h"
+#include "structures/flat_table.h"
+
+/* glibc's own allocator, wrapped below to count calls */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static const char *const g_lines[] = {
+    "NOOP",
+    "PWD",
+    "TYPE I",
+    "SYST",
+    "SIZE reports/2024/summary.csv",
+    "MDTM \"annual report.pdf\"",
+    "RNTO a\\ file\\ with\\ blanks",
+    "MLSD",
+    "retr /pub/archive.tar.gz",
+    "CWD ..",
+};
+#define LINE_COUNT (sizeof(g_lines) / sizeof(g_lines[0]))
+
+/* Answered without touching the file system */
+static const char *const g_dispatched[] = {"NOOP", "PWD", "TYPE I", "SYST"};
+#define DISPATCHED_COUNT (sizeof(g_dispatched) / sizeof(g_dispatched[0]))
+
+DEFINE_FLAT_TABLE(verb_table, uint32_t, const command_action *)
+
+static unsigned long g_allocations = 0;
+
+static double now_seconds(void);
+static void bench_parser(long commands);
+static void bench_lookup(long commands);
+static void bench_dispatcher(long commands, int batch);
+static void log_to_stderr(const char *message);
+
+void *malloc(size_t size)
+{
+    g_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    g_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    g_allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+int main(int argc, char **argv)
+{
+    long commands = argc > 1 ? atol(argv[1]) : 1000000;
+    int batch = argc > 2 ? atoi(argv[2]) : 8;
+    if (commands <= 0 || batch <= 0)
+    {
+        fprintf(stderr, "usage: %s [commands] [batch]\n", argv[0]);
+        return 1;
+    }
+
+    initialize_logger(log_to_stderr);
+    bench_parser(commands);
+    bench_lookup(commands);
+    bench_dispatcher(commands, batch);
+    return 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void bench_parser(long commands)
+{
+    /* Parsing writes over the line, every round parses a fresh copy */
+    static command_arena_t arena;
+    size_t lengths[LINE_COUNT];
+    for (size_t i = 0; i < LINE_COUNT; i++) lengths[i] = strlen(g_lines[i]);
+
+    long arguments = 0;
+    unsigned long allocations = g_allocations;
+    double start = now_seconds();
+    for (long i = 0; i < commands; i++)
+    {
+        size_t line = (size_t)i % LINE_COUNT;
+        memcpy(arena.line, g_lines[line], lengths[line] + 1);
+        parse_command_line(arena.line, &arena.command);
+        arguments += arena.command.argc;
+    }
+    double elapsed = now_seconds() - start;
+    allocations = g_allocations - allocations;
+
+    printf("parse_command_line: %.0f commands/s, %.2f allocations per "
+           "command (%ld arguments)\n",
+           commands / elapsed,
+           (double)allocations / commands,
+           arguments);
+}
+
+static void bench_lookup(long commands)
+{
+    flat_table_t *registry = verb_table_create();
+    for (size_t i = 0; i < COMMAND_SLOTS && registry; i++)
+        if (command_actions[i].verb &&
+            !verb_table_insert(
+                registry, command_actions[i].verb, &command_actions[i]))
+            break;
+    if (!registry)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    cftp_command_t parsed[LINE_COUNT];
+    for (size_t i = 0; i < LINE_COUNT; i++)
+    {
+        char line[MAX_COMMAND_LINE_LENGTH + 1];
+        snprintf(line, sizeof(line), "%s", g_lines[i]);
+        parse_command_line(line, &parsed[i]);
+    }
+
+    /* Both must find the same commands */
+    long found = 0, registry_found = 0;
+    double start = now_seconds();
+    for (long i = 0; i < commands; i++)
+        found += find_command_action(parsed[i % LINE_COUNT].verb) != NULL;
+    double elapsed = now_seconds() - start;
+
+    start = now_seconds();
+    for (long i = 0; i < commands; i++)
+        registry_found +=
+            verb_table_lookup(registry, parsed[i % LINE_COUNT].verb) != NULL;
+    double registry_elapsed = now_seconds() - start;
+
+    printf("find_command_action: %.1f ns per lookup, flat_table: %.1f ns "
+           "(%ld and %ld found)\n",
+           elapsed * 1e9 / commands,
+           registry_elapsed * 1e9 / commands,
+           found,
+           registry_found);
+    free_flat_table(registry);
+}
+
+static void bench_dispatcher(long commands, int batch)
+{
+    struct event_base *base = event_base_new();
+    struct bufferevent *pair[2];
+    connection_t *connection = create_connection(NULL, NULL);
+    if (!base || !connection || bufferevent_pair_new(base, 0, pair) != 0)
+    {
+        fprintf(stderr, "Cannot set up a session\n");
+        exit(1);
+    }
+
+    connection->base = base;
+    connection->bev = pair[0];
+    connection->authenticated = 1;
+    snprintf(connection->cwd, sizeof(connection->cwd), "/");
+    bufferevent_enable(pair[0], EV_READ | EV_WRITE);
+    bufferevent_enable(pair[1], EV_READ | EV_WRITE);
+
+    struct evbuffer *input = evbuffer_new();
+    for (int i = 0; i < batch; i++)
+        evbuffer_add_printf(
+            input, "%s\r\n", g_dispatched[i % DISPATCHED_COUNT]);
+    size_t batch_length = evbuffer_get_length(input);
+    const char *batch_text = (const char *)evbuffer_pullup(input, -1);
+
+    long rounds = (commands + batch - 1) / batch;
+    unsigned long allocations = 0;
+    size_t replied = 0;
+    double start = now_seconds();
+    for (long i = 0; i < rounds; i++)
+    {
+        bufferevent_write(pair[1], batch_text, batch_length);
+
+        unsigned long before = g_allocations;
+        execute_ftp_input(connection);
+        allocations += g_allocations - before;
+
+        event_base_loop(base, EVLOOP_NONBLOCK);
+        struct evbuffer *replies = bufferevent_get_input(pair[1]);
+        replied += evbuffer_get_length(replies);
+        evbuffer_drain(replies, evbuffer_get_length(replies));
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("execute_ftp_input: %.0f commands/s in batches of %d, %.2f "
+           "allocations per command (%zu reply bytes)\n",
+           rounds * batch / elapsed,
+           batch,
+           (double)allocations / (rounds * batch),
+           replied);
+
+    evbuffer_free(input);
+    bufferevent_free(pair[1]);
+}
+
+static void log_to_stderr(const char *message) { fputs(message, stderr); }
@@ -0,0 +1,182 @@
+"""
+Write syscalls and TLS records per reply of pipelined control commands.
+
+Logs in, then sends --rounds batches of --batch cheap commands (NOOP, PWD,
+TYPE I, SYST), each batch in one packet, and reads all their replies before
+sending the next. The write syscalls come from the syscw counter in
+/proc/<pid>/io of the process serving the session, so run it on the server
+host as the server's user or root. By default that is the newest cftp_server
+process once logged in, which is the session process unless sessions share
+a process (session threads, user workers), pass --pid then. With --tls the
+records the server sent are counted from the raw stream:
+
+    python3 benchmarks/bench_control_replies.py --user ftpuser \\
+        --password secret --tls --batch 8
+"""
+
+import argparse
+import socket
+import ssl
+import subprocess
+import time
+
+COMMANDS = [b"NOOP", b"PWD", b"TYPE I", b"SYST"]
+APPLICATION_DATA = 23
+
+
+class Control:
+    """Control connection counting the TLS records it receives"""
+
+    def __init__(self, args):
+        self.sock = socket.create_connection((args.host, args.port),
+                                             args.timeout)
+        self.tls = None
+        self.raw = b""       # Received bytes not yet split into records
+        self.records = 0     # Application data records received
+        self.text = b""
+
+    def start_tls(self):
+        context = ssl.create_default_context()
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+        self.incoming = ssl.MemoryBIO()
+        self.outgoing = ssl.MemoryBIO()
+        self.tls = context.wrap_bio(self.incoming, self.outgoing)
+        while True:
+            try:
+                self.tls.do_handshake()
+                break
+            except ssl.SSLWantReadError:
+                self._flush()
+                self._receive()
+        self._flush()
+
+    def send(self, data):
+        if self.tls:
+            self.tls.write(data)
+            self._flush()
+        else:
+            self.sock.sendall(data)
+
+    def replies(self, count):
+        """Codes of the next count replies, multi-line ones count once"""
+        codes = []
+        while len(codes) < count:
+            while b"\r\n" not in self.text:
+                self._read_text()
+            line, self.text = self.text.split(b"\r\n", 1)
+            if len(line) >= 4 and line[:3].isdigit() and line[3:4] == b" ":
+                codes.append(int(line[:3]))
+        return codes
+
+    def _read_text(self):
+        if not self.tls:
+            self.text += self._receive()
+            return
+        while True:
+            try:
+                self.text += self.tls.read(65536)
+                return
+            except ssl.SSLWantReadError:
+                self._receive()
+
+    def _receive(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise ConnectionError("server closed the connection")
+        if self.tls:
+            self.incoming.write(data)
+            self._count_records(data)
+        return data
+
+    def _count_records(self, data):
+        self.raw += data
+        while len(self.raw) >= 5:
+            length = 5 + int.from_bytes(self.raw[3:5], "big")
+            if len(self.raw) < length:
+                break
+            if self.raw[0] == APPLICATION_DATA:
+                self.records += 1
+            self.raw = self.raw[length:]
+
+    def _flush(self):
+        data = self.outgoing.read()
+        if data:
+            self.sock.sendall(data)
+
+
+def write_syscalls(pid):
+    with open(f"/proc/{pid}/io") as io:
+        for line in io:
+            if line.startswith("syscw:"):
+                return int(line.split()[1])
+    return 0
+
+
+def newest_server_process():
+    output = subprocess.run(["pgrep", "-n", "-x", "cftp_server"],
+                            capture_output=True, text=True).stdout.split()
+    if not output:
+        raise SystemExit("no cftp_server process, pass --pid")
+    return int(output[0])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--tls", action="store_true")
+    parser.add_argument("--batch", type=int, default=8,
+                        help="Commands sent together")
+    parser.add_argument("--rounds", type=int, default=500)
+    parser.add_argument("--pid", type=int,
+                        help="Process serving the session")
+    parser.add_argument("--timeout", type=float, default=30.0)
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+
+    control = Control(args)
+    control.replies(1)
+    if args.tls:
+        control.send(b"AUTH TLS\r\n")
+        control.replies(1)
+        control.start_tls()
+    control.send(f"USER {args.user}\r\n".encode())
+    control.replies(1)
+    control.send(f"PASS {args.password}\r\n".encode())
+    if control.replies(1)[0] != 230:
+        raise SystemExit("login failed")
+
+    # Settled, e.g. session tickets are in
+    control.send(b"NOOP\r\n")
+    control.replies(1)
+    time.sleep(0.2)
+    pid = args.pid or newest_server_process()
+
+    batch = b"".join(COMMANDS[i % len(COMMANDS)] + b"\r\n"
+                     for i in range(args.batch))
+    records = control.records
+    syscalls = write_syscalls(pid)
+    start = time.perf_counter()
+    for _ in range(args.rounds):
+        control.send(batch)
+        control.replies(args.batch)
+    elapsed = time.perf_counter() - start
+    syscalls = write_syscalls(pid) - syscalls
+    records = control.records - records
+
+    commands = args.rounds * args.batch
+    line = (f"{args.label or 'replies'}: {commands} commands in batches of "
+            f"{args.batch}, {syscalls / commands:.2f} write syscalls per "
+            f"command")
+    if args.tls:
+        line += f", {records / commands:.2f} TLS records per command"
+    line += f", {elapsed / args.rounds * 1000:.2f} ms per batch"
+    print(line)
+    control.send(b"QUIT\r\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,296 @@
+/*
+    Insert, lookup and delete cost of the hash tables, see
+    src/core/structures/flat_table.h.
+
+    For 1k, 10k, ... keys up to the first argument, times inserting random
+    64 bit keys into a typed flat_table, looking every one up again in
+    another order, looking up as many keys that are not there and deleting
+    all of them, then the same with string keys through the hash_table API
+    of structures/hashmap.h. The slowest single insert shows what growing
+    costs. Every result is checked, a wrong one fails with exit status 1,
+    so that a small run doubles as a test. Built with the server, run from
+    the build directory:
+
+        ./bench_hash_table 10000000
+        ./bench_hash_table 1000000 strings
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "structures/flat_table.h"
+#include "structures/hashmap.h"
+
+#define STRING_KEY_LENGTH 32
+
+DEFINE_FLAT_TABLE(u64_table, uint64_t, uint64_t)
+
+typedef struct
+{
+    double insert;
+    double worst_insert;
+    double hit;
+    double miss;
+    double remove;
+    size_t bytes;
+} results_t;
+
+static uint64_t g_random = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void);
+static uint64_t mix(uint64_t x);
+static double now_seconds(void);
+static size_t shuffled(size_t i, size_t count);
+static int bench_u64(size_t count, results_t *results);
+static int bench_strings(size_t count, results_t *results);
+static void print_results(const char *kind,
+                          size_t count,
+                          const results_t *results);
+
+int main(int argc, char **argv)
+{
+    long max_keys = argc > 1 ? atol(argv[1]) : 10000000;
+    const char *kinds = argc > 2 ? argv[2] : "u64,strings";
+    if (max_keys < 1000)
+    {
+        fprintf(stderr, "usage: %s [max keys, >= 1000] [u64,strings]\n",
+                argv[0]);
+        return 2;
+    }
+
+    for (size_t count = 1000; count <= (size_t)max_keys; count *= 10)
+    {
+        results_t results;
+        if (strstr(kinds, "u64"))
+        {
+            if (!bench_u64(count, &results)) return 1;
+            print_results("u64", count, &results);
+        }
+        if (strstr(kinds, "strings"))
+        {
+            if (!bench_strings(count, &results)) return 1;
+            print_results("strings", count, &results);
+        }
+    }
+    return 0;
+}
+
+static uint64_t next_random(void)
+{
+    /* xorshift64 */
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 7;
+    g_random ^= g_random << 17;
+    return g_random;
+}
+
+/* Finalizer of splitmix64, distinct inputs give distinct keys */
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Visits 0 to count - 1 in another order than inserted */
+static size_t shuffled(size_t i, size_t count)
+{
+    return (size_t)((i * (uint64_t)2654435761u) % count);
+}
+
+static int bench_u64(size_t count, results_t *results)
+{
+    /* keys[2 * i] is inserted with value i, keys[2 * i + 1] misses */
+    uint64_t *keys = malloc(2 * count * sizeof(uint64_t));
+    flat_table_t *table = u64_table_create();
+    flat_table_t *timed = u64_table_create();
+    if (!keys || !table || !timed)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 0;
+    }
+    for (size_t i = 0; i < 2 * count; i++) keys[i] = mix(i);
+
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+        if (!u64_table_insert(table, keys[2 * i], i))
+        {
+            fprintf(stderr, "out of memory\n");
+            return 0;
+        }
+    results->insert = (now_seconds() - start) / count;
+
+    results->worst_insert = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        double before = now_seconds();
+        u64_table_insert(timed, keys[2 * i], i);
+        double took = now_seconds() - before;
+        if (took > results->worst_insert) results->worst_insert = took;
+    }
+    free_flat_table(timed);
+
+    int ok = table->count == count;
+    start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t key = shuffled(i, count);
+        uint64_t *value = u64_table_lookup(table, keys[2 * key]);
+        ok &= value && *value == key;
+    }
+    results->hit = (now_seconds() - start) / count;
+
+    size_t found = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+        found +=
+            u64_table_lookup(table, keys[2 * shuffled(i, count) + 1]) != NULL;
+    results->miss = (now_seconds() - start) / count;
+
+    results->bytes = (table->slots.capacity + table->growing_from.capacity) *
+                     table->entry_size;
+
+    /* After removing half the other half must still be there */
+    size_t removed = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < count / 2; i++)
+        removed += u64_table_remove(table, keys[2 * i]);
+    double elapsed = now_seconds() - start;
+    for (size_t i = 0; i < count; i++)
+    {
+        int present = u64_table_lookup(table, keys[2 * i]) != NULL;
+        ok &= present == (i >= count / 2);
+    }
+
+    start = now_seconds();
+    for (size_t i = count / 2; i < count; i++)
+        removed += u64_table_remove(table, keys[2 * i]);
+    results->remove = (elapsed + now_seconds() - start) / count;
+
+    if (!ok || found || removed != count || table->count)
+    {
+        fprintf(stderr,
+                "u64: wrong lookups, %zu misses found, %zu of %zu removed, "
+                "%zu left\n",
+                found,
+                removed,
+                count,
+                table->count);
+        return 0;
+    }
+
+    free_flat_table(table);
+    free(keys);
+    return 1;
+}
+
+static int bench_strings(size_t count, results_t *results)
+{
+    /* Keys are unique by their index, misses have another prefix */
+    char(*keys)[STRING_KEY_LENGTH] = malloc(count * STRING_KEY_LENGTH);
+    struct hash_table *table = create_hash_table();
+    struct hash_table *timed = create_hash_table();
+    if (!keys || !table || !timed)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++)
+        snprintf(keys[i],
+                 STRING_KEY_LENGTH,
+                 "user-%08zx-%06x",
+                 i,
+                 (unsigned)(next_random() & 0xffffff));
+
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+        if (!insert_entry(table, keys[i], keys[i]))
+        {
+            fprintf(stderr, "out of memory\n");
+            return 0;
+        }
+    results->insert = (now_seconds() - start) / count;
+
+    results->worst_insert = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        double before = now_seconds();
+        insert_entry(timed, keys[i], keys[i]);
+        double took = now_seconds() - before;
+        if (took > results->worst_insert) results->worst_insert = took;
+    }
+    free_hash_table(timed);
+
+    int ok = 1;
+    start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t key = shuffled(i, count);
+        ok &= get_ptr_to_value_by_key(table, keys[key]) == keys[key];
+    }
+    results->hit = (now_seconds() - start) / count;
+
+    size_t found = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+    {
+        char missing[STRING_KEY_LENGTH];
+        memcpy(missing, keys[shuffled(i, count)], STRING_KEY_LENGTH);
+        missing[0] = 'U';
+        found += get_ptr_to_value_by_key(table, missing) != NULL;
+    }
+    results->miss = (now_seconds() - start) / count;
+    /* The slots, the copied keys come on top */
+    results->bytes =
+        (table->table->slots.capacity + table->table->growing_from.capacity) *
+        table->table->entry_size;
+
+    size_t removed = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < count; i++)
+        removed += delete_entry(table, keys[i]) & HASH_ENTRY_SUCCESS;
+    results->remove = (now_seconds() - start) / count;
+    for (size_t i = 0; i < count; i++)
+        ok &= !check_key_exists(table, keys[i]);
+
+    if (!ok || found || removed != count)
+    {
+        fprintf(stderr,
+                "strings: %zu misses found, %zu of %zu removed\n",
+                found,
+                removed,
+                count);
+        return 0;
+    }
+
+    free_hash_table(table);
+    free(keys);
+    return 1;
+}
+
+static void print_results(const char *kind,
+                          size_t count,
+                          const results_t *results)
+{
+    printf("%-7s %8zu keys: insert %6.1f ns (slowest %7.1f us), hit %6.1f "
+           "ns, miss %6.1f ns, delete %6.1f ns",
+           kind,
+           count,
+           results->insert * 1e9,
+           results->worst_insert * 1e6,
+           results->hit * 1e9,
+           results->miss * 1e9,
+           results->remove * 1e9);
+    if (results->bytes) printf(", %zu KB", results->bytes / 1024);
+    printf("\n");
+}
@@ -0,0 +1,88 @@
+"""
+Time of LIST on a large directory.
+
+With --populate the directory is first filled up to --entries empty files
+on the server host (run as root there), owned round robin by the uids and
+gids of --owners, e.g. $(seq 20000 21999) for 2000 owners. Then LIST runs
+--repeat times on a fresh session each, so every run starts with an empty
+name cache, and the best and median times and entries per second are
+printed:
+
+    python3 benchmarks/bench_list.py --user ftpuser --password secret \\
+        --dir big --populate /home/ftpuser/big --entries 100000
+"""
+
+import argparse
+import os
+import pwd
+import statistics
+import time
+from ftplib import FTP, FTP_TLS
+
+
+def populate(path, entries, owners):
+    os.makedirs(path, exist_ok=True)
+    ids = [(int(owner), int(owner)) if owner.isdigit()
+           else (pwd.getpwnam(owner).pw_uid, pwd.getpwnam(owner).pw_gid)
+           for owner in owners]
+    present = len(os.listdir(path))
+    for i in range(present, entries):
+        name = os.path.join(path, f"f{i:07d}")
+        with open(name, "w"):
+            pass
+        os.chown(name, *ids[i % len(ids)])
+    return max(present, entries)
+
+
+def run_list(args):
+    ftp = FTP_TLS() if args.tls else FTP()
+    ftp.connect(args.host, args.port, timeout=args.timeout)
+    if args.tls:
+        ftp.auth()
+    ftp.login(args.user, args.password)
+    if args.tls:
+        ftp.prot_p()
+
+    lines = []
+    start = time.perf_counter()
+    ftp.retrlines(f"LIST {args.dir}", lines.append)
+    elapsed = time.perf_counter() - start
+    ftp.quit()
+    return elapsed, len(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--dir", required=True,
+                        help="Directory to list, as the session sees it")
+    parser.add_argument("--populate", help="Its path on the server host")
+    parser.add_argument("--entries", type=int, default=100000)
+    parser.add_argument("--owners", nargs="+",
+                        help="Accounts owning the files, a number is used "
+                             "as uid and gid, defaults to --user")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--tls", action="store_true")
+    parser.add_argument("--timeout", type=float, default=600.0)
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+
+    if args.populate:
+        populate(args.populate, args.entries, args.owners or [args.user])
+
+    times = []
+    for _ in range(args.repeat):
+        elapsed, lines = run_list(args)
+        times.append(elapsed)
+
+    best = min(times)
+    print(f"{args.label or 'list'}: {lines} entries, "
+          f"best {best:.3f}s median {statistics.median(times):.3f}s, "
+          f"{lines / best:.0f} entries/s")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,104 @@
+"""
+Forks per successful login under unauthenticated traffic.
+
+Mixes silent connections (connect, wait, close, like port scanners), failed
+logins and successful logins, and counts the processes the host forked in
+the meantime from the `processes` counter in /proc/stat. Run it on the server
+host while nothing else forks much. Compare `preauth_in_parent=0` with
+`preauth_in_parent=1`:
+
+    python3 benchmarks/bench_preauth_forks.py --user ftpuser --password secret
+"""
+
+import argparse
+import socket
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+
+def host_forks():
+    with open("/proc/stat") as stat:
+        for line in stat:
+            if line.startswith("processes "):
+                return int(line.split()[1])
+    return 0
+
+
+def read_reply(sock):
+    data = b""
+    while not data.endswith(b"\r\n"):
+        chunk = sock.recv(512)
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def silent(args):
+    try:
+        with socket.create_connection((args.host, args.port), args.timeout):
+            time.sleep(args.silent_hold)
+        return True
+    except OSError:
+        return False
+
+
+def login(args, password):
+    try:
+        with socket.create_connection((args.host, args.port),
+                                      args.timeout) as sock:
+            read_reply(sock)
+            sock.sendall(f"USER {args.user}\r\n".encode())
+            read_reply(sock)
+            sock.sendall(f"PASS {password}\r\n".encode())
+            ok = read_reply(sock).startswith(b"230")
+            sock.sendall(b"QUIT\r\n")
+            return ok
+    except OSError:
+        return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--silent", type=int, default=500,
+                        help="Connections that never send anything")
+    parser.add_argument("--failed", type=int, default=100,
+                        help="Logins with a wrong password")
+    parser.add_argument("--logins", type=int, default=50,
+                        help="Successful logins")
+    parser.add_argument("--silent-hold", type=float, default=0.2)
+    parser.add_argument("--concurrency", type=int, default=50)
+    parser.add_argument("--timeout", type=float, default=30.0)
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+
+    jobs = ([lambda: silent(args)] * args.silent +
+            [lambda: login(args, args.password + "-wrong")] * args.failed +
+            [lambda: login(args, args.password)] * args.logins)
+
+    with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        # Client threads count as forks too, start them all beforehand
+        list(pool.map(lambda _: time.sleep(0.1), range(args.concurrency)))
+
+        forks_before = host_forks()
+        start = time.perf_counter()
+        results = list(pool.map(lambda job: job(), jobs))
+        wall = time.perf_counter() - start
+        time.sleep(0.5)  # Let session processes of the last logins start
+        forks = host_forks() - forks_before
+
+    logged_in = sum(results[args.silent + args.failed:])
+    print(f"{args.label or 'preauth-forks'}: {args.silent} silent, "
+          f"{args.failed} failed, {logged_in}/{args.logins} logged in "
+          f"in {wall:.2f}s")
+    print(f"  {forks} forks on the host, "
+          f"{forks / logged_in if logged_in else float('inf'):.2f} "
+          f"forks per successful login")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,200 @@
+/*
+    Lookup cost of the address list trie, see src/engine/ip_filter.h.
+
+    Builds a trie of --prefixes random prefixes, by default half IPv4 /8 to
+    /32 and half IPv6 /16 to /64, and times lookups of random addresses,
+    half of them inside a listed prefix. A sample of the lookups is checked
+    against a linear scan of the prefixes. Built with the server, run from
+    the build directory:
+
+        ./bench_prefix_trie 100000 10000000
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "structures/prefix_trie.h"
+
+#define CHECKED_LOOKUPS 1000
+
+typedef struct
+{
+    uint8_t key[PREFIX_TRIE_KEY_LENGTH];
+    int length;
+    int value;
+} rule_t;
+
+static uint64_t g_random = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void);
+static double now_seconds(void);
+static void random_rule(rule_t *rule);
+static void address_in(const rule_t *rule, uint8_t key[PREFIX_TRIE_KEY_LENGTH]);
+static int matches(const rule_t *rule,
+                   const uint8_t key[PREFIX_TRIE_KEY_LENGTH]);
+static int linear_lookup(const rule_t *rules,
+                         int count,
+                         const uint8_t key[PREFIX_TRIE_KEY_LENGTH]);
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    long lookups = argc > 2 ? atol(argv[2]) : 10000000;
+    if (count <= 0 || lookups <= 0)
+    {
+        fprintf(stderr, "usage: %s [prefixes] [lookups]\n", argv[0]);
+        return 2;
+    }
+
+    rule_t *rules = calloc(count, sizeof(rule_t));
+    uint8_t(*keys)[PREFIX_TRIE_KEY_LENGTH] =
+        calloc(lookups < 1000000 ? lookups : 1000000, PREFIX_TRIE_KEY_LENGTH);
+    prefix_trie_t *trie = create_prefix_trie();
+    if (!rules || !keys || !trie)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) random_rule(&rules[i]);
+
+    double start = now_seconds();
+    for (int i = 0; i < count; i++)
+        if (!prefix_trie_insert(
+                trie, rules[i].key, rules[i].length, rules[i].value))
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    finish_prefix_trie(trie);
+    double build = now_seconds() - start;
+
+    /* Half hits, half random addresses that mostly miss */
+    long distinct = lookups < 1000000 ? lookups : 1000000;
+    for (long i = 0; i < distinct; i++)
+    {
+        if (i % 2)
+            address_in(&rules[next_random() % count], keys[i]);
+        else
+            for (int b = 0; b < PREFIX_TRIE_KEY_LENGTH; b++)
+                keys[i][b] = (uint8_t)next_random();
+        if (i % 4 == 0)
+        {
+            memset(keys[i], 0, 10);
+            keys[i][10] = keys[i][11] = 0xff;
+        }
+    }
+
+    for (long i = 0; i < CHECKED_LOOKUPS && i < distinct; i++)
+        if (prefix_trie_lookup(trie, keys[i]) !=
+            linear_lookup(rules, count, keys[i]))
+        {
+            fprintf(stderr, "lookup %ld disagrees with the linear scan\n", i);
+            return 1;
+        }
+
+    long denied = 0;
+    start = now_seconds();
+    for (long i = 0; i < lookups; i++)
+        denied += prefix_trie_lookup(trie, keys[i % distinct]) == 2;
+    double elapsed = now_seconds() - start;
+
+    size_t bytes = trie->count * sizeof(prefix_trie_node_t);
+    if (trie->jump) bytes += 2 * 65536 * sizeof(prefix_trie_jump_t);
+    printf("%d prefixes: %zu nodes, %zu KB%s, built in %.1f ms\n",
+           count,
+           trie->count,
+           bytes / 1024,
+           trie->jump ? " with index" : "",
+           build * 1000);
+    printf("%ld lookups in %.3f s: %.1f ns per lookup, %.1f M/s "
+           "(%ld denied)\n",
+           lookups,
+           elapsed,
+           elapsed * 1e9 / lookups,
+           lookups / elapsed / 1e6,
+           denied);
+
+    free_prefix_trie(trie);
+    free(keys);
+    free(rules);
+    return 0;
+}
+
+static uint64_t next_random(void)
+{
+    /* xorshift64 */
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 7;
+    g_random ^= g_random << 17;
+    return g_random;
+}
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void random_rule(rule_t *rule)
+{
+    memset(rule->key, 0, sizeof(rule->key));
+    if (next_random() % 2)
+    {
+        rule->key[10] = rule->key[11] = 0xff;
+        for (int b = 12; b < PREFIX_TRIE_KEY_LENGTH; b++)
+            rule->key[b] = (uint8_t)next_random();
+        rule->length = 96 + 8 + (int)(next_random() % 25);
+    }
+    else
+    {
+        for (int b = 0; b < 8; b++) rule->key[b] = (uint8_t)next_random();
+        rule->length = 16 + (int)(next_random() % 49);
+    }
+    rule->value = 1 + (int)(next_random() % 2);
+
+    /* Zero the host bits like the trie does */
+    for (int bit = rule->length; bit < PREFIX_TRIE_KEY_LENGTH * 8; bit++)
+        rule->key[bit / 8] &= (uint8_t) ~(0x80 >> (bit % 8));
+}
+
+static void address_in(const rule_t *rule, uint8_t key[PREFIX_TRIE_KEY_LENGTH])
+{
+    for (int b = 0; b < PREFIX_TRIE_KEY_LENGTH; b++)
+        key[b] = (uint8_t)next_random();
+    for (int bit = 0; bit < rule->length; bit++)
+    {
+        uint8_t mask = (uint8_t)(0x80 >> (bit % 8));
+        key[bit / 8] = (uint8_t)((key[bit / 8] & ~mask) |
+                                 (rule->key[bit / 8] & mask));
+    }
+}
+
+static int matches(const rule_t *rule,
+                   const uint8_t key[PREFIX_TRIE_KEY_LENGTH])
+{
+    int bytes = rule->length / 8;
+    if (memcmp(key, rule->key, bytes) != 0) return 0;
+    if (rule->length % 8 == 0) return 1;
+
+    uint8_t mask = (uint8_t)(0xff << (8 - rule->length % 8));
+    return (key[bytes] & mask) == rule->key[bytes];
+}
+
+static int linear_lookup(const rule_t *rules,
+                         int count,
+                         const uint8_t key[PREFIX_TRIE_KEY_LENGTH])
+{
+    /* The last of equal prefixes wins, as with repeated inserts */
+    int best = -1, value = 0;
+    for (int i = 0; i < count; i++)
+        if (matches(&rules[i], key) && rules[i].length >= best)
+        {
+            best = rules[i].length;
+            value = rules[i].value;
+        }
+    return value;
+}
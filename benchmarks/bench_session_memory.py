@@ -0,0 +1,160 @@
+"""
+Memory cost of idle logged in sessions.
+
+Logs in many control sessions, keeps them idle and sums the memory of every
+cftp_server process (PSS, so pages shared between forked children are only
+counted once), then reports the cost per session and sessions per GB. It
+also reports login throughput while opening the sessions.
+
+Must run as root on the server host to read /proc/<pid>/smaps_rollup.
+Compare `session_model=process` with `session_model=threads`:
+
+    python3 benchmarks/bench_session_memory.py --user ftpuser --password secret \\
+        --sessions 2000
+
+With `idle_hibernate_timeout` set, wait past it with `--settle` and add
+`--probe` to send PWD on every session afterwards, which checks that each one
+resumes and reports the resume latency:
+
+    python3 benchmarks/bench_session_memory.py --user ftpuser --password secret \\
+        --sessions 2000 --settle 15 --probe
+"""
+
+import argparse
+import os
+import socket
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+
+def read_reply(sock):
+    data = b""
+    while not data.endswith(b"\r\n"):
+        chunk = sock.recv(512)
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def login(host, port, user, password, timeout):
+    try:
+        sock = socket.create_connection((host, port), timeout=timeout)
+        if not read_reply(sock).startswith(b"220"):
+            sock.close()
+            return None
+        sock.sendall(f"USER {user}\r\n".encode())
+        read_reply(sock)
+        sock.sendall(f"PASS {password}\r\n".encode())
+        if not read_reply(sock).startswith(b"230"):
+            sock.close()
+            return None
+        return sock
+    except OSError:
+        return None
+
+
+def probe(sock, timeout):
+    try:
+        sock.settimeout(timeout)
+        start = time.perf_counter()
+        sock.sendall(b"PWD\r\n")
+        if read_reply(sock).startswith(b"257"):
+            return time.perf_counter() - start
+    except OSError:
+        pass
+    return None
+
+
+def server_pids(name):
+    pids = []
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/comm") as comm:
+                if comm.read().strip() == name:
+                    pids.append(int(entry))
+        except OSError:
+            pass
+    return pids
+
+
+def memory_kb(pids):
+    totals = {"Rss": 0, "Pss": 0}
+    for pid in pids:
+        try:
+            with open(f"/proc/{pid}/smaps_rollup") as rollup:
+                for line in rollup:
+                    key, _, rest = line.partition(":")
+                    if key in totals:
+                        totals[key] += int(rest.split()[0])
+        except OSError:
+            pass
+    return totals
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--sessions", type=int, default=1000)
+    parser.add_argument("--concurrency", type=int, default=50)
+    parser.add_argument("--timeout", type=float, default=30.0)
+    parser.add_argument("--process-name", default="cftp_server")
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    parser.add_argument("--settle", type=float, default=1.0,
+                        help="Seconds to wait before sampling memory")
+    parser.add_argument("--probe", action="store_true",
+                        help="Send PWD on every session after sampling")
+    args = parser.parse_args()
+
+    baseline = memory_kb(server_pids(args.process_name))
+
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        sockets = list(pool.map(
+            lambda _: login(args.host, args.port, args.user, args.password,
+                            args.timeout),
+            range(args.sessions)))
+    wall = time.perf_counter() - start
+    sockets = [s for s in sockets if s is not None]
+
+    time.sleep(args.settle)  # Let forked children settle before sampling
+    pids = server_pids(args.process_name)
+    loaded = memory_kb(pids)
+
+    latencies = []
+    if args.probe:
+        with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+            latencies = sorted(l for l in pool.map(
+                lambda sock: probe(sock, args.timeout), sockets)
+                if l is not None)
+
+    for sock in sockets:
+        sock.close()
+
+    opened = len(sockets)
+    print(f"{args.label or 'session-memory'}: {opened} sessions "
+          f"({args.sessions - opened} failed) in {wall:.2f}s -> "
+          f"{opened / wall:.0f} logins/s, {len(pids)} server processes")
+    if opened:
+        for key in ("Pss", "Rss"):
+            per_session = (loaded[key] - baseline[key]) / opened
+            per_gb = (1 << 20) / per_session if per_session > 0 else 0
+            print(f"  {key}: {loaded[key] / 1024:.1f} MB total, "
+                  f"{per_session:.1f} kB/session, "
+                  f"{per_gb:.0f} sessions/GB")
+    if args.probe:
+        print(f"  probe: {len(latencies)}/{opened} sessions answered PWD")
+        if latencies:
+            p50 = latencies[len(latencies) // 2] * 1000
+            p99 = latencies[min(len(latencies) - 1,
+                                int(len(latencies) * 0.99))] * 1000
+            print(f"  probe latency: p50 {p50:.1f} ms, p99 {p99:.1f} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,201 @@
+"""
+Download and upload throughput of one session, plain and over PROT P.
+
+Sends a file of --size MB up once and then downloads it --repeat times in
+each mode, reporting MB/s and the CPU time the server processes spent per
+GB. Run on the server host over loopback, once with data_ktls=0 and once
+with data_ktls=1 in /etc/cftp_server.conf, restarting the server in
+between, to compare plain against user space TLS against kernel TLS:
+
+    python3 benchmarks/bench_tls_transfer.py --user ftpuser \\
+        --password secret --size 1024 --label ktls
+
+--upload also times STOR in each mode. With data_ktls=1 the server logs
+at debug level whether the kernel took over each data connection.
+
+--sessions N instead downloads over PROT P from N sessions at once and
+reports the total MB/s and the peak resident memory the server processes
+grew by per download, sampled while the downloads run.
+"""
+
+import argparse
+import os
+import ssl
+import threading
+import time
+from ftplib import FTP, FTP_TLS
+
+CHUNK = 1 << 20
+
+
+def open_session(args, tls):
+    if tls:
+        context = ssl.create_default_context()
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+        ftp = FTP_TLS(context=context)
+    else:
+        ftp = FTP()
+    ftp.connect(args.host, args.port, timeout=args.timeout)
+    if tls:
+        ftp.auth()
+    ftp.login(args.user, args.password)
+    if tls:
+        ftp.prot_p()
+    ftp.voidcmd("TYPE I")
+    return ftp
+
+
+def upload(ftp, name, size):
+    block = os.urandom(CHUNK)
+    conn = ftp.transfercmd(f"STOR {name}")
+    for _ in range(size // CHUNK):
+        conn.sendall(block)
+    if isinstance(conn, ssl.SSLSocket):
+        try:
+            conn.unwrap()
+        except ssl.SSLError:
+            pass  # The server closes without a close_notify of its own
+    conn.close()
+    ftp.voidresp()
+
+
+def download(ftp, name):
+    received = 0
+    conn = ftp.transfercmd(f"RETR {name}")
+    while True:
+        chunk = conn.recv(CHUNK)
+        if not chunk:
+            break
+        received += len(chunk)
+    conn.close()
+    ftp.voidresp()
+    return received
+
+
+def server_processes(name):
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/stat") as stat:
+                fields = stat.read().rsplit(")", 1)
+        except OSError:
+            continue
+        if fields[0].endswith(f"({name}"):
+            yield entry, fields[1].split()
+
+
+def server_rss_kb(name):
+    """Resident anonymous memory of every running server process."""
+    total = 0
+    for pid, _ in server_processes(name):
+        try:
+            with open(f"/proc/{pid}/status") as status:
+                for line in status:
+                    if line.startswith("RssAnon:"):
+                        total += int(line.split()[1])
+        except (OSError, ValueError):
+            pass
+    return total
+
+
+def server_cpu_seconds(name):
+    """User and system time of every running server process."""
+    ticks = 0
+    for _, rest in server_processes(name):
+        try:
+            ticks += int(rest[11]) + int(rest[12])
+        except (IndexError, ValueError):
+            pass
+    return ticks / os.sysconf("SC_CLK_TCK")
+
+
+def measure(args, tls, direction, size):
+    """MB/s and server CPU seconds per GB, the session stays logged in
+    while its process is measured."""
+    ftp = open_session(args, tls)
+    moved = 0
+    cpu = server_cpu_seconds(args.process_name)
+    start = time.perf_counter()
+    for _ in range(args.repeat):
+        if direction == "RETR":
+            moved += download(ftp, args.name)
+        else:
+            upload(ftp, args.name, size)
+            moved += size
+    elapsed = time.perf_counter() - start
+    cpu = server_cpu_seconds(args.process_name) - cpu
+    ftp.quit()
+    return moved / elapsed / (1 << 20), cpu / (moved / (1 << 30))
+
+
+def measure_concurrent(args):
+    """Total MB/s and peak RSS growth in KB per download of args.sessions
+    PROT P downloads started together."""
+    sessions = [open_session(args, True) for _ in range(args.sessions)]
+    baseline = server_rss_kb(args.process_name)
+    peak = baseline
+    moved = []
+    start = time.perf_counter()
+    threads = [threading.Thread(
+        target=lambda ftp=ftp: moved.append(download(ftp, args.name)))
+        for ftp in sessions]
+    for thread in threads:
+        thread.start()
+    while any(thread.is_alive() for thread in threads):
+        peak = max(peak, server_rss_kb(args.process_name))
+        time.sleep(0.01)
+    elapsed = time.perf_counter() - start
+    for ftp in sessions:
+        ftp.quit()
+    return (sum(moved) / elapsed / (1 << 20),
+            (peak - baseline) / args.sessions)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--name", default="bench_tls_transfer.bin",
+                        help="File created in the user's directory")
+    parser.add_argument("--size", type=int, default=256, help="MB")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--timeout", type=float, default=60.0)
+    parser.add_argument("--upload", action="store_true",
+                        help="Also time STOR")
+    parser.add_argument("--sessions", type=int, default=0,
+                        help="Concurrent PROT P downloads instead")
+    parser.add_argument("--process-name", default="cftp_server")
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+
+    size = args.size * CHUNK
+    ftp = open_session(args, False)
+    upload(ftp, args.name, size)
+    ftp.quit()
+
+    directions = ["RETR", "STOR"] if args.upload else ["RETR"]
+    try:
+        if args.sessions:
+            rate, rss = measure_concurrent(args)
+            print(f"{args.label or 'tls-transfer'}: {args.sessions} x RETR "
+                  f"PROT P {rate:8.1f} MB/s, server RSS "
+                  f"{rss / 1024:7.1f} MB per download")
+            return
+        for direction in directions:
+            for tls in (False, True):
+                rate, cpu = measure(args, tls, direction, size)
+                print(f"{args.label or 'tls-transfer'}: {direction} "
+                      f"{'PROT P' if tls else 'plain '} {rate:8.1f} MB/s, "
+                      f"server CPU {cpu:6.2f} s/GB")
+    finally:
+        ftp = open_session(args, False)
+        ftp.delete(args.name)
+        ftp.quit()
+
+
+if __name__ == "__main__":
+    main()
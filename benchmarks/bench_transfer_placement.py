@@ -0,0 +1,145 @@
+"""
+Download throughput of parallel sessions, to compare session placement.
+
+Logs in many sessions, has each one RETR the same file over and over for a
+fixed time and reports the aggregate and per session throughput. With the
+file in the page cache this measures what the session processes themselves
+cost: `read()` in the data path, TLS with `--tls`, and where they run
+relative to the NIC queues.
+
+Run it once per `session_cpu_affinity` policy in /etc/cftp_server.conf,
+restarting the server in between:
+
+    python3 benchmarks/bench_transfer_placement.py --user ftpuser \\
+        --password secret --file big.bin --sessions 64 --label round_robin
+
+On the server host `--show-placement` also prints which CPUs the session
+processes are allowed on, to check that the policy took effect.
+"""
+
+import argparse
+import os
+import ssl
+import statistics
+import time
+from concurrent.futures import ThreadPoolExecutor
+from ftplib import FTP, FTP_TLS
+
+
+def open_session(args):
+    if args.tls:
+        context = ssl.create_default_context()
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+        ftp = FTP_TLS(context=context)
+    else:
+        ftp = FTP()
+    ftp.connect(args.host, args.port, timeout=args.timeout)
+    if args.tls:
+        ftp.auth()
+    ftp.login(args.user, args.password)
+    if args.tls:
+        ftp.prot_p()
+    ftp.voidcmd("TYPE I")
+    return ftp
+
+
+def download_loop(args, deadline):
+    try:
+        ftp = open_session(args)
+    except Exception:
+        return None
+
+    received = 0
+    start = time.perf_counter()
+    try:
+        while time.perf_counter() < deadline:
+            conn = ftp.transfercmd(f"RETR {args.file}")
+            while True:
+                chunk = conn.recv(1 << 16)
+                if not chunk:
+                    break
+                received += len(chunk)
+            conn.close()
+            ftp.voidresp()
+        ftp.quit()
+    except Exception:
+        pass
+    return received, time.perf_counter() - start
+
+
+def server_pids(name):
+    pids = []
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/comm") as comm:
+                if comm.read().strip() == name:
+                    pids.append(int(entry))
+        except OSError:
+            pass
+    return pids
+
+
+def allowed_cpus(pid):
+    try:
+        with open(f"/proc/{pid}/status") as status:
+            for line in status:
+                if line.startswith("Cpus_allowed_list:"):
+                    return line.split(":", 1)[1].strip()
+    except OSError:
+        pass
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--file", required=True,
+                        help="Path of the file to download, as the user sees it")
+    parser.add_argument("--sessions", type=int, default=32)
+    parser.add_argument("--duration", type=float, default=20.0)
+    parser.add_argument("--timeout", type=float, default=30.0)
+    parser.add_argument("--tls", action="store_true",
+                        help="AUTH TLS and PROT P on every session")
+    parser.add_argument("--process-name", default="cftp_server")
+    parser.add_argument("--show-placement", action="store_true",
+                        help="Print the allowed CPUs of the server processes")
+    parser.add_argument("--label", default="", help="Tag printed with results")
+    args = parser.parse_args()
+
+    deadline = time.perf_counter() + args.duration
+    placement = {}
+    with ThreadPoolExecutor(max_workers=args.sessions) as pool:
+        futures = [pool.submit(download_loop, args, deadline)
+                   for _ in range(args.sessions)]
+        if args.show_placement:
+            time.sleep(min(2.0, args.duration / 2))
+            for pid in server_pids(args.process_name):
+                cpus = allowed_cpus(pid)
+                if cpus is not None:
+                    placement[cpus] = placement.get(cpus, 0) + 1
+        results = [f.result() for f in futures]
+
+    done = [r for r in results if r is not None]
+    total = sum(r[0] for r in done)
+    wall = max((r[1] for r in done), default=0.0)
+    rates = [r[0] / r[1] / (1 << 20) for r in done if r[1] > 0]
+
+    print(f"{args.label or 'transfer-placement'}: {len(done)} sessions "
+          f"({args.sessions - len(done)} failed), "
+          f"{total / (1 << 20):.0f} MB in {wall:.1f}s -> "
+          f"{total / wall / (1 << 20) if wall else 0:.1f} MB/s")
+    if rates:
+        print(f"  per session MB/s: mean {statistics.mean(rates):.1f} "
+              f"min {min(rates):.1f} max {max(rates):.1f}")
+    for cpus, count in sorted(placement.items(), key=lambda kv: -kv[1]):
+        print(f"  {count} processes allowed on CPUs {cpus}")
+
+
+if __name__ == "__main__":
+    main()
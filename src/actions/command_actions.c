@@ -1,6 +1,7 @@
 #include "command_actions.h"
 
 #include <dirent.h>
+#include <errno.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_ssl.h>
@@ -11,13 +12,16 @@
 #include <unistd.h>
 
 #include "auth.h"
+#include "auth_throttle.h"
 #include "connection.h"
 #include "control_handler.h"
 #include "data_handler.h"
 #include "error.h"
 #include "ftp_status_codes.h"
 #include "interprocess_handler.h"
+#include "preauth.h"
 #include "security.h"
+#include "session_fs.h"
 
 extern void cftp_send_file(connection_t *connection, const char *params);
 extern void cftp_recv_file_with_evbuffer(connection_t *connection,
@@ -37,12 +41,10 @@ static void handle_cwd_command(connection_t *connection, const char *params);
 
 static void handle_cwd_command(connection_t *connection, const char *params)
 {
-    char target_path[PATH_MAX];
-    struct stat st;
-
     if (!params || strlen(params) == 0)
     {
-        write_text_response(connection->bev, "550 Missing path.\r\n");
+        send_control_message(
+            connection, FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM, "Missing path.");
         return;
     }
 
@@ -53,29 +55,28 @@ static void handle_cwd_command(connection_t *connection, const char *params)
         return;
     }
 
-    snprintf(target_path, sizeof(target_path), "%s", params);
-
-    if (stat(target_path, &st) < 0 || !S_ISDIR(st.st_mode))
+    if (session_fs_chdir(connection, params) < 0)
     {
-        write_text_response(connection->bev, "550 Not a directory.\r\n");
+        if (errno == ENOTDIR || errno == ENOENT)
+            send_control_message(connection,
+                                 FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
+                                 "Not a directory.");
+        else
+            send_control_message(connection,
+                                 FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
+                                 "Failed to change directory.");
         return;
     }
 
-    if (chdir(target_path) < 0)
-    {
-        write_text_response(connection->bev,
-                            "550 Failed to change directory.\r\n");
-        return;
-    }
-
-    write_text_response(connection->bev,
-                        "250 Directory successfully changed.\r\n");
+    send_control_message(connection,
+                         FTP_STATUS_FILE_ACTION_OK,
+                         "Directory successfully changed.");
 }
 
 static void handle_mdtm_command(connection_t *connection, const char *arg)
 {
     struct stat st;
-    if (stat(arg, &st) != 0 || S_ISDIR(st.st_mode))
+    if (session_fs_stat(connection, arg, &st) != 0 || S_ISDIR(st.st_mode))
     {
         send_control_message(connection,
                              FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
@@ -83,14 +84,21 @@ static void handle_mdtm_command(connection_t *connection, const char *arg)
         return;
     }
 
-    struct tm *gmt = gmtime(&st.st_mtime);
+    struct tm gmt;
+    gmtime_r(&st.st_mtime, &gmt);
     char buf[64];
-    strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", gmt);
+    strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", &gmt);
     send_control_message(connection, FTP_STATUS_FILE_STATUS, buf);
 }
 
 /* NULL Checks must be covered by caller */
 
+const command_action *find_command_action(uint32_t verb)
+{
+    const command_action *action = &command_actions[COMMAND_SLOT(verb)];
+    return verb && action->verb == verb ? action : NULL;
+}
+
 void cftp_syst_action(cftp_command_t *cmd, connection_t *connection)
 {
     DEBG("Invoking for %s", cmd->command);
@@ -163,16 +171,18 @@ void cftp_noop_action(cftp_command_t *cmd, connection_t *connection)
 void cftp_feat_action(cftp_command_t *cmd, connection_t *connection)
 {
     DEBG("Invoking for %s", cmd->command);
-    const char *features =
-        "211-Features:\r\n"
-        " EPSV\r\n"
-        " PASV\r\n"
-        " AUTH\r\n"
-        " SIZE\r\n"
-        " MDTM\r\n"
-        " MLSD\r\n"
-        "211 End";
-    send_control_message(connection, 0, features);
+    static const char *const features[] = {"Features:",
+                                           " EPSV",
+                                           " PASV",
+                                           " AUTH",
+                                           " SIZE",
+                                           " MDTM",
+                                           " MLSD",
+                                           "End"};
+    send_control_lines(connection,
+                       FTP_STATUS_SYSTEM_STATUS,
+                       features,
+                       sizeof(features) / sizeof(features[0]));
 }
 
 void cftp_invalid_action(cftp_command_t *cmd, connection_t *connection)
@@ -276,7 +286,8 @@ void cftp_size_authenticated_action(cftp_command_t *cmd,
     }
 
     struct stat st;
-    if (stat(cmd->args[0], &st) < 0 || S_ISDIR(st.st_mode))
+    if (session_fs_stat(connection, cmd->args[0], &st) < 0 ||
+        S_ISDIR(st.st_mode))
     {
         send_control_message(connection,
                              FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
@@ -355,7 +366,7 @@ void cftp_mkd_authenticated_action(cftp_command_t *cmd,
     }
 
     struct stat st;
-    if (stat(cmd->args[0], &st) == 0)
+    if (session_fs_stat(connection, cmd->args[0], &st) == 0)
     {
         send_control_message(connection,
                              FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
@@ -363,7 +374,7 @@ void cftp_mkd_authenticated_action(cftp_command_t *cmd,
         return;
     }
 
-    IF(mkdir(cmd->args[0], 0755) == 0)
+    IF(session_fs_mkdir(connection, cmd->args[0], 0755) == 0)
     {
         DEBG(
             "Created directory: %s for %s", cmd->args[0], connection->username);
@@ -402,7 +413,8 @@ void cftp_rmd_authenticated_action(cftp_command_t *cmd,
     }
 
     struct stat st;
-    if (stat(cmd->args[0], &st) != 0 || !S_ISDIR(st.st_mode))
+    if (session_fs_stat(connection, cmd->args[0], &st) != 0 ||
+        !S_ISDIR(st.st_mode))
     {
         send_control_message(connection,
                              FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
@@ -410,7 +422,7 @@ void cftp_rmd_authenticated_action(cftp_command_t *cmd,
         return;
     }
 
-    IF(rmdir(cmd->args[0]) == 0)
+    IF(session_fs_rmdir(connection, cmd->args[0]) == 0)
     {
         DEBG(
             "Removed directory: %s for %s", cmd->args[0], connection->username);
@@ -450,17 +462,12 @@ void cftp_pwd_authenticated_action(cftp_command_t *cmd,
                                    connection_t *connection)
 {
     DEBG("Invoking for %s", cmd->command);
-    char cwd[PATH_MAX];
-    IF(getcwd(cwd, sizeof(cwd)) != NULL)
-    {
-        char response[PATH_MAX + 32];
-        snprintf(
-            response, sizeof(response), "\"%s\" is current directory", cwd);
-        send_control_message(connection, FTP_STATUS_PATHNAME_CREATED, response);
-    }
-    ELSE send_control_message(connection,
-                              FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
-                              "Failed to get current directory");
+    char response[PATH_MAX + 32];
+    snprintf(response,
+             sizeof(response),
+             "\"%s\" is current directory",
+             session_fs_getcwd(connection));
+    send_control_message(connection, FTP_STATUS_PATHNAME_CREATED, response);
 }
 
 void cftp_abor_authenticated_action(cftp_command_t *cmd,
@@ -501,6 +508,19 @@ void cftp_user_authenticated(cftp_command_t *cmd, connection_t *connection)
         return;
     }
 
+    connection->anonymous = is_anonymous_user(cmd->args[0]);
+    IF(connection->anonymous)
+    {
+        snprintf(connection->username,
+                 sizeof(connection->username),
+                 "%s",
+                 "anonymous");
+        send_control_message(connection,
+                             FTP_STATUS_USER_NAME_OK,
+                             "Anonymous login okay, send e-mail as password");
+        return;
+    }
+
     IF(user_exists(cmd->args[0], connection))
     send_control_message(
         connection, FTP_STATUS_USER_NAME_OK, "User name okay, need password");
@@ -508,6 +528,26 @@ void cftp_user_authenticated(cftp_command_t *cmd, connection_t *connection)
         connection, FTP_STATUS_NOT_LOGGED_IN, "User not found");
 }
 
+void complete_login(connection_t *connection)
+{
+    IF(!admit_user(&connection->admission, connection->uid))
+    {
+        connection->control_write_cb = disable_connection_cb;
+        send_control_message(connection,
+                             FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                             "Too many sessions of this user");
+        return;
+    }
+
+    if (!connection->anonymous) auth_throttle_succeeded(connection->username);
+    send_control_message(
+        connection, FTP_STATUS_USER_LOGGED_IN, "User logged in");
+    connection->authenticated = 1;
+    evtimer_del(connection->timeout_event);
+    event_free(connection->timeout_event);
+    connection->timeout_event = NULL;
+}
+
 void cftp_pass_authenticated(cftp_command_t *cmd, connection_t *connection)
 {
     IF(cmd->argc != 1)
@@ -519,21 +559,22 @@ void cftp_pass_authenticated(cftp_command_t *cmd, connection_t *connection)
         return;
     }
 
-    IF(authenticate_and_switch_user(
-        connection->username, cmd->args[0], connection->error_buf))
+    /* Answered once the crypt thread is done, see preauth.h */
+    IF(connection->preauth || connection->shared_loop)
     {
-        send_control_message(
-            connection, FTP_STATUS_USER_LOGGED_IN, "User logged in");
-        connection->authenticated = 1;
-        evtimer_del(connection->timeout_event);
-        event_free(connection->timeout_event);
+        submit_preauth_login(connection, cmd->args[0]);
+        return;
     }
+
+    IF(authenticate_session(connection, cmd->args[0]))
+    complete_login(connection);
     ELSE
     {
         ERROR("%s", connection->error_buf);
-        // connection->control_write_cb = disable_connection_cb;
-        // TODO: Add a timer here to close connection after some time
-        send_control_message(
-            connection, FTP_STATUS_NOT_LOGGED_IN, "Invalid credentials");
+        reject_login(connection,
+                     connection->anonymous
+                         ? 0
+                         : auth_throttle_failed(connection->source_ip,
+                                                connection->username));
     }
 }
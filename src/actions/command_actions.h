@@ -5,31 +5,87 @@
 
 typedef struct
 {
+    uint32_t verb; /* CFTP_VERB of action, 0 in unused slots */
     const char *action;
     command_execution_cb authenticated_cb;
     command_execution_cb non_authenticated_cb;
+    int writes; /* Modifies the filesystem, refused to anonymous sessions */
+    int transfers; /* Waits for the data connection when pipelined */
 } command_action;
 
 #define ACTION_FUNC(action) \
     void action(cftp_command_t *command, connection_t *connection)
 
-#define DECL_ACTION_FOR_COMMAND(action, function)  \
-    static const char *action##_COMMAND = #action; \
+#define DECL_ACTION_FOR_COMMAND(action, function)                         \
+    static const char *action##_COMMAND __attribute__((unused)) = #action; \
     ACTION_FUNC(function);
 
-#define ADD_COMMAND_WITH_SAME_ACTION(command, function)   \
-    {                                                     \
-        .action = #command, .authenticated_cb = function, \
-        .non_authenticated_cb = function                  \
+/* Packed verbs of the commands in command_actions */
+enum
+{
+    VERB_SYST = CFTP_VERB('S', 'Y', 'S', 'T'),
+    VERB_QUIT = CFTP_VERB('Q', 'U', 'I', 'T'),
+    VERB_AUTH = CFTP_VERB('A', 'U', 'T', 'H'),
+    VERB_PBSZ = CFTP_VERB('P', 'B', 'S', 'Z'),
+    VERB_PROT = CFTP_VERB('P', 'R', 'O', 'T'),
+    VERB_NOOP = CFTP_VERB('N', 'O', 'O', 'P'),
+    VERB_FEAT = CFTP_VERB('F', 'E', 'A', 'T'),
+    VERB_TYPE = CFTP_VERB('T', 'Y', 'P', 'E'),
+    VERB_EPSV = CFTP_VERB('E', 'P', 'S', 'V'),
+    VERB_PASV = CFTP_VERB('P', 'A', 'S', 'V'),
+    VERB_NLST = CFTP_VERB('N', 'L', 'S', 'T'),
+    VERB_LIST = CFTP_VERB('L', 'I', 'S', 'T'),
+    VERB_SIZE = CFTP_VERB('S', 'I', 'Z', 'E'),
+    VERB_RETR = CFTP_VERB('R', 'E', 'T', 'R'),
+    VERB_STOR = CFTP_VERB('S', 'T', 'O', 'R'),
+    VERB_MDTM = CFTP_VERB('M', 'D', 'T', 'M'),
+    VERB_CWD = CFTP_VERB('C', 'W', 'D', 0),
+    VERB_PWD = CFTP_VERB('P', 'W', 'D', 0),
+    VERB_ABOR = CFTP_VERB('A', 'B', 'O', 'R'),
+    VERB_MKD = CFTP_VERB('M', 'K', 'D', 0),
+    VERB_RMD = CFTP_VERB('R', 'M', 'D', 0),
+    VERB_DELE = CFTP_VERB('D', 'E', 'L', 'E'),
+    VERB_USER = CFTP_VERB('U', 'S', 'E', 'R'),
+    VERB_PASS = CFTP_VERB('P', 'A', 'S', 'S')
+};
+
+/* Perfect hash of the verbs above into the slots of command_actions. Two
+ * verbs in one slot fail the build (-Woverride-init of -Wextra), another
+ * odd multiplier that spreads them all is found by trying a few. */
+#define COMMAND_SLOTS 64
+#define COMMAND_SLOT(verb) ((uint32_t)((verb) * 0x9E377B4DU) >> 26)
+
+#define ADD_COMMAND_WITH_SAME_ACTION(command, function)                   \
+    [COMMAND_SLOT(VERB_##command)] = {                                    \
+        .verb = VERB_##command, .action = #command,                       \
+        .authenticated_cb = function, .non_authenticated_cb = function    \
     }
 
 #define ADD_COMMAND_WITH_DIFF_ACTION(                                   \
     command, authenticated_function, non_authenticated_function)        \
-    {                                                                   \
-        .action = #command, .authenticated_cb = authenticated_function, \
+    [COMMAND_SLOT(VERB_##command)] = {                                  \
+        .verb = VERB_##command, .action = #command,                     \
+        .authenticated_cb = authenticated_function,                     \
         .non_authenticated_cb = non_authenticated_function              \
     }
 
+#define ADD_WRITE_COMMAND(                                              \
+    command, authenticated_function, non_authenticated_function)        \
+    [COMMAND_SLOT(VERB_##command)] = {                                  \
+        .verb = VERB_##command, .action = #command,                     \
+        .authenticated_cb = authenticated_function,                     \
+        .non_authenticated_cb = non_authenticated_function, .writes = 1 \
+    }
+
+#define ADD_TRANSFER_COMMAND(                                           \
+    command, authenticated_function, non_authenticated_function, write) \
+    [COMMAND_SLOT(VERB_##command)] = {                                  \
+        .verb = VERB_##command, .action = #command,                     \
+        .authenticated_cb = authenticated_function,                     \
+        .non_authenticated_cb = non_authenticated_function,             \
+        .writes = write, .transfers = 1                                 \
+    }
+
 /* Made these macros because I got a bug earlier using strncmp as I was not
  * validating return value to be 0 */
 #define IF_MATCHES(input_command, expected_command) \
@@ -70,7 +126,8 @@ DECL_ACTION_FOR_COMMAND(USER, cftp_user_authenticated)
 DECL_ACTION_FOR_COMMAND(PASS, cftp_pass_authenticated)
 DECL_ACTION_FOR_COMMAND(AUTHENTICATED, cftp_authenticated)
 
-static const command_action command_actions[] = {
+/* Indexed by COMMAND_SLOT, see find_command_action */
+static const command_action command_actions[COMMAND_SLOTS] = {
 
     /* Authenticated and Non Authenticated */
     ADD_COMMAND_WITH_SAME_ACTION(SYST, cftp_syst_action),
@@ -91,21 +148,25 @@ static const command_action command_actions[] = {
     ADD_COMMAND_WITH_DIFF_ACTION(PASV,
                                  cftp_pasv_authenticated_action,
                                  cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(NLST,
-                                 cftp_nlst_authenticated_action,
-                                 cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(LIST,
-                                 cftp_list_authenticated_action,
-                                 cftp_non_authenticated),
+    ADD_TRANSFER_COMMAND(NLST,
+                         cftp_nlst_authenticated_action,
+                         cftp_non_authenticated,
+                         0),
+    ADD_TRANSFER_COMMAND(LIST,
+                         cftp_list_authenticated_action,
+                         cftp_non_authenticated,
+                         0),
     ADD_COMMAND_WITH_DIFF_ACTION(SIZE,
                                  cftp_size_authenticated_action,
                                  cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(RETR,
-                                 cftp_retr_authenticated_action,
-                                 cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(STOR,
-                                 cftp_stor_authenticated_action,
-                                 cftp_non_authenticated),
+    ADD_TRANSFER_COMMAND(RETR,
+                         cftp_retr_authenticated_action,
+                         cftp_non_authenticated,
+                         0),
+    ADD_TRANSFER_COMMAND(STOR,
+                         cftp_stor_authenticated_action,
+                         cftp_non_authenticated,
+                         1),
     ADD_COMMAND_WITH_DIFF_ACTION(MDTM,
                                  cftp_mdtm_authenticated_action,
                                  cftp_non_authenticated),
@@ -118,15 +179,15 @@ static const command_action command_actions[] = {
     ADD_COMMAND_WITH_DIFF_ACTION(ABOR,
                                  cftp_abor_authenticated_action,
                                  cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(MKD,
-                                 cftp_mkd_authenticated_action,
-                                 cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(RMD,
-                                 cftp_rmd_authenticated_action,
-                                 cftp_non_authenticated),
-    ADD_COMMAND_WITH_DIFF_ACTION(DELE,
-                                 cftp_dele_authenticated_action,
-                                 cftp_non_authenticated),
+    ADD_WRITE_COMMAND(MKD,
+                      cftp_mkd_authenticated_action,
+                      cftp_non_authenticated),
+    ADD_WRITE_COMMAND(RMD,
+                      cftp_rmd_authenticated_action,
+                      cftp_non_authenticated),
+    ADD_WRITE_COMMAND(DELE,
+                      cftp_dele_authenticated_action,
+                      cftp_non_authenticated),
 
     /* Non authenticated only */
     ADD_COMMAND_WITH_DIFF_ACTION(USER,
@@ -138,4 +199,30 @@ static const command_action command_actions[] = {
 
 };
 
+/*!
+ * @return Entry of the command with the packed verb, NULL for unknown
+ * verbs.
+ */
+const command_action *find_command_action(uint32_t verb);
+
+/*!
+ * @brief Cancels the listing still running for the data connection and
+ * frees it, called when the data connection closes. Does nothing without
+ * one.
+ */
+void free_list_job(connection_t *connection);
+
+/*!
+ * @brief Logs in a session whose password was verified and identity set,
+ * or answers 421 past max_connections_per_user.
+ */
+void complete_login(connection_t *connection);
+
+/*!
+ * @brief Ends the download of the data connection, called when the data
+ * connection closes. Read-ahead chunks still queued are given back once the
+ * output buffer lets go of them. Does nothing without a download.
+ */
+void free_file_stream(connection_t *connection);
+
 #endif
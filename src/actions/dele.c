@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -8,6 +9,7 @@
 #include "error.h"
 #include "ftp_status_codes.h"
 #include "security.h"
+#include "session_fs.h"
 
 typedef struct
 {
@@ -16,7 +18,9 @@ typedef struct
     const char *target;
 } dele_args_t;
 
-static int delete_directory_recursively(const char *path);
+static int delete_directory_recursively(connection_t *connection,
+                                       const char *path);
+static int delete_directory_contents(int dir_fd);
 static bool parse_dele_params(cftp_command_t *command, dele_args_t *args);
 void handle_dele_command(cftp_command_t *command, connection_t *connection);
 
@@ -38,7 +42,7 @@ void handle_dele_command(cftp_command_t *command, connection_t *connection)
     }
 
     struct stat path_stat;
-    if (stat(args.target, &path_stat) != 0)
+    if (session_fs_stat(connection, args.target, &path_stat) != 0)
     {
         if (args.force)
         {
@@ -67,11 +71,11 @@ void handle_dele_command(cftp_command_t *command, connection_t *connection)
                 "Target is a directory. Use -r to delete recursively.");
             return;
         }
-        delete_res = delete_directory_recursively(args.target);
+        delete_res = delete_directory_recursively(connection, args.target);
     }
     else
     {
-        delete_res = unlink(args.target);
+        delete_res = session_fs_unlink(connection, args.target);
     }
 
     if (delete_res != 0)
@@ -116,27 +120,46 @@ static bool parse_dele_params(cftp_command_t *command, dele_args_t *args)
     return args->target != NULL;
 }
 
-static int delete_directory_recursively(const char *path)
+static int delete_directory_recursively(connection_t *connection,
+                                       const char *path)
 {
-    DIR *dir = opendir(path);
-    if (!dir) return -1;
+    int dir_fd =
+        session_fs_open(connection, path, O_RDONLY | O_DIRECTORY, 0);
+    if (dir_fd < 0) return -1;
 
-    struct dirent *entry;
-    char filepath[PATH_MAX];
+    if (delete_directory_contents(dir_fd) != 0) return -1;
+
+    return session_fs_rmdir(connection, path);
+}
+
+/* Works on directory fds so nothing below the target is resolved by path
+ * again, takes ownership of dir_fd. */
+static int delete_directory_contents(int dir_fd)
+{
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir)
+    {
+        close(dir_fd);
+        return -1;
+    }
 
+    struct dirent *entry;
     while ((entry = readdir(dir)) != NULL)
     {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
 
-        snprintf(filepath, sizeof(filepath), "%s/%s", path, entry->d_name);
-
         struct stat st;
-        if (lstat(filepath, &st) != 0) continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
 
         if (S_ISDIR(st.st_mode))
         {
-            if (delete_directory_recursively(filepath) != 0)
+            int child = openat(dirfd(dir),
+                               entry->d_name,
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child < 0 || delete_directory_contents(child) != 0 ||
+                unlinkat(dirfd(dir), entry->d_name, AT_REMOVEDIR) != 0)
             {
                 closedir(dir);
                 return -1;
@@ -144,10 +167,10 @@ static int delete_directory_recursively(const char *path)
         }
         else
         {
-            unlink(filepath); /* Delete if file */
+            unlinkat(dirfd(dir), entry->d_name, 0); /* Delete if file */
         }
     }
 
     closedir(dir);
-    return rmdir(path);
+    return 0;
 }
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <openssl/err.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -15,6 +16,10 @@
 #include "ftp_status_codes.h"
 #include "interprocess_handler.h"
 #include "security.h"
+#include "session_fs.h"
+
+/* Entries formatted together, their owners are resolved in one request */
+#define LIST_CHUNK_ENTRIES 1024
 
 typedef struct
 {
@@ -24,6 +29,26 @@ typedef struct
     const char *path;
 } list_flags_t;
 
+typedef struct
+{
+    char name[256];
+    struct stat st;
+} list_entry_t;
+
+/* A listing in progress, it pauses while the owners of a chunk are asked
+ * from the parent and resumes from on_chunk_names */
+typedef struct list_job
+{
+    DIR *dir;
+    list_entry_t *chunk; /* NULL formats entry by entry */
+    size_t pending;      /* Entries in chunk */
+    struct evbuffer *output;
+    int description;
+    int hidden;
+    bool human;
+    uint32_t names_request; /* In flight for chunk, 0 if none */
+} list_job_t;
+
 void handle_list_command(cftp_command_t *command,
                          connection_t *connection,
                          int description);
@@ -39,6 +64,11 @@ static void format_unix_list_entry(connection_t *connection,
                                    const char *name,
                                    const struct stat *st,
                                    bool human);
+static void run_list_job(connection_t *connection);
+static int resolve_chunk(connection_t *connection);
+static void on_chunk_names(void *ctx);
+static void format_list_chunk(connection_t *connection);
+static void finish_list_job(connection_t *connection);
 static const char *human_readable_size(off_t size, char *buf, size_t buflen);
 static void tls_on_bev_event_connected(struct bufferevent *bev, void *ctx);
 static void close_on_listcb(struct bufferevent *bev, void *ctx);
@@ -107,7 +137,7 @@ void handle_list_command(cftp_command_t *command,
         return;
     }
 
-    DIR *dir = opendir(path);
+    DIR *dir = session_fs_opendir(connection, path);
     if (!dir)
     {
         connection->control_write_cb = close_data_connection_on_writecb;
@@ -118,10 +148,11 @@ void handle_list_command(cftp_command_t *command,
               connection->username);
         return;
     }
+    closedir(dir);
 
     if (connection->data_tls_required)
     {
-        strncpy(connection->path, path, PATH_MAX);
+        snprintf(connection->path, sizeof(connection->path), "%s", path);
         connection->description = description;
         connection->hidden = args.all;
         connection->data_tls_event_connected_cb = tls_on_bev_event_connected;
@@ -160,53 +191,178 @@ static void send_list_command_output(connection_t *connection,
                                      bool human)
 {
     char path[PATH_MAX] = {0};
-    strncpy(path, params, PATH_MAX);
+    snprintf(path, sizeof(path), "%s", params);
 
-    DIR *dir = opendir(path);
+    DIR *dir = session_fs_opendir(connection, path);
+    if (!dir)
+    {
+        ERROR("Directory %s vanished before listing for %s",
+              path,
+              connection->username);
+        connection->control_write_cb = close_data_connection_on_writecb;
+        send_control_message(
+            connection, FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM, "Invalid path");
+        return;
+    }
+
+    list_job_t *job = calloc(1, sizeof(list_job_t));
+    struct evbuffer *output = job ? evbuffer_new() : NULL;
+    if (!output)
+    {
+        ERROR("Out of memory listing %s for %s", path, connection->username);
+        free(job);
+        closedir(dir);
+        connection->control_write_cb = close_data_connection_on_writecb;
+        send_control_message(connection,
+                             FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
+                             "Cannot list directory");
+        return;
+    }
+
+    free_list_job(connection); /* A previous listing nobody waited for */
+    job->dir = dir;
+    job->output = output;
+    job->description = description;
+    job->hidden = hidden;
+    job->human = human;
+
+    /* Without memory for a chunk names are looked up one entry at a time */
+    if (description)
+        job->chunk = malloc(LIST_CHUNK_ENTRIES * sizeof(list_entry_t));
+    connection->list_job = job;
+    run_list_job(connection);
+}
+
+/* Reads the directory until it ends or a chunk waits for owner names */
+static void run_list_job(connection_t *connection)
+{
+    list_job_t *job = connection->list_job;
     struct dirent *entry;
-    struct evbuffer *evbuf = evbuffer_new();
 
-    while ((entry = readdir(dir)) != NULL)
+    while ((entry = readdir(job->dir)) != NULL)
     {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
 
-        char fullpath[PATH_MAX];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
-
         struct stat st;
-        if (lstat(fullpath, &st) == -1) continue;
+        if (fstatat(dirfd(job->dir),
+                    entry->d_name,
+                    &st,
+                    AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
 
-        if (hidden == 0 && entry->d_name[0] == '.') continue;
+        if (job->hidden == 0 && entry->d_name[0] == '.') continue;
+
+        if (job->chunk)
+        {
+            list_entry_t *slot = &job->chunk[job->pending];
+            snprintf(slot->name, sizeof(slot->name), "%s", entry->d_name);
+            slot->st = st;
+            if (++job->pending == LIST_CHUNK_ENTRIES &&
+                !resolve_chunk(connection))
+                return;
+            continue;
+        }
 
         char line[PATH_MAX];
-        if (description)
-            format_unix_list_entry(
-                connection, line, sizeof(line), entry->d_name, &st, human);
+        if (job->description)
+            format_unix_list_entry(connection,
+                                   line,
+                                   sizeof(line),
+                                   entry->d_name,
+                                   &st,
+                                   job->human);
         else
             snprintf(line, sizeof(line), "%s\r\n", entry->d_name);
         DEBG("Got line %s", line);
-        evbuffer_add(evbuf, line, strlen(line));
+        evbuffer_add(job->output, line, strlen(line));
     }
 
-    closedir(dir);
-    if (evbuffer_get_length(evbuf) == 0)
+    if (job->pending && !resolve_chunk(connection)) return;
+    finish_list_job(connection);
+}
+
+/* 1 if the chunk was formatted, 0 if on_chunk_names will do it */
+static int resolve_chunk(connection_t *connection)
+{
+    list_job_t *job = connection->list_job;
+
+    uint32_t uids[LIST_CHUNK_ENTRIES];
+    uint32_t gids[LIST_CHUNK_ENTRIES];
+    for (size_t i = 0; i < job->pending; i++)
+    {
+        uids[i] = job->chunk[i].st.st_uid;
+        gids[i] = job->chunk[i].st.st_gid;
+    }
+
+    job->names_request = resolve_owner_names(
+        connection, uids, gids, job->pending, on_chunk_names, connection);
+    if (job->names_request) return 0;
+
+    format_list_chunk(connection);
+    return 1;
+}
+
+static void on_chunk_names(void *ctx)
+{
+    connection_t *connection = (connection_t *)ctx;
+    connection->list_job->names_request = 0;
+    format_list_chunk(connection);
+    run_list_job(connection);
+}
+
+static void format_list_chunk(connection_t *connection)
+{
+    list_job_t *job = connection->list_job;
+    for (size_t i = 0; i < job->pending; i++)
+    {
+        char line[PATH_MAX];
+        format_unix_list_entry(connection,
+                               line,
+                               sizeof(line),
+                               job->chunk[i].name,
+                               &job->chunk[i].st,
+                               job->human);
+        evbuffer_add(job->output, line, strlen(line));
+    }
+    job->pending = 0;
+}
+
+static void finish_list_job(connection_t *connection)
+{
+    list_job_t *job = connection->list_job;
+    if (evbuffer_get_length(job->output) == 0)
     {
         DEBG("Got nothing to send !");
+        free_list_job(connection);
         connection->control_write_cb = close_data_connection_on_writecb;
         connection->data_tls_event_connected_cb =
             close_data_connection_on_writecb;
         send_control_message(connection,
                              FTP_STATUS_DATA_CONNECTION_CLOSING,
                              "Directory send OK");
-        evbuffer_free(evbuf);
         return;
     }
+
     connection->data_write_cb = close_on_listcb;
-    bufferevent_write_buffer(connection->data_bev, evbuf);
+    bufferevent_write_buffer(connection->data_bev, job->output);
+    free_list_job(connection);
 
     DEBG("Sent directory listing to data connection");
-    evbuffer_free(evbuf);
+}
+
+void free_list_job(connection_t *connection)
+{
+    list_job_t *job = connection->list_job;
+    if (!job) return;
+
+    /* Cancelling runs no continuation */
+    connection->list_job = NULL;
+    if (job->names_request) cancel_owner_names(connection, job->names_request);
+    closedir(job->dir);
+    free(job->chunk);
+    evbuffer_free(job->output);
+    free(job);
 }
 
 static void format_unix_list_entry(connection_t *connection,
@@ -227,16 +383,16 @@ static void format_unix_list_entry(connection_t *connection,
     for (int i = 0; i < 9; ++i)
         if (st->st_mode & (1 << (8 - i))) perms[i + 1] = rwx[i % 3];
 
-    struct tm *tm = localtime(&st->st_mtime);
+    struct tm tm;
+    localtime_r(&st->st_mtime, &tm);
     char timebuf[32];
-    strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", tm);
+    strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", &tm);
 
     char username[256];
-    ask_root_for_username(connection, st->st_uid, username, sizeof(username));
+    find_owner_name(connection, 0, st->st_uid, username, sizeof(username));
 
     char groupname[256];
-    ask_root_for_groupname(
-        connection, st->st_gid, groupname, sizeof(groupname));
+    find_owner_name(connection, 1, st->st_gid, groupname, sizeof(groupname));
 
     char sizebuf[32];
     if (human)
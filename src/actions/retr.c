@@ -1,24 +1,46 @@
 #include <dirent.h>
+#include <errno.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_ssl.h>
 #include <event2/event.h>
 #include <fcntl.h>
 #include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "buffer_pool.h"
 #include "command_actions.h"
 #include "control_handler.h"
 #include "data_handler.h"
 #include "error.h"
 #include "ftp_status_codes.h"
+#include "server_state.h"
+#include "session_fs.h"
+
+/* Bytes SSL_sendfile may send per wakeup, so other sessions on the loop
+ * get a turn on fast links */
+#define KTLS_SENDFILE_SLICE (4 * 1024 * 1024)
+
+/* Retry delay of a download that found transfer_chunks_total taken */
+#define CHUNK_WAIT_USEC 20000
+
+extern server_state_t g_server_state;
 
 void cftp_send_file(connection_t *connection, const char *params);
 static void send_next_chunk(struct bufferevent *bev, void *ctx);
+static void release_chunk(const void *data, size_t length, void *ctx);
+static void wait_for_chunks(connection_t *connection);
+static void retry_send(evutil_socket_t fd, short what, void *ctx);
+static void abort_download(connection_t *connection, const char *reason);
 static void ftp_send_file_with_evbuffer(connection_t *connection,
                                         const char *params);
 static void ftp_send_file_plain(connection_t *connection, const char *params);
+static void start_tls_download(struct bufferevent *bev, void *ctx);
+static void send_with_ktls(evutil_socket_t fd, short what, void *ctx);
+static void finish_ktls_download(connection_t *connection, int sent);
 static void download_completion_on_plain_connection_cb(struct bufferevent *bev,
                                                        void *ctx);
 static void close_on_retrcb(struct bufferevent *bev, void *ctx);
@@ -34,13 +56,24 @@ static void ftp_send_file_with_evbuffer(connection_t *connection,
                                         const char *filepath)
 {
     if (!connection->data_bev) return;
-    int fd = open(filepath, O_RDONLY);
-    if (fd < 0) return;  // Handle error
+    int fd = session_fs_open(connection, filepath, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        ERROR("Error occurred while opening %s", filepath);
+        send_control_message(connection,
+                             FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
+                             "Failed to open file");
+        return;
+    }
 
     struct stat st;
     if (fstat(fd, &st) < 0)
     {
+        ERROR("Error occurred while stating %s", filepath);
         close(fd);
+        send_control_message(connection,
+                             FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
+                             "Failed to open file");
         return;
     }
 
@@ -48,22 +81,84 @@ static void ftp_send_file_with_evbuffer(connection_t *connection,
         connection, FTP_STATUS_FILE_STATUS_OKAY, "Sending file");
 
     file_stream_t *fs = calloc(1, sizeof(file_stream_t));
+    if (!fs)
+    {
+        ERROR("Failed to allocate the stream of %s", filepath);
+        close(fd);
+        send_control_message(connection,
+                             FTP_STATUS_ACTION_ABORTED,
+                             "Out of memory");
+        return;
+    }
 
     fs->fd = fd;
     fs->filesize = st.st_size;
 
     connection->data_stream = fs;
+
+    /* Whether the kernel took the keys is known after the handshake, and
+     * an empty file must not close the connection before it */
+    if (!connection->data_active)
+        connection->data_tls_event_connected_cb = start_tls_download;
+    else
+        start_tls_download(connection->data_bev, connection);
+}
+
+static void start_tls_download(struct bufferevent *bev, void *ctx)
+{
+    connection_t *connection = (connection_t *)ctx;
+    connection->data_tls_event_connected_cb = NULL;
+
+    if (data_connection_ktls_send(connection))
+    {
+        /* The socket is written by SSL_sendfile from now on, the
+         * bufferevent only watches for the client going away */
+        connection->sendfile_event = event_new(connection->base,
+                                               bufferevent_getfd(bev),
+                                               EV_WRITE | EV_PERSIST,
+                                               send_with_ktls,
+                                               connection);
+        if (connection->sendfile_event)
+        {
+            DEBG("Sending file with kTLS sendfile for %s",
+                 connection->username);
+            bufferevent_disable(bev, EV_WRITE);
+            event_add(connection->sendfile_event, NULL);
+            return;
+        }
+        WARN("Cannot watch the data connection of %s, sending through "
+             "OpenSSL",
+             connection->username);
+    }
+
+    /* Topped up whenever no more than a chunk is left to send */
     connection->data_write_cb = send_next_chunk;
-    bufferevent_setwatermark(connection->data_bev, EV_WRITE, 128 * 1024, 0);
-    bufferevent_enable(connection->data_bev, EV_WRITE);
-    send_next_chunk(connection->data_bev, connection);  // kickstart
+    bufferevent_setwatermark(bev, EV_WRITE, buffer_chunk_size(), 0);
+    bufferevent_enable(bev, EV_WRITE);
+    send_next_chunk(bev, connection);  // kickstart
+}
+
+void free_file_stream(connection_t *connection)
+{
+    file_stream_t *fs = connection->data_stream;
+    if (!fs) return;
+
+    connection->data_stream = NULL;
+    if (fs->fd >= 0) close(fs->fd);
+    fs->fd = -1;
+    if (fs->wait_event) event_free(fs->wait_event);
+    fs->wait_event = NULL;
+
+    /* The output buffer may be freed later and give its chunks back then */
+    fs->ended = 1;
+    if (!fs->chunks) free(fs);
 }
 
 static void ftp_send_file_plain(connection_t *connection, const char *filepath)
 {
     if (!connection->data_bev) return;
 
-    int fd = open(filepath, O_RDONLY);
+    int fd = session_fs_open(connection, filepath, O_RDONLY, 0);
     if (fd < 0)
     {
         ERROR("Error occurred while opening %s", filepath);
@@ -97,23 +192,164 @@ static void send_next_chunk(struct bufferevent *bev, void *ctx)
 {
     connection_t *connection = (connection_t *)ctx;
     file_stream_t *fs = connection->data_stream;
+    struct evbuffer *output = bufferevent_get_output(bev);
+    size_t chunk_size = buffer_chunk_size();
 
-    ssize_t n = read(fs->fd, fs->buffer, FILE_CHUNK_SIZE);
-    if (fs->offset + n == fs->filesize)
+    /* The chunk being sent and one read ahead, handed over by reference */
+    while (fs->offset < fs->filesize &&
+           fs->chunks < g_server_state.config.transfer_chunks &&
+           evbuffer_get_length(output) < 2 * chunk_size)
     {
-        /* Set connection write back to close the connection */
-        connection->data_write_cb = close_on_retrcb;
+        buffer_chunk_t *chunk = take_buffer_chunk(&connection->admission);
+        if (!chunk)
+        {
+            /* Sending the chunks still held tops up again */
+            if (!fs->chunks) wait_for_chunks(connection);
+            return;
+        }
+
+        off_t left = fs->filesize - fs->offset;
+        ssize_t n = read(fs->fd,
+                         chunk->data,
+                         left < (off_t)chunk_size ? (size_t)left : chunk_size);
+        const char *failure = n < 0    ? strerror(errno)
+                              : n == 0 ? "file shrank"
+                                       : NULL;
+        chunk->owner = fs;
+        if (!failure &&
+            evbuffer_add_reference(output, chunk->data, n, release_chunk, chunk))
+            failure = "out of memory";
+        if (failure)
+        {
+            give_back_buffer_chunk(chunk);
+            abort_download(connection, failure);
+            return;
+        }
+        fs->chunks++;
+        fs->offset += n;
+
+        /* The kernel reads the next chunk while this one is encrypted */
+        posix_fadvise(fs->fd, fs->offset, chunk_size, POSIX_FADV_WILLNEED);
     }
-    if (n <= 0)
+
+    if (fs->offset < fs->filesize) return;
+
+    /* All read, complete once the output is empty */
+    connection->data_write_cb = close_on_retrcb;
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    if (!evbuffer_get_length(output)) close_on_retrcb(bev, connection);
+}
+
+static void release_chunk(const void *data __attribute__((unused)),
+                          size_t length __attribute__((unused)),
+                          void *ctx)
+{
+    buffer_chunk_t *chunk = (buffer_chunk_t *)ctx;
+    file_stream_t *fs = (file_stream_t *)chunk->owner;
+
+    give_back_buffer_chunk(chunk);
+    if (--fs->chunks == 0 && fs->ended) free(fs);
+}
+
+static void wait_for_chunks(connection_t *connection)
+{
+    file_stream_t *fs = connection->data_stream;
+    if (!fs->wait_event)
+        fs->wait_event = evtimer_new(connection->base, retry_send, connection);
+    if (!fs->wait_event)
+    {
+        abort_download(connection, "out of memory");
+        return;
+    }
+
+    DEBG("Download of %s waits for transfer buffer chunks",
+         connection->username);
+    struct timeval delay = {0, CHUNK_WAIT_USEC};
+    evtimer_add(fs->wait_event, &delay);
+}
+
+static void retry_send(evutil_socket_t fd __attribute__((unused)),
+                       short what __attribute__((unused)),
+                       void *ctx)
+{
+    connection_t *connection = (connection_t *)ctx;
+    session_fs_enter(connection);
+    send_next_chunk(connection->data_bev, connection);
+}
+
+static void abort_download(connection_t *connection, const char *reason)
+{
+    ERROR("Download for %s aborted at %lld bytes: %s",
+          connection->username,
+          (long long)connection->data_stream->offset,
+          reason);
+    send_control_message(
+        connection, FTP_STATUS_ACTION_ABORTED, "Transfer aborted");
+    close_data_connection(connection);
+}
+
+static void send_with_ktls(evutil_socket_t fd __attribute__((unused)),
+                           short what __attribute__((unused)),
+                           void *ctx)
+{
+    connection_t *connection = (connection_t *)ctx;
+    file_stream_t *fs = connection->data_stream;
+    off_t slice_end = fs->offset + KTLS_SENDFILE_SLICE;
+
+    while (fs->offset < fs->filesize && fs->offset < slice_end)
+    {
+        off_t left = fs->filesize - fs->offset;
+        ossl_ssize_t n = SSL_sendfile(connection->data_ssl,
+                                      fs->fd,
+                                      fs->offset,
+                                      left < KTLS_SENDFILE_SLICE
+                                          ? (size_t)left
+                                          : KTLS_SENDFILE_SLICE,
+                                      0);
+        if (n > 0)
+        {
+            fs->offset += n;
+            continue;
+        }
+
+        if (n < 0 && SSL_get_error(connection->data_ssl, (int)n) ==
+                         SSL_ERROR_WANT_WRITE)
+            return;
+
+        /* A file that shrank while being sent ends it as well */
+        unsigned long error = ERR_get_error();
+        ERROR("SSL_sendfile failed at %lld of %lld bytes for %s: %s",
+              (long long)fs->offset,
+              (long long)fs->filesize,
+              connection->username,
+              n == 0  ? "end of file"
+              : error ? ERR_reason_error_string(error)
+                      : strerror(errno));
+        finish_ktls_download(connection, 0);
+        return;
+    }
+
+    if (fs->offset >= fs->filesize) finish_ktls_download(connection, 1);
+}
+
+static void finish_ktls_download(connection_t *connection, int sent)
+{
+    event_free(connection->sendfile_event);
+    connection->sendfile_event = NULL;
+
+    if (!sent)
     {
-        DEBG("Read failed or EOF");
-        close(fs->fd);
-        fs->fd = -1;
+        send_control_message(connection,
+                             FTP_STATUS_CONNECTION_CLOSED,
+                             "Transfer aborted");
+        close_data_connection(connection);
         return;
     }
 
-    bufferevent_write(bev, fs->buffer, n);
-    fs->offset += n;
+    DEBG("Sent File OK");
+    connection->control_write_cb = close_data_connection_on_writecb;
+    send_control_message(
+        connection, FTP_STATUS_DATA_CONNECTION_CLOSING, "Transfer complete");
 }
 
 static void download_completion_on_plain_connection_cb(struct bufferevent *bev,
@@ -13,6 +13,7 @@
 #include "data_handler.h"
 #include "error.h"
 #include "ftp_status_codes.h"
+#include "session_fs.h"
 
 void cftp_recv_file_with_evbuffer(connection_t *connection,
                                   const char *filepath);
@@ -32,7 +33,8 @@ void cftp_recv_file_with_evbuffer(connection_t *connection,
         return;
     }
 
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int fd = session_fs_open(
+        connection, filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd < 0)
     {
         ERROR("Failed to open file: %s", filepath);
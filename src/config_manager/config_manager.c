@@ -28,23 +28,126 @@ static int seed_default_config_if_missing(const char *path_opt)
     if (stat(path, &st) == 0) return 1;
     if (errno != ENOENT) return -1;
 
-    /* Build default content (vsftpd-style directive=value with # comments) */
-    const char *content =
+    /* Build default content (vsftpd-style directive=value with # comments),
+     * in parts that stay below the string length C99 compilers support */
+    static const char *const content[] = {
         "# cftp server configuration (directive=value, '#' for comments)\n"
         "\n# Limits and timeouts\n"
         "max_connections=10000\n"
+        "# Connections per client address and logged in sessions per user,\n"
+        "# 0 for no limit. Counted across all processes in shared memory,\n"
+        "# see /dev/shm/cftp_server.<port>\n"
+        "max_connections_per_ip=0\n"
+        "max_connections_per_user=0\n"
+        "# Failed logins of a client address or user name wait for their\n"
+        "# 530, auth_failure_delay seconds at first and doubling up to\n"
+        "# auth_failure_delay_max, 0 never waits. Failures are forgotten\n"
+        "# auth_failure_window seconds after the last one.\n"
+        "auth_failure_delay=1\n"
+        "auth_failure_delay_max=30\n"
+        "auth_failure_window=900\n"
+        "# Password hashes computed at the same time, 0 for half the CPUs\n"
+        "auth_crypt_concurrency=0\n"
+        "# Client address allow and deny list, one CIDR prefix per line\n"
+        "# after allow or deny, the most specific one decides. Reread on\n"
+        "# SIGHUP, empty admits every address\n"
+        "ip_access_file=\n"
         "connection_accept_timeout=60\n"
         "data_connection_accept_timeout=9\n"
         "\n# Ports range (IANA dynamic/private ports)\n"
         "passive_port_start=40000\n"
         "passive_port_end=41000\n"
         "port=21\n"
+        "\n# Process model (0 accepts in the main process, N preforks N\n"
+        "# acceptor workers each owning a SO_REUSEPORT listener)\n"
+        "worker_processes=0\n"
+        "\n# Session model (process forks a chrooted child per session,\n"
+        "# threads multiplexes sessions on session_threads event loops,\n"
+        "# 0 threads uses one per CPU, and needs openat2 of Linux 5.6)\n"
+        "session_model=process\n"
+        "session_threads=0\n"
+        "\n# Process model only: greet and authenticate in the accepting\n"
+        "# process and fork once PASS succeeded, hashing passwords on\n"
+        "# preauth_crypt_threads threads. The threads model always hashes\n"
+        "# on preauth_crypt_threads threads.\n"
+        "preauth_in_parent=0\n"
+        "preauth_crypt_threads=2\n"
+        "\n# Process model without pre-auth: fork sessions from a small\n"
+        "# zygote started at boot instead of the accepting process\n"
+        "session_zygote=0\n"
+        "\n# Process model: run every plain session of a user on the loop of\n"
+        "# one long lived process chrooted to and running as that user, the\n"
+        "# session is passed to it after PASS. Implies preauth_in_parent,\n"
+        "# sessions that ran AUTH TLS still get a process of their own\n"
+        "session_per_user=0\n"
+        "\n# Process model, plain control connections only: after this many\n"
+        "# hands its socket back to the accepting process and exits, the\n"
+        "# next command resumes it in a new session process. Sessions that\n"
+        "# ran AUTH TLS never hibernate (0 disables)\n"
+        "idle_hibernate_timeout=0\n"
+        "\n# Anonymous read only downloads (USER anonymous or ftp, any\n"
+        "# password). Sessions see anonymous_root as / and run as the\n"
+        "# unprivileged anonymous_user, STOR, DELE, MKD and RMD are refused.\n"
+        "# The process model serves them from anonymous_workers shared\n"
+        "# processes instead of a process each, which implies\n"
+        "# preauth_in_parent. An empty root disables anonymous login\n"
+        "anonymous_root=\n"
+        "anonymous_user=ftp\n"
+        "anonymous_workers=1\n",
+        "\n# Process model: where session processes run. none leaves it to\n"
+        "# the scheduler, round_robin pins each to the next CPU of\n"
+        "# session_cpus, incoming_cpu pins to the CPU that received the\n"
+        "# connection (round robin when that CPU is not in the set),\n"
+        "# nic_node keeps them on the NUMA node of session_nic. An empty\n"
+        "# session_cpus allows every CPU the server may run on\n"
+        "session_cpu_affinity=none\n"
+        "session_cpus=\n"
+        "session_nic=\n"
+        "\n# Process model: place every session (scope session) or every\n"
+        "# user (scope user) in a child cgroup of session_cgroup, a\n"
+        "# delegated cgroup v2 directory the server does not run in, with\n"
+        "# these cpu.weight and io.weight (1-10000, 0 keeps the default),\n"
+        "# io.max line and memory.high. An empty session_cgroup disables it\n"
+        "session_cgroup=\n"
+        "session_cgroup_scope=session\n"
+        "session_cpu_weight=0\n"
+        "session_io_weight=0\n"
+        "session_io_max=\n"
+        "session_memory_high=\n"
+        "\n# SIGUSR2 starts the binary again on the same listening socket,\n"
+        "# SIGQUIT stops accepting. Either way the old process lets running\n"
+        "# transfers finish, tells idle clients to reconnect and exits once\n"
+        "# its sessions are gone or after this many seconds (0 no limit)\n"
+        "upgrade_drain_timeout=3600\n"
+        "\n# Process model: sessions look user and group names up in a\n"
+        "# snapshot of /etc/passwd and /etc/group taken by the process that\n"
+        "# forks them, which looks for changes at most this many seconds\n"
+        "# apart. 0 asks the parent for every name instead\n"
+        "name_snapshot_interval=5\n"
+        "\n# Names missing from the snapshot are looked up by the parent on\n"
+        "# nss_threads threads, so a slow directory service does not hold up\n"
+        "# the server. Answers are kept nss_cache_ttl seconds, ids without a\n"
+        "# name nss_negative_cache_ttl seconds (0 asks NSS every time)\n"
+        "nss_threads=4\n"
+        "nss_cache_ttl=600\n"
+        "nss_negative_cache_ttl=20\n"
         "\n# Identity\n"
         "server_name=Harkirat's CFTP Server\n"
         "\n# TLS settings\n"
         "\n# Certificate paths (adjust per distro)\n"
         "ssl_cert_file=/etc/ssl/certs/cftp_server.crt\n"
-        "ssl_key_file=/etc/ssl/private/cftp_server.key\n";
+        "ssl_key_file=/etc/ssl/private/cftp_server.key\n"
+        "\n# Kernel TLS on PROT P data connections: encrypted RETR is sent\n"
+        "# with sendfile and STOR is decrypted by the kernel. Needs the tls\n"
+        "# kernel module, without it transfers stay in user space\n"
+        "data_ktls=0\n"
+        "\n# Files sent over PROT P without kernel TLS are read into chunks\n"
+        "# of transfer_chunk_kb, a download holds at most transfer_chunks\n"
+        "# of them and all together at most transfer_chunks_total (0 for\n"
+        "# no limit)\n"
+        "transfer_chunk_kb=256\n"
+        "transfer_chunks=4\n"
+        "transfer_chunks_total=4096\n"};
 
     /* Create temp file in same directory as target: <path>.tmp.XXXXXX */
     char tmp_path[PATH_MAX];
@@ -73,21 +176,24 @@ static int seed_default_config_if_missing(const char *path_opt)
     }
 
     /* Write all content */
-    size_t to_write = strlen(content);
-    const char *p = content;
-    while (to_write > 0)
+    for (size_t i = 0; i < sizeof(content) / sizeof(content[0]); i++)
     {
-        ssize_t w = write(fd, p, to_write);
-        if (w < 0)
+        size_t to_write = strlen(content[i]);
+        const char *p = content[i];
+        while (to_write > 0)
         {
-            int e = errno;
-            close(fd);
-            unlink(tmp_path);
-            errno = e;
-            return -1;
+            ssize_t w = write(fd, p, to_write);
+            if (w < 0)
+            {
+                int e = errno;
+                close(fd);
+                unlink(tmp_path);
+                errno = e;
+                return -1;
+            }
+            p += w;
+            to_write -= (size_t)w;
         }
-        p += w;
-        to_write -= (size_t)w;
     }
 
     /* Flush data to disk */
@@ -189,6 +295,34 @@ static void assign_kv(configurations_t *cfg,
     {
         if (parse_int(v, &iv) && iv > 0) cfg->max_connections = iv;
     }
+    else if (equals_icase(k, "max_connections_per_ip"))
+    {
+        if (parse_int(v, &iv) && iv >= 0) cfg->max_connections_per_ip = iv;
+    }
+    else if (equals_icase(k, "max_connections_per_user"))
+    {
+        if (parse_int(v, &iv) && iv >= 0) cfg->max_connections_per_user = iv;
+    }
+    else if (equals_icase(k, "auth_failure_delay"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_AUTH_FAILURE_DELAY)
+            cfg->auth_failure_delay = iv;
+    }
+    else if (equals_icase(k, "auth_failure_delay_max"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_AUTH_FAILURE_DELAY)
+            cfg->auth_failure_delay_max = iv;
+    }
+    else if (equals_icase(k, "auth_failure_window"))
+    {
+        if (parse_int(v, &iv) && iv > 0) cfg->auth_failure_window = iv;
+    }
+    else if (equals_icase(k, "auth_crypt_concurrency"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 &&
+            iv <= CFTP_MAX_AUTH_CRYPT_CONCURRENCY)
+            cfg->auth_crypt_concurrency = iv;
+    }
     else if (equals_icase(k, "connection_accept_timeout"))
     {
         if (parse_int(v, &iv) && iv >= 0) cfg->connection_accept_timeout = iv;
@@ -213,6 +347,206 @@ static void assign_kv(configurations_t *cfg,
         if (parse_int(v, &iv) && iv >= 20 && iv <= 65535)
             cfg->port = iv;  // be lenient, allow 20+
     }
+    else if (equals_icase(k, "worker_processes"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_WORKER_PROCESSES)
+            cfg->worker_processes = iv;
+    }
+    else if (equals_icase(k, "session_model"))
+    {
+        if (v && equals_icase(v, "process"))
+            cfg->session_model = SESSION_MODEL_PROCESS;
+        else if (v && equals_icase(v, "threads"))
+            cfg->session_model = SESSION_MODEL_THREADS;
+        else
+            WARN("Unknown session_model '%s' at line %d", v, line_no);
+    }
+    else if (equals_icase(k, "session_threads"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_SESSION_THREADS)
+            cfg->session_threads = iv;
+    }
+    else if (equals_icase(k, "preauth_in_parent"))
+    {
+        if (parse_int(v, &iv) && (iv == 0 || iv == 1))
+            cfg->preauth_in_parent = iv;
+    }
+    else if (equals_icase(k, "preauth_crypt_threads"))
+    {
+        if (parse_int(v, &iv) && iv >= 1 && iv <= CFTP_MAX_CRYPT_THREADS)
+            cfg->preauth_crypt_threads = iv;
+    }
+    else if (equals_icase(k, "session_zygote"))
+    {
+        if (parse_int(v, &iv) && (iv == 0 || iv == 1))
+            cfg->session_zygote = iv;
+    }
+    else if (equals_icase(k, "session_per_user"))
+    {
+        if (parse_int(v, &iv) && (iv == 0 || iv == 1))
+            cfg->session_per_user = iv;
+    }
+    else if (equals_icase(k, "idle_hibernate_timeout"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 &&
+            iv <= CFTP_MAX_IDLE_HIBERNATE_TIMEOUT)
+            cfg->idle_hibernate_timeout = iv;
+    }
+    else if (equals_icase(k, "ip_access_file"))
+    {
+        if (v)
+        {
+            snprintf(
+                cfg->ip_access_file, sizeof(cfg->ip_access_file), "%s", v);
+            trim_right_inplace(cfg->ip_access_file);
+        }
+    }
+    else if (equals_icase(k, "anonymous_root"))
+    {
+        if (v)
+        {
+            snprintf(
+                cfg->anonymous_root, sizeof(cfg->anonymous_root), "%s", v);
+            trim_right_inplace(cfg->anonymous_root);
+        }
+    }
+    else if (equals_icase(k, "anonymous_user"))
+    {
+        if (v)
+        {
+            snprintf(
+                cfg->anonymous_user, sizeof(cfg->anonymous_user), "%s", v);
+            trim_right_inplace(cfg->anonymous_user);
+        }
+    }
+    else if (equals_icase(k, "anonymous_workers"))
+    {
+        if (parse_int(v, &iv) && iv >= 1 && iv <= CFTP_MAX_ANONYMOUS_WORKERS)
+            cfg->anonymous_workers = iv;
+    }
+    else if (equals_icase(k, "session_cpu_affinity"))
+    {
+        if (v && equals_icase(v, "none"))
+            cfg->session_cpu_affinity = SESSION_AFFINITY_NONE;
+        else if (v && equals_icase(v, "round_robin"))
+            cfg->session_cpu_affinity = SESSION_AFFINITY_ROUND_ROBIN;
+        else if (v && equals_icase(v, "incoming_cpu"))
+            cfg->session_cpu_affinity = SESSION_AFFINITY_INCOMING_CPU;
+        else if (v && equals_icase(v, "nic_node"))
+            cfg->session_cpu_affinity = SESSION_AFFINITY_NIC_NODE;
+        else
+            WARN("Unknown session_cpu_affinity '%s' at line %d", v, line_no);
+    }
+    else if (equals_icase(k, "session_cpus"))
+    {
+        if (v)
+        {
+            snprintf(cfg->session_cpus, sizeof(cfg->session_cpus), "%s", v);
+            trim_right_inplace(cfg->session_cpus);
+        }
+    }
+    else if (equals_icase(k, "session_nic"))
+    {
+        if (v)
+        {
+            snprintf(cfg->session_nic, sizeof(cfg->session_nic), "%s", v);
+            trim_right_inplace(cfg->session_nic);
+        }
+    }
+    else if (equals_icase(k, "session_cgroup"))
+    {
+        if (v)
+        {
+            snprintf(
+                cfg->session_cgroup, sizeof(cfg->session_cgroup), "%s", v);
+            trim_right_inplace(cfg->session_cgroup);
+        }
+    }
+    else if (equals_icase(k, "session_cgroup_scope"))
+    {
+        if (v && equals_icase(v, "session"))
+            cfg->session_cgroup_scope = SESSION_CGROUP_PER_SESSION;
+        else if (v && equals_icase(v, "user"))
+            cfg->session_cgroup_scope = SESSION_CGROUP_PER_USER;
+        else
+            WARN("Unknown session_cgroup_scope '%s' at line %d", v, line_no);
+    }
+    else if (equals_icase(k, "session_cpu_weight"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_CGROUP_WEIGHT)
+            cfg->session_cpu_weight = iv;
+    }
+    else if (equals_icase(k, "session_io_weight"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_CGROUP_WEIGHT)
+            cfg->session_io_weight = iv;
+    }
+    else if (equals_icase(k, "session_io_max"))
+    {
+        if (v)
+        {
+            snprintf(
+                cfg->session_io_max, sizeof(cfg->session_io_max), "%s", v);
+            trim_right_inplace(cfg->session_io_max);
+        }
+    }
+    else if (equals_icase(k, "session_memory_high"))
+    {
+        if (v)
+        {
+            snprintf(cfg->session_memory_high,
+                     sizeof(cfg->session_memory_high),
+                     "%s",
+                     v);
+            trim_right_inplace(cfg->session_memory_high);
+        }
+    }
+    else if (equals_icase(k, "upgrade_drain_timeout"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_DRAIN_TIMEOUT)
+            cfg->upgrade_drain_timeout = iv;
+    }
+    else if (equals_icase(k, "name_snapshot_interval"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 &&
+            iv <= CFTP_MAX_NAME_SNAPSHOT_INTERVAL)
+            cfg->name_snapshot_interval = iv;
+    }
+    else if (equals_icase(k, "nss_threads"))
+    {
+        if (parse_int(v, &iv) && iv >= 1 && iv <= CFTP_MAX_NSS_THREADS)
+            cfg->nss_threads = iv;
+    }
+    else if (equals_icase(k, "nss_cache_ttl"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_NSS_CACHE_TTL)
+            cfg->nss_cache_ttl = iv;
+    }
+    else if (equals_icase(k, "nss_negative_cache_ttl"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 && iv <= CFTP_MAX_NSS_CACHE_TTL)
+            cfg->nss_negative_cache_ttl = iv;
+    }
+    else if (equals_icase(k, "data_ktls"))
+    {
+        if (parse_int(v, &iv) && (iv == 0 || iv == 1)) cfg->data_ktls = iv;
+    }
+    else if (equals_icase(k, "transfer_chunk_kb"))
+    {
+        if (parse_int(v, &iv) && iv >= 4 && iv <= CFTP_MAX_TRANSFER_CHUNK_KB)
+            cfg->transfer_chunk_kb = iv;
+    }
+    else if (equals_icase(k, "transfer_chunks"))
+    {
+        if (parse_int(v, &iv) && iv >= 2 && iv <= CFTP_MAX_TRANSFER_CHUNKS)
+            cfg->transfer_chunks = iv;
+    }
+    else if (equals_icase(k, "transfer_chunks_total"))
+    {
+        if (parse_int(v, &iv) && iv >= 0 &&
+            iv <= CFTP_MAX_TRANSFER_CHUNKS_TOTAL)
+            cfg->transfer_chunks_total = iv;
+    }
     else if (equals_icase(k, "server_name"))
     {
         if (v)
@@ -327,11 +661,43 @@ void fill_default_configurations(configurations_t *config)
     memset(config, 0, sizeof(*config));
 
     config->max_connections = 10000;
+    config->max_connections_per_ip = 0;
+    config->max_connections_per_user = 0;
+    config->auth_failure_delay = 1;
+    config->auth_failure_delay_max = 30;
+    config->auth_failure_window = 900;
+    config->auth_crypt_concurrency = 0;
+    config->ip_access_file[0] = '\0';
     config->connection_accept_timeout = 60;
     config->data_connection_accept_timeout = 9;
     config->passive_port_start = 40000;
     config->passive_port_end = 41000;
     config->port = 21;
+    config->worker_processes = 0;
+    config->session_model = SESSION_MODEL_PROCESS;
+    config->session_threads = 0;
+    config->preauth_in_parent = 0;
+    config->preauth_crypt_threads = 2;
+    config->session_zygote = 0;
+    config->session_per_user = 0;
+    config->idle_hibernate_timeout = 0;
+    config->anonymous_root[0] = '\0';
+    snprintf(config->anonymous_user, sizeof(config->anonymous_user), "ftp");
+    config->anonymous_workers = 1;
+    config->session_cpu_affinity = SESSION_AFFINITY_NONE;
+    config->session_cpus[0] = '\0';
+    config->session_nic[0] = '\0';
+    config->session_cgroup[0] = '\0';
+    config->session_cgroup_scope = SESSION_CGROUP_PER_SESSION;
+    config->session_cpu_weight = 0;
+    config->session_io_weight = 0;
+    config->session_io_max[0] = '\0';
+    config->session_memory_high[0] = '\0';
+    config->upgrade_drain_timeout = 3600;
+    config->name_snapshot_interval = 5;
+    config->nss_threads = 4;
+    config->nss_cache_ttl = 600;
+    config->nss_negative_cache_ttl = 20;
     snprintf(config->server_name,
              sizeof(config->server_name),
              "Harkirat's FTP Server");
@@ -341,4 +707,8 @@ void fill_default_configurations(configurations_t *config)
     snprintf(config->ssl_key_file,
              sizeof(config->ssl_key_file),
              "/etc/ssl/private/cftp_server.key");
+    config->data_ktls = 0;
+    config->transfer_chunk_kb = 256;
+    config->transfer_chunks = 4;
+    config->transfer_chunks_total = 4096;
 }
@@ -4,6 +4,21 @@
 #include "configurations.h"
 
 #define CFTP_SERVER_CONFIG_FILE "/etc/cftp_server.conf"
+#define CFTP_MAX_WORKER_PROCESSES 1024
+#define CFTP_MAX_SESSION_THREADS 256
+#define CFTP_MAX_CRYPT_THREADS 64
+#define CFTP_MAX_IDLE_HIBERNATE_TIMEOUT 86400
+#define CFTP_MAX_ANONYMOUS_WORKERS 256
+#define CFTP_MAX_CGROUP_WEIGHT 10000
+#define CFTP_MAX_DRAIN_TIMEOUT 604800
+#define CFTP_MAX_AUTH_FAILURE_DELAY 3600
+#define CFTP_MAX_AUTH_CRYPT_CONCURRENCY 256
+#define CFTP_MAX_NAME_SNAPSHOT_INTERVAL 86400
+#define CFTP_MAX_NSS_THREADS 64
+#define CFTP_MAX_NSS_CACHE_TTL 86400
+#define CFTP_MAX_TRANSFER_CHUNK_KB 65536
+#define CFTP_MAX_TRANSFER_CHUNKS 64
+#define CFTP_MAX_TRANSFER_CHUNKS_TOTAL (1 << 20)
 
 void fill_default_configurations(configurations_t *config);
 void read_configurations(const char *file_path, configurations_t *config);
@@ -4,9 +4,30 @@
 #include <limits.h>
 #include <stdint.h>
 
+#define SESSION_MODEL_PROCESS 0 /* Fork a chrooted child per session */
+#define SESSION_MODEL_THREADS 1 /* Multiplex sessions on session threads */
+
+#define SESSION_AFFINITY_NONE 0         /* Leave placement to the scheduler */
+#define SESSION_AFFINITY_ROUND_ROBIN 1  /* Pin to the next CPU of the set */
+#define SESSION_AFFINITY_INCOMING_CPU 2 /* Pin to the CPU the client hit */
+#define SESSION_AFFINITY_NIC_NODE 3     /* Keep on the NUMA node of the NIC */
+
+#define SESSION_CGROUP_PER_SESSION 0 /* A cgroup per session process */
+#define SESSION_CGROUP_PER_USER 1    /* One cgroup per uid */
+
 typedef struct
 {
     uint32_t max_connections;      /* Maximum number of connections allowed */
+    uint32_t max_connections_per_ip;   /* Per source address, 0 no limit */
+    uint32_t max_connections_per_user; /* Logged in per uid, 0 no limit */
+    int auth_failure_delay;     /* Seconds the first failed login waits for
+                                   its 530, doubling after that, 0 never */
+    int auth_failure_delay_max; /* Seconds the doubling stops at */
+    int auth_failure_window;    /* Seconds failures are remembered */
+    int auth_crypt_concurrency; /* Password hashes at a time across all
+                                   processes, 0 half the CPUs */
+    char ip_access_file[PATH_MAX]; /* Allow and deny prefixes, see
+                                      ip_filter.h, empty admits all */
     int connection_accept_timeout; /* Timeout duration in seconds */
     int data_connection_accept_timeout; /* Timeout duration in seconds */
     int port;                     /* Port number for the server to listen on */
@@ -15,6 +36,41 @@ typedef struct
     char server_name[256];        /* Name of the server */
     char ssl_cert_file[PATH_MAX]; /* Path to the SSL certificate file */
     char ssl_key_file[PATH_MAX];  /* Path to the SSL key file */
+    int data_ktls; /* Let the kernel encrypt TLS data connections */
+    int transfer_chunk_kb;     /* Buffer chunks of TLS downloads */
+    int transfer_chunks;       /* Chunks a download holds at a time */
+    int transfer_chunks_total; /* Across all processes, 0 no limit */
+    int worker_processes; /* Preforked acceptor workers, 0 accepts in main */
+    int session_model;    /* SESSION_MODEL_PROCESS or SESSION_MODEL_THREADS */
+    int session_threads;  /* Session threads per process, 0 uses all CPUs */
+    int preauth_in_parent; /* Process model forks only after a good PASS */
+    int preauth_crypt_threads; /* Threads hashing passwords for pre-auth */
+    int session_zygote;   /* Process model forks sessions from a zygote */
+    int session_per_user; /* Process model runs all sessions of a user in one
+                             long lived process, implies pre-auth */
+    int idle_hibernate_timeout; /* Idle seconds before a process model session
+                                   is handed back to the parent, 0 never */
+    char anonymous_root[PATH_MAX]; /* Read only tree of anonymous sessions,
+                                      empty disables anonymous login */
+    char anonymous_user[256]; /* Unprivileged account they run as */
+    int anonymous_workers; /* Process model workers sharing them */
+    int session_cpu_affinity; /* SESSION_AFFINITY_* for session processes */
+    char session_cpus[256];   /* CPU list like 0-7,16, empty allows all */
+    char session_nic[64];     /* Interface whose node nic_node keeps to */
+    char session_cgroup[PATH_MAX]; /* Delegated cgroup v2 directory sessions
+                                      are placed below, empty disables */
+    int session_cgroup_scope; /* SESSION_CGROUP_PER_SESSION or _PER_USER */
+    int session_cpu_weight;   /* cpu.weight of the cgroups, 0 keeps it */
+    int session_io_weight;    /* io.weight of the cgroups, 0 keeps it */
+    char session_io_max[256]; /* io.max line like 8:0 rbps=1048576 */
+    char session_memory_high[32]; /* memory.high like 512M */
+    int upgrade_drain_timeout; /* Seconds the old binary waits for its
+                                  sessions after an upgrade, 0 no limit */
+    int name_snapshot_interval; /* Seconds between looks at /etc/passwd and
+                                   /etc/group for the name snapshot, 0 off */
+    int nss_threads;            /* Threads looking names up for sessions */
+    int nss_cache_ttl;          /* Seconds the parent keeps a name */
+    int nss_negative_cache_ttl; /* Seconds it keeps an id without a name */
 } configurations_t;
 
 #endif /* CONFIGURATIONS_H */
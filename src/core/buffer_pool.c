@@ -0,0 +1,90 @@
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "server_state.h"
+
+extern server_state_t g_server_state;
+
+/* Session threads take and give back concurrently */
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static buffer_chunk_t *g_pool = NULL;
+static int g_pooled = 0;
+
+static void free_chunk(buffer_chunk_t *chunk);
+
+buffer_chunk_t *take_buffer_chunk(const admission_t *admission)
+{
+    if (!admit_buffer_chunk(admission)) return NULL;
+
+    pthread_mutex_lock(&g_pool_lock);
+    buffer_chunk_t *chunk = g_pool;
+    if (chunk)
+    {
+        g_pool = chunk->next;
+        g_pooled--;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    if (!chunk)
+    {
+        /* Mapped on its own so that it goes back to the system when freed,
+         * whatever the malloc thresholds */
+        chunk = calloc(1, sizeof(buffer_chunk_t));
+        void *data = MAP_FAILED;
+        if (chunk)
+            data = mmap(NULL,
+                        buffer_chunk_size(),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+        if (data == MAP_FAILED)
+        {
+            ERROR("Cannot allocate a transfer buffer chunk");
+            free(chunk);
+            release_buffer_chunk(admission);
+            return NULL;
+        }
+        chunk->data = data;
+    }
+
+    chunk->next = NULL;
+    chunk->admission = *admission;
+    chunk->owner = NULL;
+    return chunk;
+}
+
+void give_back_buffer_chunk(buffer_chunk_t *chunk)
+{
+    release_buffer_chunk(&chunk->admission);
+
+    pthread_mutex_lock(&g_pool_lock);
+    int keep = g_pooled < g_server_state.config.transfer_chunks;
+    if (keep)
+    {
+        chunk->next = g_pool;
+        g_pool = chunk;
+        g_pooled++;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    if (!keep) free_chunk(chunk);
+}
+
+size_t buffer_chunk_size(void)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (size_t)g_server_state.config.transfer_chunk_kb * 1024;
+    return (size + page - 1) / page * page;
+}
+
+static void free_chunk(buffer_chunk_t *chunk)
+{
+    munmap(chunk->data, buffer_chunk_size());
+    free(chunk);
+}
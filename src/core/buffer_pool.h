@@ -0,0 +1,41 @@
+/*
+    Page aligned chunks of transfer_chunk_kb that TLS downloads read the
+    file into and hand to the output buffer by reference, see retr.c.
+
+    A transfer holds at most transfer_chunks of them at a time, and all
+    processes together at most transfer_chunks_total, counted on the
+    admission ticket of the session (see admission.h) so that the chunks of
+    a killed process are given back with it. Chunks given back are kept for
+    the next transfer of the process, up to transfer_chunks of them, the
+    rest is unmapped.
+*/
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#include "admission.h"
+
+typedef struct buffer_chunk
+{
+    unsigned char *data;       /* buffer_chunk_size() bytes, page aligned */
+    struct buffer_chunk *next; /* In the pool while not taken */
+    admission_t admission;     /* Ticket it is counted on */
+    void *owner;               /* Whatever the taker needs back */
+} buffer_chunk_t;
+
+/*!
+ * @brief Takes a chunk counted on admission, which may hold no ticket.
+ * @return NULL if transfer_chunks_total are taken or out of memory.
+ */
+buffer_chunk_t *take_buffer_chunk(const admission_t *admission);
+
+/*!
+ * @brief Gives a chunk back, from any thread of the process.
+ */
+void give_back_buffer_chunk(buffer_chunk_t *chunk);
+
+size_t buffer_chunk_size(void);
+
+#endif /* BUFFER_POOL_H */
@@ -15,27 +15,53 @@
 #include "control_handler.h"
 #include "data_handler.h"
 #include "error.h"
+#include "hibernate.h"
 #include "interprocess_handler.h"
+#include "name_snapshot.h"
+#include "preauth.h"
 #include "server_state.h"
+#include "session_fs.h"
+#include "session_placement.h"
+#include "session_supervisor.h"
+#include "upgrade.h"
 
 extern server_state_t g_server_state;
 
-void control_connection_accept_cb(struct evconnlistener *listener,
+static void release_connection_cb(evutil_socket_t fd, short what, void *ctx);
+
+/* Descriptors the accepting process holds for itself or for other clients,
+ * indexed by fd. Every session process forked from it closes them. */
+static unsigned char *g_parent_fds;
+static int g_parent_fds_size;
+
+connection_t *create_connection(SSL_CTX *ssl_ctx, struct sockaddr *addr)
+{
+    connection_t *connection = calloc(1, sizeof(connection_t));
+    if (!connection)
+    {
+        ERROR("Failed to allocate connection object");
+        return NULL;
+    }
+
+    connection->ssl_ctx = ssl_ctx;
+    connection->control_active = 1;
+    connection->root_fd = -1;
+    connection->upload_fd = -1;
+    connection->interprocess_fd = -1;
+    connection->admission = ADMISSION_NONE;
+    if (addr) fill_source_ip(addr, connection->source_ip);
+    return connection;
+}
+
+void control_connection_accept_cb(struct evconnlistener *listener
+                                  __attribute__((unused)),
                                   evutil_socket_t fd,
                                   struct sockaddr *addr,
                                   int len __attribute__((unused)),
                                   void *ctx)
 {
-    if (g_server_state.current_connections >=
-        g_server_state.config.max_connections)
-    {
-        ERROR(
-            "Max connections reached, rejecting new connection, already got "
-            "%" PRIu32 " !",
-            g_server_state.current_connections);
-        close(fd);
-        return;
-    }
+    admission_t admission;
+    if (!admit_connection(fd, addr, &admission)) return;
 
     DEBG("Accepted new connection on fd %d", fd);
     SSL_CTX *ssl_ctx = (SSL_CTX *)ctx;
@@ -45,6 +71,7 @@ void control_connection_accept_cb(struct evconnlistener *listener,
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, rpc_fd) < 0)
     {
         ERROR("Failed to create socket pair: %s", strerror(errno));
+        release_admission(&admission);
         close(fd);
         return;
     }
@@ -53,62 +80,76 @@ void control_connection_accept_cb(struct evconnlistener *listener,
                        dies then child process should not survive */
     pipe(pipe_fd);
 
+    refresh_name_snapshot();
     pid_t child = fork();
     if (child == 0)
     {
         close(pipe_fd[1]);
-        evconnlistener_free(listener);
-        connection_t *connection = calloc(1, sizeof(connection_t));
-        connection->ssl_ctx = ssl_ctx;
-        connection->control_active = 1;
+        close_parent_fds(fd);
+        place_session_process(fd);
+        connection_t *connection = create_connection(ssl_ctx, addr);
+        if (!connection) exit(1);
         connection->interprocess_fd = rpc_fd[1];
-        fill_source_ip(addr, connection->source_ip);
+        connection->admission = admission;
+        adopt_admission(&connection->admission);
         INFO("Control connection with %s", connection->source_ip);
         close(rpc_fd[0]);
-        register_interprocess_fd_on_child(
-            rpc_fd[1],
-            connection); /* register the child side of the socket pair */
         start_control_connection_loop(fd, connection, pipe_fd[0]);
     }
 
     close(pipe_fd[0]);
     close(rpc_fd[1]);
     close(fd); /* parent closes client's socket */
+    if (child > 0)
+        pass_admission(&admission, child);
+    else
+        release_admission(&admission);
+
+    char source_ip[INET6_ADDRSTRLEN] = "-";
+    fill_source_ip(addr, source_ip);
+    supervise_process(
+        g_server_state.base, child, pipe_fd[1], "session", NULL, source_ip);
     register_interprocess_fd_on_server(
         rpc_fd[0]); /* register the parent side of the socket pair */
 }
 
-void on_read(struct bufferevent *bev, void *cookie)
+void on_read(struct bufferevent *bev __attribute__((unused)), void *cookie)
 {
     connection_t *connection = (connection_t *)cookie;
-    char input[1024] = {0};
-    struct evbuffer *input_buf = bufferevent_get_input(bev);
-    evbuffer_remove(input_buf, input, sizeof(input) - 1);
 
-    if (cookie)
-        execute_ftp_command(input, connection);
-    else
-        execute_root_command(input, bev);
+    session_fs_enter(connection);
+    touch_idle_hibernation(connection);
+    execute_ftp_input(connection);
 }
 
-void start_server_listener(struct event_base *base,
-                           void *ctx,
-                           int port,
-                           accept_callback_t accept_cb)
+struct evconnlistener *start_server_listener(struct event_base *base,
+                                             void *ctx,
+                                             int port,
+                                             accept_callback_t accept_cb,
+                                             int reuse_port)
 {
     struct sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_port = htons(port);
 
-    struct evconnlistener *listener =
-        evconnlistener_new_bind(base,
-                                accept_cb,
-                                ctx,
-                                LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
-                                -1,
-                                (struct sockaddr *)&sin,
-                                sizeof(sin));
+    unsigned flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE;
+    if (reuse_port) flags |= LEV_OPT_REUSEABLE_PORT;
+
+    /* Connections queued on the socket of the previous binary carry over */
+    struct evconnlistener *listener;
+    int inherited_fd = take_inherited_listener(port);
+    if (inherited_fd >= 0)
+        listener = evconnlistener_new(
+            base, accept_cb, ctx, LEV_OPT_CLOSE_ON_FREE, -1, inherited_fd);
+    else
+        listener = evconnlistener_new_bind(base,
+                                           accept_cb,
+                                           ctx,
+                                           flags,
+                                           -1,
+                                           (struct sockaddr *)&sin,
+                                           sizeof(sin));
 
     if (!listener)
     {
@@ -116,7 +157,59 @@ void start_server_listener(struct event_base *base,
         exit(1);
     }
 
+    track_parent_fd(evconnlistener_get_fd(listener));
+    g_server_state.listener = listener;
     INFO("Listening on port %d", port);
+    return listener;
+}
+
+int track_parent_fd(int fd)
+{
+    if (fd < 0) return 0;
+
+    if (fd >= g_parent_fds_size)
+    {
+        int size = g_parent_fds_size ? g_parent_fds_size : 64;
+        while (size <= fd) size *= 2;
+
+        unsigned char *fds = realloc(g_parent_fds, size);
+        if (!fds)
+        {
+            ERROR("Failed to grow parent descriptor table to %d", size);
+            return 0;
+        }
+        memset(fds + g_parent_fds_size, 0, size - g_parent_fds_size);
+        g_parent_fds = fds;
+        g_parent_fds_size = size;
+    }
+
+    g_parent_fds[fd] = 1;
+    return 1;
+}
+
+int untrack_parent_fd(int fd)
+{
+    if (fd < 0 || fd >= g_parent_fds_size || !g_parent_fds[fd]) return 0;
+    g_parent_fds[fd] = 0;
+    return 1;
+}
+
+void close_parent_fds(int keep_fd)
+{
+    /* Only raw descriptors are closed, the inherited loop shares its epoll
+     * instance with the parent and must not be touched */
+    for (int fd = 0; fd < g_parent_fds_size; fd++)
+        if (g_parent_fds[fd] && fd != keep_fd) close(fd);
+
+    free(g_parent_fds);
+    g_parent_fds = NULL;
+    g_parent_fds_size = 0;
+    drop_parent_admissions();
+
+    /* The inherited handlers would report to the parent's loop, see
+     * upgrade.h */
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
 }
 
 int get_random_unused_port()
@@ -168,5 +261,58 @@ void disable_connection_cb(struct bufferevent *bev, void *ctx)
     INFO("Disabling connection !");
     bufferevent_disable(bev, EV_READ | EV_WRITE);
     bufferevent_free(bev);
-    event_base_loopbreak(connection->base);
+    connection->bev = NULL;
+
+    /* A session process simply ends its loop, a shared loop keeps running
+     * and the session is released once the current callback unwound. */
+    if (connection->shared_loop)
+        event_base_once(connection->base,
+                        -1,
+                        EV_TIMEOUT,
+                        release_connection_cb,
+                        connection,
+                        NULL);
+    else
+        event_base_loopbreak(connection->base);
+}
+
+static void release_connection_cb(evutil_socket_t fd __attribute__((unused)),
+                                  short what __attribute__((unused)),
+                                  void *ctx)
+{
+    release_connection((connection_t *)ctx);
+}
+
+void release_connection(connection_t *connection)
+{
+    /* The crypt thread still refers to it, the login result finishes it */
+    if (connection->auth_pending)
+    {
+        connection->control_active = 0;
+        return;
+    }
+
+    if (connection->preauth) forget_preauth_session(connection);
+    if (connection->bev) bufferevent_free(connection->bev);
+    connection->bev = NULL;
+    free(connection->command_arena);
+    connection->command_arena = NULL;
+    connection->next_command = NULL;
+    if (connection->reply_event) event_free(connection->reply_event);
+    if (connection->replies) evbuffer_free(connection->replies);
+    if (connection->data_bev) close_data_connection(connection);
+    if (connection->pasv_listener)
+        evconnlistener_free(connection->pasv_listener);
+    if (connection->timeout_event) event_free(connection->timeout_event);
+    if (connection->login_delay_event)
+        event_free(connection->login_delay_event);
+    session_fs_close(connection);
+    free_name_cache(&connection->names);
+    release_admission(&connection->admission);
+
+    INFO("Session of %s from %s released",
+         connection->username,
+         connection->source_ip);
+    free(connection);
+    __sync_sub_and_fetch(&g_server_state.current_connections, 1);
 }
@@ -6,6 +6,10 @@
 #include <event2/listener.h>
 #include <openssl/ssl.h>
 
+#include "admission.h"
+#include "ipc_channel.h"
+#include "name_cache.h"
+
 typedef void (*accept_callback_t)(struct evconnlistener *listener,
                                   evutil_socket_t fd,
                                   struct sockaddr *addr,
@@ -26,10 +30,37 @@ void tls_data_connection_upgrade_cb(struct evconnlistener *listener,
 
 /* Server stuff */
 
-void start_server_listener(struct event_base *base,
-                           void *ctx,
-                           int port,
-                           accept_callback_t accept_cb);
+/*!
+ * @brief Binds the control listener on the configured port.
+ * @param reuse_port Set SO_REUSEPORT so that several processes can own their
+ * own listener on the same port and let the kernel balance between them.
+ * @return The listener, the process exits if it cannot be created.
+ */
+struct evconnlistener *start_server_listener(struct event_base *base,
+                                             void *ctx,
+                                             int port,
+                                             accept_callback_t accept_cb,
+                                             int reuse_port);
+
+/*!
+ * @brief Marks a descriptor the accepting process keeps for itself or for
+ * another client, such as a listener or a pre-auth control socket.
+ * @return 1 on success, 0 if the table could not grow.
+ */
+int track_parent_fd(int fd);
+
+/*!
+ * @brief Forgets a descriptor marked with track_parent_fd before it is
+ * closed.
+ * @return 1 if it was marked, 0 if not or if close_parent_fds closed it.
+ */
+int untrack_parent_fd(int fd);
+
+/*!
+ * @brief Closes every tracked descriptor except keep_fd, called in each
+ * session process right after it was forked.
+ */
+void close_parent_fds(int keep_fd);
 
 void close_data_connection_on_writecb(struct bufferevent *bev, void *ctx);
 
@@ -40,14 +71,19 @@ typedef enum transfer_mode
     TRANSFER_MODE_EBCDIC
 } transfer_mode_t;
 
-#define FILE_CHUNK_SIZE 0x4000000 /* 64 MB */
+#define CFTP_MAX_SESSION_GROUPS 64
 
+/* File of a download over TLS, see retr.c. Freed with the last chunk the
+ * output buffer still holds once the transfer is over */
 typedef struct
 {
     int fd;
-    off_t offset;
+    off_t offset; /* Read or sent up to here */
     off_t filesize;
-    char buffer[FILE_CHUNK_SIZE];
+    int chunks;               /* In the output buffer, see buffer_pool.h */
+    int ended;                /* Transfer over, waits for its chunks */
+    struct event *wait_event; /* Retries while transfer_chunks_total are
+                                 taken */
 } file_stream_t;
 
 typedef struct
@@ -80,17 +116,40 @@ typedef struct
     data_callback_t data_tls_event_connected_cb;
     data_callback_t data_eof_event_cb;
     file_stream_t *data_stream;
+    struct event *sendfile_event; /* Drives a kTLS RETR, see retr.c */
     char path[PATH_MAX];
     int description;
     int hidden;
     int human;
 
+    /* Session filesystem view, see session_fs.h */
+    int root_fd;        /* Directory every session path resolves under */
+    char cwd[PATH_MAX]; /* Virtual working directory, absolute from root */
+    gid_t groups[CFTP_MAX_SESSION_GROUPS]; /* Supplementary groups */
+    int ngroups;
+    name_cache_t names; /* Owners shown by LIST, see name_cache.h */
+
     /* Server structures */
     SSL_CTX *ssl_ctx;        /* SSL context for secure connections */
     SSL *ssl;                /* SSL structure for the connection */
     int fd;                  /* File descriptor for the connection */
     struct bufferevent *bev; /* Buffer event for the connection */
+    struct cftp_command *next_command;   /* Read ahead of its turn into
+                                            command_arena, see
+                                            execute_ftp_input */
+    struct command_arena *command_arena; /* See command_parser.h */
+    int discarding_line;  /* Rest of an overlong command line is dropped */
+    struct evbuffer *replies;  /* Queued by send_control_message, written to
+                                  bev once per loop iteration */
+    struct event *reply_event; /* Active while replies has any */
     struct event_base *base; /* Event base for the connection */
+    int shared_loop; /* Set when the base is a session thread's loop shared
+                        with other sessions instead of owned by this one */
+    int preauth;      /* Pre-auth session on the accepting loop, forked into
+                         a session process after login, see preauth.h */
+    int auth_pending; /* Password check in flight on a crypt thread */
+    int anonymous;    /* Read only anonymous login, see anonymous_root */
+    admission_t admission; /* Ticket counting the session, see admission.h */
 
     /* data channels */
     int passive_fd;
@@ -100,14 +159,26 @@ typedef struct
     struct bufferevent *data_bev; /* Buffer event for passive data connection */
     SSL *data_ssl; /* SSL structure for passive data connection */
     int upload_fd;
+    struct list_job *list_job; /* LIST waiting for owner names, list.c */
 
     /* Interprocess Communication */
-    struct bufferevent *interprocess_bev; /* Buffer event for interprocess
-                                              communication */
+    ipc_channel_t *ipc; /* To the parent, NULL without one, see
+                           ipc_channel.h */
 
     struct event *timeout_event;
+    struct event *login_delay_event; /* Holds back a 530, auth_throttle.h */
+    struct event *idle_event; /* Hibernates the session, see hibernate.h */
+    struct event *kill_event;   /* Parent kill switch, see on_parent_dead */
+    struct event *orphan_event; /* Leaves once idle after the parent let go */
 } connection_t;
 
+/*!
+ * @brief Allocates a session for an accepted control connection with every
+ * descriptor field marked unused.
+ * @param addr Peer address, NULL leaves source_ip for the caller to fill.
+ */
+connection_t *create_connection(SSL_CTX *ssl_ctx, struct sockaddr *addr);
+
 int get_random_unused_port(
     void); /*TODO: Deprecate this method and add a configurable port limit */
 
@@ -115,4 +186,11 @@ void on_read(struct bufferevent *bev, void *cookie);
 void fill_source_ip(struct sockaddr *addr, char ip_str[]);
 void disable_connection_cb(struct bufferevent *bev, void *ctx);
 
+/*!
+ * @brief Frees a session living on a shared loop and everything it owns.
+ * @details Must not be called from within the session's own bufferevent
+ * callbacks, disable_connection_cb defers it for that reason.
+ */
+void release_connection(connection_t *connection);
+
 #endif
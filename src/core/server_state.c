@@ -12,6 +12,8 @@
 
 server_state_t g_server_state;
 
+static void check_ktls(void);
+
 #ifndef SERVER_VERSION
 #error "SERVER_VERSION not defined"
 #endif
@@ -43,6 +45,7 @@ void init_server_state()
         ERROR("Failed to load cert or key");
         exit(-1);
     }
+    if (g_server_state.config.data_ktls) check_ktls();
 
     connections_init_pasv_range(g_server_state.config.passive_port_start,
                                 g_server_state.config.passive_port_end);
@@ -61,6 +64,32 @@ void destroy_server_state()
     event_base_free(g_server_state.base);
 }
 
+/* Only warns, every data connection still tries and falls back on its own */
+static void check_ktls(void)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    char ulps[256] = "";
+    FILE *file = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (file)
+    {
+        if (!fgets(ulps, sizeof(ulps), file)) ulps[0] = '\0';
+        fclose(file);
+    }
+
+    for (char *ulp = strtok(ulps, " \n"); ulp; ulp = strtok(NULL, " \n"))
+        if (strcmp(ulp, "tls") == 0)
+        {
+            INFO("Kernel TLS enabled for data connections");
+            return;
+        }
+    WARN("data_ktls is set but the tls kernel module is not loaded, TLS data "
+         "connections stay in user space unless it can be loaded on demand");
+#else
+    WARN("data_ktls is set but OpenSSL was built without kernel TLS, TLS data "
+         "connections stay in user space");
+#endif
+}
+
 void connections_init_pasv_range(int start, int end)
 {
     if (end < start)
@@ -22,11 +22,14 @@ typedef struct
 {
     configurations_t config; /* Server configurations */
     pasv_port_range_t pasv_range;
-    uint32_t current_connections; /* Current number of active connections */
+    uint32_t current_connections; /* Sessions on the shared loops of this
+                                     process, see admission.h for totals */
     char server_version[64];      /* Version of the server */
     int is_running;          /* Flag to indicate if the server is running */
     SSL_CTX *ssl_ctx;        /* SSL context for secure connections */
     struct event_base *base; /* Event base for managing events */
+    struct evconnlistener *listener; /* Control listener, NULL in the pool
+                                        supervisor and once draining */
 } server_state_t;
 
 void init_server_state(void);
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE /* O_PATH, AT_EMPTY_PATH */
+
+#include "session_fs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+
+/* Identity currently applied to this thread, see session_fs_enter */
+static __thread uid_t thread_fsuid = 0;
+static __thread gid_t thread_fsgid = 0;
+
+static int openat2_missing = 0;      /* Kernel older than 5.6 */
+static int confinement_required = 0; /* No fallback, no chroot either */
+
+static int normalize_path(const char *cwd,
+                          const char *path,
+                          char *out,
+                          size_t size);
+static int open_beneath(int root_fd,
+                        const char *virtual_path,
+                        int flags,
+                        mode_t mode);
+static int open_parent(connection_t *connection,
+                       const char *path,
+                       char *name,
+                       size_t name_size);
+static int call_openat2(int dir_fd, const char *path, int flags, mode_t mode);
+
+/* Joins path to cwd and folds "." and ".." lexically, ".." never climbs above
+ * the session root. The result is always absolute. */
+static int normalize_path(const char *cwd,
+                          const char *path,
+                          char *out,
+                          size_t size)
+{
+    char joined[PATH_MAX * 2];
+    if (path[0] == '/')
+        snprintf(joined, sizeof(joined), "%s", path);
+    else
+        snprintf(joined, sizeof(joined), "%s/%s", cwd, path);
+
+    size_t len = 0;
+    out[0] = '\0';
+
+    char *save = NULL;
+    for (char *part = strtok_r(joined, "/", &save); part;
+         part = strtok_r(NULL, "/", &save))
+    {
+        if (strcmp(part, ".") == 0) continue;
+
+        if (strcmp(part, "..") == 0)
+        {
+            char *slash = strrchr(out, '/');
+            if (slash)
+            {
+                *slash = '\0';
+                len = slash - out;
+            }
+            continue;
+        }
+
+        size_t n = strlen(part);
+        if (len + n + 2 > size)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        out[len++] = '/';
+        memcpy(out + len, part, n);
+        len += n;
+        out[len] = '\0';
+    }
+
+    if (len == 0) snprintf(out, size, "/");
+
+    return 0;
+}
+
+/* Opens an absolute session path under root_fd. With openat2 the kernel also
+ * keeps symlinks from escaping the root, which the threaded model relies on
+ * since it has no chroot. */
+static int open_beneath(int root_fd,
+                        const char *virtual_path,
+                        int flags,
+                        mode_t mode)
+{
+    const char *relative = virtual_path[1] ? virtual_path + 1 : ".";
+
+    if (!__atomic_load_n(&openat2_missing, __ATOMIC_RELAXED))
+    {
+        int fd = call_openat2(root_fd, relative, flags, mode);
+        if (fd >= 0 || errno != ENOSYS) return fd;
+
+        /* Gone after the startup check, e.g. a seccomp filter */
+        if (confinement_required)
+        {
+            ERROR("openat2 is not available, refusing to open %s",
+                  virtual_path);
+            errno = EACCES;
+            return -1;
+        }
+
+        WARN("openat2 is not available, symlinks are not confined");
+        __atomic_store_n(&openat2_missing, 1, __ATOMIC_RELAXED);
+    }
+
+    return openat(root_fd, relative, flags | O_CLOEXEC, mode);
+}
+
+static int call_openat2(int dir_fd, const char *path, int flags, mode_t mode)
+{
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+    return syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+}
+
+static int open_parent(connection_t *connection,
+                       const char *path,
+                       char *name,
+                       size_t name_size)
+{
+    char virtual_path[PATH_MAX];
+    if (normalize_path(connection->cwd, path, virtual_path, PATH_MAX) < 0)
+        return -1;
+
+    if (strcmp(virtual_path, "/") == 0)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    char *slash = strrchr(virtual_path, '/');
+    snprintf(name, name_size, "%s", slash + 1);
+    if (slash == virtual_path)
+        virtual_path[1] = '\0'; /* Parent is the session root itself */
+    else
+        *slash = '\0';
+
+    return open_beneath(
+        connection->root_fd, virtual_path, O_PATH | O_DIRECTORY, 0);
+}
+
+int session_fs_open_root(connection_t *connection, const char *root)
+{
+    int fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ERROR("Failed to open session root %s: %s", root, strerror(errno));
+        return -1;
+    }
+
+    session_fs_close(connection);
+    connection->root_fd = fd;
+    snprintf(connection->cwd, sizeof(connection->cwd), "/");
+    return 0;
+}
+
+int session_fs_require_confinement(void)
+{
+    confinement_required = 1;
+
+    int fd = call_openat2(AT_FDCWD, "/", O_PATH | O_DIRECTORY, 0);
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+void session_fs_close(connection_t *connection)
+{
+    if (connection->root_fd >= 0) close(connection->root_fd);
+    connection->root_fd = -1;
+}
+
+void session_fs_enter(connection_t *connection)
+{
+    /* A per user worker shares its loop but already runs as the user */
+    if (!connection->shared_loop || geteuid() != 0) return;
+
+    uid_t uid = connection->authenticated ? connection->uid : 0;
+    gid_t gid = connection->authenticated ? connection->gid : 0;
+    if (uid == thread_fsuid && gid == thread_fsgid) return;
+
+    /* Raw syscall on purpose, the libc wrapper applies to every thread */
+    if (syscall(SYS_setgroups,
+                connection->authenticated ? connection->ngroups : 0,
+                connection->groups) != 0)
+        ERROR("setgroups failed for %s: %s",
+              connection->username,
+              strerror(errno));
+
+    /* Group first, dropping fsuid 0 also drops the capability to do so */
+    setfsgid(gid);
+    setfsuid(uid);
+    thread_fsuid = uid;
+    thread_fsgid = gid;
+}
+
+int session_fs_open(connection_t *connection,
+                    const char *path,
+                    int flags,
+                    mode_t mode)
+{
+    char virtual_path[PATH_MAX];
+    if (normalize_path(connection->cwd, path, virtual_path, PATH_MAX) < 0)
+        return -1;
+
+    return open_beneath(connection->root_fd, virtual_path, flags, mode);
+}
+
+int session_fs_stat(connection_t *connection,
+                    const char *path,
+                    struct stat *st)
+{
+    int fd = session_fs_open(connection, path, O_PATH, 0);
+    if (fd < 0) return -1;
+
+    int result = fstat(fd, st);
+    close(fd);
+    return result;
+}
+
+DIR *session_fs_opendir(connection_t *connection, const char *path)
+{
+    int fd = session_fs_open(connection, path, O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0) return NULL;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) close(fd);
+    return dir;
+}
+
+int session_fs_mkdir(connection_t *connection, const char *path, mode_t mode)
+{
+    char name[NAME_MAX + 1];
+    int parent = open_parent(connection, path, name, sizeof(name));
+    if (parent < 0) return -1;
+
+    int result = mkdirat(parent, name, mode);
+    close(parent);
+    return result;
+}
+
+int session_fs_rmdir(connection_t *connection, const char *path)
+{
+    char name[NAME_MAX + 1];
+    int parent = open_parent(connection, path, name, sizeof(name));
+    if (parent < 0) return -1;
+
+    int result = unlinkat(parent, name, AT_REMOVEDIR);
+    close(parent);
+    return result;
+}
+
+int session_fs_unlink(connection_t *connection, const char *path)
+{
+    char name[NAME_MAX + 1];
+    int parent = open_parent(connection, path, name, sizeof(name));
+    if (parent < 0) return -1;
+
+    int result = unlinkat(parent, name, 0);
+    close(parent);
+    return result;
+}
+
+int session_fs_chdir(connection_t *connection, const char *path)
+{
+    char virtual_path[PATH_MAX];
+    if (normalize_path(connection->cwd, path, virtual_path, PATH_MAX) < 0)
+        return -1;
+
+    int fd = open_beneath(
+        connection->root_fd, virtual_path, O_PATH | O_DIRECTORY, 0);
+    if (fd < 0) return -1;
+
+    /* Entering a directory needs search permission like chdir(2) */
+    int result = faccessat(fd, "", X_OK, AT_EACCESS | AT_EMPTY_PATH);
+    close(fd);
+    if (result != 0) return -1;
+
+    snprintf(connection->cwd, sizeof(connection->cwd), "%s", virtual_path);
+    return 0;
+}
+
+const char *session_fs_getcwd(connection_t *connection)
+{
+    return connection->cwd;
+}
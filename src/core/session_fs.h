@@ -0,0 +1,71 @@
+/*
+    Per-session filesystem view.
+
+    Every path a client sends is resolved against the session's root
+    directory fd and its virtual working directory instead of the process
+    root and cwd. In the process-per-session model the root is "/" inside the
+    chroot, in the threaded model it is the user's home directory, which lets
+    many sessions of different users share one process.
+*/
+
+#ifndef SESSION_FS_H
+#define SESSION_FS_H
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "connection.h"
+
+/*!
+ * @brief Opens the directory every path of this session resolves under and
+ * resets the working directory to "/".
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int session_fs_open_root(connection_t *connection, const char *root);
+
+/*!
+ * @brief Makes every later open fail with EACCES rather than fall back to
+ * an unconfined openat, for the threaded model which has no chroot.
+ * @return 1 if openat2 is available, 0 otherwise.
+ */
+int session_fs_require_confinement(void);
+
+/*!
+ * @brief Releases the session root.
+ */
+void session_fs_close(connection_t *connection);
+
+/*!
+ * @brief Applies the session's filesystem identity to the calling thread.
+ * @details Only the threaded model needs this, there the fsuid, fsgid and
+ * supplementary groups are per thread and switched per session, so file
+ * permission checks and ownership of new files follow the logged in user.
+ * In the process model the whole process already runs as the user.
+ */
+void session_fs_enter(connection_t *connection);
+
+int session_fs_open(connection_t *connection,
+                    const char *path,
+                    int flags,
+                    mode_t mode);
+int session_fs_stat(connection_t *connection,
+                    const char *path,
+                    struct stat *st);
+DIR *session_fs_opendir(connection_t *connection, const char *path);
+int session_fs_mkdir(connection_t *connection, const char *path, mode_t mode);
+int session_fs_rmdir(connection_t *connection, const char *path);
+int session_fs_unlink(connection_t *connection, const char *path);
+
+/*!
+ * @brief Changes the virtual working directory of the session.
+ * @return 0 on success, -1 with errno set (ENOTDIR if not a directory).
+ */
+int session_fs_chdir(connection_t *connection, const char *path);
+
+/*!
+ * @brief Virtual working directory, always absolute from the session root.
+ */
+const char *session_fs_getcwd(connection_t *connection);
+
+#endif
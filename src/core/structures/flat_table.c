@@ -0,0 +1,364 @@
+#include "flat_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FLAT_TABLE_EMPTY 0
+#define FLAT_TABLE_PRESENT 0x80000000u /* Set in the hash of every entry */
+#define FLAT_TABLE_GONE 0x40000000u /* Moved or removed from growing_from */
+#define FLAT_TABLE_MAX_CAPACITY ((size_t)1 << 30) /* Below the flags */
+#define FLAT_TABLE_FIRST_CAPACITY 16
+#define FLAT_TABLE_MOVE_STEP 8 /* Slots of growing_from moved per write */
+
+static uint32_t stored_hash(const flat_table_t *table, const void *key);
+static int equal_bytes(const void *a, const void *b, size_t key_size);
+static unsigned char *entry_at(const flat_table_t *table,
+                               const flat_table_slots_t *slots,
+                               size_t slot);
+static uint32_t hash_of(const unsigned char *entry);
+static void set_hash(unsigned char *entry, uint32_t hash);
+static int allocate_slots(flat_table_slots_t *slots,
+                          size_t capacity,
+                          size_t entry_size);
+static void free_slots(flat_table_slots_t *slots);
+static long find_slot(const flat_table_t *table,
+                      const flat_table_slots_t *slots,
+                      uint32_t hash,
+                      const void *key);
+static size_t place_entry(flat_table_t *table, const unsigned char *entry);
+static int make_room(flat_table_t *table);
+static void move_slots(flat_table_t *table, size_t count);
+
+flat_table_t *create_flat_table(size_t key_size,
+                                size_t value_size,
+                                flat_table_hash_cb hash,
+                                flat_table_equal_cb equal)
+{
+    flat_table_t *table = calloc(1, sizeof(flat_table_t));
+    if (!table) return NULL;
+
+    /* The hash first, a key of up to 4 bytes fits next to it */
+    table->key_size = key_size;
+    table->key_offset = key_size <= 4 ? 4 : 8;
+    table->value_offset = (table->key_offset + key_size + 7) & ~(size_t)7;
+    table->entry_size = (table->value_offset + value_size + 7) & ~(size_t)7;
+    table->hash = hash ? hash : flat_table_hash_bytes;
+    table->equal = equal ? equal : equal_bytes;
+    table->scratch = malloc(2 * table->entry_size);
+    if (!table->scratch)
+    {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void free_flat_table(flat_table_t *table)
+{
+    if (!table) return;
+    free_slots(&table->slots);
+    free_slots(&table->growing_from);
+    free(table->scratch);
+    free(table);
+}
+
+void *flat_table_lookup(const flat_table_t *table, const void *key)
+{
+    if (!table->count) return NULL;
+
+    uint32_t hash = stored_hash(table, key);
+    long slot = find_slot(table, &table->slots, hash, key);
+    if (slot >= 0)
+        return entry_at(table, &table->slots, slot) + table->value_offset;
+
+    if (!table->growing_from.capacity) return NULL;
+    slot = find_slot(table, &table->growing_from, hash, key);
+    return slot < 0 ? NULL
+                    : entry_at(table, &table->growing_from, slot) +
+                          table->value_offset;
+}
+
+void *flat_table_insert(flat_table_t *table,
+                        const void *key,
+                        const void *value)
+{
+    size_t value_size = table->entry_size - table->value_offset;
+    uint32_t hash = stored_hash(table, key);
+
+    /* Equal keys are updated where they are, also not moved yet */
+    for (int i = 0; i < 2; i++)
+    {
+        flat_table_slots_t *slots = i ? &table->growing_from : &table->slots;
+        long slot =
+            slots->capacity ? find_slot(table, slots, hash, key) : -1;
+        if (slot < 0) continue;
+
+        unsigned char *stored =
+            entry_at(table, slots, slot) + table->value_offset;
+        if (value) memcpy(stored, value, value_size);
+        return stored;
+    }
+
+    if (!make_room(table)) return NULL;
+
+    unsigned char *entry = table->scratch + table->entry_size;
+    memset(entry, 0, table->entry_size);
+    set_hash(entry, hash);
+    memcpy(entry + table->key_offset, key, table->key_size);
+    if (value) memcpy(entry + table->value_offset, value, value_size);
+
+    size_t slot = place_entry(table, entry);
+    table->count++;
+    return entry_at(table, &table->slots, slot) + table->value_offset;
+}
+
+int flat_table_remove(flat_table_t *table, const void *key, void *key_out)
+{
+    if (!table->count) return 0;
+
+    uint32_t hash = stored_hash(table, key);
+    flat_table_slots_t *slots = &table->slots;
+    long found = find_slot(table, slots, hash, key);
+    if (found < 0 && table->growing_from.capacity)
+    {
+        /* Entries past the one removed there are left where they are */
+        slots = &table->growing_from;
+        found = find_slot(table, slots, hash, key);
+        if (found < 0) return 0;
+
+        unsigned char *entry = entry_at(table, slots, found);
+        if (key_out)
+            memcpy(key_out, entry + table->key_offset, table->key_size);
+        set_hash(entry, hash | FLAT_TABLE_GONE);
+        table->count--;
+        move_slots(table, FLAT_TABLE_MOVE_STEP);
+        return 1;
+    }
+    if (found < 0) return 0;
+
+    size_t slot = (size_t)found;
+    if (key_out)
+        memcpy(key_out,
+               entry_at(table, slots, slot) + table->key_offset,
+               table->key_size);
+
+    /* Backward shift: the entries after it move one closer to home until
+     * one is already there */
+    size_t mask = slots->capacity - 1;
+    for (;;)
+    {
+        size_t next = (slot + 1) & mask;
+        unsigned char *next_entry = entry_at(table, slots, next);
+        uint32_t next_hash = hash_of(next_entry);
+        if (next_hash == FLAT_TABLE_EMPTY || ((next - next_hash) & mask) == 0)
+            break;
+
+        memcpy(entry_at(table, slots, slot), next_entry, table->entry_size);
+        slot = next;
+    }
+    set_hash(entry_at(table, slots, slot), FLAT_TABLE_EMPTY);
+    table->count--;
+    move_slots(table, FLAT_TABLE_MOVE_STEP);
+    return 1;
+}
+
+void flat_table_foreach(const flat_table_t *table,
+                        void (*cb)(void *key, void *value, void *ctx),
+                        void *ctx)
+{
+    const flat_table_slots_t *all[] = {&table->slots, &table->growing_from};
+    for (int i = 0; i < 2; i++)
+        for (size_t slot = 0; slot < all[i]->capacity; slot++)
+        {
+            unsigned char *entry = entry_at(table, all[i], slot);
+            if ((hash_of(entry) & (FLAT_TABLE_PRESENT | FLAT_TABLE_GONE)) ==
+                FLAT_TABLE_PRESENT)
+                cb(entry + table->key_offset,
+                   entry + table->value_offset,
+                   ctx);
+        }
+}
+
+uint64_t flat_table_hash_bytes(const void *key, size_t key_size)
+{
+    const unsigned char *bytes = key;
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ key_size;
+
+    while (key_size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+        bytes += 8;
+        key_size -= 8;
+    }
+    if (key_size)
+    {
+        uint64_t word = 0;
+        memcpy(&word, bytes, key_size);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+    }
+
+    /* Final mix of murmur3, the low bits pick the slot */
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint32_t stored_hash(const flat_table_t *table, const void *key)
+{
+    return ((uint32_t)table->hash(key, table->key_size) & ~FLAT_TABLE_GONE) |
+           FLAT_TABLE_PRESENT;
+}
+
+static int equal_bytes(const void *a, const void *b, size_t key_size)
+{
+    return memcmp(a, b, key_size) == 0;
+}
+
+static unsigned char *entry_at(const flat_table_t *table,
+                               const flat_table_slots_t *slots,
+                               size_t slot)
+{
+    return slots->entries + slot * table->entry_size;
+}
+
+static uint32_t hash_of(const unsigned char *entry)
+{
+    return *(const uint32_t *)entry;
+}
+
+static void set_hash(unsigned char *entry, uint32_t hash)
+{
+    *(uint32_t *)entry = hash;
+}
+
+static int allocate_slots(flat_table_slots_t *slots,
+                          size_t capacity,
+                          size_t entry_size)
+{
+    /* A zero hash is an empty slot */
+    slots->entries = calloc(capacity, entry_size);
+    if (!slots->entries) return 0;
+    slots->capacity = capacity;
+    return 1;
+}
+
+static void free_slots(flat_table_slots_t *slots)
+{
+    free(slots->entries);
+    memset(slots, 0, sizeof(*slots));
+}
+
+static long find_slot(const flat_table_t *table,
+                      const flat_table_slots_t *slots,
+                      uint32_t hash,
+                      const void *key)
+{
+    size_t mask = slots->capacity - 1;
+    size_t slot = hash & mask;
+
+    for (size_t distance = 0; distance <= mask; distance++)
+    {
+        const unsigned char *entry = entry_at(table, slots, slot);
+        uint32_t found = hash_of(entry);
+        if (found == FLAT_TABLE_EMPTY) return -1;
+
+        /* Entries gone from growing_from keep their hash for this */
+        if (found == hash &&
+            table->equal(key, entry + table->key_offset, table->key_size))
+            return (long)slot;
+
+        /* It would have taken this slot */
+        if (((slot - found) & mask) < distance) return -1;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/* Places an entry whose key is not in slots, returns where it went */
+static size_t place_entry(flat_table_t *table, const unsigned char *entry)
+{
+    flat_table_slots_t *slots = &table->slots;
+    unsigned char *carried = table->scratch;
+    memmove(carried, entry, table->entry_size);
+
+    size_t mask = slots->capacity - 1;
+    size_t slot = hash_of(carried) & mask;
+    size_t distance = 0;
+    size_t placed = (size_t)-1;
+
+    for (;;)
+    {
+        unsigned char *stored = entry_at(table, slots, slot);
+        uint32_t found = hash_of(stored);
+        if (found == FLAT_TABLE_EMPTY)
+        {
+            memcpy(stored, carried, table->entry_size);
+            return placed == (size_t)-1 ? slot : placed;
+        }
+
+        /* Robin Hood: the one further from home takes the slot */
+        size_t found_distance = (slot - found) & mask;
+        if (found_distance < distance)
+        {
+            unsigned char *swap = table->scratch + table->entry_size;
+            memcpy(swap, stored, table->entry_size);
+            memcpy(stored, carried, table->entry_size);
+            memcpy(carried, swap, table->entry_size);
+            distance = found_distance;
+            if (placed == (size_t)-1) placed = slot;
+        }
+        slot = (slot + 1) & mask;
+        distance++;
+    }
+}
+
+/* Makes sure one more entry fits, starting to grow at 7/8 full */
+static int make_room(flat_table_t *table)
+{
+    if (!table->slots.capacity)
+        return allocate_slots(&table->slots,
+                              FLAT_TABLE_FIRST_CAPACITY,
+                              table->entry_size);
+
+    move_slots(table, FLAT_TABLE_MOVE_STEP);
+    if ((table->count + 1) * 8 <= table->slots.capacity * 7) return 1;
+    if (table->slots.capacity >= FLAT_TABLE_MAX_CAPACITY) return 0;
+
+    /* Still growing only if writes were mostly removes */
+    move_slots(table, (size_t)-1);
+
+    flat_table_slots_t bigger;
+    if (!allocate_slots(
+            &bigger, table->slots.capacity * 2, table->entry_size))
+        return 0;
+    table->growing_from = table->slots;
+    table->slots = bigger;
+    table->moved = 0;
+    move_slots(table, FLAT_TABLE_MOVE_STEP);
+    return 1;
+}
+
+/* Moves up to count slots of growing_from, freeing it once all are */
+static void move_slots(flat_table_t *table, size_t count)
+{
+    flat_table_slots_t *from = &table->growing_from;
+    if (!from->capacity) return;
+
+    for (; count && table->moved < from->capacity; count--, table->moved++)
+    {
+        unsigned char *entry = entry_at(table, from, table->moved);
+        uint32_t hash = hash_of(entry);
+        if (hash == FLAT_TABLE_EMPTY || (hash & FLAT_TABLE_GONE)) continue;
+
+        place_entry(table, entry);
+        set_hash(entry, hash | FLAT_TABLE_GONE);
+    }
+
+    if (table->moved == from->capacity) free_slots(from);
+}
@@ -0,0 +1,129 @@
+/*
+    Hash table with keys and values of fixed size stored inline, for caches
+    and counters that are looked up far more often than changed.
+
+    Open addressing with Robin Hood probing: an entry may take the slot of
+    one closer to its home slot, so probe sequences stay short and a lookup
+    gives up as soon as it meets an entry closer to home than itself. Each
+    entry starts with the 32 bit hash of its key, so a probe reads one
+    cache line for hash, key and value, compares keys only where the hash
+    matches, and growing never hashes a key again.
+
+    Growing is spread over the writes that follow it: the full array stays
+    as it is while every insert and remove moves a few of its slots into
+    one twice the size, lookups check both until it is empty. No single
+    insert pays for moving the whole table.
+
+    Keys are compared and by default hashed as bytes, so key types must
+    have no padding, or have it zeroed. Values are 8 byte aligned.
+*/
+
+#ifndef FLAT_TABLE_H
+#define FLAT_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint64_t (*flat_table_hash_cb)(const void *key, size_t key_size);
+typedef int (*flat_table_equal_cb)(const void *a,
+                                   const void *b,
+                                   size_t key_size);
+
+/* One array of slots, the table keeps a second one while growing */
+typedef struct
+{
+    unsigned char *entries; /* Hash, key and value per slot, hash 0 if empty */
+    size_t capacity;        /* A power of two, 0 before the first insert */
+} flat_table_slots_t;
+
+typedef struct
+{
+    flat_table_slots_t slots;
+    flat_table_slots_t growing_from; /* Not moved yet, capacity 0 if none */
+    size_t moved;                    /* Slots of growing_from moved */
+    size_t count;
+    size_t key_size;
+    size_t key_offset;   /* Of the key within an entry, after the hash */
+    size_t value_offset; /* Of the value within an entry */
+    size_t entry_size;
+    flat_table_hash_cb hash;
+    flat_table_equal_cb equal;
+    unsigned char *scratch; /* Two entries, for swapping while inserting */
+} flat_table_t;
+
+/*!
+ * @brief Allocates an empty table, the slots come with the first insert.
+ * @param hash NULL to hash the key bytes.
+ * @param equal NULL to compare the key bytes.
+ * @return NULL if out of memory.
+ */
+flat_table_t *create_flat_table(size_t key_size,
+                                size_t value_size,
+                                flat_table_hash_cb hash,
+                                flat_table_equal_cb equal);
+
+void free_flat_table(flat_table_t *table);
+
+/*!
+ * @return The value stored under key, NULL if there is none. Valid until
+ * the next insert or remove.
+ */
+void *flat_table_lookup(const flat_table_t *table, const void *key);
+
+/*!
+ * @brief Stores value under key, replacing the value of an equal key.
+ * @param value NULL leaves the value of a new key zeroed.
+ * @return The stored value as flat_table_lookup, NULL if out of memory.
+ */
+void *flat_table_insert(flat_table_t *table,
+                        const void *key,
+                        const void *value);
+
+/*!
+ * @brief Removes key and its value.
+ * @param key_out Receives the removed key when not NULL, e.g. to free
+ * what it points to.
+ * @return 1 if the key was there, 0 otherwise.
+ */
+int flat_table_remove(flat_table_t *table, const void *key, void *key_out);
+
+/*!
+ * @brief Visits every entry in no particular order, cb must not insert or
+ * remove.
+ */
+void flat_table_foreach(const flat_table_t *table,
+                        void (*cb)(void *key, void *value, void *ctx),
+                        void *ctx);
+
+uint64_t flat_table_hash_bytes(const void *key, size_t key_size);
+
+/*
+    Typed wrappers taking and returning key_type and value_type, e.g.
+    DEFINE_FLAT_TABLE(uid_counts, uint32_t, uint64_t) gives
+    uid_counts_create(), uid_counts_lookup(table, uid) returning a
+    uint64_t pointer, uid_counts_insert(table, uid, count) and
+    uid_counts_remove(table, uid).
+*/
+#define DEFINE_FLAT_TABLE(name, key_type, value_type)                       \
+    __attribute__((unused)) static inline flat_table_t *name##_create(void) \
+    {                                                                       \
+        return create_flat_table(                                          \
+            sizeof(key_type), sizeof(value_type), NULL, NULL);              \
+    }                                                                       \
+    __attribute__((unused)) static inline value_type *name##_lookup(        \
+        const flat_table_t *table, key_type key)                            \
+    {                                                                       \
+        return (value_type *)flat_table_lookup(table, &key);                \
+    }                                                                       \
+    __attribute__((unused)) static inline value_type *name##_insert(        \
+        flat_table_t *table, key_type key, value_type value)                \
+    {                                                                       \
+        return (value_type *)flat_table_insert(table, &key, &value);        \
+    }                                                                       \
+    __attribute__((unused)) static inline int name##_remove(                \
+        flat_table_t *table, key_type key)                                  \
+    {                                                                       \
+        return flat_table_remove(table, &key, NULL);                        \
+    }
+
+#endif /* FLAT_TABLE_H */
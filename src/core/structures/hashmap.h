@@ -7,8 +7,7 @@
 
 #include <stddef.h>
 
-#define HASH_TABLE_INTIAL_SIZE 21
-#define DEFAULT_LOAD_FACTOR 0.75f
+#include "flat_table.h"
 
 /* Hash Error Codes (Bits) */
 #define HASH_ENTRY_FAILED 0x0
@@ -18,34 +17,21 @@
 #define HASH_FREED 0x8
 #define HASH_ENTRY_UPDATED 0x10
 
-/*
-    Hash Table Elements
-        - Follows a linked list structure to resolve collision
-*/
-struct hash_table_elem
-{
-    struct hash_table_elem *next, *prev;
-    char *key;
-    void *address;
-};
-
 /*
     Hash Table
-        - To store the root hash table element along with properties
+        - String keys mapped to addresses, kept in a flat_table as copies of
+          the key and the address. See structures/flat_table.h.
 */
 struct hash_table
 {
-    size_t length;
-    struct hash_table_elem **table;
-    float load_factor;
-    int elem_count;
+    flat_table_t *table;
 };
 
 /*  FUNCTION DECLARATIONS  */
 
 /*
-    Allocates memory for hash table structure and hash table element pointer
-    table,and initializes to default values.
+    Allocates memory for hash table structure, the slots are allocated with
+    the first insert.
 */
 struct hash_table *create_hash_table(void);
 
@@ -0,0 +1,259 @@
+#include "prefix_trie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFIX_TRIE_KEY_BITS (PREFIX_TRIE_KEY_LENGTH * 8)
+#define PREFIX_TRIE_INITIAL_NODES 64
+#define PREFIX_TRIE_JUMP_BITS 16
+#define PREFIX_TRIE_JUMP_SIZE (1 << PREFIX_TRIE_JUMP_BITS)
+#define PREFIX_TRIE_JUMP_MIN_NODES 4096 /* Smaller tries stay in cache */
+#define PREFIX_TRIE_V4_BITS 96 /* ::ffff:0:0/96 */
+
+static int32_t add_node(prefix_trie_t *trie,
+                        const uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                        int length,
+                        int value);
+static int common_length(const uint8_t *a, const uint8_t *b, int limit);
+static int key_bit(const uint8_t *key, int bit);
+static int prefix_matches(const uint8_t *key, const prefix_trie_node_t *node);
+static prefix_trie_jump_t find_jump(const prefix_trie_t *trie,
+                                    const uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                                    int length);
+static int is_v4_mapped(const uint8_t key[PREFIX_TRIE_KEY_LENGTH]);
+
+prefix_trie_t *create_prefix_trie(void)
+{
+    prefix_trie_t *trie = calloc(1, sizeof(prefix_trie_t));
+    if (!trie) return NULL;
+
+    static const uint8_t any[PREFIX_TRIE_KEY_LENGTH];
+    if (add_node(trie, any, 0, 0) < 0)
+    {
+        free(trie);
+        return NULL;
+    }
+    return trie;
+}
+
+void free_prefix_trie(prefix_trie_t *trie)
+{
+    if (!trie) return;
+    free(trie->jump);
+    free(trie->nodes);
+    free(trie);
+}
+
+int prefix_trie_insert(prefix_trie_t *trie,
+                       const uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                       int length,
+                       int value)
+{
+    free(trie->jump);
+    trie->jump = NULL;
+
+    /* Bits past the prefix must not take part in comparisons */
+    uint8_t masked[PREFIX_TRIE_KEY_LENGTH] = {0};
+    memcpy(masked, key, (length + 7) / 8);
+    if (length % 8) masked[length / 8] &= (uint8_t)(0xff << (8 - length % 8));
+
+    /* Indices, add_node may move the array */
+    int32_t node = 0;
+    for (;;)
+    {
+        if (trie->nodes[node].length == length)
+        {
+            trie->nodes[node].value = (uint8_t)value;
+            return 1;
+        }
+
+        int bit = key_bit(masked, trie->nodes[node].length);
+        int32_t child = trie->nodes[node].child[bit];
+        if (child < 0)
+        {
+            int32_t leaf = add_node(trie, masked, length, value);
+            if (leaf < 0) return 0;
+            trie->nodes[node].child[bit] = leaf;
+            return 1;
+        }
+
+        int child_length = trie->nodes[child].length;
+        int common = common_length(masked,
+                                   trie->nodes[child].prefix,
+                                   length < child_length ? length
+                                                         : child_length);
+        if (common == child_length)
+        {
+            node = child;
+            continue;
+        }
+
+        /* The prefix ends or parts from the child above it, the new node
+         * goes between */
+        int32_t split = add_node(trie, masked, common, 0);
+        if (split < 0) return 0;
+        trie->nodes[split].child[key_bit(trie->nodes[child].prefix, common)] =
+            child;
+        trie->nodes[node].child[bit] = split;
+
+        if (common == length)
+        {
+            trie->nodes[split].value = (uint8_t)value;
+            return 1;
+        }
+
+        int32_t leaf = add_node(trie, masked, length, value);
+        if (leaf < 0) return 0;
+        trie->nodes[split].child[key_bit(masked, common)] = leaf;
+        return 1;
+    }
+}
+
+void finish_prefix_trie(prefix_trie_t *trie)
+{
+    free(trie->jump);
+    trie->jump = NULL;
+    if (trie->count < PREFIX_TRIE_JUMP_MIN_NODES) return;
+
+    /* Every /16 of IPv6, then every /16 of ::ffff:0:0/96 */
+    prefix_trie_jump_t *jump = malloc(2 * PREFIX_TRIE_JUMP_SIZE *
+                                      sizeof(prefix_trie_jump_t));
+    if (!jump) return;
+    for (int family = 0; family < 2; family++)
+    {
+        uint8_t key[PREFIX_TRIE_KEY_LENGTH] = {0};
+        int offset = family ? PREFIX_TRIE_V4_BITS / 8 : 0;
+        if (family) key[10] = key[11] = 0xff;
+
+        for (int i = 0; i < PREFIX_TRIE_JUMP_SIZE; i++)
+        {
+            key[offset] = (uint8_t)(i >> 8);
+            key[offset + 1] = (uint8_t)i;
+            jump[family * PREFIX_TRIE_JUMP_SIZE + i] = find_jump(
+                trie, key, offset * 8 + PREFIX_TRIE_JUMP_BITS);
+        }
+    }
+    trie->jump = jump;
+}
+
+int prefix_trie_lookup(const prefix_trie_t *trie,
+                       const uint8_t key[PREFIX_TRIE_KEY_LENGTH])
+{
+    const prefix_trie_node_t *nodes = trie->nodes;
+    int32_t index = 0;
+    int value = nodes[0].value;
+    if (trie->jump)
+    {
+        const prefix_trie_jump_t *jump =
+            is_v4_mapped(key)
+                ? &trie->jump[PREFIX_TRIE_JUMP_SIZE + (key[12] << 8 | key[13])]
+                : &trie->jump[key[0] << 8 | key[1]];
+        index = jump->node;
+        value = jump->value;
+    }
+
+    /* Follows the bits of key without comparing prefixes on the way. Once
+     * the path left key, no node below matches, and those passed before
+     * are prefixes of each other, so the deepest one that matches wins. */
+    int32_t passed[PREFIX_TRIE_KEY_BITS + 1];
+    int count = 0;
+    while (nodes[index].length < PREFIX_TRIE_KEY_BITS)
+    {
+        index = nodes[index].child[key_bit(key, nodes[index].length)];
+        if (index < 0) break;
+        if (nodes[index].value) passed[count++] = index;
+    }
+
+    while (count--)
+    {
+        const prefix_trie_node_t *node = &nodes[passed[count]];
+        if (prefix_matches(key, node)) return node->value;
+    }
+    return value;
+}
+
+static int32_t add_node(prefix_trie_t *trie,
+                        const uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                        int length,
+                        int value)
+{
+    if (trie->count == trie->capacity)
+    {
+        size_t capacity = trie->capacity ? trie->capacity * 2
+                                         : PREFIX_TRIE_INITIAL_NODES;
+        prefix_trie_node_t *nodes =
+            realloc(trie->nodes, capacity * sizeof(prefix_trie_node_t));
+        if (!nodes) return -1;
+        trie->nodes = nodes;
+        trie->capacity = capacity;
+    }
+
+    prefix_trie_node_t *node = &trie->nodes[trie->count];
+    memset(node, 0, sizeof(*node));
+    memcpy(node->prefix, key, (length + 7) / 8);
+    if (length % 8)
+        node->prefix[length / 8] &= (uint8_t)(0xff << (8 - length % 8));
+    node->length = (uint8_t)length;
+    node->value = (uint8_t)value;
+    node->child[0] = -1;
+    node->child[1] = -1;
+    return (int32_t)trie->count++;
+}
+
+static int common_length(const uint8_t *a, const uint8_t *b, int limit)
+{
+    /* Leading bits a and b share, at most limit */
+    for (int byte = 0; byte * 8 < limit; byte++)
+    {
+        unsigned differ = a[byte] ^ b[byte];
+        if (!differ) continue;
+
+        int common = byte * 8 + __builtin_clz(differ) - 24;
+        return common < limit ? common : limit;
+    }
+    return limit;
+}
+
+static int key_bit(const uint8_t *key, int bit)
+{
+    return (key[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static int prefix_matches(const uint8_t *key, const prefix_trie_node_t *node)
+{
+    int bytes = node->length / 8;
+    if (memcmp(key, node->prefix, bytes) != 0) return 0;
+    if (node->length % 8 == 0) return 1;
+
+    uint8_t mask = (uint8_t)(0xff << (8 - node->length % 8));
+    return (key[bytes] & mask) == node->prefix[bytes];
+}
+
+static prefix_trie_jump_t find_jump(const prefix_trie_t *trie,
+                                    const uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                                    int length)
+{
+    /* Nodes no longer than length match either every key of the range or
+     * none, descend through those that match */
+    prefix_trie_jump_t jump = {0, trie->nodes[0].value};
+    for (;;)
+    {
+        const prefix_trie_node_t *node = &trie->nodes[jump.node];
+        if (node->length >= length) return jump;
+
+        int32_t child = node->child[key_bit(key, node->length)];
+        if (child < 0 || trie->nodes[child].length > length ||
+            !prefix_matches(key, &trie->nodes[child]))
+            return jump;
+
+        jump.node = child;
+        if (trie->nodes[child].value) jump.value = trie->nodes[child].value;
+    }
+}
+
+static int is_v4_mapped(const uint8_t key[PREFIX_TRIE_KEY_LENGTH])
+{
+    static const uint8_t mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return memcmp(key, mapped, sizeof(mapped)) == 0;
+}
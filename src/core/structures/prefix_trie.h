@@ -0,0 +1,81 @@
+/*
+    Longest prefix match over 128 bit keys, IPv6 addresses with IPv4 mapped
+    into ::ffff:0:0/96.
+
+    A path compressed binary trie: a node exists only where a prefix ends
+    or two prefixes part, so n prefixes take at most 2n nodes. The nodes
+    sit in one array and refer to their children by index, a lookup walks
+    at most one node per differing bit and touches no allocator.
+
+    Large tries get an index by the first 16 bits of IPv6 addresses and of
+    IPv4 addresses once every prefix is in, see finish_prefix_trie. Lookups
+    start at the node the index points to, which skips the top levels that
+    otherwise cost a cache miss each.
+*/
+
+#ifndef PREFIX_TRIE_H
+#define PREFIX_TRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PREFIX_TRIE_KEY_LENGTH 16 /* Bytes */
+
+typedef struct
+{
+    uint8_t prefix[PREFIX_TRIE_KEY_LENGTH]; /* Bits past length are zero */
+    uint8_t length;                         /* In bits, 0 to 128 */
+    uint8_t value;                          /* 0 where no prefix ends */
+    uint16_t reserved;
+    int32_t child[2]; /* By the bit after length, -1 for none */
+} prefix_trie_node_t;
+
+/* Where lookups of a /16 start */
+typedef struct
+{
+    int32_t node;  /* Deepest node covering the whole /16 */
+    uint8_t value; /* Of the longest prefix covering it, 0 if none */
+} prefix_trie_jump_t;
+
+typedef struct
+{
+    prefix_trie_node_t *nodes; /* nodes[0] is the root, ::/0 */
+    size_t count;
+    size_t capacity;
+    prefix_trie_jump_t *jump; /* IPv6 then IPv4 /16s, NULL without index */
+} prefix_trie_t;
+
+/*!
+ * @brief Allocates a trie holding no prefixes.
+ * @return NULL if out of memory.
+ */
+prefix_trie_t *create_prefix_trie(void);
+
+void free_prefix_trie(prefix_trie_t *trie);
+
+/*!
+ * @brief Adds a prefix, replacing the value of an equal one.
+ * @param length Prefix length in bits.
+ * @param value 1 to 255, returned by lookups the prefix is the longest
+ * match of.
+ * @return 1 on success, 0 if out of memory.
+ * @details Drops the index, finish_prefix_trie builds it again.
+ */
+int prefix_trie_insert(prefix_trie_t *trie,
+                       const uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                       int length,
+                       int value);
+
+/*!
+ * @brief Builds the index of a trie large enough to need one, called after
+ * the last insert. Without memory for it lookups still work, only slower.
+ */
+void finish_prefix_trie(prefix_trie_t *trie);
+
+/*!
+ * @brief Value of the longest prefix of key in the trie, 0 if none.
+ */
+int prefix_trie_lookup(const prefix_trie_t *trie,
+                       const uint8_t key[PREFIX_TRIE_KEY_LENGTH]);
+
+#endif /* PREFIX_TRIE_H */
@@ -0,0 +1,645 @@
+#include "admission.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "error.h"
+#include "ip_filter.h"
+#include "server_state.h"
+#include "upgrade.h"
+
+#define ADMISSION_MAGIC 0x41544643 /* "CFTA" */
+#define ADMISSION_VERSION 2
+#define ADMISSION_KEY_LENGTH 16 /* IPv6 address, IPv4 is mapped into it */
+
+extern server_state_t g_server_state;
+
+/* Connections counted per address or per uid, count 0 marks a free slot.
+ * Open addressing with linear probing, the table has at least twice as
+ * many slots as there are tickets so it never fills up. */
+typedef struct
+{
+    uint8_t key[ADMISSION_KEY_LENGTH];
+    uint32_t count;
+} admission_count_t;
+
+typedef struct
+{
+    uint32_t generation;
+    uint32_t in_use;
+    int32_t owner; /* Process releasing it when it exits */
+    uint32_t uid;
+    uint32_t has_user;
+    int32_t next_free;
+    uint32_t buffer_chunks; /* Transfer buffers, see buffer_pool.h */
+    uint8_t ip[ADMISSION_KEY_LENGTH];
+} admission_ticket_t;
+
+/* Start of the segment, the fields up to buffer_chunks are read by
+ * benchmarks/admission_stats.py and keep their layout within a version */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_total;
+    uint32_t max_per_ip; /* 0 no limit */
+    uint32_t max_per_user;
+    uint32_t tickets;
+    uint32_t count_slots; /* Slots of each count table, a power of two */
+    uint32_t tickets_offset;
+    uint32_t ips_offset;
+    uint32_t users_offset;
+    uint32_t active;    /* Tickets in use */
+    uint32_t logged_in; /* Tickets with a user */
+    uint64_t admitted;
+    uint64_t rejected_total;
+    uint64_t rejected_ip;
+    uint64_t rejected_user;
+    uint32_t max_buffer_chunks; /* 0 no limit */
+    uint32_t buffer_chunks;     /* Taken by transfers of every process */
+
+    int32_t free_head;
+    uint32_t reserved;
+    pthread_mutex_t lock; /* Robust, a session may die holding it */
+} admission_header_t;
+
+typedef struct
+{
+    admission_header_t *header; /* NULL leaves connections unlimited */
+    admission_ticket_t *tickets;
+    admission_count_t *ips;
+    admission_count_t *users;
+    uint64_t *owned; /* Tickets this process releases when it exits */
+} admission_state_t;
+
+static admission_state_t g_admission;
+
+static admission_header_t *map_segment(const char *name,
+                                       size_t size,
+                                       int reuse);
+static void init_segment(admission_header_t *header,
+                         uint32_t tickets,
+                         uint32_t slots);
+static void lock_segment(void);
+static void unlock_segment(void);
+static admission_ticket_t *find_ticket(const admission_t *admission);
+static void release_ticket(admission_ticket_t *ticket);
+static int count_up(admission_count_t *table,
+                    const uint8_t key[ADMISSION_KEY_LENGTH],
+                    uint32_t limit);
+static void count_down(admission_count_t *table,
+                       const uint8_t key[ADMISSION_KEY_LENGTH]);
+static uint32_t hash_key(const uint8_t key[ADMISSION_KEY_LENGTH]);
+static void address_key(const struct sockaddr *addr,
+                        uint8_t key[ADMISSION_KEY_LENGTH]);
+static void uid_key(uint32_t uid, uint8_t key[ADMISSION_KEY_LENGTH]);
+static void mark_owned(int32_t index, int owned);
+static void release_owned_admissions(void);
+
+void start_admission(void)
+{
+    uint32_t tickets = g_server_state.config.max_connections;
+    if (tickets > ADMISSION_MAX_TICKETS) tickets = ADMISSION_MAX_TICKETS;
+
+    uint32_t slots = 1;
+    while (slots < 2 * tickets) slots <<= 1;
+
+    size_t size = sizeof(admission_header_t) +
+                  (size_t)tickets * sizeof(admission_ticket_t) +
+                  2 * (size_t)slots * sizeof(admission_count_t);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/cftp_server.%d", g_server_state.config.port);
+
+    /* Sessions of the previous binary still hold their tickets */
+    admission_header_t *header = NULL;
+    if (started_by_upgrade())
+    {
+        header = map_segment(name, size, 1);
+        if (header &&
+            (header->magic != ADMISSION_MAGIC ||
+             header->version != ADMISSION_VERSION ||
+             header->tickets != tickets || header->count_slots != slots))
+        {
+            WARN("Admission segment of the previous binary does not fit, its "
+                 "sessions are not counted");
+            munmap(header, size);
+            header = NULL;
+        }
+    }
+
+    if (!header)
+    {
+        header = map_segment(name, size, 0);
+        if (header) init_segment(header, tickets, slots);
+    }
+    if (!header)
+    {
+        ERROR("No admission segment, connections are not limited");
+        return;
+    }
+
+    g_admission.header = header;
+    g_admission.tickets =
+        (admission_ticket_t *)((char *)header + header->tickets_offset);
+    g_admission.ips =
+        (admission_count_t *)((char *)header + header->ips_offset);
+    g_admission.users =
+        (admission_count_t *)((char *)header + header->users_offset);
+    g_admission.owned = calloc((tickets + 63) / 64, sizeof(uint64_t));
+
+    /* Limits follow the configuration of the running binary */
+    lock_segment();
+    header->max_total = tickets;
+    header->max_per_ip = g_server_state.config.max_connections_per_ip;
+    header->max_per_user = g_server_state.config.max_connections_per_user;
+    header->max_buffer_chunks = g_server_state.config.transfer_chunks_total;
+    unlock_segment();
+
+    atexit(release_owned_admissions);
+    INFO("Admission control in %s for %" PRIu32 " connections, %" PRIu32
+         " per address, %" PRIu32 " per user",
+         name,
+         tickets,
+         header->max_per_ip,
+         header->max_per_user);
+}
+
+int admit_connection(int fd,
+                     const struct sockaddr *addr,
+                     admission_t *admission)
+{
+    *admission = ADMISSION_NONE;
+    if (!ip_filter_allows(addr))
+    {
+        DEBG("Address list denies connection on fd %d", fd);
+        close(fd);
+        return 0;
+    }
+
+    admission_header_t *header = g_admission.header;
+    if (!header) return 1;
+
+    uint8_t key[ADMISSION_KEY_LENGTH];
+    address_key(addr, key);
+
+    const char *refusal = NULL;
+    lock_segment();
+    if (header->free_head < 0)
+    {
+        refusal = "Too many connections";
+        header->rejected_total++;
+    }
+    else if (!count_up(g_admission.ips, key, header->max_per_ip))
+    {
+        refusal = "Too many connections from your address";
+        header->rejected_ip++;
+    }
+    else
+    {
+        admission->index = header->free_head;
+        admission_ticket_t *ticket = &g_admission.tickets[admission->index];
+        header->free_head = ticket->next_free;
+
+        ticket->generation++;
+        ticket->in_use = 1;
+        ticket->owner = getpid();
+        ticket->has_user = 0;
+        memcpy(ticket->ip, key, sizeof(ticket->ip));
+        admission->generation = ticket->generation;
+
+        header->active++;
+        header->admitted++;
+    }
+    unlock_segment();
+
+    if (!refusal)
+    {
+        mark_owned(admission->index, 1);
+        return 1;
+    }
+
+    /* Best effort, a client that does not read only misses the reason */
+    char reply[128];
+    int length = snprintf(reply, sizeof(reply), "421 %s\r\n", refusal);
+    if (send(fd, reply, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        DEBG("Cannot tell refused client why: %s", strerror(errno));
+    close(fd);
+
+    char source_ip[INET6_ADDRSTRLEN] = "-";
+    fill_source_ip((struct sockaddr *)addr, source_ip);
+    WARN("%s, refused %s", refusal, source_ip);
+    return 0;
+}
+
+int admit_user(admission_t *admission, uint32_t uid)
+{
+    admission_header_t *header = g_admission.header;
+    if (!header || admission->index < 0) return 1;
+
+    uint8_t key[ADMISSION_KEY_LENGTH];
+    uid_key(uid, key);
+
+    int admitted = 1;
+    lock_segment();
+    admission_ticket_t *ticket = find_ticket(admission);
+    if (ticket && !(ticket->has_user && ticket->uid == uid))
+    {
+        admitted = count_up(g_admission.users, key, header->max_per_user);
+        if (!admitted)
+            header->rejected_user++;
+        else if (ticket->has_user)
+        {
+            /* Logged in again as somebody else */
+            uint8_t previous[ADMISSION_KEY_LENGTH];
+            uid_key(ticket->uid, previous);
+            count_down(g_admission.users, previous);
+        }
+        else
+            header->logged_in++;
+
+        if (admitted)
+        {
+            ticket->uid = uid;
+            ticket->has_user = 1;
+        }
+    }
+    unlock_segment();
+
+    if (!admitted)
+        WARN("Too many sessions of uid %" PRIu32 ", refused login", uid);
+    return admitted;
+}
+
+int admit_buffer_chunk(const admission_t *admission)
+{
+    admission_header_t *header = g_admission.header;
+    if (!header || admission->index < 0) return 1;
+
+    int admitted = 1;
+    lock_segment();
+    admission_ticket_t *ticket = find_ticket(admission);
+    if (ticket)
+    {
+        admitted = !header->max_buffer_chunks ||
+                   header->buffer_chunks < header->max_buffer_chunks;
+        if (admitted)
+        {
+            ticket->buffer_chunks++;
+            header->buffer_chunks++;
+        }
+    }
+    unlock_segment();
+    return admitted;
+}
+
+void release_buffer_chunk(const admission_t *admission)
+{
+    if (!g_admission.header || admission->index < 0) return;
+
+    lock_segment();
+    admission_ticket_t *ticket = find_ticket(admission);
+    if (ticket && ticket->buffer_chunks)
+    {
+        ticket->buffer_chunks--;
+        g_admission.header->buffer_chunks--;
+    }
+    unlock_segment();
+}
+
+void release_admission(admission_t *admission)
+{
+    if (!g_admission.header || admission->index < 0) return;
+
+    lock_segment();
+    admission_ticket_t *ticket = find_ticket(admission);
+    if (ticket) release_ticket(ticket);
+    unlock_segment();
+
+    mark_owned(admission->index, 0);
+    *admission = ADMISSION_NONE;
+}
+
+int adopt_admission(admission_t *admission)
+{
+    if (!g_admission.header || admission->index < 0) return 1;
+
+    lock_segment();
+    admission_ticket_t *ticket = find_ticket(admission);
+    if (ticket) ticket->owner = getpid();
+    unlock_segment();
+
+    if (!ticket)
+    {
+        *admission = ADMISSION_NONE;
+        return 0;
+    }
+    mark_owned(admission->index, 1);
+    return 1;
+}
+
+void pass_admission(admission_t *admission, pid_t to)
+{
+    if (!g_admission.header || admission->index < 0) return;
+
+    lock_segment();
+    admission_ticket_t *ticket = find_ticket(admission);
+    if (ticket && to > 0) ticket->owner = to;
+    unlock_segment();
+
+    mark_owned(admission->index, 0);
+    *admission = ADMISSION_NONE;
+}
+
+void drop_parent_admissions(void)
+{
+    if (!g_admission.owned) return;
+    memset(g_admission.owned,
+           0,
+           (g_admission.header->tickets + 63) / 64 * sizeof(uint64_t));
+}
+
+void reclaim_admissions(pid_t pid)
+{
+    if (!g_admission.header) return;
+
+    unsigned reclaimed = 0;
+    lock_segment();
+    for (uint32_t i = 0; i < g_admission.header->tickets; i++)
+    {
+        admission_ticket_t *ticket = &g_admission.tickets[i];
+        if (!ticket->in_use || ticket->owner != pid) continue;
+        release_ticket(ticket);
+        reclaimed++;
+    }
+    unlock_segment();
+
+    if (reclaimed)
+        WARN("Reclaimed %u connection tickets of process %d", reclaimed, pid);
+}
+
+static admission_header_t *map_segment(const char *name,
+                                       size_t size,
+                                       int reuse)
+{
+    int fd;
+    if (reuse)
+        fd = shm_open(name, O_RDWR, 0);
+    else
+    {
+        /* Left over by a server that did not shut down cleanly. Only the
+         * server's user may read it, it holds the clients' addresses and
+         * uids. */
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 && (fchmod(fd, 0600) < 0 || ftruncate(fd, size) < 0))
+        {
+            ERROR("Cannot size admission segment %s: %s",
+                  name,
+                  strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            fd = -1;
+        }
+    }
+
+    struct stat st;
+    if (fd >= 0 && reuse && (fstat(fd, &st) < 0 || (size_t)st.st_size != size))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *segment;
+    if (fd >= 0)
+    {
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    else if (reuse)
+        return NULL;
+    else
+    {
+        /* Still shared by every process forked from here, only monitoring
+         * cannot see it */
+        WARN("Cannot create admission segment %s (%s), it stays private",
+             name,
+             strerror(errno));
+        segment = mmap(NULL,
+                       size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS,
+                       -1,
+                       0);
+    }
+
+    if (segment == MAP_FAILED)
+    {
+        ERROR("Cannot map admission segment: %s", strerror(errno));
+        return NULL;
+    }
+    return (admission_header_t *)segment;
+}
+
+static void init_segment(admission_header_t *header,
+                         uint32_t tickets,
+                         uint32_t slots)
+{
+    header->magic = ADMISSION_MAGIC;
+    header->version = ADMISSION_VERSION;
+    header->tickets = tickets;
+    header->count_slots = slots;
+    header->tickets_offset = sizeof(admission_header_t);
+    header->ips_offset =
+        header->tickets_offset + tickets * sizeof(admission_ticket_t);
+    header->users_offset =
+        header->ips_offset + slots * sizeof(admission_count_t);
+
+    admission_ticket_t *ticket =
+        (admission_ticket_t *)((char *)header + header->tickets_offset);
+    for (uint32_t i = 0; i < tickets; i++)
+        ticket[i].next_free = i + 1 < tickets ? (int32_t)i + 1 : -1;
+    header->free_head = tickets ? 0 : -1;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+static void lock_segment(void)
+{
+    /* The counts may be off by the update the dead owner was making, that
+     * is still better than a server that cannot admit anybody */
+    if (pthread_mutex_lock(&g_admission.header->lock) == EOWNERDEAD)
+    {
+        WARN("A process died updating the admission counters");
+        pthread_mutex_consistent(&g_admission.header->lock);
+    }
+}
+
+static void unlock_segment(void)
+{
+    pthread_mutex_unlock(&g_admission.header->lock);
+}
+
+static admission_ticket_t *find_ticket(const admission_t *admission)
+{
+    if (admission->index < 0 ||
+        (uint32_t)admission->index >= g_admission.header->tickets)
+        return NULL;
+
+    admission_ticket_t *ticket = &g_admission.tickets[admission->index];
+    if (!ticket->in_use || ticket->generation != admission->generation)
+        return NULL;
+    return ticket;
+}
+
+static void release_ticket(admission_ticket_t *ticket)
+{
+    admission_header_t *header = g_admission.header;
+
+    count_down(g_admission.ips, ticket->ip);
+    if (ticket->has_user)
+    {
+        uint8_t key[ADMISSION_KEY_LENGTH];
+        uid_key(ticket->uid, key);
+        count_down(g_admission.users, key);
+        header->logged_in--;
+    }
+
+    header->buffer_chunks -= ticket->buffer_chunks;
+    ticket->buffer_chunks = 0;
+    ticket->in_use = 0;
+    ticket->has_user = 0;
+    ticket->owner = 0;
+    ticket->next_free = header->free_head;
+    header->free_head = (int32_t)(ticket - g_admission.tickets);
+    header->active--;
+}
+
+static int count_up(admission_count_t *table,
+                    const uint8_t key[ADMISSION_KEY_LENGTH],
+                    uint32_t limit)
+{
+    uint32_t mask = g_admission.header->count_slots - 1;
+    uint32_t slot = hash_key(key) & mask;
+    while (table[slot].count &&
+           memcmp(table[slot].key, key, ADMISSION_KEY_LENGTH))
+        slot = (slot + 1) & mask;
+
+    if (limit && table[slot].count >= limit) return 0;
+
+    if (!table[slot].count) memcpy(table[slot].key, key, ADMISSION_KEY_LENGTH);
+    table[slot].count++;
+    return 1;
+}
+
+static void count_down(admission_count_t *table,
+                       const uint8_t key[ADMISSION_KEY_LENGTH])
+{
+    uint32_t mask = g_admission.header->count_slots - 1;
+    uint32_t slot = hash_key(key) & mask;
+    while (table[slot].count &&
+           memcmp(table[slot].key, key, ADMISSION_KEY_LENGTH))
+        slot = (slot + 1) & mask;
+
+    if (!table[slot].count || --table[slot].count) return;
+
+    /* Backward shift deletion, entries probing past the freed slot move up
+     * so that lookups never stop early */
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & mask; table[next].count;
+         next = (next + 1) & mask)
+    {
+        uint32_t home = hash_key(table[next].key) & mask;
+        int stays = hole <= next ? hole < home && home <= next
+                                 : hole < home || home <= next;
+        if (stays) continue;
+
+        table[hole] = table[next];
+        table[next].count = 0;
+        hole = next;
+    }
+}
+
+static uint32_t hash_key(const uint8_t key[ADMISSION_KEY_LENGTH])
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < ADMISSION_KEY_LENGTH; i++)
+    {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void address_key(const struct sockaddr *addr,
+                        uint8_t key[ADMISSION_KEY_LENGTH])
+{
+    memset(key, 0, ADMISSION_KEY_LENGTH);
+    if (addr->sa_family == AF_INET6)
+        memcpy(key,
+               &((const struct sockaddr_in6 *)addr)->sin6_addr,
+               ADMISSION_KEY_LENGTH);
+    else if (addr->sa_family == AF_INET)
+    {
+        /* ::ffff:a.b.c.d, as a dual stack listener would see it */
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+}
+
+static void uid_key(uint32_t uid, uint8_t key[ADMISSION_KEY_LENGTH])
+{
+    memset(key, 0, ADMISSION_KEY_LENGTH);
+    memcpy(key, &uid, sizeof(uid));
+}
+
+static void mark_owned(int32_t index, int owned)
+{
+    if (!g_admission.owned || index < 0) return;
+
+    /* Session threads admit and release concurrently */
+    uint64_t bit = 1ULL << (index % 64);
+    if (owned)
+        __sync_fetch_and_or(&g_admission.owned[index / 64], bit);
+    else
+        __sync_fetch_and_and(&g_admission.owned[index / 64], ~bit);
+}
+
+static void release_owned_admissions(void)
+{
+    if (!g_admission.owned) return;
+
+    pid_t self = getpid();
+    lock_segment();
+    for (uint32_t word = 0; word < (g_admission.header->tickets + 63) / 64;
+         word++)
+    {
+        uint64_t bits = g_admission.owned[word];
+        for (int bit = 0; bits; bit++, bits >>= 1)
+        {
+            if (!(bits & 1)) continue;
+
+            admission_ticket_t *ticket =
+                &g_admission.tickets[word * 64 + bit];
+            if (ticket->in_use && ticket->owner == self)
+                release_ticket(ticket);
+        }
+    }
+    unlock_segment();
+}
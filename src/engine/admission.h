@@ -0,0 +1,107 @@
+/*
+    Admission control shared by every process of the server.
+
+    The counters live in a POSIX shared memory segment named after the
+    control port (/dev/shm/cftp_server.<port>), created by the main process
+    before anything is forked. Every admitted connection holds a ticket in
+    it that records its source address and, once logged in, its uid. The
+    number of tickets is capped by max_connections, tickets per address by
+    max_connections_per_ip and tickets per uid by max_connections_per_user.
+    Connections over a limit get a 421 and are closed in the accept
+    callback, before anything is forked for them.
+
+    A ticket is released by the process that serves the session when the
+    session ends or the process exits, wherever the session moved to in
+    between. Tickets of a process killed by a signal are reclaimed by its
+    supervisor. The transfer buffer chunks of a session, see buffer_pool.h,
+    are counted on its ticket against transfer_chunks_total and given back
+    with it. A binary upgrade keeps the segment, so sessions of the old
+    binary still count against the limits of the new one.
+
+    The header of the segment is meant to be read by monitoring, see
+    benchmarks/admission_stats.py.
+*/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define ADMISSION_MAX_TICKETS (1u << 20) /* Caps the segment size */
+
+/* Handle of a ticket, index -1 when the connection holds none */
+typedef struct
+{
+    int32_t index;
+    uint32_t generation; /* Tells a reused ticket from a released one */
+} admission_t;
+
+#define ADMISSION_NONE ((admission_t){.index = -1, .generation = 0})
+
+/*!
+ * @brief Creates or, after an upgrade, reopens the segment. Called once in
+ * the main process before anything is forked.
+ */
+void start_admission(void);
+
+/*!
+ * @brief Admits an accepted control connection against the address list,
+ * see ip_filter.h, and the global and per address limits.
+ * @return 1 with a ticket in admission, 0 if it was refused, fd is closed
+ * then and the client got a 421 unless the address list denied it.
+ */
+int admit_connection(int fd,
+                     const struct sockaddr *addr,
+                     admission_t *admission);
+
+/*!
+ * @brief Counts the session against the limit of the user it logged in as.
+ * @return 0 if the user already has max_connections_per_user sessions.
+ */
+int admit_user(admission_t *admission, uint32_t uid);
+
+/*!
+ * @brief Counts a transfer buffer chunk on the ticket, always succeeds
+ * without one.
+ * @return 0 if transfer_chunks_total are taken.
+ */
+int admit_buffer_chunk(const admission_t *admission);
+
+/*!
+ * @brief Gives a chunk counted with admit_buffer_chunk back, nothing if the
+ * ticket was released in the meantime.
+ */
+void release_buffer_chunk(const admission_t *admission);
+
+/*!
+ * @brief Gives the ticket back, may be called from any process.
+ */
+void release_admission(admission_t *admission);
+
+/*!
+ * @brief Makes the calling process responsible for a ticket it received
+ * from another process, it is released when the process exits.
+ * @return 0 if the ticket was released in the meantime.
+ */
+int adopt_admission(admission_t *admission);
+
+/*!
+ * @brief Hands the ticket to another process and clears the local handle.
+ * @param to Receiving process, responsible until it adopts the ticket, 0
+ * if it is not known.
+ */
+void pass_admission(admission_t *admission, pid_t to);
+
+/*!
+ * @brief Forgets the tickets of the parent, called in every forked child.
+ */
+void drop_parent_admissions(void);
+
+/*!
+ * @brief Releases the tickets still held by a process that was killed.
+ */
+void reclaim_admissions(pid_t pid);
+
+#endif
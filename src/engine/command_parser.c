@@ -1,6 +1,7 @@
 #include "command_parser.h"
 
 #include <ctype.h>
+#include <event2/buffer.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,234 +18,262 @@
 #include "ftp_status_codes.h"
 #include "interprocess_handler.h"
 #include "security.h"
-#include "structures/hashmap.h"
 
 /* This must follow: https://datatracker.ietf.org/doc/html/rfc959 */
 
-static struct hash_table *command_registry = NULL;
+static cftp_command_t *read_command(connection_t *connection);
+static int read_command_line(connection_t *connection, char *line);
+static int command_may_run(connection_t *connection,
+                           const cftp_command_t *command);
+static int transfer_running(const connection_t *connection);
+static int run_pipelined_abort(connection_t *connection);
+static void limit_control_input(connection_t *connection);
 
-static int register_command(const char *command,
-                            command_execution_cb authenticated_cb,
-                            command_execution_cb non_authenticated_cb,
-                            connection_t *connection);
-inline static void parse_text_command(const char *input,
-                                      cftp_command_t *cmd_out);
-
-void execute_root_command(const char *input, struct bufferevent *bev)
+void execute_ftp_input(connection_t *connection)
 {
-    char username_buf[MAX_ARG_LEN];
+    /* The bufferevent is replaced by AUTH TLS and gone after QUIT */
+    while (connection->bev &&
+           (bufferevent_get_enabled(connection->bev) & EV_READ))
+    {
+        if (!connection->next_command &&
+            !(connection->next_command = read_command(connection)))
+            break;
 
-    cftp_command_t cmd;
-    parse_text_command(input, &cmd);
+        if (!command_may_run(connection, connection->next_command))
+        {
+            /* The parked command waits for the transfer ABOR ends */
+            if (transfer_running(connection) &&
+                run_pipelined_abort(connection))
+                continue;
+            break;
+        }
+
+        cftp_command_t *command = connection->next_command;
+        connection->next_command = NULL;
+        execute_ftp_command(command, connection);
+    }
+
+    if (connection->bev) limit_control_input(connection);
+}
 
-    if (cmd.argc != 1)
+void execute_ftp_command(cftp_command_t *cmd, connection_t *connection)
+{
+    DEBG("Got command %s with %d arguments", cmd->command, cmd->argc);
+    const command_action *action = find_command_action(cmd->verb);
+    if (action)
     {
-        ERROR("Invalid command format: %s", input);
-        write_text_response(bev, "500 Invalid UID format\r\n");
-        destroy_command(&cmd);
-        return;
+        if (connection->authenticated && connection->anonymous &&
+            action->writes)
+            send_control_message(connection,
+                                 FTP_STATUS_FILE_ACTION_NOT_TAKEN_PERM,
+                                 "Anonymous sessions are read only");
+        else if (connection->authenticated)
+            action->authenticated_cb(cmd, connection);
+        else
+            action->non_authenticated_cb(cmd, connection);
     }
+    else
+        cftp_invalid_action(cmd, connection);
+}
 
-    if (strcmp(cmd.command, "UID") == 0)
+/* The next complete command, parsed into the arena of the session, NULL
+ * until one arrived */
+static cftp_command_t *read_command(connection_t *connection)
+{
+    command_arena_t *arena = connection->command_arena;
+    if (!arena && !(arena = connection->command_arena =
+                        malloc(sizeof(command_arena_t))))
     {
-        uid_t requested_uid = 0;
+        ERROR("Out of memory reading a command of %s",
+              connection->username);
+        return NULL;
+    }
 
-        if (sscanf(cmd.args[0], "%u", &requested_uid) != 1)
-        {
-            ERROR("Invalid UID format: %s", input);
-            write_text_response(bev, "500 Invalid UID format\r\n");
-            destroy_command(&cmd);
-            return;
-        }
+    if (!read_command_line(connection, arena->line)) return NULL;
+    parse_command_line(arena->line, &arena->command);
+    return &arena->command;
+}
 
-        struct passwd *pw = getpwuid(requested_uid);
-        if (pw)
-            snprintf(username_buf, sizeof(username_buf), "%s", pw->pw_name);
-        else
-            snprintf(username_buf, sizeof(username_buf), "unknown");
+/* Copies a complete line without its line ending to line, 0 until one
+ * arrived. Lines over MAX_COMMAND_LINE_LENGTH are answered once and
+ * dropped. */
+static int read_command_line(connection_t *connection, char *line)
+{
+    struct evbuffer *input = bufferevent_get_input(connection->bev);
 
-        DEBG("[PARENT] Found username '%s'. Sending back to child.\n",
-             username_buf);
-        bufferevent_write(bev, username_buf, strlen(username_buf) + 1);
-    }
-    else if (strcmp(cmd.command, "GID") == 0)
+    for (;;)
     {
-        gid_t requested_gid = 0;
+        size_t eol_length = 0;
+        struct evbuffer_ptr eol =
+            evbuffer_search_eol(input, NULL, &eol_length, EVBUFFER_EOL_CRLF);
+        size_t length =
+            eol.pos < 0 ? evbuffer_get_length(input) : (size_t)eol.pos;
 
-        if (sscanf(cmd.args[0], "%u", &requested_gid) != 1)
+        if (connection->discarding_line || length > MAX_COMMAND_LINE_LENGTH)
         {
-            ERROR("Invalid GID format: %s", input);
-            write_text_response(bev, "500 Invalid GID format\r\n");
-            destroy_command(&cmd);
-            return;
+            if (!connection->discarding_line)
+            {
+                WARN("Dropping command line of %zu bytes or more from %s",
+                     length,
+                     connection->source_ip);
+                send_control_message(connection,
+                                     FTP_STATUS_SYNTAX_ERROR,
+                                     "Command line too long");
+            }
+
+            /* Without its end yet the rest of the line is dropped as it
+             * comes in */
+            connection->discarding_line = eol.pos < 0;
+            evbuffer_drain(input, eol.pos < 0 ? length : length + eol_length);
+            if (eol.pos < 0) return 0;
+            continue;
         }
 
-        struct group *grp = getgrgid(requested_gid);
-        if (grp)
-            snprintf(username_buf, sizeof(username_buf), "%s", grp->gr_name);
-        else
-            snprintf(username_buf, sizeof(username_buf), "unknown");
+        if (eol.pos < 0) return 0;
 
-        DEBG("[PARENT] Found username '%s'. Sending back to child.\n",
-             username_buf);
-        bufferevent_write(bev, username_buf, strlen(username_buf) + 1);
+        evbuffer_remove(input, line, length);
+        line[length] = '\0';
+        evbuffer_drain(input, eol_length);
+        return 1;
     }
+}
+
+/* Pipelined commands keep their order with the replies and transfers of
+ * those before them */
+static int command_may_run(connection_t *connection,
+                           const cftp_command_t *command)
+{
+    if (transfer_running(connection)) return command->verb == VERB_ABOR;
+    if (connection->control_write_cb) return 0;
 
-    destroy_command(&cmd);
+    /* Until the client connected to PASV, or the listener timed out */
+    const command_action *action = find_command_action(command->verb);
+    return !(action && action->transfers && connection->authenticated &&
+             connection->pasv_listener && !connection->data_bev);
 }
 
-void execute_ftp_command(const char *input, connection_t *connection)
+static int transfer_running(const connection_t *connection)
 {
-    /*  Parse the command and parameters */
-    cftp_command_t cmd;
-    parse_text_command(input, &cmd);
-
-    DEBG("Got command %s", input);
-    command_cb *command_cb =
-        get_ptr_to_value_by_key(command_registry, cmd.command);
-    if (command_cb)
+    return connection->data_read_cb || connection->data_write_cb ||
+           connection->data_tls_event_connected_cb ||
+           connection->data_eof_event_cb || connection->data_stream ||
+           connection->upload_fd >= 0 || connection->list_job;
+}
+
+/* Takes the first ABOR line out of the unread input and runs it, 0 if there
+ * is none. The lines around it keep their order. */
+static int run_pipelined_abort(connection_t *connection)
+{
+    struct evbuffer *input = bufferevent_get_input(connection->bev);
+    struct evbuffer_ptr start;
+    evbuffer_ptr_set(input, &start, 0, EVBUFFER_PTR_SET);
+
+    /* The rest of an overlong line is no command of its own */
+    int skip = connection->discarding_line;
+    for (;;)
     {
-        if (connection->authenticated)
-            command_cb->authenticated_cb(&cmd, connection);
-        else
-            command_cb->non_authenticated_cb(&cmd, connection);
-    }
-    else
-        cftp_invalid_action(&cmd, connection);
+        size_t eol_length = 0;
+        struct evbuffer_ptr eol =
+            evbuffer_search_eol(input, &start, &eol_length, EVBUFFER_EOL_CRLF);
+        if (eol.pos < 0) return 0;
+
+        size_t length = (size_t)(eol.pos - start.pos);
+        if (!skip && length < MAX_ABORT_LINE_LENGTH)
+        {
+            char line[MAX_ABORT_LINE_LENGTH];
+            cftp_command_t command;
+            evbuffer_copyout_from(input, &start, line, length);
+            line[length] = '\0';
+            parse_command_line(line, &command);
+
+            struct evbuffer *before;
+            if (command.verb == VERB_ABOR && (before = evbuffer_new()))
+            {
+                evbuffer_remove_buffer(input, before, (size_t)start.pos);
+                evbuffer_drain(input, length + eol_length);
+                evbuffer_prepend_buffer(input, before);
+                evbuffer_free(before);
+
+                DEBG("Running ABOR ahead of %s",
+                     connection->next_command->command);
+                execute_ftp_command(&command, connection);
+                return 1;
+            }
+        }
 
-    destroy_command(&cmd);
+        skip = 0;
+        evbuffer_ptr_set(
+            input, &start, (size_t)eol.pos + eol_length, EVBUFFER_PTR_SET);
+    }
 }
 
-inline static void parse_text_command(const char *input,
-                                      cftp_command_t *cmd_out)
+/* Input is read further while a transfer runs, an ABOR may follow the
+ * commands waiting for it */
+static void limit_control_input(connection_t *connection)
 {
-    memset(cmd_out, 0, sizeof(*cmd_out));
+    bufferevent_setwatermark(connection->bev,
+                             EV_READ,
+                             0,
+                             transfer_running(connection)
+                                 ? MAX_TRANSFER_INPUT
+                                 : MAX_PIPELINED_INPUT);
+}
 
+void parse_command_line(char *line, cftp_command_t *command)
+{
+    const char *input = line;
     while (isspace((unsigned char)*input)) input++;
 
     size_t i = 0;
+    uint32_t verb = 0;
     while (*input && !isspace((unsigned char)*input) &&
-           i < sizeof(cmd_out->command) - 1)
+           i < sizeof(command->command) - 1)
     {
-        cmd_out->command[i++] = toupper((unsigned char)*input++);
+        command->command[i] = toupper((unsigned char)*input++);
+        verb = verb << 8 | (unsigned char)command->command[i++];
     }
-    cmd_out->command[i] = '\0';
+    command->command[i] = '\0';
+    command->verb = i == 0 || i > 4 ? 0 : verb << 8 * (4 - i);
 
     while (isspace((unsigned char)*input)) input++;
 
+    /* Arguments are written over the line from its start, behind what was
+     * read of it. The verb and its blank put reading two bytes ahead, only
+     * cutting an argument at MAX_ARG_LEN, which a line fits once, takes one
+     * of them back. */
+    char *output = line;
     int argc = 0;
     while (*input && argc < MAX_ARGS)
     {
-        while (isspace((unsigned char)*input)) input++;
-
-        if (*input == '\0') break;
-
-        char *arg = malloc(MAX_ARG_LEN);
-        if (!arg) break;
-
+        char *arg = output;
         size_t j = 0;
         bool in_quotes = false;
 
         while (*input && j < MAX_ARG_LEN - 1)
         {
-            if (*input == '"' && !in_quotes)
+            if (*input == '"')
             {
-                in_quotes = true;
+                in_quotes = !in_quotes;
                 input++;
-                continue;
-            }
-            else if (*input == '"' && in_quotes)
-            {
-                in_quotes = false;
-                input++;
-                continue;
             }
             else if (!in_quotes && isspace((unsigned char)*input))
-            {
                 break;
-            }
             else if (*input == '\\' && input[1] != '\0')
             {
                 arg[j++] = input[1];
                 input += 2;
             }
             else
-            {
                 arg[j++] = *input++;
-            }
         }
 
         arg[j] = '\0';
-        cmd_out->args[argc++] = arg;
+        output = arg + j + 1;
+        command->args[argc++] = arg;
 
         while (isspace((unsigned char)*input)) input++;
     }
 
-    cmd_out->argc = argc;
-    cmd_out->args[argc] = NULL;
-}
-
-void destroy_command(cftp_command_t *command)
-{
-    for (int i = 0; i < command->argc; ++i) free(command->args[i]);
-}
-
-// inline static void parse_text_command(const char *input,
-//                                       char *command_out,
-//                                       size_t cmd_size,
-//                                       char *params_out,
-//                                       size_t param_size)
-// {
-//     while (isspace((unsigned char)*input)) input++;
-
-//     size_t i = 0;
-//     while (*input && !isspace((unsigned char)*input) && i < cmd_size - 1)
-//     {
-//         command_out[i++] = toupper((unsigned char)*input++);
-//     }
-//     command_out[i] = '\0';
-
-//     while (isspace((unsigned char)*input)) input++;
-
-//     strncpy(params_out, input, param_size - 1);
-//     params_out[param_size - 1] = '\0';
-
-//     /*  Trim trailing whitespace from params */
-//     size_t len = strlen(params_out);
-//     while (len > 0 && isspace((unsigned char)params_out[len - 1]))
-//         params_out[--len] = '\0';
-// }
-
-static int register_command(const char *command,
-                            command_execution_cb authenticated_cb,
-                            command_execution_cb non_authenticated_cb,
-                            connection_t *connection)
-{
-    command_cb *cmd_cbs = (command_cb *)malloc(sizeof(command_cb));
-    cmd_cbs->connection = connection;
-    cmd_cbs->authenticated_cb = authenticated_cb;
-    cmd_cbs->non_authenticated_cb = non_authenticated_cb;
-    return insert_entry(command_registry, command, cmd_cbs);
-}
-
-void initialize_execution_engine(connection_t *connection)
-{
-    command_registry = create_hash_table();
-
-    for (size_t i = 0; i < sizeof(command_actions) / sizeof(command_action);
-         i++)
-    {
-        if (!register_command(command_actions[i].action,
-                              command_actions[i].authenticated_cb,
-                              command_actions[i].non_authenticated_cb,
-                              connection))
-        {
-            ERROR("Critical error occurred while registering commands");
-            exit(-1);
-        }
-        else
-            DEBG("Registered command %s", command_actions[i].action);
-    }
-
-    DEBG("Done registering commands !");
+    command->argc = argc;
+    command->args[argc] = NULL;
 }
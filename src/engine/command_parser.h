@@ -2,35 +2,69 @@
 #define COMMAND_PARSER_H
 
 #include <event2/bufferevent.h>
+#include <stdint.h>
 
 #include "connection.h"
 
 #define MAX_ARGS 256
 #define MAX_ARG_LEN 4096
 #define MAX_COMMAND_LENGTH 4096
+#define MAX_COMMAND_LINE_LENGTH (MAX_ARG_LEN + 8) /* A verb and a path */
+#define MAX_PIPELINED_INPUT \
+    (4 * MAX_COMMAND_LINE_LENGTH) /* Read no further until commands ran */
+#define MAX_TRANSFER_INPUT \
+    (2 * MAX_PIPELINED_INPUT) /* The same during a transfer, see ABOR */
+#define MAX_ABORT_LINE_LENGTH 32 /* Longer lines are no ABOR */
+#define MAX_VERB_LENGTH 16          /* Longer verbs are cut, none is known */
 
-typedef struct
+/* Verbs of up to four letters packed into the key commands are looked up
+ * by, shorter ones padded with 0 */
+#define CFTP_VERB(a, b, c, d)                                  \
+    ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | \
+     (uint32_t)(d))
+
+typedef struct cftp_command
 {
-    char command[MAX_ARG_LEN];
-    char *args[MAX_ARGS + 1];
+    char command[MAX_VERB_LENGTH]; /* Upper case */
+    uint32_t verb;                 /* CFTP_VERB of command, 0 if longer */
+    char *args[MAX_ARGS + 1];      /* Into the parsed line, NULL terminated */
     int argc;
 } cftp_command_t;
 
+/* Where a session's commands are read and parsed, allocated with its first
+ * one and reused for every further */
+typedef struct command_arena
+{
+    char line[MAX_COMMAND_LINE_LENGTH + 1];
+    cftp_command_t command;
+} command_arena_t;
+
 typedef void (*command_execution_cb)(cftp_command_t *command,
                                      connection_t *connection);
 
-typedef struct
-{
-    connection_t *connection;
-    command_execution_cb authenticated_cb; /* Callback to executed if user is
-                                              successfully authenticated*/
-    command_execution_cb non_authenticated_cb; /* Callback to executed if user
-                                                  is not authenticated */
-} command_cb;
-
-void execute_ftp_command(const char *input, connection_t *connection);
-void execute_root_command(const char *input, struct bufferevent *bev);
-void destroy_command(cftp_command_t *command);
-void initialize_execution_engine(connection_t *connection);
+/*!
+ * @brief Runs the complete command lines of the control input in order,
+ * several may come in one read. Called whenever input arrives and by
+ * resume_control_input.
+ * @details The next line waits while reading is disabled, a reply has a
+ * control_write_cb pending or a transfer runs, and a transfer command also
+ * while its passive data connection is not there yet. ABOR is run during a
+ * transfer, ahead of the lines waiting for it. Reading goes on up to
+ * MAX_TRANSFER_INPUT then, so an ABOR behind pipelined commands arrives.
+ */
+void execute_ftp_input(connection_t *connection);
+
+/*!
+ * @brief Runs a parsed command, whatever the state of the session.
+ */
+void execute_ftp_command(cftp_command_t *command, connection_t *connection);
+
+/*!
+ * @brief Splits line into its verb and arguments. Quotes group blanks into
+ * an argument and a backslash takes the next byte as it is.
+ * @details The arguments are written over line and point into it, so they
+ * last as long as it does. Nothing is allocated.
+ */
+void parse_command_line(char *line, cftp_command_t *command);
 
 #endif
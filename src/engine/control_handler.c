@@ -13,13 +13,24 @@
 #include "command_parser.h"
 #include "error.h"
 #include "ftp_status_codes.h"
+#include "hibernate.h"
 #include "interprocess_handler.h"
 #include "server_state.h"
 
+#define ORPHAN_CHECK_INTERVAL 1 /* Seconds between idle checks */
+
 extern server_state_t g_server_state;
 
 static void on_event(struct bufferevent *bev, short events, void *ctx);
 static void on_write(struct bufferevent *bev, void *ctx);
+static void leave_when_idle(evutil_socket_t fd, short what, void *arg);
+static void queue_reply_line(connection_t *connection,
+                             uint32_t status_code,
+                             char separator,
+                             const char *text);
+static struct evbuffer *reply_queue(connection_t *connection);
+static void on_reply_flush(evutil_socket_t fd, short what, void *arg);
+static void format_status_code(char *out, uint32_t status_code, char separator);
 
 static void on_event(struct bufferevent *bev, short events, void *ctx)
 {
@@ -45,23 +56,17 @@ static void on_write(struct bufferevent *bev, void *ctx)
     if (!bev || !ctx) return;
 
     connection_t *connection = (connection_t *)ctx;
+    if (!connection->control_write_cb) return;
 
-    if (connection->control_write_cb) connection->control_write_cb(bev, ctx);
-
+    connection->control_write_cb(bev, ctx);
     connection->control_write_cb = NULL;
+
+    /* Pipelined commands waited for this reply to go out */
+    if (connection->bev) resume_control_input(connection);
 }
 
-void start_control_connection_loop(evutil_socket_t fd,
-                                   connection_t *connection,
-                                   int pipe)
+void setup_control_connection(evutil_socket_t fd, connection_t *connection)
 {
-    if (!connection)
-    {
-        ERROR("Connection object is NULL !");
-        return;
-    }
-
-    connection->base = event_base_new();
     connection->fd = fd;
 
     struct bufferevent *bev = bufferevent_socket_new(
@@ -75,11 +80,6 @@ void start_control_connection_loop(evutil_socket_t fd,
 
     connection->bev = bev;
 
-    /* Setup kill switch */
-    struct event *parent_kill_event = event_new(
-        connection->base, pipe, EV_READ | EV_PERSIST, on_parent_dead, NULL);
-    event_add(parent_kill_event, NULL);
-
     /* Setup authentication timeout */
     struct timeval timeout = {g_server_state.config.connection_accept_timeout,
                               0};
@@ -87,13 +87,38 @@ void start_control_connection_loop(evutil_socket_t fd,
         evtimer_new(connection->base, terminate_process_on_timeout, connection);
     evtimer_add(connection->timeout_event, &timeout);
 
-    initialize_execution_engine(connection);
-
     send_control_message(
         connection, FTP_STATUS_SERVICE_READY, "Welcome to CFTP Server");
 
     bufferevent_setcb(bev, on_read, on_write, on_event, connection);
+    bufferevent_setwatermark(bev, EV_READ, 0, MAX_PIPELINED_INPUT);
     bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+void start_control_connection_loop(evutil_socket_t fd,
+                                   connection_t *connection,
+                                   int pipe)
+{
+    if (!connection)
+    {
+        ERROR("Connection object is NULL !");
+        return;
+    }
+
+    connection->base = event_base_new();
+    open_session_channel(connection);
+
+    /* Setup kill switch */
+    connection->kill_event = event_new(connection->base,
+                                       pipe,
+                                       EV_READ | EV_PERSIST,
+                                       on_parent_dead,
+                                       connection);
+    event_add(connection->kill_event, NULL);
+
+    setup_control_connection(fd, connection);
+    if (!connection->bev) exit(1);
+    arm_idle_hibernation(connection);
 
     event_base_dispatch(connection->base);
     event_base_free(connection->base);
@@ -104,6 +129,86 @@ void start_control_connection_loop(evutil_socket_t fd,
     exit(0);
 }
 
+void setup_logged_in_connection(connection_t *connection, int announce_login)
+{
+    /* Belonged to the pre-auth loop */
+    connection->timeout_event = NULL;
+    connection->reply_event = NULL;
+
+    /* Set if forked from the pre-auth loop, its input may hold commands
+     * pipelined after PASS */
+    struct bufferevent *previous = connection->bev;
+
+    struct bufferevent *bev;
+    if (connection->upgraded_to_tls)
+    {
+        /* The TLS session came along with the fork, only its transport moves
+         * from the pre-auth filter chain to the socket itself */
+        BIO *bio = BIO_new_socket(connection->fd, BIO_NOCLOSE);
+        SSL_set_bio(connection->ssl, bio, bio);
+        bev = bufferevent_openssl_socket_new(
+            connection->base,
+            connection->fd,
+            connection->ssl,
+            BUFFEREVENT_SSL_OPEN,
+            BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    }
+    else
+        bev = bufferevent_socket_new(
+            connection->base,
+            connection->fd,
+            BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+
+    if (!bev)
+    {
+        ERROR("An error occurred while creating bufferevent object !");
+        return;
+    }
+
+    /* Input of a bufferevent only grows at the front from outside */
+    if (previous)
+        evbuffer_prepend_buffer(bufferevent_get_input(bev),
+                                bufferevent_get_input(previous));
+
+    connection->bev = bev;
+    connection->authenticated = 1;
+    if (announce_login)
+        send_control_message(
+            connection, FTP_STATUS_USER_LOGGED_IN, "User logged in");
+
+    bufferevent_setcb(bev, on_read, on_write, on_event, connection);
+    bufferevent_setwatermark(bev, EV_READ, 0, MAX_PIPELINED_INPUT);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    resume_control_input(connection);
+}
+
+void resume_control_connection_loop(connection_t *connection,
+                                    int pipe,
+                                    int announce_login)
+{
+    connection->base = event_base_new();
+    open_session_channel(connection);
+
+    setup_logged_in_connection(connection, announce_login);
+    if (!connection->bev) exit(1);
+
+    /* Setup kill switch */
+    connection->kill_event = event_new(connection->base,
+                                       pipe,
+                                       EV_READ | EV_PERSIST,
+                                       on_parent_dead,
+                                       connection);
+    event_add(connection->kill_event, NULL);
+
+    arm_idle_hibernation(connection);
+
+    event_base_dispatch(connection->base);
+    event_base_free(connection->base);
+    free(connection);
+
+    exit(0);
+}
+
 void upgrade_to_tls(connection_t *connection)
 {
     if (!connection)
@@ -115,9 +220,21 @@ void upgrade_to_tls(connection_t *connection)
     /*  Create new SSL object */
     send_control_message(
         connection, FTP_STATUS_AUTH_TLS_OK, "AUTH TLS Success");
+    flush_control_replies(connection); /* Still in plaintext */
 
     connection->ssl = SSL_new(connection->ssl_ctx);
 
+    /* Plaintext sent along with AUTH TLS must not pass for commands sent
+     * over TLS, nor reach the handshake */
+    struct evbuffer *plaintext = bufferevent_get_input(connection->bev);
+    if (evbuffer_get_length(plaintext))
+    {
+        WARN("Dropping %zu bytes sent after AUTH TLS by %s",
+             evbuffer_get_length(plaintext),
+             connection->source_ip);
+        evbuffer_drain(plaintext, evbuffer_get_length(plaintext));
+    }
+
     /* This old bufferevent must be disabled then only filter will apply */
     bufferevent_disable(connection->bev, EV_READ | EV_WRITE);
 
@@ -133,16 +250,20 @@ void upgrade_to_tls(connection_t *connection)
 
     connection->bev = bev_ssl;
     bufferevent_setcb(connection->bev, on_read, on_write, on_event, connection);
+    bufferevent_setwatermark(
+        connection->bev, EV_READ, 0, MAX_PIPELINED_INPUT);
     bufferevent_enable(connection->bev, EV_READ | EV_WRITE);
     connection->upgraded_to_tls = 1;
 }
 
-void write_text_response(struct bufferevent *bev, const char *text)
+void resume_control_input(connection_t *connection)
 {
-    if (bev)
-        bufferevent_write(bev, text, strlen(text));
-    else
-        ERROR("Connection buffer event is NULL");
+    /* No new input may come for the commands already read */
+    if (connection->bev &&
+        (connection->next_command ||
+         evbuffer_get_length(bufferevent_get_input(connection->bev))))
+        bufferevent_trigger(
+            connection->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
 }
 
 void send_control_message(connection_t *connection,
@@ -155,14 +276,143 @@ void send_control_message(connection_t *connection,
         return;
     }
 
-    char buffer[MAX_RESPONSE_BUFFER_LENGTH];
+    queue_reply_line(connection, status_code, ' ', text);
+}
+
+void send_control_lines(connection_t *connection,
+                        uint32_t status_code,
+                        const char *const *lines,
+                        size_t count)
+{
+    if (!connection || !connection->bev)
+    {
+        ERROR("Got invalid connection while sending a control message !");
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        queue_reply_line(connection,
+                         i == 0 || i == count - 1 ? status_code : 0,
+                         i == count - 1 ? ' ' : '-',
+                         lines[i]);
+}
+
+void flush_control_replies(connection_t *connection)
+{
+    if (connection->bev && connection->replies &&
+        evbuffer_get_length(connection->replies))
+        bufferevent_write_buffer(connection->bev, connection->replies);
+}
+
+/* Appends "code text\r\n" in place, status_code 0 leaves the code out */
+static void queue_reply_line(connection_t *connection,
+                             uint32_t status_code,
+                             char separator,
+                             const char *text)
+{
+    struct evbuffer *replies = reply_queue(connection);
+    size_t length = strlen(text);
+    size_t size = (status_code ? 4 : 0) + length + 2;
+
+    struct evbuffer_iovec space;
+    if (!replies || evbuffer_reserve_space(replies, size, &space, 1) < 1)
+    {
+        /* Out of memory, written on its own after what was queued */
+        flush_control_replies(connection);
+        char code[4];
+        if (status_code)
+        {
+            format_status_code(code, status_code, separator);
+            bufferevent_write(connection->bev, code, sizeof(code));
+        }
+        bufferevent_write(connection->bev, text, length);
+        bufferevent_write(connection->bev, "\r\n", 2);
+        return;
+    }
+
+    char *line = (char *)space.iov_base;
     if (status_code)
-        snprintf(
-            buffer, sizeof(buffer), "%" PRIu32 " %s\r\n", status_code, text);
-    else
-        snprintf(buffer, sizeof(buffer), "%s\r\n", text);
+    {
+        format_status_code(line, status_code, separator);
+        line += 4;
+    }
+    memcpy(line, text, length);
+    memcpy(line + length, "\r\n", 2);
+
+    space.iov_len = size;
+    evbuffer_commit_space(replies, &space, 1);
+}
+
+/* Queue of connection with its flush armed, activating an active event
+ * again does nothing */
+static struct evbuffer *reply_queue(connection_t *connection)
+{
+    if (!connection->replies) connection->replies = evbuffer_new();
+    if (!connection->reply_event)
+        connection->reply_event = event_new(
+            connection->base, -1, 0, on_reply_flush, connection);
+    if (!connection->replies || !connection->reply_event) return NULL;
+
+    event_active(connection->reply_event, EV_WRITE, 0);
+    return connection->replies;
+}
 
-    bufferevent_write(connection->bev, buffer, strnlen(buffer, sizeof(buffer)));
+static void on_reply_flush(evutil_socket_t fd __attribute__((unused)),
+                           short what __attribute__((unused)),
+                           void *arg)
+{
+    flush_control_replies((connection_t *)arg);
+}
+
+/* The three digits of status_code and separator, without a terminator */
+static void format_status_code(char *out, uint32_t status_code, char separator)
+{
+    out[0] = (char)('0' + status_code / 100 % 10);
+    out[1] = (char)('0' + status_code / 10 % 10);
+    out[2] = (char)('0' + status_code % 10);
+    out[3] = separator;
+}
+
+void orphan_session(connection_t *connection)
+{
+    INFO("Session of %s from %s orphaned, leaving once idle",
+         connection->username[0] ? connection->username : "-",
+         connection->source_ip);
+
+    /* Hibernating would hand the session to a parent that is going away */
+    if (connection->idle_event)
+    {
+        event_free(connection->idle_event);
+        connection->idle_event = NULL;
+    }
+
+    struct timeval interval = {ORPHAN_CHECK_INTERVAL, 0};
+    connection->orphan_event = event_new(
+        connection->base, -1, EV_PERSIST, leave_when_idle, connection);
+    event_add(connection->orphan_event, &interval);
+    leave_when_idle(-1, EV_TIMEOUT, connection);
+}
+
+static void leave_when_idle(evutil_socket_t fd __attribute__((unused)),
+                            short what __attribute__((unused)),
+                            void *arg)
+{
+    connection_t *connection = (connection_t *)arg;
+    if (!connection->bev) return; /* Already closing */
+
+    int busy = connection->data_bev || connection->pasv_listener ||
+               connection->data_active || connection->upload_fd >= 0 ||
+               connection->control_write_cb || connection->auth_pending ||
+               evbuffer_get_length(bufferevent_get_output(connection->bev));
+    if (busy) return;
+
+    event_free(connection->orphan_event);
+    connection->orphan_event = NULL;
+
+    connection->control_write_cb = disable_connection_cb;
+    send_control_message(connection,
+                         FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                         "Server restarting, please reconnect");
 }
 
 void terminate_process_on_timeout(evutil_socket_t fd __attribute__((unused)),
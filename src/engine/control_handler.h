@@ -6,8 +6,6 @@
 
 #include "connection.h"
 
-#define MAX_RESPONSE_BUFFER_LENGTH 0x100
-
 /*!
  * @brief This method handles control connection and is called from accept
  * callback.
@@ -18,6 +16,37 @@ void start_control_connection_loop(evutil_socket_t fd,
                                    connection_t *connection,
                                    int pipe);
 
+/*!
+ * @brief Starts a session on connection->base without running the loop.
+ * @details Creates the control bufferevent, arms the authentication timeout
+ * and greets the client. Used by the session threads where many sessions
+ * share one loop, connection->bev stays NULL if setup failed.
+ */
+void setup_control_connection(evutil_socket_t fd, connection_t *connection);
+
+/*!
+ * @brief Continues a logged in session on connection->base without running
+ * the loop.
+ * @details The control socket and TLS state are taken over from the
+ * connection object, connection->bev stays NULL if setup failed.
+ * @param announce_login Send the 230 reply to the PASS that logged the
+ * session in on the pre-auth loop.
+ */
+void setup_logged_in_connection(connection_t *connection, int announce_login);
+
+/*!
+ * @brief Continues a logged in session in a freshly forked session process,
+ * never returns.
+ * @details The process must already run as the user. The control socket and
+ * TLS state are taken over from the connection object.
+ * @param announce_login Send the 230 reply to the PASS that logged the
+ * session in on the pre-auth loop, unset when a hibernated session resumes.
+ */
+void resume_control_connection_loop(connection_t *connection,
+                                    int pipe,
+                                    int announce_login)
+    __attribute__((noreturn));
+
 /*!
  * @brief Control function to upgrade to TLS channel on demand.
  * @param connection The connection object which has to be upgraded.
@@ -25,22 +54,49 @@ void start_control_connection_loop(evutil_socket_t fd,
 void upgrade_to_tls(connection_t *connection);
 
 /*!
- * @brief Write a text response to connection.
- * @param bev Bufferevent object.
- * @param text Text message.
- * @deprecated This method is deprecated. Instead use send_control_message.
+ * @brief Runs the commands that were read ahead, once what they waited for
+ * is done, see execute_ftp_input. Reading paused with bufferevent_disable
+ * has to be enabled first.
  */
-void write_text_response(struct bufferevent *bev, const char *text);
+void resume_control_input(connection_t *connection);
 
 /*!
  * @brief Sends a control message to client via control channel.
  * @param bev Bufferevent object.
- * @param status_code FTP response status code.
+ * @param status_code FTP response status code, 0 to send text as it is.
  * @param text The actual text message.
  * @details Takes care of appending CRLF to the response message endings.
+ * Replies are queued and written together once the current loop iteration
+ * ran its callbacks, so the replies to pipelined commands leave in one
+ * write and, with TLS, one record.
  */
 void send_control_message(connection_t *connection,
                           uint32_t status_code,
                           const char *text);
+
+/*!
+ * @brief Sends a multi-line reply, "code-" before the first line and "code "
+ * before the last one, the lines between as they are. These must not start
+ * with a digit, RFC 2389 features start with a space.
+ */
+void send_control_lines(connection_t *connection,
+                        uint32_t status_code,
+                        const char *const *lines,
+                        size_t count);
+
+/*!
+ * @brief Writes the queued replies to the control connection right away,
+ * e.g. before its bufferevent is replaced.
+ */
+void flush_control_replies(connection_t *connection);
+
+/*!
+ * @brief Lets a session process go on without its parent, e.g. after a
+ * binary upgrade took over the listener.
+ * @details A running transfer completes, then the client is told to
+ * reconnect with a 421 and the session ends.
+ */
+void orphan_session(connection_t *connection);
+
 void terminate_process_on_timeout(evutil_socket_t fd, short what, void *arg);
 #endif
@@ -3,12 +3,15 @@
 #include <arpa/inet.h>
 #include <event2/buffer.h>
 #include <openssl/err.h>
+#include <openssl/ssl.h>
 #include <unistd.h>
 
+#include "command_actions.h"
 #include "control_handler.h"
 #include "error.h"
 #include "ftp_status_codes.h"
 #include "server_state.h"
+#include "session_fs.h"
 
 extern server_state_t g_server_state;
 
@@ -21,6 +24,8 @@ static void data_connection_event_cb(struct bufferevent *bev,
                                      short events,
                                      void *ctx);
 static void kill_listener_on_timeout(evutil_socket_t fd, short what, void *arg);
+static void enable_ktls(SSL *ssl);
+static int ktls_receive(const connection_t *connection);
 
 void data_connection_accept_cb(struct evconnlistener *listener,
                                evutil_socket_t fd,
@@ -65,6 +70,8 @@ void data_connection_accept_cb(struct evconnlistener *listener,
     {
         DEBG("Got encrypted data for %s !", connection->username);
         connection->data_ssl = SSL_new(connection->ssl_ctx);
+        if (connection->data_ssl && g_server_state.config.data_ktls)
+            enable_ktls(connection->data_ssl);
         connection->data_bev = bufferevent_openssl_socket_new(
             base,
             fd,
@@ -90,10 +97,17 @@ void data_connection_accept_cb(struct evconnlistener *listener,
     if (!connection->data_tls_required)
         __sync_add_and_fetch_8(&connection->data_active, 1);
 
-    evtimer_del(connection->timeout_event);
-    event_free(connection->timeout_event);
+    if (connection->timeout_event)
+    {
+        evtimer_del(connection->timeout_event);
+        event_free(connection->timeout_event);
+        connection->timeout_event = NULL;
+    }
 
     DEBG("Data connection established on fd %d", fd);
+
+    /* A transfer command may have come before the client connected */
+    resume_control_input(connection);
 }
 
 void data_connection_listener_config(connection_t *connection, int extended)
@@ -154,6 +168,7 @@ void data_connection_listener_config(connection_t *connection, int extended)
         }
 
         /* Start a timer */
+        if (connection->timeout_event) event_free(connection->timeout_event);
         struct timeval timeout = {
             g_server_state.config.data_connection_accept_timeout, 0};
         connection->timeout_event =
@@ -214,6 +229,7 @@ static void data_connection_read_cb(struct bufferevent *bev, void *ctx)
         return;
     }
 
+    session_fs_enter(connection);
     if (connection->data_read_cb) connection->data_read_cb(bev, ctx);
 }
 
@@ -226,6 +242,7 @@ static void data_connection_write_cb(struct bufferevent *bev, void *ctx)
         return;
     }
 
+    session_fs_enter(connection);
     if (connection->data_write_cb) connection->data_write_cb(bev, ctx);
 }
 
@@ -240,6 +257,8 @@ static void data_connection_event_cb(struct bufferevent *bev,
         return;
     }
 
+    session_fs_enter(connection);
+
     /* Multiple events can occur together */
     DEBG("Data event occurred: %" PRId16, events);
 
@@ -255,6 +274,13 @@ static void data_connection_event_cb(struct bufferevent *bev,
         {
             DEBG("TLS Handshake successful for %s data connection",
                  connection->username);
+            if (g_server_state.config.data_ktls)
+                DEBG("kTLS for %s data connection with %s: send %s, "
+                     "receive %s",
+                     connection->username,
+                     SSL_get_cipher_name(connection->data_ssl),
+                     data_connection_ktls_send(connection) ? "on" : "off",
+                     ktls_receive(connection) ? "on" : "off");
             bufferevent_enable(
                 bev, EV_READ | EV_WRITE); /* Should be disabled earlier */
 
@@ -322,6 +348,14 @@ static void data_connection_event_cb(struct bufferevent *bev,
 
 void close_data_connection(connection_t *connection)
 {
+    free_list_job(connection);
+
+    if (connection->sendfile_event)
+    {
+        event_free(connection->sendfile_event);
+        connection->sendfile_event = NULL;
+    }
+
     if (!connection->data_bev)
     {
         ERROR("close called on already invalid data bev !");
@@ -333,6 +367,7 @@ void close_data_connection(connection_t *connection)
         connection->data_write_cb = NULL;
         connection->data_active = 0;
         connection->upload_fd = -1;
+        resume_control_input(connection);
         return;
     }
 
@@ -349,15 +384,17 @@ void close_data_connection(connection_t *connection)
     connection->data_read_cb = NULL;
     connection->data_write_cb = NULL;
     connection->data_active = 0;
+
+    /* Unfinished transfers, a session process would only drop these on exit */
+    if (connection->upload_fd >= 0) close(connection->upload_fd);
     connection->upload_fd = -1;
 
-    if (connection->data_stream)
-    {
-        free(connection->data_stream);
-        connection->data_stream = NULL;
-    }
+    free_file_stream(connection);
 
     DEBG("Data connection closed for %s", connection->username);
+
+    /* Commands pipelined behind the transfer */
+    resume_control_input(connection);
 }
 
 static void kill_listener_on_timeout(evutil_socket_t fd __attribute__((unused)),
@@ -375,4 +412,42 @@ static void kill_listener_on_timeout(evutil_socket_t fd __attribute__((unused)),
             "listener for %s!",
             connection->username);
     }
+
+    /* A parked transfer command runs now and finds no data connection */
+    resume_control_input(connection);
+}
+
+int data_connection_ktls_send(const connection_t *connection)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return connection->data_ssl &&
+           BIO_get_ktls_send(SSL_get_wbio(connection->data_ssl));
+#else
+    (void)connection;
+    return 0;
+#endif
+}
+
+static int ktls_receive(const connection_t *connection)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return connection->data_ssl &&
+           BIO_get_ktls_recv(SSL_get_rbio(connection->data_ssl));
+#else
+    (void)connection;
+    return 0;
+#endif
+}
+
+static void enable_ktls(SSL *ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    /* OpenSSL hands the keys to the kernel after the handshake if the tls
+     * module takes the cipher, AES-GCM for TLS 1.2 and any TLS 1.3 suite
+     * but AES-CCM, otherwise the connection stays in user space */
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_set_cipher_list(ssl, "ECDHE+AESGCM:ECDHE+CHACHA20:DEFAULT");
+#else
+    (void)ssl;
+#endif
 }
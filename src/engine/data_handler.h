@@ -27,4 +27,11 @@ void data_connection_listener_config(connection_t *connection, int extended);
 
 void close_data_connection(connection_t *connection);
 
+/*!
+ * @brief Whether the kernel encrypts what is sent on the TLS data
+ * connection, so that SSL_sendfile works on it. Known once the handshake
+ * is done, always 0 without data_ktls.
+ */
+int data_connection_ktls_send(const connection_t *connection);
+
 #endif
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE /* struct ucred */
+
+#include "hibernate.h"
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "auth.h"
+#include "control_handler.h"
+#include "error.h"
+#include "interprocess_handler.h"
+#include "name_snapshot.h"
+#include "preauth.h"
+#include "server_state.h"
+#include "session_fs.h"
+#include "session_placement.h"
+#include "session_supervisor.h"
+
+extern server_state_t g_server_state;
+
+/* What a hibernating session sends along with its control socket, cwd is
+ * cut to its actual length on the wire */
+typedef struct
+{
+    char username[256];
+    uint32_t uid;
+    uint32_t gid;
+    transfer_mode_t transfer_mode;
+    int data_tls_required;
+    char source_ip[INET6_ADDRSTRLEN];
+    admission_t admission;
+    char cwd[PATH_MAX];
+} hibernated_state_t;
+
+/* Kept by the accepting process per hibernated session */
+typedef struct
+{
+    evutil_socket_t fd;
+    struct event *wake_event;
+    char username[256];
+    uint32_t uid;
+    uint32_t gid;
+    transfer_mode_t transfer_mode;
+    int data_tls_required;
+    char source_ip[INET6_ADDRSTRLEN];
+    admission_t admission;
+    char cwd[];
+} hibernated_session_t;
+
+typedef struct
+{
+    int channel[2]; /* Session processes write, accepting process reads */
+    struct event *channel_event;
+
+    unsigned long sleeping;
+    unsigned long hibernations;
+    unsigned long resumes;
+} hibernate_state_t;
+
+static hibernate_state_t g_hibernate = {.channel = {-1, -1}};
+
+static void hibernate_session(evutil_socket_t fd, short what, void *arg);
+static int send_session(connection_t *connection);
+static void on_hibernated_session(evutil_socket_t fd, short what, void *ctx);
+static void keep_session(const hibernated_state_t *state,
+                         size_t length,
+                         evutil_socket_t fd);
+static void on_session_wakeup(evutil_socket_t fd, short what, void *arg);
+static void on_session_identity(const user_identity_t *identity, void *ctx);
+static void resume_session(hibernated_session_t *session,
+                           const user_identity_t *identity);
+static void free_session(hibernated_session_t *session);
+
+void start_hibernation(void)
+{
+    if (!g_server_state.config.idle_hibernate_timeout) return;
+
+    /* Datagrams keep concurrent writers apart, SO_PASSCRED has the kernel
+     * attach the sender's uid so a session cannot claim another user */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, g_hibernate.channel) < 0)
+    {
+        ERROR("Failed to create hibernation channel: %s", strerror(errno));
+        return;
+    }
+
+    int on = 1;
+    setsockopt(
+        g_hibernate.channel[0], SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+    evutil_make_socket_nonblocking(g_hibernate.channel[0]);
+    track_parent_fd(g_hibernate.channel[0]);
+
+    g_hibernate.channel_event = event_new(g_server_state.base,
+                                          g_hibernate.channel[0],
+                                          EV_READ | EV_PERSIST,
+                                          on_hibernated_session,
+                                          NULL);
+    event_add(g_hibernate.channel_event, NULL);
+
+    INFO("Sessions hibernate after %d idle seconds",
+         g_server_state.config.idle_hibernate_timeout);
+}
+
+void arm_idle_hibernation(connection_t *connection)
+{
+    if (g_hibernate.channel[1] < 0 || connection->shared_loop) return;
+
+    connection->idle_event =
+        evtimer_new(connection->base, hibernate_session, connection);
+    touch_idle_hibernation(connection);
+}
+
+void touch_idle_hibernation(connection_t *connection)
+{
+    if (!connection->idle_event) return;
+
+    struct timeval idle = {g_server_state.config.idle_hibernate_timeout, 0};
+    evtimer_add(connection->idle_event, &idle);
+}
+
+/* Session process side */
+
+static void hibernate_session(evutil_socket_t fd __attribute__((unused)),
+                              short what __attribute__((unused)),
+                              void *arg)
+{
+    connection_t *connection = (connection_t *)arg;
+
+    /* The TLS state cannot leave this process, see hibernate.h */
+    if (connection->upgraded_to_tls) return;
+
+    int busy = !connection->authenticated || connection->data_bev ||
+               connection->pasv_listener || connection->data_active ||
+               connection->upload_fd >= 0 || connection->control_write_cb ||
+               connection->next_command || !connection->bev ||
+               evbuffer_get_length(bufferevent_get_input(connection->bev)) ||
+               evbuffer_get_length(bufferevent_get_output(connection->bev));
+
+    if (busy || send_session(connection) < 0)
+    {
+        touch_idle_hibernation(connection);
+        return;
+    }
+
+    INFO("Session of %s from %s hibernated",
+         connection->username,
+         connection->source_ip);
+    exit(0);
+}
+
+static int send_session(connection_t *connection)
+{
+    hibernated_state_t state;
+    memset(&state, 0, sizeof(state));
+    snprintf(
+        state.username, sizeof(state.username), "%s", connection->username);
+    state.uid = connection->uid;
+    state.gid = connection->gid;
+    state.transfer_mode = connection->transfer_mode;
+    state.data_tls_required = connection->data_tls_required;
+    snprintf(
+        state.source_ip, sizeof(state.source_ip), "%s", connection->source_ip);
+    snprintf(state.cwd, sizeof(state.cwd), "%s", session_fs_getcwd(connection));
+    state.admission = connection->admission;
+
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {
+        .iov_base = &state,
+        .iov_len = offsetof(hibernated_state_t, cwd) + strlen(state.cwd) + 1};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &connection->fd, sizeof(int));
+
+    /* Handed over first, the accepting process may adopt it before this
+     * returns */
+    pass_admission(&connection->admission, 0);
+    if (sendmsg(g_hibernate.channel[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+        WARN("Session of %s cannot hibernate: %s",
+             connection->username,
+             strerror(errno));
+        connection->admission = state.admission;
+        adopt_admission(&connection->admission);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Accepting process side */
+
+static void on_hibernated_session(evutil_socket_t fd,
+                                  short what __attribute__((unused)),
+                                  void *ctx __attribute__((unused)))
+{
+    for (;;)
+    {
+        hibernated_state_t state;
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(int)) +
+                        CMSG_SPACE(sizeof(struct ucred))];
+            struct cmsghdr align;
+        } control;
+
+        struct iovec iov = {.iov_base = &state, .iov_len = sizeof(state)};
+        struct msghdr msg = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control.buffer,
+                             .msg_controllen = sizeof(control.buffer)};
+
+        ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        int session_fd = -1;
+        struct ucred *cred = NULL;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET) continue;
+            if (cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+                memcpy(&session_fd, CMSG_DATA(cmsg), sizeof(int));
+            else if (cmsg->cmsg_type == SCM_CREDENTIALS)
+                cred = (struct ucred *)CMSG_DATA(cmsg);
+        }
+
+        size_t header = offsetof(hibernated_state_t, cwd);
+        if (session_fd < 0 || !cred || (size_t)n <= header ||
+            (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+            cred->uid != state.uid)
+        {
+            ERROR("Dropping malformed hibernation request of %zd bytes", n);
+            if ((size_t)n > header) release_admission(&state.admission);
+            if (session_fd >= 0) close(session_fd);
+            continue;
+        }
+
+        state.username[sizeof(state.username) - 1] = '\0';
+        state.source_ip[sizeof(state.source_ip) - 1] = '\0';
+        ((char *)&state)[n - 1] = '\0';
+        keep_session(&state, strlen(state.cwd), session_fd);
+    }
+}
+
+static void keep_session(const hibernated_state_t *state,
+                         size_t length,
+                         evutil_socket_t fd)
+{
+    hibernated_session_t *session =
+        malloc(sizeof(hibernated_session_t) + length + 1);
+    if (!session || !track_parent_fd(fd))
+    {
+        ERROR("Failed to keep hibernated session of %s", state->username);
+        admission_t admission = state->admission;
+        release_admission(&admission);
+        free(session);
+        close(fd);
+        return;
+    }
+
+    session->fd = fd;
+    memcpy(session->username, state->username, sizeof(session->username));
+    session->uid = state->uid;
+    session->gid = state->gid;
+    session->transfer_mode = state->transfer_mode;
+    session->data_tls_required = state->data_tls_required;
+    memcpy(session->source_ip, state->source_ip, sizeof(session->source_ip));
+    memcpy(session->cwd, state->cwd, length + 1);
+    session->admission = state->admission;
+    adopt_admission(&session->admission);
+
+    session->wake_event = event_new(
+        g_server_state.base, fd, EV_READ, on_session_wakeup, session);
+    if (!session->wake_event)
+    {
+        ERROR("Failed to watch hibernated session of %s", state->username);
+        free_session(session);
+        return;
+    }
+    event_add(session->wake_event, NULL);
+
+    g_hibernate.sleeping++;
+    g_hibernate.hibernations++;
+    DEBG("Keeping hibernated session of %s, %lu sleeping",
+         session->username,
+         g_hibernate.sleeping);
+}
+
+static void on_session_wakeup(evutil_socket_t fd,
+                              short what __attribute__((unused)),
+                              void *arg)
+{
+    hibernated_session_t *session = (hibernated_session_t *)arg;
+    g_hibernate.sleeping--;
+
+    /* A client that just disconnects is not worth a fork */
+    char peek;
+    ssize_t n = recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR)))
+    {
+        INFO("Hibernated session of %s from %s closed",
+             session->username,
+             session->source_ip);
+        free_session(session);
+        return;
+    }
+
+    /* With pre-auth the crypt threads run while this process forks, the
+     * session process must not use NSS then, see preauth.h */
+    if (!submit_identity_lookup(
+            session->username, on_session_identity, session))
+        resume_session(session, NULL);
+}
+
+static void on_session_identity(const user_identity_t *identity, void *ctx)
+{
+    hibernated_session_t *session = (hibernated_session_t *)ctx;
+    if (!identity)
+    {
+        ERROR("Cannot resume session of %s: user not found",
+              session->username);
+        free_session(session);
+        return;
+    }
+
+    resume_session(session, identity);
+}
+
+/* identity is NULL if the session process may look it up itself */
+static void resume_session(hibernated_session_t *session,
+                           const user_identity_t *identity)
+{
+    int rpc_fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, rpc_fd) < 0)
+    {
+        ERROR("Failed to create socket pair: %s", strerror(errno));
+        free_session(session);
+        return;
+    }
+
+    int pipe_fd[2]; /* Kill switch, see start_control_connection_loop */
+    if (pipe(pipe_fd) < 0)
+    {
+        ERROR("Failed to create kill switch pipe: %s", strerror(errno));
+        close(rpc_fd[0]);
+        close(rpc_fd[1]);
+        free_session(session);
+        return;
+    }
+
+    refresh_name_snapshot();
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        close(pipe_fd[1]);
+        close(rpc_fd[0]);
+        close_parent_fds(session->fd);
+        place_session_process(session->fd);
+
+        connection_t *connection =
+            create_connection(g_server_state.ssl_ctx, NULL);
+        if (!connection) exit(1);
+
+        connection->fd = session->fd;
+        connection->interprocess_fd = rpc_fd[1];
+        snprintf(connection->username,
+                 sizeof(connection->username),
+                 "%s",
+                 session->username);
+        snprintf(connection->source_ip,
+                 sizeof(connection->source_ip),
+                 "%s",
+                 session->source_ip);
+        connection->uid = session->uid;
+        connection->gid = session->gid;
+        connection->transfer_mode = session->transfer_mode;
+        connection->data_tls_required = session->data_tls_required;
+        connection->admission = session->admission;
+        adopt_admission(&connection->admission);
+
+        /* The uid was vouched for by the kernel, the name must still map to
+         * it after switching */
+        int switched =
+            identity
+                ? switch_to_identity(identity, connection->error_buf)
+                : switch_to_user(connection->username, connection->error_buf);
+        if (!switched || getuid() != connection->uid ||
+            session_fs_open_root(connection, "/") < 0)
+        {
+            ERROR("Cannot resume session of %s: %s",
+                  connection->username,
+                  connection->error_buf);
+            exit(1);
+        }
+        if (session_fs_chdir(connection, session->cwd) < 0)
+            WARN("Session of %s resumes in / instead of %s",
+                 connection->username,
+                 session->cwd);
+
+        INFO("Session of %s from %s resumed",
+             connection->username,
+             connection->source_ip);
+        resume_control_connection_loop(connection, pipe_fd[0], 0);
+    }
+
+    close(pipe_fd[0]);
+    close(rpc_fd[1]);
+
+    if (child < 0)
+    {
+        ERROR("Failed to fork resumed session of %s: %s",
+              session->username,
+              strerror(errno));
+        close(pipe_fd[1]);
+        close(rpc_fd[0]);
+        free_session(session);
+        return;
+    }
+
+    supervise_process(g_server_state.base,
+                      child,
+                      pipe_fd[1],
+                      "session",
+                      session->username,
+                      session->source_ip);
+    g_hibernate.resumes++;
+    DEBG("Session of %s resumed in process %d, %lu hibernations, %lu resumes",
+         session->username,
+         child,
+         g_hibernate.hibernations,
+         g_hibernate.resumes);
+
+    register_interprocess_fd_on_server(rpc_fd[0]);
+    pass_admission(&session->admission, child);
+    free_session(session); /* The session process owns the socket now */
+}
+
+static void free_session(hibernated_session_t *session)
+{
+    release_admission(&session->admission);
+    untrack_parent_fd(session->fd);
+    if (session->wake_event) event_free(session->wake_event);
+    close(session->fd);
+    free(session);
+}
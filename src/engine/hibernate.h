@@ -0,0 +1,38 @@
+/*
+    Idle session hibernation.
+
+    With idle_hibernate_timeout a logged in process model session that sat
+    idle for that long sends its state (user, cwd, transfer type) and its
+    control socket back to the accepting process over SCM_RIGHTS and exits.
+    The accepting process only keeps the socket and a small record. Once the
+    client sends its next command it forks a new session process that
+    switches to the user again and continues where the old one stopped.
+
+    Only plain control connections hibernate. The TLS state of a session
+    lives in its process' OpenSSL objects and cannot be handed over, sessions
+    that ran AUTH TLS keep their process for as long as they are connected.
+*/
+
+#ifndef HIBERNATE_H
+#define HIBERNATE_H
+
+#include "connection.h"
+
+/*!
+ * @brief Opens the channel sessions hibernate through, called once per
+ * accepting process before any session process is forked.
+ */
+void start_hibernation(void);
+
+/*!
+ * @brief Arms the idle timer of a session process, does nothing unless
+ * hibernation is enabled and the session owns its loop.
+ */
+void arm_idle_hibernation(connection_t *connection);
+
+/*!
+ * @brief Restarts the idle timer, called for every command of the session.
+ */
+void touch_idle_hibernation(connection_t *connection);
+
+#endif
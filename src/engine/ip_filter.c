@@ -0,0 +1,212 @@
+#include "ip_filter.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "server_state.h"
+#include "structures/prefix_trie.h"
+#include "worker_pool.h"
+
+#define IP_FILTER_ALLOW 1
+#define IP_FILTER_DENY 2
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    prefix_trie_t *trie; /* NULL allows everyone */
+    struct event *reload_event;
+} ip_filter_t;
+
+static ip_filter_t g_filter;
+
+static prefix_trie_t *compile_list(const char *path);
+static int parse_rule(char *line,
+                      uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                      int *length,
+                      int *verdict);
+static void address_key(const struct sockaddr *addr,
+                        uint8_t key[PREFIX_TRIE_KEY_LENGTH]);
+static void on_reload_signal(evutil_socket_t sig, short what, void *arg);
+
+void start_ip_filter(void)
+{
+    if (g_server_state.config.ip_access_file[0])
+    {
+        g_filter.trie = compile_list(g_server_state.config.ip_access_file);
+        if (!g_filter.trie) exit(-1);
+    }
+
+    /* Also without a file, a SIGHUP must not end the server */
+    watch_ip_filter_reload();
+}
+
+void watch_ip_filter_reload(void)
+{
+    /* An event of the base a worker inherited went with that base */
+    g_filter.reload_event =
+        evsignal_new(g_server_state.base, SIGHUP, on_reload_signal, NULL);
+    event_add(g_filter.reload_event, NULL);
+}
+
+int ip_filter_allows(const struct sockaddr *addr)
+{
+    if (!g_filter.trie) return 1;
+
+    uint8_t key[PREFIX_TRIE_KEY_LENGTH];
+    address_key(addr, key);
+    return prefix_trie_lookup(g_filter.trie, key) != IP_FILTER_DENY;
+}
+
+static void on_reload_signal(evutil_socket_t sig __attribute__((unused)),
+                             short what __attribute__((unused)),
+                             void *arg __attribute__((unused)))
+{
+    /* Pool supervisor, respawned workers start with its list */
+    if (g_server_state.config.worker_processes > 0 && !g_server_state.listener)
+        signal_worker_pool(SIGHUP);
+
+    const char *path = g_server_state.config.ip_access_file;
+    if (!path[0]) return;
+
+    prefix_trie_t *trie = compile_list(path);
+    if (!trie)
+    {
+        ERROR("Keeping the previous address list");
+        return;
+    }
+
+    free_prefix_trie(g_filter.trie);
+    g_filter.trie = trie;
+}
+
+static prefix_trie_t *compile_list(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        ERROR("Cannot open address list %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    prefix_trie_t *trie = create_prefix_trie();
+    if (!trie)
+    {
+        ERROR("Failed to allocate address list");
+        fclose(file);
+        return NULL;
+    }
+
+    char line[256];
+    int line_number = 0;
+    size_t rules[3] = {0};
+    while (fgets(line, sizeof(line), file))
+    {
+        line_number++;
+        uint8_t key[PREFIX_TRIE_KEY_LENGTH];
+        int length, verdict;
+        int parsed = parse_rule(line, key, &length, &verdict);
+        if (parsed < 0)
+        {
+            WARN("%s:%d: not an allow or deny prefix, ignored",
+                 path,
+                 line_number);
+            continue;
+        }
+        if (!parsed) continue;
+
+        if (!prefix_trie_insert(trie, key, length, verdict))
+        {
+            ERROR("Out of memory at %s:%d", path, line_number);
+            free_prefix_trie(trie);
+            fclose(file);
+            return NULL;
+        }
+        rules[verdict]++;
+    }
+    fclose(file);
+    finish_prefix_trie(trie);
+
+    INFO("Address list %s: %zu allowed and %zu denied prefixes in %zu trie "
+         "nodes",
+         path,
+         rules[IP_FILTER_ALLOW],
+         rules[IP_FILTER_DENY],
+         trie->count);
+    return trie;
+}
+
+static int parse_rule(char *line,
+                      uint8_t key[PREFIX_TRIE_KEY_LENGTH],
+                      int *length,
+                      int *verdict)
+{
+    /* 1 for a rule, 0 for a blank or comment line, -1 if malformed */
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char *words[3];
+    int count = 0;
+    for (char *word = strtok(line, " \t\r\n"); word && count < 3;
+         word = strtok(NULL, " \t\r\n"))
+        words[count++] = word;
+    if (!count) return 0;
+
+    char *prefix = words[0];
+    *verdict = IP_FILTER_DENY;
+    if (count == 2 && strcmp(words[0], "allow") == 0)
+        *verdict = IP_FILTER_ALLOW;
+    else if (count == 2 && strcmp(words[0], "deny") != 0)
+        return -1;
+    if (count == 2) prefix = words[1];
+    else if (count != 1) return -1;
+
+    int max_length = 128;
+    char *slash = strchr(prefix, '/');
+    if (slash) *slash = '\0';
+
+    memset(key, 0, PREFIX_TRIE_KEY_LENGTH);
+    if (inet_pton(AF_INET, prefix, key + 12) == 1)
+    {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        max_length = 32;
+    }
+    else if (inet_pton(AF_INET6, prefix, key) != 1)
+        return -1;
+
+    *length = max_length;
+    if (slash)
+    {
+        char *end;
+        long bits = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || bits < 0 || bits > max_length)
+            return -1;
+        *length = (int)bits;
+    }
+    if (max_length == 32) *length += 96;
+    return 1;
+}
+
+static void address_key(const struct sockaddr *addr,
+                        uint8_t key[PREFIX_TRIE_KEY_LENGTH])
+{
+    memset(key, 0, PREFIX_TRIE_KEY_LENGTH);
+    if (addr->sa_family == AF_INET6)
+        memcpy(key,
+               &((const struct sockaddr_in6 *)addr)->sin6_addr,
+               PREFIX_TRIE_KEY_LENGTH);
+    else if (addr->sa_family == AF_INET)
+    {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+}
@@ -0,0 +1,44 @@
+/*
+    Client address allow and deny lists.
+
+    ip_access_file holds one CIDR prefix per line, IPv4 or IPv6, after
+    "allow" or "deny" (a bare prefix denies), '#' starts a comment:
+
+        deny ::/0
+        allow 192.0.2.0/24
+        deny 192.0.2.128/25
+
+    The most specific prefix matching the client address decides, an
+    address matching none is allowed, so a "deny ::/0" turns the file into
+    an allow list. IPv4 addresses are matched as ::ffff:a.b.c.d.
+
+    The file is compiled into a prefix trie at startup and again on SIGHUP
+    to the main process, which passes the signal on to acceptor workers. A
+    file that cannot be read on reload keeps the previous list. Denied
+    clients are closed in the accept callback without a reply, before
+    anything is allocated or forked for them.
+*/
+
+#ifndef IP_FILTER_H
+#define IP_FILTER_H
+
+#include <sys/socket.h>
+
+/*!
+ * @brief Compiles ip_access_file, if set, and reloads it on SIGHUP. Called
+ * once in the main process before anything is forked, exits if the file
+ * cannot be read.
+ */
+void start_ip_filter(void);
+
+/*!
+ * @brief Reloads the list on SIGHUP in an acceptor worker of the pool.
+ */
+void watch_ip_filter_reload(void);
+
+/*!
+ * @return 1 if a client from addr may connect.
+ */
+int ip_filter_allows(const struct sockaddr *addr);
+
+#endif
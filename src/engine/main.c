@@ -3,9 +3,19 @@
 #include <signal.h>
 #include <sys/wait.h>
 
+#include "admission.h"
+#include "auth_throttle.h"
 #include "connection.h"
 #include "error.h"
+#include "ip_filter.h"
+#include "name_snapshot.h"
 #include "server_state.h"
+#include "session_cgroup.h"
+#include "session_placement.h"
+#include "session_supervisor.h"
+#include "session_threads.h"
+#include "upgrade.h"
+#include "worker_pool.h"
 
 extern server_state_t g_server_state;
 
@@ -34,21 +44,36 @@ static void setup_sigchld_handler()
     }
 }
 
-int main()
+int main(void)
 {
     SSL_library_init();
     SSL_load_error_strings();
     OpenSSL_add_all_algorithms();
     initialize_logger(print_log_to_console);
-    setup_sigchld_handler();
+    if (!start_session_supervisor()) setup_sigchld_handler();
 
     init_server_state();
+    start_upgrade_handling();
+    start_admission();
+    start_auth_throttle();
+    start_ip_filter();
+    start_session_placement();
+    start_session_cgroups();
+    start_name_snapshot();
+    check_session_confinement();
 
-    start_server_listener(g_server_state.base,
-                          g_server_state.ssl_ctx,
-                          g_server_state.config.port,
-                          control_connection_accept_cb);
-    event_base_dispatch(g_server_state.base);
+    if (g_server_state.config.worker_processes > 0)
+        start_worker_pool(g_server_state.config.worker_processes);
+    else
+    {
+        start_server_listener(g_server_state.base,
+                              g_server_state.ssl_ctx,
+                              g_server_state.config.port,
+                              prepare_session_engine(),
+                              0);
+        announce_upgrade_ready(1);
+        event_base_dispatch(g_server_state.base);
+    }
 
     destroy_server_state();
     return 0;
@@ -0,0 +1,493 @@
+#define _GNU_SOURCE /* pipe2 */
+#include "preauth.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "auth.h"
+#include "auth_throttle.h"
+#include "command_actions.h"
+#include "control_handler.h"
+#include "error.h"
+#include "ftp_status_codes.h"
+#include "interprocess_handler.h"
+#include "name_snapshot.h"
+#include "server_state.h"
+#include "session_fs.h"
+#include "session_placement.h"
+#include "session_supervisor.h"
+#include "user_workers.h"
+
+extern server_state_t g_server_state;
+
+typedef struct preauth_job
+{
+    connection_t *connection; /* NULL for an identity lookup */
+    identity_cb_t identity_done;
+    void *ctx;
+    int result_fd; /* Of the loop the session runs on */
+    char username[256];
+    char password[1024];
+    int verified;
+    int anonymous;
+    user_identity_t identity; /* Looked up along with the password, the
+                                 session process must not use NSS */
+    struct preauth_job *next;
+} preauth_job_t;
+
+/* Crypt threads write finished jobs, the loop of their sessions reads */
+typedef struct
+{
+    int fd[2];
+    struct event *event;
+} login_results_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    preauth_job_t *head; /* Jobs waiting for a crypt thread */
+    preauth_job_t *tail;
+    int crypt_threads;    /* Running */
+
+    login_results_t results; /* Of the accepting loop */
+
+    unsigned long logins;
+    unsigned long failed_logins;
+    unsigned long forks;
+} preauth_state_t;
+
+static preauth_state_t g_preauth = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                    .wakeup = PTHREAD_COND_INITIALIZER,
+                                    .results = {.fd = {-1, -1}}};
+
+/* Where the jobs submitted from this thread's loop are answered */
+static __thread login_results_t *t_results;
+
+static int open_login_results(struct event_base *base,
+                              login_results_t *results);
+static void *run_crypt_thread(void *arg);
+static void on_login_result(evutil_socket_t fd, short events, void *ctx);
+static void queue_job(preauth_job_t *job);
+static void finish_login(const preauth_job_t *job);
+static void finish_thread_login(connection_t *connection,
+                                const preauth_job_t *job);
+static void fork_session(connection_t *connection,
+                         const user_identity_t *identity);
+
+void start_preauth(void)
+{
+    /* The accepting process now writes to client sockets itself */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!open_login_results(g_server_state.base, &g_preauth.results))
+        exit(-1);
+    track_parent_fd(g_preauth.results.fd[0]);
+    track_parent_fd(g_preauth.results.fd[1]);
+    t_results = &g_preauth.results;
+
+    start_crypt_threads();
+    INFO("Pre-auth runs in the accepting process with %d crypt threads",
+         g_preauth.crypt_threads);
+}
+
+void start_crypt_threads(void)
+{
+    int threads = g_server_state.config.preauth_crypt_threads;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_crypt_thread, NULL) != 0)
+        {
+            ERROR("Failed to start crypt thread %d", i);
+            exit(-1);
+        }
+        pthread_detach(thread);
+    }
+    g_preauth.crypt_threads = threads;
+}
+
+int watch_login_results(struct event_base *base)
+{
+    login_results_t *results = calloc(1, sizeof(login_results_t));
+    if (!results || !open_login_results(base, results))
+    {
+        free(results);
+        return 0;
+    }
+
+    t_results = results;
+    return 1;
+}
+
+static int open_login_results(struct event_base *base,
+                              login_results_t *results)
+{
+    if (pipe2(results->fd, O_CLOEXEC) != 0)
+    {
+        ERROR("Failed to create login result pipe: %s", strerror(errno));
+        return 0;
+    }
+
+    evutil_make_socket_nonblocking(results->fd[0]);
+    results->event = event_new(
+        base, results->fd[0], EV_READ | EV_PERSIST, on_login_result, NULL);
+    if (!results->event || event_add(results->event, NULL) != 0)
+    {
+        ERROR("Failed to watch login result pipe");
+        if (results->event) event_free(results->event);
+        close(results->fd[0]);
+        close(results->fd[1]);
+        return 0;
+    }
+    return 1;
+}
+
+void preauth_accept_cb(struct evconnlistener *listener
+                       __attribute__((unused)),
+                       evutil_socket_t fd,
+                       struct sockaddr *addr,
+                       int len __attribute__((unused)),
+                       void *ctx)
+{
+    admission_t admission;
+    if (!admit_connection(fd, addr, &admission)) return;
+
+    /* Session processes forked for other clients must not keep it open */
+    connection_t *connection = create_connection((SSL_CTX *)ctx, addr);
+    if (!connection || !track_parent_fd(fd))
+    {
+        free(connection);
+        release_admission(&admission);
+        close(fd);
+        return;
+    }
+
+    __sync_add_and_fetch(&g_server_state.current_connections, 1);
+    connection->admission = admission;
+
+    connection->base = g_server_state.base;
+    connection->shared_loop = 1;
+    connection->preauth = 1;
+    INFO("Control connection with %s", connection->source_ip);
+
+    setup_control_connection(fd, connection);
+    if (!connection->bev)
+    {
+        untrack_parent_fd(fd);
+        __sync_sub_and_fetch(&g_server_state.current_connections, 1);
+        release_admission(&connection->admission);
+        close(fd);
+        free(connection);
+    }
+}
+
+void submit_preauth_login(connection_t *connection, const char *password)
+{
+    preauth_job_t *job =
+        t_results ? calloc(1, sizeof(preauth_job_t)) : NULL;
+    if (!job)
+    {
+        send_control_message(connection,
+                             FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                             "Out of memory");
+        return;
+    }
+
+    job->connection = connection;
+    job->result_fd = t_results->fd[1];
+    job->anonymous = connection->anonymous;
+    snprintf(job->username, sizeof(job->username), "%s", connection->username);
+    snprintf(job->password, sizeof(job->password), "%s", password);
+
+    /* Nothing else from this client is processed until PASS is answered */
+    bufferevent_disable(connection->bev, EV_READ);
+    connection->auth_pending = 1;
+    queue_job(job);
+}
+
+int submit_identity_lookup(const char *username,
+                           identity_cb_t done,
+                           void *ctx)
+{
+    if (!g_preauth.crypt_threads || !t_results) return 0;
+
+    preauth_job_t *job = calloc(1, sizeof(preauth_job_t));
+    if (!job)
+    {
+        done(NULL, ctx);
+        return 1;
+    }
+
+    job->identity_done = done;
+    job->ctx = ctx;
+    job->result_fd = t_results->fd[1];
+    snprintf(job->username, sizeof(job->username), "%s", username);
+    queue_job(job);
+    return 1;
+}
+
+static void queue_job(preauth_job_t *job)
+{
+    pthread_mutex_lock(&g_preauth.lock);
+    if (g_preauth.tail)
+        g_preauth.tail->next = job;
+    else
+        g_preauth.head = job;
+    g_preauth.tail = job;
+    pthread_cond_signal(&g_preauth.wakeup);
+    pthread_mutex_unlock(&g_preauth.lock);
+}
+
+void forget_preauth_session(connection_t *connection)
+{
+    untrack_parent_fd(connection->fd);
+}
+
+static void *run_crypt_thread(void *arg __attribute__((unused)))
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&g_preauth.lock);
+        while (!g_preauth.head)
+            pthread_cond_wait(&g_preauth.wakeup, &g_preauth.lock);
+
+        preauth_job_t *job = g_preauth.head;
+        g_preauth.head = job->next;
+        if (!g_preauth.head) g_preauth.tail = NULL;
+        pthread_mutex_unlock(&g_preauth.lock);
+
+        /* The accepting process forks with these threads running, a lock
+         * of an NSS module held by one of them stays held in the child.
+         * So the child gets everything it needs from here. */
+        if (job->identity_done)
+            job->verified = lookup_user_identity(job->username, &job->identity);
+        else if (job->anonymous)
+            job->verified = lookup_anonymous_identity(&job->identity);
+        else
+            job->verified =
+                verify_user_password(job->username, job->password, NULL) &&
+                lookup_user_identity(job->username, &job->identity);
+        explicit_bzero(job->password, sizeof(job->password));
+
+        if (write(job->result_fd, &job, sizeof(job)) != sizeof(job))
+            ERROR("Lost login result for %s: %s",
+                  job->username,
+                  strerror(errno));
+    }
+
+    return NULL;
+}
+
+static void on_login_result(evutil_socket_t fd,
+                            short events __attribute__((unused)),
+                            void *ctx __attribute__((unused)))
+{
+    preauth_job_t *job;
+    while (read(fd, &job, sizeof(job)) == sizeof(job))
+    {
+        if (job->identity_done)
+            job->identity_done(job->verified ? &job->identity : NULL,
+                               job->ctx);
+        else
+            finish_login(job);
+        free(job);
+    }
+}
+
+static void finish_login(const preauth_job_t *job)
+{
+    connection_t *connection = job->connection;
+    connection->uid = job->identity.uid;
+    connection->gid = job->identity.gid;
+
+    connection->auth_pending = 0;
+    if (!connection->control_active)
+    {
+        /* Released while the password was being checked */
+        release_connection(connection);
+        return;
+    }
+    if (!connection->bev) return; /* Release is already scheduled */
+
+    if (!connection->preauth)
+    {
+        finish_thread_login(connection, job);
+        return;
+    }
+
+    if (job->verified && !admit_user(&connection->admission, connection->uid))
+    {
+        connection->control_write_cb = disable_connection_cb;
+        send_control_message(connection,
+                             FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                             "Too many sessions of this user");
+        return;
+    }
+
+    if (job->verified)
+    {
+        g_preauth.logins++;
+        if (!connection->anonymous)
+            auth_throttle_succeeded(connection->username);
+
+        /* The TLS state cannot be passed on, see user_workers.h */
+        if (!connection->upgraded_to_tls &&
+            (connection->anonymous ||
+             g_server_state.config.session_per_user) &&
+            route_to_user_worker(connection, &job->identity))
+            return;
+
+        fork_session(connection, &job->identity);
+        return;
+    }
+
+    g_preauth.failed_logins++;
+    ERROR("Incorrect password for user '%s' from %s",
+          connection->username,
+          connection->source_ip);
+    reject_login(connection,
+                 connection->anonymous
+                     ? 0
+                     : auth_throttle_failed(connection->source_ip,
+                                            connection->username));
+}
+
+/* The threaded model keeps the session on its session thread */
+static void finish_thread_login(connection_t *connection,
+                                const preauth_job_t *job)
+{
+    if (!job->verified)
+    {
+        ERROR("Incorrect password for user '%s' from %s",
+              connection->username,
+              connection->source_ip);
+        reject_login(connection,
+                     connection->anonymous
+                         ? 0
+                         : auth_throttle_failed(connection->source_ip,
+                                                connection->username));
+        return;
+    }
+
+    /* Without a chroot the home directory itself becomes the session root */
+    set_session_identity(connection, &job->identity);
+    if (session_fs_open_root(connection, job->identity.root) < 0)
+    {
+        ERROR("Cannot open the root of %s", connection->username);
+        reject_login(connection, 0);
+        return;
+    }
+
+    complete_login(connection);
+    bufferevent_enable(connection->bev, EV_READ);
+    resume_control_input(connection);
+}
+
+static void fork_session(connection_t *connection,
+                         const user_identity_t *identity)
+{
+    int rpc_fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, rpc_fd) < 0)
+    {
+        ERROR("Failed to create socket pair: %s", strerror(errno));
+        send_control_message(connection,
+                             FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                             "Cannot start session");
+        bufferevent_enable(connection->bev, EV_READ);
+        resume_control_input(connection);
+        return;
+    }
+
+    int pipe_fd[2]; /* Kill switch, see start_control_connection_loop */
+    if (pipe(pipe_fd) < 0)
+    {
+        ERROR("Failed to create kill switch pipe: %s", strerror(errno));
+        close(rpc_fd[0]);
+        close(rpc_fd[1]);
+        send_control_message(connection,
+                             FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                             "Cannot start session");
+        bufferevent_enable(connection->bev, EV_READ);
+        resume_control_input(connection);
+        return;
+    }
+
+    refresh_name_snapshot();
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        close(pipe_fd[1]);
+        close(rpc_fd[0]);
+
+        /* Neither the listener nor sockets of other clients still in
+         * pre-auth may stay open in the session process */
+        close_parent_fds(connection->fd);
+        place_session_process(connection->fd);
+
+        connection->preauth = 0;
+        connection->shared_loop = 0;
+        connection->interprocess_fd = rpc_fd[1];
+        adopt_admission(&connection->admission);
+
+        /* Looked up by the crypt thread, NSS is not safe to use here */
+        if (!connection->anonymous) set_session_identity(connection, identity);
+        if (!switch_to_identity(identity, connection->error_buf) ||
+            session_fs_open_root(connection, "/") < 0)
+        {
+            ERROR("%s", connection->error_buf);
+            exit(1);
+        }
+
+        resume_control_connection_loop(connection, pipe_fd[0], 1);
+    }
+
+    close(pipe_fd[0]);
+    close(rpc_fd[1]);
+
+    if (child < 0)
+    {
+        ERROR("Failed to fork session for %s: %s",
+              connection->username,
+              strerror(errno));
+        close(pipe_fd[1]);
+        close(rpc_fd[0]);
+        send_control_message(connection,
+                             FTP_STATUS_SERVICE_NOT_AVAILABLE,
+                             "Cannot start session");
+        bufferevent_enable(connection->bev, EV_READ);
+        resume_control_input(connection);
+        return;
+    }
+
+    supervise_process(g_server_state.base,
+                      child,
+                      pipe_fd[1],
+                      "session",
+                      connection->username,
+                      connection->source_ip);
+    g_preauth.forks++;
+    INFO("Session of %s moved to process %d, %lu forks for %lu logins, %lu "
+         "failed logins",
+         connection->username,
+         child,
+         g_preauth.forks,
+         g_preauth.logins,
+         g_preauth.failed_logins);
+
+    register_interprocess_fd_on_server(rpc_fd[0]);
+    pass_admission(&connection->admission, child);
+
+    /* The session process owns the socket and TLS state now, dropping the
+     * local copies neither closes the connection nor sends close_notify */
+    release_connection(connection);
+}
@@ -0,0 +1,81 @@
+/*
+    Pre-auth phase on the accepting loop.
+
+    With preauth_in_parent the accepting process (main process or prefork
+    worker) greets clients and runs AUTH TLS, USER and PASS itself on its own
+    loop. Password hashing runs on a few crypt threads so a slow hash never
+    stalls the loop. Only a successful login forks a session process, which
+    takes over the socket and the TLS state and continues as a regular
+    process model session, so scanners and failed logins never cost a fork.
+
+    The accepting process forks while the crypt threads run, and a lock an
+    NSS module (sssd, LDAP) held in one of them at that moment stays held
+    in the child. So the crypt threads also look up the uid, groups and home
+    directory of the user, and the session process switches to them without
+    any NSS call of its own.
+
+    The threaded model checks its passwords on the same crypt threads, a
+    hash waiting for a slot must not stall every session of its session
+    thread. The result comes back to the session thread's own loop, where
+    the session continues.
+*/
+
+#ifndef PREAUTH_H
+#define PREAUTH_H
+
+#include "auth.h"
+#include "connection.h"
+
+/* Gets NULL if the user does not exist */
+typedef void (*identity_cb_t)(const user_identity_t *identity, void *ctx);
+
+/*!
+ * @brief Starts the crypt threads and the result channel on the accepting
+ * loop, called once per accepting process.
+ */
+void start_preauth(void);
+
+/*!
+ * @brief Starts the preauth_crypt_threads crypt threads, called once per
+ * process by start_preauth or for the threaded model.
+ */
+void start_crypt_threads(void);
+
+/*!
+ * @brief Lets sessions of the calling thread's loop submit logins, called
+ * on every session thread of the threaded model.
+ * @return 0 on failure, PASS answers 421 then.
+ */
+int watch_login_results(struct event_base *base);
+
+/*!
+ * @brief Accept callback that keeps the new session on the accepting loop.
+ */
+void preauth_accept_cb(struct evconnlistener *listener,
+                       evutil_socket_t fd,
+                       struct sockaddr *addr,
+                       int len,
+                       void *ctx);
+
+/*!
+ * @brief Queues the password check of a pre-auth or threaded model session,
+ * the reply to PASS is sent once the crypt thread is done.
+ */
+void submit_preauth_login(connection_t *connection, const char *password);
+
+/*!
+ * @brief Looks up the identity of a user on a crypt thread for a process
+ * about to be forked, done runs on the calling thread's loop.
+ * @return 0 if this process runs no crypt threads, done is not called
+ * then. Without threads NSS is safe to use after forking.
+ */
+int submit_identity_lookup(const char *username,
+                           identity_cb_t done,
+                           void *ctx);
+
+/*!
+ * @brief Drops a released pre-auth session from the bookkeeping.
+ */
+void forget_preauth_session(connection_t *connection);
+
+#endif
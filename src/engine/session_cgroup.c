@@ -0,0 +1,234 @@
+#include "session_cgroup.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "server_state.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+#define CGROUP_JOIN_ATTEMPTS 3 /* A sweep may remove a fresh empty child */
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    int enabled;
+    /* Limits whose controller is available for the children */
+    int cpu_weight;
+    int io_weight;
+    int io_max;
+    int memory_high;
+    struct event *sweep_event;
+} session_cgroups_t;
+
+static session_cgroups_t g_cgroups;
+
+static int write_cgroup_file(const char *dir,
+                             const char *file,
+                             const char *value);
+static void set_cgroup_limit(const char *dir,
+                             const char *file,
+                             const char *value);
+static int enable_controller(const char *controller, const char *limit);
+static void sweep_session_cgroups(evutil_socket_t fd, short what, void *arg);
+
+void start_session_cgroups(void)
+{
+    const configurations_t *config = &g_server_state.config;
+    if (!config->session_cgroup[0]) return;
+
+    if (config->session_model != SESSION_MODEL_PROCESS)
+    {
+        WARN("session_cgroup only places session processes, ignored for "
+             "the threaded model");
+        return;
+    }
+
+    struct statfs fs;
+    if (statfs(config->session_cgroup, &fs) < 0 ||
+        fs.f_type != CGROUP2_SUPER_MAGIC)
+    {
+        WARN("session_cgroup %s is not a cgroup v2 directory, sessions are "
+             "not placed",
+             config->session_cgroup);
+        return;
+    }
+
+    g_cgroups.enabled = 1;
+    if (config->session_cpu_weight)
+        g_cgroups.cpu_weight = enable_controller("cpu", "session_cpu_weight");
+    if (config->session_io_weight || config->session_io_max[0])
+    {
+        int io = enable_controller("io", "session_io_weight/io_max");
+        g_cgroups.io_weight = io && config->session_io_weight;
+        g_cgroups.io_max = io && config->session_io_max[0];
+    }
+    if (config->session_memory_high[0])
+        g_cgroups.memory_high =
+            enable_controller("memory", "session_memory_high");
+
+    struct timeval interval = {CFTP_CGROUP_SWEEP_INTERVAL, 0};
+    g_cgroups.sweep_event = event_new(g_server_state.base,
+                                      -1,
+                                      EV_PERSIST,
+                                      sweep_session_cgroups,
+                                      NULL);
+    event_add(g_cgroups.sweep_event, &interval);
+
+    INFO("Sessions are placed in cgroups per %s under %s",
+         config->session_cgroup_scope == SESSION_CGROUP_PER_USER ? "user"
+                                                                 : "session",
+         config->session_cgroup);
+}
+
+void enter_session_cgroup(uint32_t uid)
+{
+    if (!g_cgroups.enabled) return;
+
+    const configurations_t *config = &g_server_state.config;
+    char path[PATH_MAX];
+    int len;
+    if (config->session_cgroup_scope == SESSION_CGROUP_PER_USER)
+        len = snprintf(path,
+                       sizeof(path),
+                       "%s/user-%" PRIu32,
+                       config->session_cgroup,
+                       uid);
+    else
+        len = snprintf(path,
+                       sizeof(path),
+                       "%s/session-%d",
+                       config->session_cgroup,
+                       (int)getpid());
+    if (len < 0 || (size_t)len >= sizeof(path))
+    {
+        WARN("session_cgroup path too long, session is not placed");
+        return;
+    }
+
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+
+    int joined = 0;
+    for (int attempt = 0; attempt < CGROUP_JOIN_ATTEMPTS && !joined; attempt++)
+    {
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) break;
+        joined = write_cgroup_file(path, "cgroup.procs", pid) == 0;
+        if (!joined && errno != ENOENT) break; /* Else swept in between */
+    }
+    if (!joined)
+    {
+        WARN("Cannot move session into cgroup %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* Rewritten by every session of a user, the values are the same */
+    char value[64];
+    if (g_cgroups.cpu_weight)
+    {
+        snprintf(value, sizeof(value), "%d", config->session_cpu_weight);
+        set_cgroup_limit(path, "cpu.weight", value);
+    }
+    if (g_cgroups.io_weight)
+    {
+        snprintf(
+            value, sizeof(value), "default %d", config->session_io_weight);
+        set_cgroup_limit(path, "io.weight", value);
+    }
+    if (g_cgroups.io_max)
+        set_cgroup_limit(path, "io.max", config->session_io_max);
+    if (g_cgroups.memory_high)
+        set_cgroup_limit(path, "memory.high", config->session_memory_high);
+}
+
+static int write_cgroup_file(const char *dir,
+                             const char *file,
+                             const char *value)
+{
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if (len < 0 || (size_t)len >= sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    size_t size = strlen(value);
+    int ok = write(fd, value, size) == (ssize_t)size;
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return ok ? 0 : -1;
+}
+
+static void set_cgroup_limit(const char *dir,
+                             const char *file,
+                             const char *value)
+{
+    if (write_cgroup_file(dir, file, value) < 0)
+        WARN("Cannot set %s of %s to '%s': %s",
+             file,
+             dir,
+             value,
+             strerror(errno));
+}
+
+static int enable_controller(const char *controller, const char *limit)
+{
+    char value[32];
+    snprintf(value, sizeof(value), "+%s", controller);
+    if (write_cgroup_file(g_server_state.config.session_cgroup,
+                          "cgroup.subtree_control",
+                          value) == 0)
+        return 1;
+
+    WARN("The %s controller is not available below %s, %s is ignored",
+         controller,
+         g_server_state.config.session_cgroup,
+         limit);
+    return 0;
+}
+
+static void sweep_session_cgroups(evutil_socket_t fd __attribute__((unused)),
+                                  short what __attribute__((unused)),
+                                  void *arg __attribute__((unused)))
+{
+    DIR *dir = opendir(g_server_state.config.session_cgroup);
+    if (!dir) return;
+
+    char path[PATH_MAX];
+    unsigned removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "session-", 8) != 0 &&
+            strncmp(entry->d_name, "user-", 5) != 0)
+            continue;
+
+        /* Only succeeds once the last process of the cgroup is gone */
+        int len = snprintf(path,
+                           sizeof(path),
+                           "%s/%s",
+                           g_server_state.config.session_cgroup,
+                           entry->d_name);
+        if (len > 0 && (size_t)len < sizeof(path) && rmdir(path) == 0)
+            removed++;
+    }
+    closedir(dir);
+
+    if (removed) DEBG("Removed %u empty session cgroups", removed);
+}
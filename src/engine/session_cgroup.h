@@ -0,0 +1,42 @@
+/*
+    cgroup v2 placement of session processes.
+
+    With session_cgroup pointing at a delegated cgroup v2 directory every
+    process model session moves itself into a child cgroup of it while it
+    switches to its user, still as root and before the chroot hides /sys.
+    The child is per session (session-<pid>) or shared by all sessions of a
+    uid (user-<uid>), and gets session_cpu_weight, session_io_weight,
+    session_io_max and session_memory_high written to it. One tenant's
+    transfers then compete with the others by weight instead of as equal
+    peers of the whole server.
+
+    The server itself must run outside session_cgroup, cgroup v2 does not
+    allow processes in a cgroup that has controllers enabled for its
+    children. Children left empty by ended sessions are removed by the
+    main process every CFTP_CGROUP_SWEEP_INTERVAL seconds. The threaded
+    model keeps all sessions in one process and is not placed.
+*/
+
+#ifndef SESSION_CGROUP_H
+#define SESSION_CGROUP_H
+
+#include <stdint.h>
+
+#define CFTP_CGROUP_SWEEP_INTERVAL 30
+
+/*!
+ * @brief Checks session_cgroup, enables the controllers the configured
+ * limits need for its children and starts sweeping empty children, called
+ * once in the main process before its loop runs.
+ */
+void start_session_cgroups(void);
+
+/*!
+ * @brief Moves the calling session process into its cgroup and applies the
+ * limits. Failures are logged, the session goes on without isolation.
+ * @param uid User the session runs as, names the cgroup in the per user
+ * scope.
+ */
+void enter_session_cgroup(uint32_t uid);
+
+#endif
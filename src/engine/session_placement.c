@@ -0,0 +1,216 @@
+#define _GNU_SOURCE /* cpu_set_t, sched_setaffinity */
+
+#include "session_placement.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "error.h"
+#include "server_state.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49 /* Linux 3.19, missing from older headers */
+#endif
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    int policy;
+    cpu_set_t cpus;         /* CPUs sessions may run on */
+    int order[CPU_SETSIZE]; /* The same CPUs ascending, for round robin */
+    int count;
+    uint32_t *next; /* Round robin cursor, shared with every forked process */
+    uint32_t local_next; /* Used when the shared page cannot be mapped */
+} session_placement_t;
+
+static session_placement_t g_placement;
+
+static int parse_cpu_list(const char *list, cpu_set_t *cpus);
+static int read_nic_node_cpus(const char *nic, cpu_set_t *cpus);
+static int next_round_robin_cpu(void);
+
+void start_session_placement(void)
+{
+    g_placement.policy = g_server_state.config.session_cpu_affinity;
+    if (g_placement.policy == SESSION_AFFINITY_NONE) return;
+
+    if (g_server_state.config.session_model != SESSION_MODEL_PROCESS)
+    {
+        WARN("session_cpu_affinity only places session processes, ignored "
+             "for the threaded model");
+        g_placement.policy = SESSION_AFFINITY_NONE;
+        return;
+    }
+
+    /* Never widen what the server itself was started with */
+    if (sched_getaffinity(0, sizeof(g_placement.cpus), &g_placement.cpus) < 0)
+    {
+        ERROR("Cannot read CPU affinity: %s", strerror(errno));
+        g_placement.policy = SESSION_AFFINITY_NONE;
+        return;
+    }
+
+    cpu_set_t restrict_to;
+    if (g_server_state.config.session_cpus[0])
+    {
+        if (!parse_cpu_list(g_server_state.config.session_cpus, &restrict_to))
+        {
+            WARN("Invalid session_cpus '%s', sessions are not placed",
+                 g_server_state.config.session_cpus);
+            g_placement.policy = SESSION_AFFINITY_NONE;
+            return;
+        }
+        CPU_AND(&g_placement.cpus, &g_placement.cpus, &restrict_to);
+    }
+
+    if (g_placement.policy == SESSION_AFFINITY_NIC_NODE)
+    {
+        if (!read_nic_node_cpus(g_server_state.config.session_nic,
+                                &restrict_to))
+        {
+            WARN("No NUMA node known for session_nic '%s', sessions are not "
+                 "placed",
+                 g_server_state.config.session_nic);
+            g_placement.policy = SESSION_AFFINITY_NONE;
+            return;
+        }
+        CPU_AND(&g_placement.cpus, &g_placement.cpus, &restrict_to);
+    }
+
+    g_placement.count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &g_placement.cpus))
+            g_placement.order[g_placement.count++] = cpu;
+
+    if (g_placement.count == 0)
+    {
+        WARN("No usable CPU left for session processes, they are not placed");
+        g_placement.policy = SESSION_AFFINITY_NONE;
+        return;
+    }
+
+    /* Acceptor workers, the zygote and session processes are all forked
+     * after this, one shared page gives them a single cursor */
+    g_placement.next = mmap(NULL,
+                            sizeof(uint32_t),
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS,
+                            -1,
+                            0);
+    if (g_placement.next == MAP_FAILED)
+    {
+        WARN("Cannot map round robin cursor, each acceptor keeps its own: %s",
+             strerror(errno));
+        g_placement.next = &g_placement.local_next;
+    }
+    *g_placement.next = 0;
+
+    static const char *names[] = {
+        "none", "round robin", "incoming CPU", "NIC node"};
+    INFO("Placing session processes over %d CPUs (%s)",
+         g_placement.count,
+         names[g_placement.policy]);
+}
+
+void place_session_process(int client_fd)
+{
+    if (g_placement.policy == SESSION_AFFINITY_NONE) return;
+
+    cpu_set_t target;
+    CPU_ZERO(&target);
+
+    if (g_placement.policy == SESSION_AFFINITY_NIC_NODE)
+        target = g_placement.cpus; /* The scheduler balances within the node */
+    else
+    {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (g_placement.policy == SESSION_AFFINITY_INCOMING_CPU &&
+            client_fd >= 0)
+            getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len);
+
+        /* Unknown yet or outside session_cpus */
+        if (cpu < 0 || cpu >= CPU_SETSIZE ||
+            !CPU_ISSET(cpu, &g_placement.cpus))
+            cpu = next_round_robin_cpu();
+        CPU_SET(cpu, &target);
+    }
+
+    if (sched_setaffinity(0, sizeof(target), &target) < 0)
+        WARN("Cannot place session process: %s", strerror(errno));
+}
+
+static int next_round_robin_cpu(void)
+{
+    uint32_t n = __sync_fetch_and_add(g_placement.next, 1);
+    return g_placement.order[n % g_placement.count];
+}
+
+static int parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return 0;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return 0;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) return 0;
+
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, cpus);
+
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return 0;
+    }
+
+    return CPU_COUNT(cpus) > 0;
+}
+
+static int read_nic_node_cpus(const char *nic, cpu_set_t *cpus)
+{
+    if (!nic[0] || strchr(nic, '/')) return 0;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", nic);
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    int node = -1;
+    int fields = fscanf(file, "%d", &node);
+    fclose(file);
+    if (fields != 1 || node < 0) return 0; /* Virtual device or no NUMA */
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    file = fopen(path, "r");
+    if (!file) return 0;
+    char list[1024] = {0};
+    int ok = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if (!ok) return 0;
+    list[strcspn(list, "\n")] = '\0';
+
+    INFO("session_nic %s is attached to NUMA node %d (CPUs %s)",
+         nic,
+         node,
+         list);
+    return parse_cpu_list(list, cpus);
+}
@@ -0,0 +1,34 @@
+/*
+    CPU placement of session processes.
+
+    With session_cpu_affinity every forked session process sets its own CPU
+    affinity right after fork, before it touches the client. round_robin
+    pins sessions one after another over the CPUs of session_cpus, the
+    cursor is shared by every accepting process. incoming_cpu pins a session
+    to the CPU that processed the client's packets (SO_INCOMING_CPU), so the
+    session runs where its NIC queue interrupts land. nic_node confines
+    sessions to the CPUs of the NUMA node session_nic is attached to and
+    lets the scheduler balance within it, first touch keeps their buffers
+    and the page cache they read on that node.
+
+    The threaded model keeps all sessions in one process and is not placed.
+*/
+
+#ifndef SESSION_PLACEMENT_H
+#define SESSION_PLACEMENT_H
+
+/*!
+ * @brief Resolves the configured CPU set, called once in the main process
+ * before any acceptor or session process exists, sysfs is not reachable
+ * from a chroot.
+ */
+void start_session_placement(void);
+
+/*!
+ * @brief Applies the placement policy to the calling session process.
+ * @param client_fd Control socket the policy may look at, -1 for processes
+ * serving many clients, incoming_cpu then falls back to round robin.
+ */
+void place_session_process(int client_fd);
+
+#endif
@@ -0,0 +1,336 @@
+#include "session_supervisor.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "connection.h"
+#include "error.h"
+#include "name_snapshot.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434 /* Same number on every architecture */
+#endif
+
+#define SUPERVISOR_DRAIN_CHECK_INTERVAL 1 /* Seconds */
+
+typedef struct supervised_process
+{
+    pid_t pid;
+    int pidfd;
+    int kill_fd; /* Write end of the child's kill switch, -1 once orphaned */
+    struct event *exit_event;
+    struct timespec started_at;
+    char kind[32];
+    char username[256];
+    char source_ip[INET6_ADDRSTRLEN];
+    struct supervised_process *prev;
+    struct supervised_process *next;
+} supervised_process_t;
+
+typedef struct
+{
+    supervised_process_t *processes;
+    unsigned count;
+    int draining;
+    struct event_base *drain_base;
+    struct event *drain_event;
+    struct timespec drain_deadline; /* tv_sec 0 without a deadline */
+} supervisor_t;
+
+/* What /proc still tells about a zombie */
+typedef struct
+{
+    long uid;
+    unsigned long long rchar;
+    unsigned long long wchar;
+} exit_snapshot_t;
+
+static int g_pidfd_supported = -1; /* Unknown until probed */
+static supervisor_t g_supervisor;
+
+static int open_pidfd(pid_t pid);
+static void on_process_exit(evutil_socket_t fd, short what, void *arg);
+static void orphan_process(supervised_process_t *process);
+static void on_drain_check(evutil_socket_t fd, short what, void *arg);
+static void read_exit_snapshot(pid_t pid, exit_snapshot_t *snapshot);
+static void name_user(long uid, char *buffer, size_t buffer_size);
+static double seconds(struct timeval tv);
+
+int start_session_supervisor(void)
+{
+    int pidfd = open_pidfd(getpid());
+    g_pidfd_supported = pidfd >= 0;
+    if (pidfd >= 0)
+        close(pidfd);
+    else
+        WARN("pidfds not supported (%s), session resource usage is not "
+             "recorded",
+             strerror(errno));
+    return g_pidfd_supported;
+}
+
+void supervise_process(struct event_base *base,
+                       pid_t pid,
+                       int kill_fd,
+                       const char *kind,
+                       const char *username,
+                       const char *source_ip)
+{
+    /* Later children must not hold on to their siblings' kill switches,
+     * otherwise those never fire */
+    if (kill_fd >= 0) track_parent_fd(kill_fd);
+
+    if (g_pidfd_supported != 1 || pid <= 0)
+    {
+        /* Without an exit notification the kill switch stays open */
+        if (pid <= 0 && kill_fd >= 0)
+        {
+            untrack_parent_fd(kill_fd);
+            close(kill_fd);
+        }
+        return;
+    }
+
+    supervised_process_t *process = calloc(1, sizeof(supervised_process_t));
+    if (!process)
+    {
+        ERROR("Failed to allocate supervisor entry for process %d", pid);
+        return;
+    }
+
+    /* Nobody else reaps, so the pid cannot have been reused yet even if
+     * the child already exited */
+    process->pidfd = open_pidfd(pid);
+    if (process->pidfd < 0)
+    {
+        ERROR("Cannot open pidfd of process %d: %s", pid, strerror(errno));
+        free(process);
+        return;
+    }
+
+    process->pid = pid;
+    process->kill_fd = kill_fd;
+    clock_gettime(CLOCK_MONOTONIC, &process->started_at);
+    snprintf(process->kind, sizeof(process->kind), "%s", kind);
+    snprintf(process->username,
+             sizeof(process->username),
+             "%s",
+             username ? username : "");
+    snprintf(process->source_ip,
+             sizeof(process->source_ip),
+             "%s",
+             source_ip ? source_ip : "-");
+
+    process->exit_event =
+        event_new(base, process->pidfd, EV_READ, on_process_exit, process);
+    if (!process->exit_event)
+    {
+        ERROR("Failed to watch process %d", pid);
+        close(process->pidfd);
+        free(process);
+        return;
+    }
+    event_add(process->exit_event, NULL);
+    track_parent_fd(process->pidfd);
+
+    process->next = g_supervisor.processes;
+    if (process->next) process->next->prev = process;
+    g_supervisor.processes = process;
+    g_supervisor.count++;
+
+    if (g_supervisor.draining) orphan_process(process);
+}
+
+void drain_supervised_processes(struct event_base *base, int timeout)
+{
+    if (g_supervisor.draining) return;
+    g_supervisor.draining = 1;
+
+    for (supervised_process_t *process = g_supervisor.processes; process;
+         process = process->next)
+        orphan_process(process);
+
+    if (timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &g_supervisor.drain_deadline);
+        g_supervisor.drain_deadline.tv_sec += timeout;
+    }
+
+    /* Without pidfds nothing is known about the children, they are left to
+     * finish on their own */
+    INFO("Draining %u child processes", g_supervisor.count);
+
+    struct timeval interval = {SUPERVISOR_DRAIN_CHECK_INTERVAL, 0};
+    g_supervisor.drain_base = base;
+    g_supervisor.drain_event =
+        event_new(base, -1, EV_PERSIST, on_drain_check, NULL);
+    event_add(g_supervisor.drain_event, &interval);
+    on_drain_check(-1, EV_TIMEOUT, NULL);
+}
+
+static void orphan_process(supervised_process_t *process)
+{
+    if (process->kill_fd < 0) return;
+    untrack_parent_fd(process->kill_fd);
+    close(process->kill_fd);
+    process->kill_fd = -1;
+}
+
+static void on_drain_check(evutil_socket_t fd __attribute__((unused)),
+                           short what __attribute__((unused)),
+                           void *arg __attribute__((unused)))
+{
+    int expired = 0;
+    if (g_supervisor.drain_deadline.tv_sec)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        expired = now.tv_sec >= g_supervisor.drain_deadline.tv_sec;
+    }
+
+    if (g_supervisor.count && !expired) return;
+
+    if (g_supervisor.count)
+        WARN("Drain deadline passed with %u child processes left, they go "
+             "on unsupervised",
+             g_supervisor.count);
+    else
+        INFO("All child processes are gone");
+    event_base_loopexit(g_supervisor.drain_base, NULL);
+}
+
+static int open_pidfd(pid_t pid)
+{
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void on_process_exit(evutil_socket_t fd __attribute__((unused)),
+                            short what __attribute__((unused)),
+                            void *arg)
+{
+    supervised_process_t *process = (supervised_process_t *)arg;
+
+    exit_snapshot_t snapshot;
+    read_exit_snapshot(process->pid, &snapshot);
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    pid_t reaped;
+    do
+        reaped = wait4(process->pid, &status, 0, &usage);
+    while (reaped < 0 && errno == EINTR);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wall = (double)(now.tv_sec - process->started_at.tv_sec) +
+                  (now.tv_nsec - process->started_at.tv_nsec) / 1e9;
+
+    if (!process->username[0])
+        name_user(snapshot.uid, process->username, sizeof(process->username));
+
+    char how[32];
+    if (reaped < 0)
+        snprintf(how, sizeof(how), "unknown");
+    else if (WIFSIGNALED(status))
+    {
+        snprintf(how, sizeof(how), "signal:%d", WTERMSIG(status));
+        reclaim_admissions(process->pid);
+    }
+    else
+        snprintf(how, sizeof(how), "exit:%d", WEXITSTATUS(status));
+
+    INFO("Resource usage %s pid=%d user=%s ip=%s status=%s wall=%.3fs "
+         "cpu_user=%.3fs cpu_sys=%.3fs max_rss=%ldkB read=%llu written=%llu "
+         "blk_in=%ld blk_out=%ld vcsw=%ld ivcsw=%ld",
+         process->kind,
+         process->pid,
+         process->username,
+         process->source_ip,
+         how,
+         wall,
+         seconds(usage.ru_utime),
+         seconds(usage.ru_stime),
+         usage.ru_maxrss,
+         snapshot.rchar,
+         snapshot.wchar,
+         usage.ru_inblock,
+         usage.ru_oublock,
+         usage.ru_nvcsw,
+         usage.ru_nivcsw);
+
+    if (process->prev)
+        process->prev->next = process->next;
+    else
+        g_supervisor.processes = process->next;
+    if (process->next) process->next->prev = process->prev;
+    g_supervisor.count--;
+
+    orphan_process(process);
+    untrack_parent_fd(process->pidfd);
+    event_free(process->exit_event);
+    close(process->pidfd);
+    free(process);
+}
+
+static void read_exit_snapshot(pid_t pid, exit_snapshot_t *snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->uid = -1;
+
+    char path[64];
+    char line[256];
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file)
+    {
+        while (fgets(line, sizeof(line), file))
+            if (sscanf(line, "Uid: %ld", &snapshot->uid) == 1) break;
+        fclose(file);
+    }
+
+    /* Includes the control and data sockets, not only files */
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    file = fopen(path, "r");
+    if (file)
+    {
+        while (fgets(line, sizeof(line), file))
+        {
+            sscanf(line, "rchar: %llu", &snapshot->rchar);
+            sscanf(line, "wchar: %llu", &snapshot->wchar);
+        }
+        fclose(file);
+    }
+}
+
+static void name_user(long uid, char *buffer, size_t buffer_size)
+{
+    /* Still root, the session never logged in */
+    if (uid <= 0)
+    {
+        snprintf(buffer, buffer_size, "-");
+        return;
+    }
+
+    /* Never NSS, a slow directory would stall the accepting loop */
+    const char *name = lookup_snapshot_name(0, (uint32_t)uid);
+    if (name)
+        snprintf(buffer, buffer_size, "%s", name);
+    else
+        snprintf(buffer, buffer_size, "%ld", uid);
+}
+
+static double seconds(struct timeval tv)
+{
+    return (double)tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,60 @@
+/*
+    pidfd based supervision of forked processes.
+
+    Every process that forks sessions (the accepting process, the zygote)
+    registers each child with a pidfd on its own event loop. When the pidfd
+    becomes readable the child is a zombie: the supervisor reads what only
+    /proc still knows about it (uid, read and written bytes), reaps it with
+    wait4 and logs one resource record with CPU user and system time, max
+    RSS, block I/O, context switches, wall time, the user and the source IP.
+    Children forked before the user was known are named by the uid they
+    ended with, from the name snapshot or as the number, see
+    name_snapshot.h.
+
+    The supervisor also owns the write end of each child's kill switch.
+    Closing it orphans the child: sessions finish a running transfer and
+    leave, see on_parent_dead. Draining orphans every child and ends the
+    loop once all of them are gone.
+
+    The blind SIGCHLD reaper is only installed where pidfds are not
+    supported (before Linux 5.3), records are not available there.
+*/
+
+#ifndef SESSION_SUPERVISOR_H
+#define SESSION_SUPERVISOR_H
+
+#include <event2/event.h>
+#include <sys/types.h>
+
+/*!
+ * @brief Checks whether pidfds can be used, called once in the main process
+ * before anything is forked.
+ * @return 1 if children will be reaped by the supervisor, 0 if the caller
+ * has to install a reaper of its own.
+ */
+int start_session_supervisor(void);
+
+/*!
+ * @brief Watches a child of the calling process until it exits, then reaps
+ * it and logs its resource usage.
+ * @param kill_fd Write end of the child's kill switch, owned by the
+ * supervisor from now on, -1 if the child has none.
+ * @param kind What the child is, e.g. "session", starts the record.
+ * @param username User the child runs as, NULL or empty if not known yet.
+ * @param source_ip Client address, NULL if the child serves many clients.
+ */
+void supervise_process(struct event_base *base,
+                       pid_t pid,
+                       int kill_fd,
+                       const char *kind,
+                       const char *username,
+                       const char *source_ip);
+
+/*!
+ * @brief Orphans every supervised child and every child supervised from now
+ * on, then exits the loop of base once none is left or after timeout
+ * seconds (0 waits for as long as it takes).
+ */
+void drain_supervised_processes(struct event_base *base, int timeout);
+
+#endif
@@ -0,0 +1,229 @@
+#include "session_threads.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "control_handler.h"
+#include "error.h"
+#include "hibernate.h"
+#include "nss_helper.h"
+#include "preauth.h"
+#include "server_state.h"
+#include "session_fs.h"
+#include "zygote.h"
+
+extern server_state_t g_server_state;
+
+/* Accepted control socket on its way to a session thread, small enough for
+ * a single atomic pipe write */
+typedef struct
+{
+    evutil_socket_t fd;
+    admission_t admission;
+    struct sockaddr_storage addr;
+} session_handoff_t;
+
+typedef struct
+{
+    pthread_t thread;
+    struct event_base *base;
+    int notify_fd[2]; /* Accepting loop writes, session thread reads */
+    struct event *notify_event;
+} session_thread_t;
+
+typedef struct
+{
+    session_thread_t *threads;
+    int count;
+    uint32_t next; /* Round robin cursor */
+} session_threads_t;
+
+static session_threads_t g_session_threads;
+
+static void start_session_threads(int count);
+static void *run_session_thread(void *arg);
+static void on_session_handoff(evutil_socket_t fd, short events, void *ctx);
+
+accept_callback_t prepare_session_engine(void)
+{
+    if (g_server_state.config.session_model != SESSION_MODEL_THREADS)
+    {
+        /* Forked before the crypt threads exist, see nss_helper.h */
+        start_nss_helper();
+
+        /* Before the zygote, its sessions inherit the channel too */
+        start_hibernation();
+
+        /* Pre-auth forks from the accepting process on purpose, the TLS
+         * state of the session is only in its memory. Per user and
+         * anonymous workers need the login done before any session process
+         * exists. */
+        if (g_server_state.config.preauth_in_parent ||
+            g_server_state.config.session_per_user ||
+            g_server_state.config.anonymous_root[0])
+        {
+            start_preauth();
+            return preauth_accept_cb;
+        }
+
+        if (g_server_state.config.session_zygote)
+        {
+            start_zygote();
+            return zygote_accept_cb;
+        }
+
+        return control_connection_accept_cb;
+    }
+
+    int count = g_server_state.config.session_threads;
+    if (count == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+    }
+
+    /* A client resetting the connection must not take every session down */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Passwords are hashed off the session threads, see preauth.h */
+    start_crypt_threads();
+    start_session_threads(count);
+    return session_thread_accept_cb;
+}
+
+void check_session_confinement(void)
+{
+    if (g_server_state.config.session_model != SESSION_MODEL_THREADS) return;
+
+    /* Without a chroot only openat2 keeps sessions in their home */
+    if (!session_fs_require_confinement())
+    {
+        ERROR("session_model=threads needs openat2 (Linux 5.6 or later, "
+              "not blocked by seccomp): %s",
+              strerror(errno));
+        exit(-1);
+    }
+}
+
+static void start_session_threads(int count)
+{
+    g_session_threads.count = count;
+    g_session_threads.threads = calloc(count, sizeof(session_thread_t));
+    if (!g_session_threads.threads)
+    {
+        ERROR("Failed to allocate %d session threads", count);
+        exit(-1);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        session_thread_t *thread = &g_session_threads.threads[i];
+
+        thread->base = event_base_new();
+        if (!thread->base || pipe2(thread->notify_fd, O_CLOEXEC) != 0)
+        {
+            ERROR("Failed to set up session thread %d", i);
+            exit(-1);
+        }
+
+        evutil_make_socket_nonblocking(thread->notify_fd[0]);
+        thread->notify_event = event_new(thread->base,
+                                         thread->notify_fd[0],
+                                         EV_READ | EV_PERSIST,
+                                         on_session_handoff,
+                                         thread);
+        event_add(thread->notify_event, NULL);
+
+        if (pthread_create(&thread->thread, NULL, run_session_thread, thread))
+        {
+            ERROR("Failed to start session thread %d", i);
+            exit(-1);
+        }
+    }
+
+    INFO("Started %d session threads", count);
+}
+
+static void *run_session_thread(void *arg)
+{
+    session_thread_t *thread = (session_thread_t *)arg;
+    if (!watch_login_results(thread->base))
+        WARN("Session thread cannot check passwords, PASS is refused");
+    event_base_dispatch(thread->base);
+    return NULL;
+}
+
+void session_thread_accept_cb(struct evconnlistener *listener
+                              __attribute__((unused)),
+                              evutil_socket_t fd,
+                              struct sockaddr *addr,
+                              int len,
+                              void *ctx __attribute__((unused)))
+{
+    session_handoff_t handoff;
+    memset(&handoff, 0, sizeof(handoff));
+    if (!admit_connection(fd, addr, &handoff.admission)) return;
+
+    __sync_add_and_fetch(&g_server_state.current_connections, 1);
+    handoff.fd = fd;
+    if (len > 0 && (size_t)len <= sizeof(handoff.addr))
+        memcpy(&handoff.addr, addr, len);
+
+    uint32_t index = g_session_threads.next++ % g_session_threads.count;
+    session_thread_t *thread = &g_session_threads.threads[index];
+
+    if (write(thread->notify_fd[1], &handoff, sizeof(handoff)) !=
+        sizeof(handoff))
+    {
+        ERROR("Failed to hand connection over to session thread %" PRIu32
+              ": %s",
+              index,
+              strerror(errno));
+        __sync_sub_and_fetch(&g_server_state.current_connections, 1);
+        release_admission(&handoff.admission);
+        close(fd);
+    }
+}
+
+static void on_session_handoff(evutil_socket_t fd,
+                               short events __attribute__((unused)),
+                               void *ctx)
+{
+    session_thread_t *thread = (session_thread_t *)ctx;
+    session_handoff_t handoff;
+
+    while (read(fd, &handoff, sizeof(handoff)) == sizeof(handoff))
+    {
+        connection_t *connection = create_connection(
+            g_server_state.ssl_ctx, (struct sockaddr *)&handoff.addr);
+        if (!connection)
+        {
+            __sync_sub_and_fetch(&g_server_state.current_connections, 1);
+            release_admission(&handoff.admission);
+            close(handoff.fd);
+            continue;
+        }
+
+        connection->admission = handoff.admission;
+        connection->base = thread->base;
+        connection->shared_loop = 1;
+        INFO("Control connection with %s", connection->source_ip);
+
+        evutil_make_socket_nonblocking(handoff.fd);
+        setup_control_connection(handoff.fd, connection);
+        if (!connection->bev)
+        {
+            __sync_sub_and_fetch(&g_server_state.current_connections, 1);
+            release_admission(&connection->admission);
+            close(handoff.fd);
+            free(connection);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+/*
+    Threaded session model.
+
+    A fixed set of session threads each run their own event_base and
+    multiplex many sessions, the accepting loop only hands accepted control
+    sockets over. Passwords are checked on the crypt threads of preauth.h. Sessions are not chrooted and the process keeps running as
+    root, every filesystem access goes through session_fs with the session's
+    root directory fd and per thread fsuid/fsgid.
+*/
+
+#ifndef SESSION_THREADS_H
+#define SESSION_THREADS_H
+
+#include "connection.h"
+
+/*!
+ * @brief Prepares the configured session model in the calling process.
+ * @return The accept callback to put on the control listener, for the
+ * threaded model the session threads (for pre-auth in the process model the
+ * crypt threads) are running when this returns.
+ * @details Must be called in the process that will accept, threads do not
+ * survive fork so prefork workers call it after forking.
+ */
+accept_callback_t prepare_session_engine(void);
+
+/*!
+ * @brief Exits if the threaded model is configured but openat2 is missing,
+ * called once in the main process before anything is forked.
+ */
+void check_session_confinement(void);
+
+/*!
+ * @brief Accept callback of the threaded model, hands the socket to the next
+ * session thread.
+ */
+void session_thread_accept_cb(struct evconnlistener *listener,
+                              evutil_socket_t fd,
+                              struct sockaddr *addr,
+                              int len,
+                              void *ctx);
+
+#endif
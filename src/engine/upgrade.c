@@ -0,0 +1,314 @@
+#include "upgrade.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "error.h"
+#include "nss_helper.h"
+#include "server_state.h"
+#include "session_supervisor.h"
+#include "worker_pool.h"
+#include "zygote.h"
+
+#ifndef SYS_close_range
+#define SYS_close_range 436 /* Same number on every architecture */
+#endif
+
+#define UPGRADE_LISTENER_ENV "CFTP_UPGRADE_LISTENER_FD"
+#define UPGRADE_READY_ENV "CFTP_UPGRADE_READY_FD"
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    char binary[PATH_MAX]; /* Resolved at startup, the file may be replaced */
+    int ready_fd;          /* Readiness pipe to the previous binary or -1 */
+    int inherited;         /* Started by an upgrade */
+    pid_t pid;             /* New binary that has not reported yet, or 0 */
+    int ready;             /* It reported at least once */
+    int draining;
+    struct event *ready_event;
+    struct event *upgrade_event;
+    struct event *drain_event;
+} upgrade_t;
+
+static upgrade_t g_upgrade = {.ready_fd = -1};
+
+static void on_upgrade_signal(evutil_socket_t sig, short what, void *arg);
+static void on_drain_signal(evutil_socket_t sig, short what, void *arg);
+static void on_upgrade_ready(evutil_socket_t fd, short what, void *arg);
+static void exec_upgrade(int listener_fd, int ready_fd)
+    __attribute__((noreturn));
+static void drain_acceptor(void);
+static int take_inherited_fd(const char *name);
+static void close_other_fds(int keep_a, int keep_b);
+static void close_fd_range(unsigned first, unsigned last);
+
+void start_upgrade_handling(void)
+{
+    /* Children forked from here on must not keep the previous binary
+     * waiting */
+    g_upgrade.ready_fd = take_inherited_fd(UPGRADE_READY_ENV);
+    if (g_upgrade.ready_fd >= 0) track_parent_fd(g_upgrade.ready_fd);
+    g_upgrade.inherited = g_upgrade.ready_fd >= 0;
+
+    ssize_t len = readlink(
+        "/proc/self/exe", g_upgrade.binary, sizeof(g_upgrade.binary) - 1);
+    if (len < 0)
+    {
+        WARN("Cannot resolve the server binary (%s), SIGUSR2 does not "
+             "upgrade",
+             strerror(errno));
+        len = 0;
+    }
+    g_upgrade.binary[len] = '\0';
+
+    g_upgrade.upgrade_event =
+        evsignal_new(g_server_state.base, SIGUSR2, on_upgrade_signal, NULL);
+    event_add(g_upgrade.upgrade_event, NULL);
+    g_upgrade.drain_event =
+        evsignal_new(g_server_state.base, SIGQUIT, on_drain_signal, NULL);
+    event_add(g_upgrade.drain_event, NULL);
+}
+
+void watch_drain_signal(void)
+{
+    /* Upgrades are driven by the pool supervisor */
+    signal(SIGUSR2, SIG_IGN);
+
+    g_upgrade.drain_event =
+        evsignal_new(g_server_state.base, SIGQUIT, on_drain_signal, NULL);
+    event_add(g_upgrade.drain_event, NULL);
+}
+
+int started_by_upgrade(void) { return g_upgrade.inherited; }
+
+int take_inherited_listener(int port)
+{
+    int fd = take_inherited_fd(UPGRADE_LISTENER_ENV);
+    if (fd < 0) return -1;
+
+    int listening = 0;
+    socklen_t listening_len = sizeof(listening);
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    if (getsockopt(
+            fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_len) < 0 ||
+        !listening ||
+        getsockname(fd, (struct sockaddr *)&sin, &sin_len) < 0 ||
+        sin.sin_family != AF_INET || ntohs(sin.sin_port) != port)
+    {
+        WARN("Inherited descriptor %d is no listener on port %d, binding a "
+             "new one",
+             fd,
+             port);
+        close(fd);
+        return -1;
+    }
+
+    evutil_make_socket_nonblocking(fd);
+    INFO("Took over the listener of the previous binary");
+    return fd;
+}
+
+void announce_upgrade_ready(int listening)
+{
+    if (g_upgrade.ready_fd < 0) return;
+
+    if (listening && send(g_upgrade.ready_fd, "1", 1, MSG_NOSIGNAL) != 1)
+        WARN("Cannot report to the previous binary: %s", strerror(errno));
+
+    untrack_parent_fd(g_upgrade.ready_fd);
+    close(g_upgrade.ready_fd);
+    g_upgrade.ready_fd = -1;
+}
+
+static void on_upgrade_signal(evutil_socket_t sig __attribute__((unused)),
+                              short what __attribute__((unused)),
+                              void *arg __attribute__((unused)))
+{
+    if (g_upgrade.draining || g_upgrade.pid || !g_upgrade.binary[0])
+    {
+        WARN("Upgrade ignored, %s",
+             g_upgrade.draining ? "already draining"
+             : g_upgrade.pid    ? "another one is in progress"
+                                : "the binary is unknown");
+        return;
+    }
+
+    int ready[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ready) < 0)
+    {
+        ERROR("Failed to create upgrade readiness socket: %s",
+              strerror(errno));
+        return;
+    }
+
+    int listener_fd = g_server_state.listener
+                          ? evconnlistener_get_fd(g_server_state.listener)
+                          : -1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) exec_upgrade(listener_fd, ready[1]);
+
+    close(ready[1]);
+    if (pid < 0)
+    {
+        ERROR("Failed to fork upgrade: %s", strerror(errno));
+        close(ready[0]);
+        return;
+    }
+
+    g_upgrade.pid = pid;
+    g_upgrade.ready = 0;
+    track_parent_fd(ready[0]);
+    g_upgrade.ready_event = event_new(g_server_state.base,
+                                      ready[0],
+                                      EV_READ | EV_PERSIST,
+                                      on_upgrade_ready,
+                                      NULL);
+    event_add(g_upgrade.ready_event, NULL);
+    INFO("Upgrading to %s in process %d", g_upgrade.binary, pid);
+}
+
+static void on_drain_signal(evutil_socket_t sig __attribute__((unused)),
+                            short what __attribute__((unused)),
+                            void *arg __attribute__((unused)))
+{
+    if (g_upgrade.draining) return;
+    g_upgrade.draining = 1;
+
+    if (g_server_state.config.worker_processes > 0 && !g_server_state.listener)
+        drain_worker_pool(); /* Pool supervisor */
+    else
+        drain_acceptor();
+}
+
+static void on_upgrade_ready(evutil_socket_t fd,
+                             short what __attribute__((unused)),
+                             void *arg __attribute__((unused)))
+{
+    /* Every process of the new binary that listens reports, the last one
+     * closing the socket ends the wait */
+    char buffer[64];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n > 0) g_upgrade.ready = 1;
+    if (n > 0 || (n < 0 && (errno == EINTR || errno == EAGAIN))) return;
+
+    event_free(g_upgrade.ready_event);
+    g_upgrade.ready_event = NULL;
+    untrack_parent_fd(fd);
+    close(fd);
+
+    pid_t pid = g_upgrade.pid;
+    g_upgrade.pid = 0;
+    if (!g_upgrade.ready)
+    {
+        /* Closed without reporting, it exits or already did */
+        waitpid(pid, NULL, 0);
+        ERROR("Upgraded binary in process %d failed to start, still serving",
+              pid);
+        return;
+    }
+
+    INFO("Upgraded binary in process %d accepts now", pid);
+    on_drain_signal(-1, 0, NULL);
+}
+
+static void exec_upgrade(int listener_fd, int ready_fd)
+{
+    close_other_fds(listener_fd, ready_fd);
+
+    char value[16];
+    fcntl(ready_fd, F_SETFD, 0);
+    snprintf(value, sizeof(value), "%d", ready_fd);
+    setenv(UPGRADE_READY_ENV, value, 1);
+    if (listener_fd >= 0)
+    {
+        fcntl(listener_fd, F_SETFD, 0);
+        snprintf(value, sizeof(value), "%d", listener_fd);
+        setenv(UPGRADE_LISTENER_ENV, value, 1);
+    }
+
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    char *argv[] = {g_upgrade.binary, NULL};
+    execv(g_upgrade.binary, argv);
+    ERROR("Cannot execute %s: %s", g_upgrade.binary, strerror(errno));
+    _exit(127);
+}
+
+static void drain_acceptor(void)
+{
+    if (g_server_state.listener)
+    {
+        untrack_parent_fd(evconnlistener_get_fd(g_server_state.listener));
+        evconnlistener_free(g_server_state.listener);
+        g_server_state.listener = NULL;
+    }
+    stop_zygote();
+    stop_nss_helper();
+
+    INFO("Stopped accepting on port %d", g_server_state.config.port);
+    drain_supervised_processes(g_server_state.base,
+                               g_server_state.config.upgrade_drain_timeout);
+}
+
+static int take_inherited_fd(const char *name)
+{
+    const char *value = getenv(name);
+    if (!value) return -1;
+
+    char *end;
+    errno = 0;
+    long fd = strtol(value, &end, 10);
+    int valid = !errno && end != value && !*end && fd > STDERR_FILENO &&
+                fd <= INT_MAX && fcntl((int)fd, F_GETFD) >= 0;
+    if (!valid) WARN("Ignoring %s=%s", name, value);
+
+    /* Must not reach the next binary */
+    unsetenv(name);
+    return valid ? (int)fd : -1;
+}
+
+static void close_other_fds(int keep_a, int keep_b)
+{
+    int keep[2] = {keep_a < keep_b ? keep_a : keep_b,
+                   keep_a < keep_b ? keep_b : keep_a};
+
+    unsigned first = STDERR_FILENO + 1;
+    for (int i = 0; i < 2; i++)
+    {
+        if (keep[i] < (int)first) continue;
+        close_fd_range(first, (unsigned)keep[i] - 1);
+        first = (unsigned)keep[i] + 1;
+    }
+    close_fd_range(first, ~0U);
+}
+
+static void close_fd_range(unsigned first, unsigned last)
+{
+    if (first > last) return;
+    if (syscall(SYS_close_range, first, last, 0) == 0) return;
+
+    /* Before Linux 5.9 */
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0) max = 1024;
+    for (long fd = first; fd <= (long)last && fd < max; fd++) close((int)fd);
+}
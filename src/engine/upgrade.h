@@ -0,0 +1,59 @@
+/*
+    Binary upgrade and graceful drain.
+
+    SIGUSR2 to the main process forks and execs the binary it was started
+    from. In the accepting process the listening socket is handed over as
+    an inherited descriptor, connections queued on it are accepted by the
+    new binary. The worker pool supervisor hands nothing over, the new
+    workers bind SO_REUSEPORT listeners of their own next to the old ones.
+    The new binary reports over a socket once it listens, only then the
+    old one drains. If it dies before that the old one keeps serving.
+
+    SIGQUIT drains without an upgrade. Draining frees the listener, stops
+    the zygote and the name resolver helper (owners the name snapshot does
+    not know are shown as ids from then on) and orphans every session
+    process (see on_parent_dead): running transfers finish, idle clients
+    are told to reconnect. The old process exits once its children are
+    gone or upgrade_drain_timeout passed. User workers take no more
+    sessions and keep theirs until the clients leave. Pre-auth and
+    hibernated sessions live in the old process itself and end with it, so
+    do sessions of the threaded model.
+*/
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*!
+ * @brief Remembers the binary and handles SIGUSR2 and SIGQUIT on the loop
+ * of the main process, called once before anything is forked.
+ * @details A process started by an upgrade also takes over the readiness
+ * pipe here.
+ */
+void start_upgrade_handling(void);
+
+/*!
+ * @brief Handles SIGQUIT in an acceptor worker of the pool by draining it.
+ */
+void watch_drain_signal(void);
+
+/*!
+ * @brief Tells whether the process was started by an upgrade, valid after
+ * start_upgrade_handling.
+ */
+int started_by_upgrade(void);
+
+/*!
+ * @brief Takes over the listening socket of the previous binary.
+ * @return The descriptor if one was inherited for port, else -1.
+ */
+int take_inherited_listener(int port);
+
+/*!
+ * @brief Tells the previous binary that the calling process accepts now and
+ * lets go of the readiness pipe. Does nothing without an upgrade.
+ * @param listening 0 only lets go, for the pool supervisor whose workers
+ * report for it.
+ */
+void announce_upgrade_ready(int listening);
+
+#endif
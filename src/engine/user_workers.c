@@ -0,0 +1,577 @@
+#include "user_workers.h"
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "auth.h"
+#include "command_parser.h"
+#include "control_handler.h"
+#include "error.h"
+#include "interprocess_handler.h"
+#include "name_snapshot.h"
+#include "server_state.h"
+#include "session_fs.h"
+#include "session_placement.h"
+#include "session_supervisor.h"
+
+#define USER_WORKER_IDLE_CHECK_INTERVAL 1 /* Seconds, once orphaned */
+
+extern server_state_t g_server_state;
+
+/* Messages on the worker control socket, each starts with its kind and
+ * carries one descriptor as SCM_RIGHTS */
+#define USER_WORKER_SESSION 1 /* A user_session_t and its control socket */
+#define USER_WORKER_NAMES 2   /* The kind alone and a newer name snapshot */
+
+/* Session handed to a user worker. Only input_length bytes of input are
+ * sent. */
+typedef struct
+{
+    uint32_t kind; /* USER_WORKER_SESSION */
+    char username[256];
+    uint32_t uid;
+    uint32_t gid;
+    transfer_mode_t transfer_mode;
+    int data_tls_required;
+    int anonymous;
+    char source_ip[INET6_ADDRSTRLEN];
+    admission_t admission;
+    uint32_t input_length;
+    char input[MAX_PIPELINED_INPUT]; /* Commands pipelined after PASS */
+} user_session_t;
+
+/* Accepting process side, one per uid with a live worker plus the pool of
+ * anonymous workers */
+typedef struct user_worker
+{
+    uint32_t uid;
+    int anonymous;
+    int slot; /* Position in the anonymous pool */
+    pid_t pid;
+    int fd;      /* Accepting process end of the worker control socket */
+    uint32_t snapshot_generation; /* Of the name snapshot it runs from */
+    struct event *exit_event;
+    unsigned long sessions;
+    struct user_worker *next;
+} user_worker_t;
+
+/* Worker side */
+typedef struct
+{
+    struct event_base *base;
+    ipc_channel_t *ipc; /* Shared by all sessions */
+    uint32_t uid;
+    int anonymous;
+    struct event *kill_event;
+    struct event *session_event;
+    struct event *orphan_event; /* Exits once the last session ended */
+} user_worker_state_t;
+
+static user_worker_t *g_user_workers;
+static unsigned long g_anonymous_sessions; /* Round robin over the pool */
+static struct event *g_snapshot_event; /* Sends workers new snapshots */
+static user_worker_state_t g_worker;
+
+static user_worker_t *spawn_user_worker(connection_t *connection,
+                                        const user_identity_t *identity,
+                                        int slot);
+static void retire_user_worker(user_worker_t *worker);
+static void on_user_worker_exit(evutil_socket_t fd, short what, void *arg);
+static int send_user_session(user_worker_t *worker, connection_t *connection);
+static void send_name_snapshot(user_worker_t *worker);
+static void on_snapshot_timer(evutil_socket_t fd, short what, void *ctx);
+static int send_with_fd(int socket, const void *message, size_t length, int fd);
+static void run_user_worker(int control_fd, int interprocess_fd, int pipe)
+    __attribute__((noreturn));
+static void on_user_session(evutil_socket_t fd, short what, void *ctx);
+static void on_user_worker_orphaned(evutil_socket_t fd, short what, void *ctx);
+static void exit_when_idle(evutil_socket_t fd, short what, void *ctx);
+static void adopt_user_session(const user_session_t *session, int fd);
+static void receive_user_session(user_session_t *session,
+                                 size_t length,
+                                 int fd);
+
+int route_to_user_worker(connection_t *connection,
+                         const user_identity_t *identity)
+{
+    /* Commands pipelined after PASS travel along up to one buffer, a
+     * forked session takes any amount */
+    if (evbuffer_get_length(bufferevent_get_input(connection->bev)) >
+        MAX_PIPELINED_INPUT)
+        return 0;
+
+    int slot = 0;
+    if (connection->anonymous)
+        slot = g_anonymous_sessions++ %
+               g_server_state.config.anonymous_workers;
+
+    user_worker_t *worker = g_user_workers;
+    while (worker && (worker->anonymous != connection->anonymous ||
+                      worker->uid != connection->uid || worker->slot != slot))
+        worker = worker->next;
+
+    refresh_name_snapshot();
+    if (!worker && !(worker = spawn_user_worker(connection, identity, slot)))
+        return 0;
+    send_name_snapshot(worker);
+
+    if (send_user_session(worker, connection) < 0)
+    {
+        WARN("User worker %d of %s unreachable: %s",
+             worker->pid,
+             connection->username,
+             strerror(errno));
+        if (errno != EAGAIN) retire_user_worker(worker); /* Else backlogged */
+        return 0;
+    }
+
+    worker->sessions++;
+    INFO("Session of %s from %s handed to user worker %d, %lu so far",
+         connection->username,
+         connection->source_ip,
+         worker->pid,
+         worker->sessions);
+
+    /* The worker owns the socket now, the local copy only goes away */
+    release_connection(connection);
+    return 1;
+}
+
+static user_worker_t *spawn_user_worker(connection_t *connection,
+                                        const user_identity_t *identity,
+                                        int slot)
+{
+    user_worker_t *worker = calloc(1, sizeof(user_worker_t));
+    if (!worker)
+    {
+        ERROR("Failed to allocate user worker for %s", connection->username);
+        return NULL;
+    }
+
+    int control[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, control) < 0)
+    {
+        ERROR("Failed to create user worker socket: %s", strerror(errno));
+        free(worker);
+        return NULL;
+    }
+
+    int rpc_fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, rpc_fd) < 0)
+    {
+        ERROR("Failed to create socket pair: %s", strerror(errno));
+        close(control[0]);
+        close(control[1]);
+        free(worker);
+        return NULL;
+    }
+
+    int pipe_fd[2]; /* Kill switch, see start_control_connection_loop */
+    if (pipe(pipe_fd) < 0)
+    {
+        ERROR("Failed to create kill switch pipe: %s", strerror(errno));
+        close(control[0]);
+        close(control[1]);
+        close(rpc_fd[0]);
+        close(rpc_fd[1]);
+        free(worker);
+        return NULL;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(control[0]);
+        close(rpc_fd[0]);
+        close(pipe_fd[1]);
+        close_parent_fds(-1);
+        place_session_process(-1); /* Serves many clients */
+
+        /* Forked next to the crypt threads, NSS is not safe to use here */
+        char error_buf[256];
+        if (!switch_to_identity(identity, error_buf))
+        {
+            ERROR("User worker of %s: %s", connection->username, error_buf);
+            exit(1);
+        }
+
+        g_worker.uid = connection->uid;
+        g_worker.anonymous = connection->anonymous;
+        g_server_state.current_connections = 0; /* Counts its own sessions */
+        run_user_worker(control[1], rpc_fd[1], pipe_fd[0]);
+    }
+
+    close(control[1]);
+    close(rpc_fd[1]);
+    close(pipe_fd[0]);
+
+    if (pid < 0)
+    {
+        ERROR("Failed to fork user worker for %s: %s",
+              connection->username,
+              strerror(errno));
+        close(control[0]);
+        close(rpc_fd[0]);
+        close(pipe_fd[1]);
+        free(worker);
+        return NULL;
+    }
+
+    worker->uid = connection->uid;
+    worker->anonymous = connection->anonymous;
+    worker->slot = slot;
+    worker->pid = pid;
+    worker->fd = control[0];
+    name_snapshot_fd(&worker->snapshot_generation); /* Inherited */
+    track_parent_fd(worker->fd);
+
+    /* Workers without new sessions get new snapshots all the same */
+    int interval = g_server_state.config.name_snapshot_interval;
+    if (!g_snapshot_event && interval > 0 &&
+        (g_snapshot_event = event_new(g_server_state.base,
+                                      -1,
+                                      EV_PERSIST,
+                                      on_snapshot_timer,
+                                      NULL)))
+    {
+        struct timeval period = {interval, 0};
+        event_add(g_snapshot_event, &period);
+    }
+
+    /* The worker never writes, readable means it is gone */
+    worker->exit_event = event_new(g_server_state.base,
+                                   worker->fd,
+                                   EV_READ,
+                                   on_user_worker_exit,
+                                   worker);
+    event_add(worker->exit_event, NULL);
+
+    register_interprocess_fd_on_server(rpc_fd[0]);
+    supervise_process(g_server_state.base,
+                      pid,
+                      pipe_fd[1],
+                      connection->anonymous ? "anonymous-worker"
+                                            : "user-worker",
+                      connection->username,
+                      NULL);
+
+    worker->next = g_user_workers;
+    g_user_workers = worker;
+
+    if (worker->anonymous)
+        INFO("Anonymous worker %d running as process %d", slot, pid);
+    else
+        INFO("User worker of %s running as process %d",
+             connection->username,
+             pid);
+    return worker;
+}
+
+static void retire_user_worker(user_worker_t *worker)
+{
+    user_worker_t **link = &g_user_workers;
+    while (*link && *link != worker) link = &(*link)->next;
+    if (*link) *link = worker->next;
+
+    untrack_parent_fd(worker->fd);
+    event_free(worker->exit_event);
+    close(worker->fd);
+    free(worker);
+}
+
+static void on_user_worker_exit(evutil_socket_t fd __attribute__((unused)),
+                                short what __attribute__((unused)),
+                                void *arg)
+{
+    user_worker_t *worker = (user_worker_t *)arg;
+    WARN("User worker %d exited after %lu sessions",
+         worker->pid,
+         worker->sessions);
+    retire_user_worker(worker);
+}
+
+static int send_user_session(user_worker_t *worker, connection_t *connection)
+{
+    user_session_t session;
+    memset(&session, 0, offsetof(user_session_t, input));
+    session.kind = USER_WORKER_SESSION;
+    snprintf(session.username,
+             sizeof(session.username),
+             "%s",
+             connection->username);
+    session.uid = connection->uid;
+    session.gid = connection->gid;
+    session.transfer_mode = connection->transfer_mode;
+    session.data_tls_required = connection->data_tls_required;
+    session.anonymous = connection->anonymous;
+    snprintf(session.source_ip,
+             sizeof(session.source_ip),
+             "%s",
+             connection->source_ip);
+    session.admission = connection->admission;
+    ev_ssize_t copied =
+        evbuffer_copyout(bufferevent_get_input(connection->bev),
+                         session.input,
+                         sizeof(session.input));
+    session.input_length = copied > 0 ? (uint32_t)copied : 0;
+
+    /* Handed over first, the worker may adopt it before this returns */
+    pass_admission(&connection->admission, worker->pid);
+    if (send_with_fd(worker->fd,
+                     &session,
+                     offsetof(user_session_t, input) + session.input_length,
+                     connection->fd) < 0)
+    {
+        int error = errno;
+        connection->admission = session.admission;
+        adopt_admission(&connection->admission);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Once the worker has it, the next one is sent when the files change */
+static void send_name_snapshot(user_worker_t *worker)
+{
+    uint32_t generation;
+    int fd = name_snapshot_fd(&generation);
+    if (fd < 0 || generation == worker->snapshot_generation) return;
+
+    uint32_t kind = USER_WORKER_NAMES;
+    if (send_with_fd(worker->fd, &kind, sizeof(kind), fd) < 0)
+    {
+        WARN("User worker %d keeps its name snapshot: %s",
+             worker->pid,
+             strerror(errno));
+        return;
+    }
+    worker->snapshot_generation = generation;
+}
+
+static void on_snapshot_timer(evutil_socket_t fd __attribute__((unused)),
+                              short what __attribute__((unused)),
+                              void *ctx __attribute__((unused)))
+{
+    refresh_name_snapshot();
+    for (user_worker_t *worker = g_user_workers; worker; worker = worker->next)
+        send_name_snapshot(worker);
+}
+
+static int send_with_fd(int socket, const void *message, size_t length, int fd)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {.iov_base = (void *)message, .iov_len = length};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static void run_user_worker(int control_fd, int interprocess_fd, int pipe)
+{
+    g_worker.base = event_base_new();
+    if (!g_worker.base) exit(1);
+
+    g_worker.ipc = open_ipc_channel(g_worker.base, interprocess_fd);
+
+    /* Setup kill switch */
+    g_worker.kill_event = event_new(g_worker.base,
+                                    pipe,
+                                    EV_READ | EV_PERSIST,
+                                    on_user_worker_orphaned,
+                                    NULL);
+    event_add(g_worker.kill_event, NULL);
+
+    g_worker.session_event = event_new(g_worker.base,
+                                       control_fd,
+                                       EV_READ | EV_PERSIST,
+                                       on_user_session,
+                                       NULL);
+    event_add(g_worker.session_event, NULL);
+
+    event_base_dispatch(g_worker.base);
+    exit(0);
+}
+
+static void on_user_worker_orphaned(evutil_socket_t fd,
+                                    short what __attribute__((unused)),
+                                    void *ctx __attribute__((unused)))
+{
+    char dummy[1];
+    ssize_t n = read(fd, dummy, sizeof(dummy));
+    if (n > 0 || (n < 0 && errno == EINTR)) return;
+
+    /* The sessions already here stay until their clients leave */
+    INFO("User worker orphaned with %" PRIu32 " sessions",
+         g_server_state.current_connections);
+    event_free(g_worker.kill_event);
+    event_free(g_worker.session_event);
+    g_worker.kill_event = NULL;
+    g_worker.session_event = NULL;
+
+    struct timeval interval = {USER_WORKER_IDLE_CHECK_INTERVAL, 0};
+    g_worker.orphan_event =
+        event_new(g_worker.base, -1, EV_PERSIST, exit_when_idle, NULL);
+    event_add(g_worker.orphan_event, &interval);
+    exit_when_idle(-1, EV_TIMEOUT, NULL);
+}
+
+static void exit_when_idle(evutil_socket_t fd __attribute__((unused)),
+                           short what __attribute__((unused)),
+                           void *ctx __attribute__((unused)))
+{
+    if (g_server_state.current_connections == 0) exit(0);
+}
+
+static void on_user_session(evutil_socket_t fd,
+                            short what __attribute__((unused)),
+                            void *ctx __attribute__((unused)))
+{
+    user_session_t session;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov = {.iov_base = &session, .iov_len = sizeof(session)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0) exit(n == 0 ? 0 : 1); /* Accepting process is gone */
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        ERROR("Malformed session handoff of %zd bytes", n);
+        return;
+    }
+
+    int received_fd;
+    memcpy(&received_fd, CMSG_DATA(cmsg), sizeof(int));
+
+    if ((size_t)n >= sizeof(session.kind) &&
+        session.kind == USER_WORKER_NAMES)
+    {
+        if (!adopt_name_snapshot(received_fd))
+            WARN("Ignoring a malformed name snapshot");
+        return;
+    }
+
+    receive_user_session(&session, (size_t)n, received_fd);
+}
+
+static void receive_user_session(user_session_t *session,
+                                 size_t length,
+                                 int fd)
+{
+    size_t header = offsetof(user_session_t, input);
+    int complete = session->kind == USER_WORKER_SESSION && length >= header &&
+                   session->input_length <= sizeof(session->input) &&
+                   length == header + session->input_length;
+    if (!complete || session->uid != g_worker.uid ||
+        session->anonymous != g_worker.anonymous)
+    {
+        ERROR("Rejecting session handoff for uid %" PRIu32, session->uid);
+        if (complete) release_admission(&session->admission);
+        close(fd);
+        return;
+    }
+
+    session->username[sizeof(session->username) - 1] = '\0';
+    session->source_ip[sizeof(session->source_ip) - 1] = '\0';
+    adopt_user_session(session, fd);
+}
+
+static void adopt_user_session(const user_session_t *session, int fd)
+{
+    admission_t admission = session->admission;
+    connection_t *connection = create_connection(g_server_state.ssl_ctx, NULL);
+    if (!connection)
+    {
+        release_admission(&admission);
+        close(fd);
+        return;
+    }
+
+    snprintf(connection->username,
+             sizeof(connection->username),
+             "%s",
+             session->username);
+    snprintf(connection->source_ip,
+             sizeof(connection->source_ip),
+             "%s",
+             session->source_ip);
+    connection->uid = session->uid;
+    connection->gid = session->gid;
+    connection->transfer_mode = session->transfer_mode;
+    connection->data_tls_required = session->data_tls_required;
+    connection->anonymous = session->anonymous;
+    connection->fd = fd;
+    connection->base = g_worker.base;
+    connection->shared_loop = 1;
+    connection->ipc = g_worker.ipc;
+    connection->admission = admission;
+    adopt_admission(&connection->admission);
+
+    /* The whole worker already runs chrooted as the user or anonymously */
+    if (session_fs_open_root(connection, "/") < 0)
+    {
+        ERROR("Cannot open session root for %s: %s",
+              connection->username,
+              strerror(errno));
+        release_admission(&connection->admission);
+        close(fd);
+        free(connection);
+        return;
+    }
+
+    __sync_add_and_fetch(&g_server_state.current_connections, 1);
+    setup_logged_in_connection(connection, 1);
+    if (!connection->bev)
+    {
+        __sync_sub_and_fetch(&g_server_state.current_connections, 1);
+        session_fs_close(connection);
+        release_admission(&connection->admission);
+        close(fd);
+        free(connection);
+        return;
+    }
+
+    evbuffer_prepend(bufferevent_get_input(connection->bev),
+                     session->input,
+                     session->input_length);
+    resume_control_input(connection);
+
+    INFO("Control connection with %s for %s",
+         connection->source_ip,
+         connection->username);
+}
@@ -0,0 +1,46 @@
+/*
+    Per user session workers.
+
+    With session_per_user the accepting process logs clients in on its
+    pre-auth loop and then passes the control socket over SCM_RIGHTS to a
+    long lived worker of that user instead of forking a session process. The
+    worker is forked on the first login of a uid, chroots into the user's
+    home and drops to the user exactly like a session process, then runs all
+    sessions of the user on its own loop. The process count follows the
+    number of distinct users instead of the number of sessions, privilege
+    separation between users stays as it was.
+
+    Anonymous sessions go to a pool of anonymous_workers workers the same
+    way. Those chroot once into anonymous_root and run as the unprivileged
+    anonymous_user, whatever user name the client logged in with.
+
+    Workers outlive the name snapshot they were forked with, see
+    name_snapshot.h. The accepting process sends each of them the sealed
+    memfd of every newer snapshot, when it routes a session there and every
+    name_snapshot_interval seconds, so a LIST in a worker names owners as
+    of at most one interval ago.
+
+    Only plain sessions are routed. After AUTH TLS the TLS state lives in
+    the accepting process' OpenSSL objects and cannot be passed on, such a
+    session is forked into a process of its own as before.
+*/
+
+#ifndef USER_WORKERS_H
+#define USER_WORKERS_H
+
+#include "auth.h"
+#include "connection.h"
+
+/*!
+ * @brief Passes a session that just logged in on the pre-auth loop to the
+ * worker of its uid or to the next anonymous worker, forking the worker
+ * first if needed.
+ * @param identity Looked up by the crypt thread, the worker switches to it
+ * without any NSS call, see preauth.h.
+ * @return 1 if the worker took the session over and the local copy was
+ * released, 0 if the caller has to fork a session process instead.
+ */
+int route_to_user_worker(connection_t *connection,
+                         const user_identity_t *identity);
+
+#endif
@@ -0,0 +1,220 @@
+#include "worker_pool.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "connection.h"
+#include "error.h"
+#include "ip_filter.h"
+#include "server_state.h"
+#include "session_threads.h"
+#include "upgrade.h"
+
+#define WORKER_RESPAWN_BACKOFF_S 1 /* Delay respawn of a crash looping worker */
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    pid_t pid;             /* 0 when the slot has no running worker */
+    time_t started_at;     /* To detect workers dying right after start */
+    struct event *respawn; /* Pending delayed respawn timer */
+} worker_slot_t;
+
+typedef struct
+{
+    worker_slot_t *slots;
+    int count;
+    pid_t supervisor_pid;
+    int draining;
+} worker_pool_t;
+
+static worker_pool_t g_pool;
+
+static void spawn_worker(int index);
+static void run_worker(int index) __attribute__((noreturn));
+static void on_worker_exit(evutil_socket_t sig, short events, void *ctx);
+static void on_respawn_timer(evutil_socket_t fd, short events, void *ctx);
+static int running_workers(void);
+
+void start_worker_pool(int workers)
+{
+    g_pool.count = workers;
+    g_pool.supervisor_pid = getpid();
+    g_pool.slots = calloc(workers, sizeof(worker_slot_t));
+    if (!g_pool.slots)
+    {
+        ERROR("Failed to allocate worker pool of %d workers", workers);
+        exit(-1);
+    }
+
+    /* Reaping is done from the loop, this replaces the async SIGCHLD handler
+     * for the supervisor only, workers get the original handler back when
+     * they drop the inherited event base. */
+    struct event *sigchld_event =
+        evsignal_new(g_server_state.base, SIGCHLD, on_worker_exit, NULL);
+    event_add(sigchld_event, NULL);
+
+    for (int i = 0; i < workers; i++) spawn_worker(i);
+    announce_upgrade_ready(0); /* The workers report for themselves */
+
+    INFO("Supervising %d acceptor workers on port %d",
+         workers,
+         g_server_state.config.port);
+    event_base_dispatch(g_server_state.base);
+
+    event_free(sigchld_event);
+    for (int i = 0; i < workers; i++)
+        if (g_pool.slots[i].respawn) event_free(g_pool.slots[i].respawn);
+    free(g_pool.slots);
+}
+
+void drain_worker_pool(void)
+{
+    g_pool.draining = 1;
+    for (int i = 0; i < g_pool.count; i++)
+    {
+        worker_slot_t *slot = &g_pool.slots[i];
+        if (slot->respawn) evtimer_del(slot->respawn);
+        if (slot->pid) kill(slot->pid, SIGQUIT);
+    }
+
+    INFO("Draining %d acceptor workers", running_workers());
+    if (!running_workers()) event_base_loopexit(g_server_state.base, NULL);
+}
+
+void signal_worker_pool(int sig)
+{
+    for (int i = 0; i < g_pool.count; i++)
+        if (g_pool.slots[i].pid) kill(g_pool.slots[i].pid, sig);
+}
+
+static void spawn_worker(int index)
+{
+    fflush(stdout); /* Do not duplicate pending log lines in the worker */
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERROR("Failed to fork acceptor worker %d: %s", index, strerror(errno));
+        return;
+    }
+
+    if (pid == 0) run_worker(index);
+
+    g_pool.slots[index].pid = pid;
+    g_pool.slots[index].started_at = time(NULL);
+    DEBG("Started acceptor worker %d with pid %d", index, pid);
+}
+
+static void run_worker(int index)
+{
+    /* A worker must not outlive the supervisor, otherwise an upgrade or a
+     * restart would find the port still taken by orphaned listeners. */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != g_pool.supervisor_pid) exit(1);
+
+    for (int i = 0; i < g_pool.count; i++)
+        if (g_pool.slots[i].respawn) event_free(g_pool.slots[i].respawn);
+    free(g_pool.slots);
+
+    /* The inherited base shares its epoll instance with the supervisor, it
+     * has to be detached before it can be released. */
+    event_reinit(g_server_state.base);
+    event_base_free(g_server_state.base);
+    g_server_state.base = event_base_new();
+    if (!g_server_state.base)
+    {
+        ERROR("Failed to create event base for acceptor worker %d", index);
+        exit(-1);
+    }
+
+    start_server_listener(g_server_state.base,
+                          g_server_state.ssl_ctx,
+                          g_server_state.config.port,
+                          prepare_session_engine(),
+                          1);
+    announce_upgrade_ready(1);
+    watch_drain_signal();
+    watch_ip_filter_reload();
+    INFO("Acceptor worker %d ready", index);
+
+    event_base_dispatch(g_server_state.base);
+    destroy_server_state();
+    exit(0);
+}
+
+static void on_worker_exit(evutil_socket_t sig __attribute__((unused)),
+                           short events __attribute__((unused)),
+                           void *ctx __attribute__((unused)))
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i < g_pool.count; i++)
+        {
+            worker_slot_t *slot = &g_pool.slots[i];
+            if (slot->pid != pid) continue;
+
+            slot->pid = 0;
+            if (WIFSIGNALED(status)) reclaim_admissions(pid);
+            if (g_pool.draining)
+            {
+                DEBG("Acceptor worker %d (pid %d) drained", i, pid);
+                if (!running_workers())
+                    event_base_loopexit(g_server_state.base, NULL);
+                break;
+            }
+
+            if (WIFSIGNALED(status))
+                ERROR("Acceptor worker %d (pid %d) killed by signal %d",
+                      i,
+                      pid,
+                      WTERMSIG(status));
+            else
+                ERROR("Acceptor worker %d (pid %d) exited with status %d",
+                      i,
+                      pid,
+                      WEXITSTATUS(status));
+
+            if (time(NULL) - slot->started_at >= WORKER_RESPAWN_BACKOFF_S)
+            {
+                spawn_worker(i);
+                break;
+            }
+
+            /* Died right after start (e.g. port in use), do not spin */
+            if (!slot->respawn)
+                slot->respawn = evtimer_new(
+                    g_server_state.base, on_respawn_timer, (void *)(long)i);
+            struct timeval backoff = {WORKER_RESPAWN_BACKOFF_S, 0};
+            evtimer_add(slot->respawn, &backoff);
+            break;
+        }
+    }
+}
+
+static void on_respawn_timer(evutil_socket_t fd __attribute__((unused)),
+                             short events __attribute__((unused)),
+                             void *ctx)
+{
+    int index = (int)(long)ctx;
+    if (g_pool.slots[index].pid == 0) spawn_worker(index);
+}
+
+static int running_workers(void)
+{
+    int running = 0;
+    for (int i = 0; i < g_pool.count; i++)
+        if (g_pool.slots[i].pid) running++;
+    return running;
+}
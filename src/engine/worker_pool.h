@@ -0,0 +1,26 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/*!
+ * @brief Runs the prefork process model, the calling process becomes the
+ * supervisor and never accepts a connection itself.
+ * @param workers Number of acceptor workers to keep alive.
+ * @details Every worker owns a SO_REUSEPORT listener on the control port so
+ * the kernel spreads incoming sessions over the workers, and each worker
+ * forks its own session children. The supervisor only respawns workers that
+ * died. Returns once the supervisor event loop exits.
+ */
+void start_worker_pool(int workers);
+
+/*!
+ * @brief Stops respawning and has every worker drain, see upgrade.h. The
+ * supervisor loop exits once the last worker is gone.
+ */
+void drain_worker_pool(void);
+
+/*!
+ * @brief Sends sig to every running worker.
+ */
+void signal_worker_pool(int sig);
+
+#endif
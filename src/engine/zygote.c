@@ -0,0 +1,304 @@
+#include "zygote.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "control_handler.h"
+#include "error.h"
+#include "interprocess_handler.h"
+#include "name_snapshot.h"
+#include "server_state.h"
+#include "session_placement.h"
+#include "session_supervisor.h"
+
+/* Client socket, IPC child end, both ends of the kill switch */
+#define ZYGOTE_SPAWN_FDS 4
+
+extern server_state_t g_server_state;
+
+/* Payload of a spawn request, the descriptors travel as SCM_RIGHTS */
+typedef struct
+{
+    admission_t admission; /* Held by the zygote until a session adopts it */
+    struct sockaddr_storage addr;
+} zygote_request_t;
+
+typedef struct
+{
+    int fd; /* Accepting process end of the zygote control socket */
+    pid_t pid;
+} zygote_t;
+
+static zygote_t g_zygote = {.fd = -1, .pid = 0};
+
+static void run_zygote(int control_fd) __attribute__((noreturn));
+static void on_spawn_request(evutil_socket_t control_fd,
+                             short what,
+                             void *ctx);
+static int spawn_session(int control_fd,
+                         const zygote_request_t *request,
+                         const int fds[ZYGOTE_SPAWN_FDS]);
+static int send_spawn_request(const zygote_request_t *request,
+                              const int fds[ZYGOTE_SPAWN_FDS]);
+
+void start_zygote(void)
+{
+    if (g_zygote.fd >= 0) close(g_zygote.fd);
+
+    int control[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) < 0)
+    {
+        ERROR("Failed to create zygote control socket: %s", strerror(errno));
+        g_zygote.fd = -1;
+        return;
+    }
+
+    fflush(stdout); /* Do not duplicate pending log lines in the zygote */
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERROR("Failed to fork zygote: %s", strerror(errno));
+        close(control[0]);
+        close(control[1]);
+        g_zygote.fd = -1;
+        return;
+    }
+
+    if (pid == 0)
+    {
+        close(control[0]);
+        run_zygote(control[1]);
+    }
+
+    close(control[1]);
+    g_zygote.fd = control[0];
+    g_zygote.pid = pid;
+    supervise_process(g_server_state.base, pid, -1, "zygote", NULL, NULL);
+    INFO("Session zygote running as process %d", pid);
+}
+
+void stop_zygote(void)
+{
+    if (g_zygote.fd < 0) return;
+    close(g_zygote.fd);
+    g_zygote.fd = -1;
+}
+
+void zygote_accept_cb(struct evconnlistener *listener,
+                      evutil_socket_t fd,
+                      struct sockaddr *addr,
+                      int len,
+                      void *ctx)
+{
+    zygote_request_t request;
+    memset(&request, 0, sizeof(request));
+    if (!admit_connection(fd, addr, &request.admission)) return;
+
+    int rpc_fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, rpc_fd) < 0)
+    {
+        ERROR("Failed to create socket pair: %s", strerror(errno));
+        release_admission(&request.admission);
+        close(fd);
+        return;
+    }
+
+    int pipe_fd[2]; /* Kill switch, see control_connection_accept_cb */
+    if (pipe(pipe_fd) < 0)
+    {
+        ERROR("Failed to create kill switch pipe: %s", strerror(errno));
+        close(rpc_fd[0]);
+        close(rpc_fd[1]);
+        release_admission(&request.admission);
+        close(fd);
+        return;
+    }
+
+    if (len > 0 && (size_t)len <= sizeof(request.addr))
+        memcpy(&request.addr, addr, len);
+
+    /* Handed over before sending, the session may adopt it first */
+    admission_t admission = request.admission;
+    pass_admission(&admission, g_zygote.pid);
+
+    /* The zygote supervises the session and holds its kill switch */
+    int fds[ZYGOTE_SPAWN_FDS] = {fd, rpc_fd[1], pipe_fd[0], pipe_fd[1]};
+    if (send_spawn_request(&request, fds) < 0)
+    {
+        ERROR("Session zygote unreachable (%s), restarting it",
+              strerror(errno));
+        close(rpc_fd[0]);
+        close(rpc_fd[1]);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        release_admission(&request.admission);
+        start_zygote();
+        control_connection_accept_cb(listener, fd, addr, len, ctx);
+        return;
+    }
+
+    close(fd);
+    close(rpc_fd[1]);
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    register_interprocess_fd_on_server(rpc_fd[0]);
+}
+
+static int send_spawn_request(const zygote_request_t *request,
+                              const int fds[ZYGOTE_SPAWN_FDS])
+{
+    if (g_zygote.fd < 0)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * ZYGOTE_SPAWN_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {.iov_base = (void *)request,
+                        .iov_len = sizeof(*request)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * ZYGOTE_SPAWN_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * ZYGOTE_SPAWN_FDS);
+
+    return sendmsg(g_zygote.fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static void run_zygote(int control_fd)
+{
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    /* Drop the accepting loop, the base shares its epoll instance with the
+     * parent, detach it first. */
+    event_reinit(g_server_state.base);
+    event_base_free(g_server_state.base);
+    g_server_state.base = NULL;
+
+    /* A restarted zygote is forked after the listener exists */
+    close_parent_fds(-1);
+
+    /* Its own loop only serves spawn requests and reaps the sessions */
+    g_server_state.base = event_base_new();
+    if (!g_server_state.base) exit(1);
+
+    struct event *request_event = event_new(g_server_state.base,
+                                            control_fd,
+                                            EV_READ | EV_PERSIST,
+                                            on_spawn_request,
+                                            event_self_cbarg());
+    event_add(request_event, NULL);
+    event_base_dispatch(g_server_state.base);
+    exit(0);
+}
+
+static void on_spawn_request(evutil_socket_t control_fd,
+                             short what __attribute__((unused)),
+                             void *ctx)
+{
+    zygote_request_t request;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * ZYGOTE_SPAWN_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    ssize_t n = recvmsg(control_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR) return;
+    if (n < 0) exit(1);
+    if (n == 0)
+    {
+        /* The accepting process drains, so do the sessions forked here */
+        event_free((struct event *)ctx);
+        close(control_fd);
+        drain_supervised_processes(g_server_state.base,
+                                   g_server_state.config.upgrade_drain_timeout);
+        return;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * ZYGOTE_SPAWN_FDS))
+    {
+        ERROR("Malformed spawn request of %zd bytes", n);
+        return;
+    }
+
+    int fds[ZYGOTE_SPAWN_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (spawn_session(control_fd, &request, fds) < 0)
+    {
+        release_admission(&request.admission);
+        close(fds[3]);
+    }
+
+    /* The write end of the kill switch went to the supervisor */
+    for (int i = 0; i < ZYGOTE_SPAWN_FDS - 1; i++) close(fds[i]);
+}
+
+static int spawn_session(int control_fd,
+                         const zygote_request_t *request,
+                         const int fds[ZYGOTE_SPAWN_FDS])
+{
+    refresh_name_snapshot();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERROR("Failed to fork session: %s", strerror(errno));
+        return -1;
+    }
+    if (pid > 0)
+    {
+        admission_t admission = request->admission;
+        pass_admission(&admission, pid);
+
+        char source_ip[INET6_ADDRSTRLEN] = "-";
+        fill_source_ip((struct sockaddr *)&request->addr, source_ip);
+        supervise_process(
+            g_server_state.base, pid, fds[3], "session", NULL, source_ip);
+        return 0;
+    }
+
+    close(control_fd);
+    close(fds[3]);
+    close_parent_fds(fds[0]); /* pidfds of the other sessions */
+    event_reinit(g_server_state.base);
+    event_base_free(g_server_state.base);
+    g_server_state.base = NULL;
+    place_session_process(fds[0]);
+
+    connection_t *connection = create_connection(
+        g_server_state.ssl_ctx, (struct sockaddr *)&request->addr);
+    if (!connection) exit(1);
+
+    connection->interprocess_fd = fds[1];
+    connection->admission = request->admission;
+    adopt_admission(&connection->admission);
+    INFO("Control connection with %s", connection->source_ip);
+    start_control_connection_loop(fds[0], connection, fds[2]);
+    exit(0);
+}
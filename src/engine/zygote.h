@@ -0,0 +1,39 @@
+/*
+    Session zygote.
+
+    A small helper forked at startup, before the accepting process builds up
+    its listener and IPC state. It holds the loaded SSL_CTX, the command
+    registry and the logger and nothing else. The accepting process passes
+    every accepted control socket to it over SCM_RIGHTS, and the zygote
+    forks the session process. Forking from the small zygote is cheaper than
+    forking the accepting process, and the child has nothing to tear down.
+*/
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include "connection.h"
+
+/*!
+ * @brief Forks the zygote of the calling accepting process.
+ */
+void start_zygote(void);
+
+/*!
+ * @brief Closes the control socket of the zygote, which then forks no more
+ * sessions and drains the ones it has, see drain_supervised_processes.
+ */
+void stop_zygote(void);
+
+/*!
+ * @brief Accept callback that has the zygote fork the session process.
+ * @details Falls back to forking in place and restarts the zygote if it
+ * cannot be reached.
+ */
+void zygote_accept_cb(struct evconnlistener *listener,
+                      evutil_socket_t fd,
+                      struct sockaddr *addr,
+                      int len,
+                      void *ctx);
+
+#endif
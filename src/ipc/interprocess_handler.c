@@ -1,96 +1,80 @@
 #include "interprocess_handler.h"
 
-#include <event2/bufferevent_ssl.h>
+#include <event2/buffer.h>
 #include <event2/event.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "connection.h"
+#include "control_handler.h"
 #include "error.h"
+#include "ipc_channel.h"
+#include "name_snapshot.h"
+#include "nss_helper.h"
 #include "server_state.h"
 
-void event_cb(struct bufferevent *bev, short events, void *ctx);
-static void ask_custom_command(connection_t *connection,
-                               char *buffer,
-                               size_t buffer_size);
-
-extern server_state_t g_server_state;
-
-/* IPC structure for maintaining state when child tries to wait for reply */
+/* A resolve_owner_names request waiting for its reply */
 typedef struct
 {
-    char *buffer;
-    size_t buffer_size;
-    int reply_received;
-} reply_context_t;
+    connection_t *connection;
+    void (*done)(void *ctx);
+    void *ctx;
+    size_t count;
+    ipc_owner_t owners[];
+} names_request_t;
 
-void register_interprocess_fd_on_server(int interprocess_fd)
-{
-    DEBG("Registered interprocess fd: %d", interprocess_fd);
-    struct bufferevent *bev = bufferevent_socket_new(
-        g_server_state.base, interprocess_fd, BEV_OPT_CLOSE_ON_FREE);
-    if (!bev)
-    {
-        ERROR("bufferevent_socket_new in server");
-        return;
-    }
+static void dispatch_root_request(struct bufferevent *bev,
+                                  const ipc_header_t *request,
+                                  const void *payload);
+static void answer_names(struct bufferevent *bev,
+                         const ipc_header_t *request,
+                         const void *payload);
+static void resolve_name_locally(int is_group,
+                                 uint32_t id,
+                                 char *buffer,
+                                 size_t buffer_size);
+static void on_names_reply(int status,
+                           const void *payload,
+                           size_t length,
+                           void *ctx);
+static int compare_owners(const void *a, const void *b);
 
-    __sync_add_and_fetch(&g_server_state.current_connections, 1);
-    bufferevent_setcb(bev, on_read, NULL, event_cb, NULL);
-    bufferevent_enable(bev, EV_READ | EV_WRITE);
-}
+extern server_state_t g_server_state;
 
-void register_interprocess_fd_on_child(int interprocess_fd,
-                                       connection_t *connection)
+void register_interprocess_fd_on_server(int interprocess_fd)
 {
-    DEBG("Registered interprocess fd for child: %d", interprocess_fd);
-    struct event_base *base =
-        event_base_new(); /* Nested event base for ipc purpose only */
-
-    connection->interprocess_bev =
-        bufferevent_socket_new(base, interprocess_fd, BEV_OPT_CLOSE_ON_FREE);
-    if (!connection->interprocess_bev)
-    {
-        ERROR("bufferevent_socket_new in child");
-        return;
-    }
-
-    bufferevent_setcb(connection->interprocess_bev, NULL, NULL, event_cb, NULL);
-    bufferevent_enable(connection->interprocess_bev, EV_READ | EV_WRITE);
+    DEBG("Registered interprocess fd: %d", interprocess_fd);
+    serve_ipc_channel(
+        g_server_state.base, interprocess_fd, dispatch_root_request);
 }
 
-/**
- * [BOTH] Called on events like errors or connection close.
- */
-void event_cb(struct bufferevent *bev, short events, void *ctx)
+void open_session_channel(connection_t *connection)
 {
-    if (!ctx) return;
+    if (connection->interprocess_fd < 0) return;
 
-    if (events & BEV_EVENT_ERROR) ERROR("Error from bufferevent");
-
-    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
-    {
-        bufferevent_disable(bev, EV_READ | EV_WRITE);
-        bufferevent_setcb(bev, NULL, NULL, NULL, ctx);
-        bufferevent_free(bev);
-        __sync_add_and_fetch(&g_server_state.current_connections, 1);
-        if (getuid() != 0)
-        {
-            ERROR(
-                "Interprocess communication error, exiting because main "
-                "process exited");
-            exit(-1);
-        }
-    }
+    DEBG("Registered interprocess fd for child: %d",
+         connection->interprocess_fd);
+    connection->ipc =
+        open_ipc_channel(connection->base, connection->interprocess_fd);
 }
 
-void on_parent_dead(evutil_socket_t fd,
-                    short events,
-                    void *ctx __attribute__((unused)))
+void on_parent_dead(evutil_socket_t fd, short events, void *ctx)
 {
     INFO("IPC pipe event occurred %" PRId16, events);
     char dummy[1];
     ssize_t n = read(fd, dummy, sizeof(dummy));
-    if (n == 0)
+    if (n == 0 && ctx)
+    {
+        /* Parent drains or is gone, the session still finishes its work */
+        connection_t *connection = (connection_t *)ctx;
+        event_free(connection->kill_event);
+        connection->kill_event = NULL;
+        orphan_session(connection);
+    }
+    else if (n == 0)
     {
         // Parent closed its end (EOF)
         ERROR("Parent process died. Exiting child.");
@@ -103,66 +87,205 @@ void on_parent_dead(evutil_socket_t fd,
     }
 }
 
-/* This callback fires when the parent's reply arrives */
-static void ipc_reply_cb(struct bufferevent *bev, void *ctx)
+/* [PARENT] Requests of a session process, see ipc_channel.h */
+static void dispatch_root_request(struct bufferevent *bev,
+                                  const ipc_header_t *request,
+                                  const void *payload)
 {
-    reply_context_t *reply_ctx = (reply_context_t *)ctx;
+    switch (request->type)
+    {
+        case IPC_RESOLVE_NAMES:
+            answer_names(bev, request, payload);
+            break;
+        default:
+            ERROR("Unknown IPC request type %" PRIu16, request->type);
+            send_ipc_reply(bev, request, IPC_STATUS_UNSUPPORTED, NULL);
+    }
+}
 
-    size_t n =
-        bufferevent_read(bev, reply_ctx->buffer, reply_ctx->buffer_size - 1);
-    reply_ctx->buffer[n] = '\0';
+static void answer_names(struct bufferevent *bev,
+                         const ipc_header_t *request,
+                         const void *payload)
+{
+    ipc_deferred_reply_t *reply = NULL;
+    if (request->length % sizeof(ipc_owner_t) ||
+        !(reply = defer_ipc_reply(bev, request)))
+    {
+        ERROR("Cannot answer name request of %" PRIu32 " bytes",
+              request->length);
+        send_ipc_reply(bev, request, IPC_STATUS_UNSUPPORTED, NULL);
+        return;
+    }
 
-    reply_ctx->reply_received = 1;
-    DEBG("IPC callback received reply: %s", reply_ctx->buffer);
+    /* NSS is never called here, see nss_helper.h */
+    forward_to_nss_helper(reply, request, payload);
+}
+
+/* Sessions on session threads are not chrooted and have no parent to ask,
+ * the name databases are still reachable from their own process. */
+static void resolve_name_locally(int is_group,
+                                 uint32_t id,
+                                 char *buffer,
+                                 size_t buffer_size)
+{
+    char nss_buffer[0x4000];
+    const char *name = NULL;
+
+    if (is_group)
+    {
+        struct group grp, *result = NULL;
+        if (getgrgid_r(id, &grp, nss_buffer, sizeof(nss_buffer), &result) ==
+                0 &&
+            result)
+            name = result->gr_name;
+    }
+    else
+    {
+        struct passwd pwd, *result = NULL;
+        if (getpwuid_r(id, &pwd, nss_buffer, sizeof(nss_buffer), &result) ==
+                0 &&
+            result)
+            name = result->pw_name;
+    }
 
-    event_base_loopexit(bufferevent_get_base(bev), NULL);
+    snprintf(buffer, buffer_size, "%s", name ? name : "unknown");
 }
 
-static void ask_custom_command(connection_t *connection,
-                               char *buffer,
-                               size_t buffer_size)
+void find_owner_name(connection_t *connection,
+                     int is_group,
+                     uint32_t id,
+                     char *buffer,
+                     size_t buffer_size)
 {
-    if (!connection || !buffer || buffer_size == 0)
+    const char *known = lookup_cached_name(&connection->names, is_group, id);
+    if (!known) known = lookup_snapshot_name(is_group, id);
+    if (known)
     {
+        snprintf(buffer, buffer_size, "%s", known);
         return;
     }
 
-    reply_context_t reply_ctx = {
-        .buffer = buffer, .buffer_size = buffer_size, .reply_received = 0};
+    if (!connection->ipc)
+    {
+        resolve_name_locally(is_group, id, buffer, buffer_size);
+        cache_name(&connection->names, is_group, id, buffer);
+        return;
+    }
 
-    bufferevent_setcb(
-        connection->interprocess_bev, ipc_reply_cb, NULL, event_cb, &reply_ctx);
+    /* The parent did not answer in time, shown as ls shows unnamed ids */
+    snprintf(buffer, buffer_size, "%" PRIu32, id);
+}
 
-    bufferevent_write(connection->interprocess_bev, buffer, strlen(buffer));
-    DEBG("Sent custom command, now waiting for reply...");
+uint32_t resolve_owner_names(connection_t *connection,
+                             const uint32_t *uids,
+                             const uint32_t *gids,
+                             size_t count,
+                             void (*done)(void *ctx),
+                             void *ctx)
+{
+    names_request_t *request =
+        malloc(sizeof(names_request_t) + 2 * count * sizeof(ipc_owner_t));
+    if (!request) return 0; /* Shown as ids */
 
-    /*TODO: Add a timeout here */
+    /* Owners neither cached nor in the snapshot, sorted to drop repeats */
+    size_t missing = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!lookup_cached_name(&connection->names, 0, uids[i]) &&
+            !lookup_snapshot_name(0, uids[i]))
+            request->owners[missing++] = (ipc_owner_t){uids[i], 0};
+        if (!lookup_cached_name(&connection->names, 1, gids[i]) &&
+            !lookup_snapshot_name(1, gids[i]))
+            request->owners[missing++] = (ipc_owner_t){gids[i], 1};
+    }
+    qsort(request->owners, missing, sizeof(ipc_owner_t), compare_owners);
 
-    event_base_dispatch(bufferevent_get_base(connection->interprocess_bev));
+    size_t unique = 0;
+    for (size_t i = 0; i < missing; i++)
+        if (!unique || compare_owners(&request->owners[unique - 1],
+                                      &request->owners[i]) != 0)
+            request->owners[unique++] = request->owners[i];
 
-    if (reply_ctx.reply_received)
-        DEBG("ask_custom_command finished with reply: %s", reply_ctx.buffer);
-    else
-        ERROR("ask_custom_command failed: no reply received.");
+    if (unique && !connection->ipc)
+        for (size_t i = 0; i < unique; i++)
+        {
+            char name[NAME_CACHE_NAME_LENGTH];
+            resolve_name_locally(request->owners[i].is_group,
+                                 request->owners[i].id,
+                                 name,
+                                 sizeof(name));
+            cache_name(&connection->names,
+                       request->owners[i].is_group,
+                       request->owners[i].id,
+                       name);
+        }
+
+    /* A parent that let one request time out is not waited for again
+     * until it answers, the owners are shown as ids meanwhile */
+    uint32_t id = 0;
+    if (unique && connection->ipc && !ipc_channel_stalled(connection->ipc))
+    {
+        request->connection = connection;
+        request->done = done;
+        request->ctx = ctx;
+        request->count = unique;
+        id = send_ipc_request(connection->ipc,
+                              IPC_RESOLVE_NAMES,
+                              request->owners,
+                              unique * sizeof(ipc_owner_t),
+                              on_names_reply,
+                              request);
+    }
 
-    bufferevent_setcb(
-        connection->interprocess_bev, NULL, NULL, event_cb, connection);
+    if (!id) free(request);
+    return id;
 }
 
-void ask_root_for_username(connection_t *connection,
-                           uint32_t uid,
-                           char *buffer,
-                           size_t buffer_size)
+void cancel_owner_names(connection_t *connection, uint32_t request)
 {
-    snprintf(buffer, buffer_size, "UID %u", uid);
-    ask_custom_command(connection, buffer, buffer_size);
+    cancel_ipc_request(connection->ipc, request);
+}
+
+static void on_names_reply(int status,
+                           const void *payload,
+                           size_t length,
+                           void *ctx)
+{
+    names_request_t *request = (names_request_t *)ctx;
+
+    if (status == IPC_STATUS_OK)
+    {
+        /* A NUL terminated name per owner, a short reply leaves the rest
+         * uncached */
+        const char *name = (const char *)payload;
+        const char *end = name + length;
+        for (size_t i = 0; i < request->count; i++)
+        {
+            const char *nul = name < end ? memchr(name, '\0', end - name)
+                                         : NULL;
+            if (!nul)
+            {
+                ERROR("Parent answered %zu of %zu names", i, request->count);
+                break;
+            }
+            cache_name(&request->connection->names,
+                       request->owners[i].is_group,
+                       request->owners[i].id,
+                       name);
+            name = nul + 1;
+        }
+    }
+    else if (status != IPC_STATUS_CANCELLED)
+        WARN("No owner names from the parent (status %d), showing ids",
+             status);
+
+    if (status != IPC_STATUS_CANCELLED) request->done(request->ctx);
+    free(request);
 }
 
-void ask_root_for_groupname(connection_t *connection,
-                            uint32_t gid,
-                            char *buffer,
-                            size_t buffer_size)
+static int compare_owners(const void *a, const void *b)
 {
-    snprintf(buffer, buffer_size, "GID %u", gid);
-    ask_custom_command(connection, buffer, buffer_size);
+    const ipc_owner_t *x = a, *y = b;
+    if (x->is_group != y->is_group) return x->is_group < y->is_group ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
 }
@@ -6,22 +6,62 @@
 /*
     * Interprocess communication
     * This is used to communicate with the main process for authentication and
-    * other control operations.
+    * other control operations, framed as described in ipc_channel.h.
 
     interprocess_fd is the file descriptor for the socket pair
 */
+
+/*!
+ * @brief Parent side of the socket pair, answers the session process'
+ * requests on the server loop.
+ */
 void register_interprocess_fd_on_server(int interprocess_fd);
-void register_interprocess_fd_on_child(int interprocess_fd,
-                                       connection_t *connection);
-
-void ask_root_for_username(connection_t *connection,
-                           uint32_t uid,
-                           char *buffer,
-                           size_t buffer_size);
-void ask_root_for_groupname(connection_t *connection,
-                            uint32_t gid,
-                            char *buffer,
-                            size_t buffer_size);
+
+/*!
+ * @brief Session side, opens connection->interprocess_fd on the session's
+ * loop once connection->base exists. Nothing without a descriptor.
+ */
+void open_session_channel(connection_t *connection);
+
+/*!
+ * @brief Name of a uid or gid from the session's name cache or the name
+ * snapshot, see name_cache.h and name_snapshot.h. Never waits for the
+ * parent, ids it did not name yet are shown as numbers.
+ * @details Sessions without a parent look the name up themselves.
+ */
+void find_owner_name(connection_t *connection,
+                     int is_group,
+                     uint32_t id,
+                     char *buffer,
+                     size_t buffer_size);
+
+/*!
+ * @brief Puts the names of count owners into the session's name cache,
+ * asking the parent for all that are missing in one request.
+ * @param uids, gids Owners of count files, repeated ids are asked once,
+ * count is at most a few thousand.
+ * @param done Called from the session's loop once the reply is cached, or
+ * the request failed or timed out.
+ * @return Id of the request done waits for, 0 if nothing had to be asked,
+ * done is not called then.
+ */
+uint32_t resolve_owner_names(connection_t *connection,
+                             const uint32_t *uids,
+                             const uint32_t *gids,
+                             size_t count,
+                             void (*done)(void *ctx),
+                             void *ctx);
+
+/*!
+ * @brief Drops a request of resolve_owner_names, its done is not called.
+ */
+void cancel_owner_names(connection_t *connection, uint32_t request);
+
+/*!
+ * @brief Kill switch callback of a session process.
+ * @param ctx The session, orphaned once the parent closed its end, see
+ * orphan_session. NULL exits right away.
+ */
 void on_parent_dead(evutil_socket_t fd, short events, void *ctx);
 
 #endif
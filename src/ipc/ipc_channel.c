@@ -0,0 +1,374 @@
+#include "ipc_channel.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "error.h"
+
+typedef struct ipc_request
+{
+    uint32_t id;
+    ipc_reply_cb_t cb;
+    void *ctx;
+    struct event *deadline;
+    ipc_channel_t *channel;
+    struct ipc_request *next;
+} ipc_request_t;
+
+struct ipc_channel
+{
+    struct bufferevent *bev; /* NULL once the channel broke */
+    uint32_t next_id;
+    ipc_request_t *pending; /* Sent and not answered, newest first */
+    int stalled; /* A request timed out, nothing was answered since */
+    void (*closed)(void *ctx); /* See watch_ipc_channel */
+    void *closed_ctx;
+};
+
+/* Parent side, one per session channel */
+typedef struct
+{
+    struct bufferevent *bev; /* NULL once the session is gone */
+    ipc_request_handler_t handler;
+    int references; /* The channel and every deferred reply */
+} ipc_server_t;
+
+struct ipc_deferred_reply
+{
+    ipc_server_t *server;
+    ipc_header_t request;
+};
+
+static int read_frame(struct evbuffer *input,
+                      ipc_header_t *header,
+                      const void **payload);
+static ipc_request_t *take_request(ipc_channel_t *channel, uint32_t id);
+static void finish_request(ipc_request_t *request,
+                           int status,
+                           const void *payload,
+                           size_t length);
+static void break_channel(ipc_channel_t *channel);
+static void on_reply(struct bufferevent *bev, void *ctx);
+static void on_channel_event(struct bufferevent *bev, short events, void *ctx);
+static void on_deadline(evutil_socket_t fd, short what, void *ctx);
+static void on_request(struct bufferevent *bev, void *ctx);
+static void on_served_event(struct bufferevent *bev, short events, void *ctx);
+static void close_server(ipc_server_t *server);
+static void release_server(ipc_server_t *server);
+
+ipc_channel_t *open_ipc_channel(struct event_base *base, int fd)
+{
+    ipc_channel_t *channel = calloc(1, sizeof(ipc_channel_t));
+    struct bufferevent *bev =
+        channel ? bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE)
+                : NULL;
+    if (!bev)
+    {
+        ERROR("Cannot open IPC channel on fd %d", fd);
+        free(channel);
+        close(fd);
+        return NULL;
+    }
+
+    channel->bev = bev;
+    channel->next_id = 1;
+    bufferevent_setcb(bev, on_reply, NULL, on_channel_event, channel);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    return channel;
+}
+
+uint32_t send_ipc_request(ipc_channel_t *channel,
+                          uint16_t type,
+                          const void *payload,
+                          size_t length,
+                          ipc_reply_cb_t cb,
+                          void *ctx)
+{
+    if (!channel || !channel->bev || length > IPC_MAX_PAYLOAD) return 0;
+
+    ipc_request_t *request = calloc(1, sizeof(ipc_request_t));
+    if (!request) return 0;
+    request->deadline = evtimer_new(
+        bufferevent_get_base(channel->bev), on_deadline, request);
+    if (!request->deadline)
+    {
+        free(request);
+        return 0;
+    }
+
+    request->id = channel->next_id++;
+    if (!channel->next_id) channel->next_id = 1; /* 0 is no request */
+
+    ipc_header_t header = {(uint32_t)length, request->id, type, 0};
+    if (bufferevent_write(channel->bev, &header, sizeof(header)) < 0 ||
+        (length && bufferevent_write(channel->bev, payload, length) < 0))
+    {
+        ERROR("Cannot queue IPC request of %zu bytes", length);
+        event_free(request->deadline);
+        free(request);
+        return 0;
+    }
+
+    request->cb = cb;
+    request->ctx = ctx;
+    request->channel = channel;
+    request->next = channel->pending;
+    channel->pending = request;
+
+    struct timeval timeout = {IPC_REQUEST_TIMEOUT_MS / 1000,
+                              IPC_REQUEST_TIMEOUT_MS % 1000 * 1000};
+    evtimer_add(request->deadline, &timeout);
+    return request->id;
+}
+
+void watch_ipc_channel(ipc_channel_t *channel,
+                       void (*closed)(void *ctx),
+                       void *ctx)
+{
+    channel->closed = closed;
+    channel->closed_ctx = ctx;
+}
+
+void close_ipc_channel(ipc_channel_t *channel)
+{
+    if (!channel) return;
+
+    channel->closed = NULL;
+    if (channel->bev) break_channel(channel);
+    free(channel);
+}
+
+int ipc_channel_stalled(const ipc_channel_t *channel)
+{
+    return channel && channel->stalled;
+}
+
+void cancel_ipc_request(ipc_channel_t *channel, uint32_t id)
+{
+    ipc_request_t *request = channel ? take_request(channel, id) : NULL;
+    if (request) finish_request(request, IPC_STATUS_CANCELLED, NULL, 0);
+}
+
+void serve_ipc_channel(struct event_base *base,
+                       int fd,
+                       ipc_request_handler_t handler)
+{
+    ipc_server_t *server = calloc(1, sizeof(ipc_server_t));
+    struct bufferevent *bev =
+        server ? bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE)
+               : NULL;
+    if (!bev)
+    {
+        ERROR("Cannot serve IPC channel on fd %d", fd);
+        free(server);
+        close(fd);
+        return;
+    }
+
+    server->bev = bev;
+    server->handler = handler;
+    server->references = 1;
+    bufferevent_setcb(bev, on_request, NULL, on_served_event, server);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+void send_ipc_reply(struct bufferevent *bev,
+                    const ipc_header_t *request,
+                    int status,
+                    struct evbuffer *payload)
+{
+    ipc_header_t header = {
+        payload ? (uint32_t)evbuffer_get_length(payload) : 0,
+        request->id,
+        request->type,
+        (uint16_t)status};
+    bufferevent_write(bev, &header, sizeof(header));
+    if (payload) bufferevent_write_buffer(bev, payload);
+}
+
+ipc_deferred_reply_t *defer_ipc_reply(struct bufferevent *bev,
+                                      const ipc_header_t *request)
+{
+    ipc_deferred_reply_t *reply = malloc(sizeof(ipc_deferred_reply_t));
+    if (!reply) return NULL;
+
+    /* Every served bufferevent has its ipc_server_t as argument */
+    void *server;
+    bufferevent_getcb(bev, NULL, NULL, NULL, &server);
+    reply->server = (ipc_server_t *)server;
+    reply->server->references++;
+    reply->request = *request;
+    return reply;
+}
+
+void finish_ipc_reply(ipc_deferred_reply_t *reply,
+                      int status,
+                      struct evbuffer *payload)
+{
+    if (reply->server->bev)
+        send_ipc_reply(reply->server->bev, &reply->request, status, payload);
+    else
+        DEBG("Dropping IPC reply %" PRIu32 ", the session is gone",
+             reply->request.id);
+
+    release_server(reply->server);
+    free(reply);
+}
+
+/* 1 with the header removed and the payload contiguous at the front of
+ * input, 0 while incomplete, -1 if it cannot be a frame */
+static int read_frame(struct evbuffer *input,
+                      ipc_header_t *header,
+                      const void **payload)
+{
+    if (evbuffer_get_length(input) < sizeof(ipc_header_t)) return 0;
+
+    evbuffer_copyout(input, header, sizeof(ipc_header_t));
+    if (header->length > IPC_MAX_PAYLOAD) return -1;
+    if (evbuffer_get_length(input) < sizeof(ipc_header_t) + header->length)
+        return 0;
+
+    evbuffer_drain(input, sizeof(ipc_header_t));
+    *payload = header->length ? evbuffer_pullup(input, header->length) : NULL;
+    return 1;
+}
+
+static ipc_request_t *take_request(ipc_channel_t *channel, uint32_t id)
+{
+    for (ipc_request_t **link = &channel->pending; *link;
+         link = &(*link)->next)
+    {
+        if ((*link)->id != id) continue;
+
+        ipc_request_t *request = *link;
+        *link = request->next;
+        return request;
+    }
+    return NULL;
+}
+
+static void finish_request(ipc_request_t *request,
+                           int status,
+                           const void *payload,
+                           size_t length)
+{
+    event_free(request->deadline);
+    request->cb(status, payload, length, request->ctx);
+    free(request);
+}
+
+static void break_channel(ipc_channel_t *channel)
+{
+    /* Callbacks sending new requests see the channel broken already */
+    struct bufferevent *bev = channel->bev;
+    channel->bev = NULL;
+    bufferevent_free(bev);
+
+    while (channel->pending)
+    {
+        ipc_request_t *request = channel->pending;
+        channel->pending = request->next;
+        finish_request(request, IPC_STATUS_CLOSED, NULL, 0);
+    }
+
+    if (channel->closed) channel->closed(channel->closed_ctx);
+}
+
+static void on_reply(struct bufferevent *bev, void *ctx)
+{
+    ipc_channel_t *channel = (ipc_channel_t *)ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    ipc_header_t header;
+    const void *payload;
+    int framed;
+    while ((framed = read_frame(input, &header, &payload)) > 0)
+    {
+        channel->stalled = 0; /* Even a late reply shows it is back */
+        ipc_request_t *request = take_request(channel, header.id);
+        if (!request)
+            DEBG("Dropping IPC reply %" PRIu32 " nobody waits for",
+                 header.id);
+        else if (header.status == IPC_STATUS_OK)
+            finish_request(request, IPC_STATUS_OK, payload, header.length);
+        else
+            finish_request(request, header.status, NULL, 0);
+        evbuffer_drain(input, header.length);
+    }
+
+    if (framed < 0)
+    {
+        ERROR("Malformed IPC reply of %" PRIu32 " bytes", header.length);
+        break_channel(channel);
+    }
+}
+
+static void on_channel_event(struct bufferevent *bev __attribute__((unused)),
+                             short events,
+                             void *ctx)
+{
+    if (!(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))) return;
+
+    /* The kill switch decides whether the session goes on without it */
+    WARN("Other end closed the IPC channel");
+    break_channel((ipc_channel_t *)ctx);
+}
+
+static void on_deadline(evutil_socket_t fd __attribute__((unused)),
+                        short what __attribute__((unused)),
+                        void *ctx)
+{
+    ipc_request_t *request = (ipc_request_t *)ctx;
+    WARN("IPC request %" PRIu32 " timed out after %d ms",
+         request->id,
+         IPC_REQUEST_TIMEOUT_MS);
+    request->channel->stalled = 1;
+    take_request(request->channel, request->id);
+    finish_request(request, IPC_STATUS_TIMEOUT, NULL, 0);
+}
+
+static void on_request(struct bufferevent *bev, void *ctx)
+{
+    ipc_server_t *server = (ipc_server_t *)ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    ipc_header_t header;
+    const void *payload;
+    int framed;
+    while ((framed = read_frame(input, &header, &payload)) > 0)
+    {
+        server->handler(bev, &header, payload);
+        evbuffer_drain(input, header.length);
+    }
+
+    if (framed < 0)
+    {
+        ERROR("Malformed IPC request of %" PRIu32 " bytes, closing channel",
+              header.length);
+        close_server(server);
+    }
+}
+
+static void on_served_event(struct bufferevent *bev __attribute__((unused)),
+                            short events,
+                            void *ctx)
+{
+    if (!(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))) return;
+    if (events & BEV_EVENT_ERROR) ERROR("Error from IPC channel");
+
+    /* The session process is gone */
+    close_server((ipc_server_t *)ctx);
+}
+
+static void close_server(ipc_server_t *server)
+{
+    bufferevent_free(server->bev);
+    server->bev = NULL;
+    release_server(server);
+}
+
+static void release_server(ipc_server_t *server)
+{
+    if (--server->references == 0) free(server);
+}
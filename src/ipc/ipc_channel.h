@@ -0,0 +1,156 @@
+/*
+    Framed messages between a session process and its parent over their
+    socket pair. Every message is an ipc_header_t followed by length bytes
+    of payload, in host byte order as both ends run on the same machine.
+
+    The session side sends requests with an id of its own choosing and
+    keeps going, replies are matched by id and handed to the callback of
+    the request on the session's loop, so any number of requests can be in
+    flight. A request not answered within IPC_REQUEST_TIMEOUT_MS gets
+    IPC_STATUS_TIMEOUT instead, a late reply is dropped.
+
+    The parent side hands every complete request to a handler, which
+    answers it with send_ipc_reply, or later with finish_ipc_reply when the
+    answer is not at hand yet.
+
+    The accepting process passes name requests on to its resolver helper
+    the same way, as the session side of a channel, see nss_helper.h.
+*/
+
+#ifndef IPC_CHANNEL_H
+#define IPC_CHANNEL_H
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IPC_MAX_PAYLOAD (1 << 20) /* Longer frames end the channel */
+#define IPC_REQUEST_TIMEOUT_MS 3000
+
+/* Message types */
+#define IPC_RESOLVE_NAMES 1 /* ipc_owner_t array, answered with the names */
+
+/* Reply status, the last three are never sent but given to callbacks */
+#define IPC_STATUS_OK 0
+#define IPC_STATUS_UNSUPPORTED 1 /* Unknown type or malformed payload */
+#define IPC_STATUS_TIMEOUT 2
+#define IPC_STATUS_CLOSED 3    /* The channel broke */
+#define IPC_STATUS_CANCELLED 4 /* See cancel_ipc_request */
+
+typedef struct
+{
+    uint32_t length; /* Payload bytes after the header */
+    uint32_t id;     /* Chosen by the session, echoed by the reply */
+    uint16_t type;   /* IPC_RESOLVE_NAMES, ... */
+    uint16_t status; /* IPC_STATUS_* in replies, 0 in requests */
+} ipc_header_t;
+
+/* An owner in IPC_RESOLVE_NAMES, its reply holds a NUL terminated name per
+ * owner in the same order */
+typedef struct
+{
+    uint32_t id;
+    uint32_t is_group;
+} ipc_owner_t;
+
+typedef struct ipc_channel ipc_channel_t;
+typedef struct ipc_deferred_reply ipc_deferred_reply_t;
+
+/*!
+ * @param payload The reply, valid only during the call, NULL unless status
+ * is IPC_STATUS_OK.
+ */
+typedef void (*ipc_reply_cb_t)(int status,
+                               const void *payload,
+                               size_t length,
+                               void *ctx);
+
+/*!
+ * @brief Parent side, called for every complete request.
+ */
+typedef void (*ipc_request_handler_t)(struct bufferevent *bev,
+                                      const ipc_header_t *request,
+                                      const void *payload);
+
+/*!
+ * @brief Session side of the socket pair, replies are delivered on base.
+ * @return NULL if out of memory, the descriptor is closed then.
+ */
+ipc_channel_t *open_ipc_channel(struct event_base *base, int fd);
+
+/*!
+ * @brief Queues a request without waiting for the parent.
+ * @return Id of the request, 0 if the channel is broken, in which case cb
+ * is never called.
+ * @details cb is called exactly once otherwise, from the loop of the
+ * channel, or from cancel_ipc_request.
+ */
+uint32_t send_ipc_request(ipc_channel_t *channel,
+                          uint16_t type,
+                          const void *payload,
+                          size_t length,
+                          ipc_reply_cb_t cb,
+                          void *ctx);
+
+/*!
+ * @brief Has closed called on the loop of the channel once it breaks, its
+ * descriptor is closed by then. close_ipc_channel does not call it.
+ */
+void watch_ipc_channel(ipc_channel_t *channel,
+                       void (*closed)(void *ctx),
+                       void *ctx);
+
+/*!
+ * @brief Closes the channel unless it broke already and frees it, pending
+ * requests get IPC_STATUS_CLOSED.
+ */
+void close_ipc_channel(ipc_channel_t *channel);
+
+/*!
+ * @return 1 after a request timed out until the parent answers anything
+ * again, callers that can do without the answer should not ask meanwhile.
+ */
+int ipc_channel_stalled(const ipc_channel_t *channel);
+
+/*!
+ * @brief Gives up on a request, its callback runs right away with
+ * IPC_STATUS_CANCELLED. Unknown or finished ids are ignored.
+ */
+void cancel_ipc_request(ipc_channel_t *channel, uint32_t id);
+
+/*!
+ * @brief Parent side of the socket pair, requests go to handler until the
+ * session closes its end.
+ */
+void serve_ipc_channel(struct event_base *base,
+                       int fd,
+                       ipc_request_handler_t handler);
+
+/*!
+ * @brief Answers request, payload may be NULL for an empty reply and is
+ * drained.
+ */
+void send_ipc_reply(struct bufferevent *bev,
+                    const ipc_header_t *request,
+                    int status,
+                    struct evbuffer *payload);
+
+/*!
+ * @brief Keeps what answering request takes past the handler, the session
+ * may close its channel meanwhile.
+ * @return NULL if out of memory.
+ */
+ipc_deferred_reply_t *defer_ipc_reply(struct bufferevent *bev,
+                                      const ipc_header_t *request);
+
+/*!
+ * @brief send_ipc_reply for a deferred request, dropped if the channel has
+ * closed since. Frees reply.
+ */
+void finish_ipc_reply(ipc_deferred_reply_t *reply,
+                      int status,
+                      struct evbuffer *payload);
+
+#endif /* IPC_CHANNEL_H */
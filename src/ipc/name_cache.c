@@ -0,0 +1,51 @@
+#include "name_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    char name[NAME_CACHE_NAME_LENGTH];
+} cached_name_t;
+
+DEFINE_FLAT_TABLE(cached_names, uint32_t, cached_name_t)
+
+const char *lookup_cached_name(const name_cache_t *cache,
+                               int is_group,
+                               uint32_t id)
+{
+    const flat_table_t *table = is_group ? cache->groups : cache->users;
+    if (!table) return NULL;
+
+    cached_name_t *cached = cached_names_lookup(table, id);
+    return cached ? cached->name : NULL;
+}
+
+void cache_name(name_cache_t *cache,
+                int is_group,
+                uint32_t id,
+                const char *name)
+{
+    flat_table_t **table = is_group ? &cache->groups : &cache->users;
+
+    /* Files of that many owners in one session, start over rather than
+     * keep growing */
+    if (*table && (*table)->count >= NAME_CACHE_MAX_ENTRIES)
+    {
+        free_flat_table(*table);
+        *table = NULL;
+    }
+    if (!*table && !(*table = cached_names_create())) return;
+
+    cached_name_t cached;
+    snprintf(cached.name, sizeof(cached.name), "%s", name);
+    cached_names_insert(*table, id, cached);
+}
+
+void free_name_cache(name_cache_t *cache)
+{
+    free_flat_table(cache->users);
+    free_flat_table(cache->groups);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,44 @@
+/*
+    User and group names a session has resolved, so that LIST asks the
+    parent (or NSS for sessions without one) once per id and session instead
+    of once per directory entry. Names are not refreshed, a renamed user
+    shows under the old name until the session ends.
+*/
+
+#ifndef NAME_CACHE_H
+#define NAME_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "structures/flat_table.h"
+
+#define NAME_CACHE_NAME_LENGTH 64 /* Longer names are cut */
+#define NAME_CACHE_MAX_ENTRIES 4096 /* Per kind, the cache starts over */
+
+/* Names by id, NULL before the first one, see structures/flat_table.h */
+typedef struct
+{
+    flat_table_t *users;
+    flat_table_t *groups;
+} name_cache_t;
+
+/*!
+ * @return The cached name of the uid or gid, NULL if it is not cached.
+ * Valid until the next cache_name.
+ */
+const char *lookup_cached_name(const name_cache_t *cache,
+                               int is_group,
+                               uint32_t id);
+
+/*!
+ * @brief Remembers a name, silently does nothing if out of memory.
+ */
+void cache_name(name_cache_t *cache,
+                int is_group,
+                uint32_t id,
+                const char *name);
+
+void free_name_cache(name_cache_t *cache);
+
+#endif
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE /* memfd_create, F_ADD_SEALS, fgetpwent_r */
+#include "name_snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "error.h"
+#include "server_state.h"
+
+#define NAME_SNAPSHOT_PASSWD "/etc/passwd"
+#define NAME_SNAPSHOT_GROUP "/etc/group"
+#define NAME_SNAPSHOT_LINE_LENGTH 0x10000 /* Groups list their members */
+#define NAME_SNAPSHOT_INITIAL_ENTRIES 256
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t name; /* Offset of the NUL terminated name in the snapshot */
+} snapshot_entry_t;
+
+/* Start of the memfd, users then groups sorted by id, the names follow */
+typedef struct
+{
+    uint32_t users;
+    uint32_t groups;
+    snapshot_entry_t entries[];
+} snapshot_t;
+
+typedef struct
+{
+    snapshot_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} entry_list_t;
+
+/* A snapshot while the files are read, name offsets are into names */
+typedef struct
+{
+    entry_list_t users;
+    entry_list_t groups;
+    char *names;
+    size_t length;
+    size_t capacity;
+} snapshot_builder_t;
+
+static struct
+{
+    const snapshot_t *map; /* Read only, NULL without a snapshot */
+    size_t size;
+    int fd;              /* Sealed memfd of map, -1 if not kept */
+    uint32_t generation; /* Counts the snapshots published */
+    int active;          /* Set by start_name_snapshot */
+    time_t checked;      /* Monotonic seconds of the last look at the files */
+    struct stat passwd;  /* The files as of the current snapshot */
+    struct stat group;
+} g_snapshot = {.fd = -1};
+
+static int publish_snapshot(const struct stat *passwd,
+                            const struct stat *group);
+static int read_users(snapshot_builder_t *builder);
+static int read_groups(snapshot_builder_t *builder);
+static int add_name(snapshot_builder_t *builder,
+                    entry_list_t *list,
+                    uint32_t id,
+                    const char *name);
+static void *write_snapshot(snapshot_builder_t *builder,
+                            size_t *size,
+                            int *fd_out);
+static int valid_snapshot(const snapshot_t *snapshot, size_t size);
+static void replace_snapshot(const snapshot_t *map, size_t size, int fd);
+static void sort_entries(entry_list_t *list);
+static int compare_entries(const void *a, const void *b);
+static int same_file(const struct stat *a, const struct stat *b);
+static time_t monotonic_seconds(void);
+
+void start_name_snapshot(void)
+{
+    if (!g_server_state.config.name_snapshot_interval ||
+        g_server_state.config.session_model != SESSION_MODEL_PROCESS)
+        return;
+
+    g_snapshot.active = 1;
+    g_snapshot.checked = monotonic_seconds();
+
+    struct stat passwd, group;
+    if (stat(NAME_SNAPSHOT_PASSWD, &passwd) < 0 ||
+        stat(NAME_SNAPSHOT_GROUP, &group) < 0 ||
+        !publish_snapshot(&passwd, &group))
+    {
+        WARN("No name snapshot, sessions ask the parent for every name");
+        return;
+    }
+
+    INFO("Name snapshot of %u users and %u groups, checked every %d seconds",
+         g_snapshot.map->users,
+         g_snapshot.map->groups,
+         g_server_state.config.name_snapshot_interval);
+}
+
+void refresh_name_snapshot(void)
+{
+    if (!g_snapshot.active) return;
+
+    time_t now = monotonic_seconds();
+    if (now - g_snapshot.checked < g_server_state.config.name_snapshot_interval)
+        return;
+    g_snapshot.checked = now;
+
+    /* Taken before reading, a change while reading shows up next time */
+    struct stat passwd, group;
+    if (stat(NAME_SNAPSHOT_PASSWD, &passwd) < 0 ||
+        stat(NAME_SNAPSHOT_GROUP, &group) < 0)
+        return;
+    if (g_snapshot.map && same_file(&passwd, &g_snapshot.passwd) &&
+        same_file(&group, &g_snapshot.group))
+        return;
+
+    if (publish_snapshot(&passwd, &group))
+        INFO("Name snapshot refreshed, %u users and %u groups",
+             g_snapshot.map->users,
+             g_snapshot.map->groups);
+}
+
+const char *lookup_snapshot_name(int is_group, uint32_t id)
+{
+    const snapshot_t *snapshot = g_snapshot.map;
+    if (!snapshot) return NULL;
+
+    const snapshot_entry_t *entries =
+        snapshot->entries + (is_group ? snapshot->users : 0);
+    size_t count = is_group ? snapshot->groups : snapshot->users;
+
+    size_t low = 0, high = count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (entries[middle].id < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low == count || entries[low].id != id) return NULL;
+    return (const char *)snapshot + entries[low].name;
+}
+
+int name_snapshot_fd(uint32_t *generation)
+{
+    *generation = g_snapshot.generation;
+    return g_snapshot.fd;
+}
+
+int adopt_name_snapshot(int fd)
+{
+    /* Only a sealed snapshot cannot change under the binary search */
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    int required = F_SEAL_SHRINK | F_SEAL_WRITE;
+    void *map = MAP_FAILED;
+    if (seals >= 0 && (seals & required) == required && fstat(fd, &st) == 0 &&
+        st.st_size > 0)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) return 0;
+    if (!valid_snapshot(map, (size_t)st.st_size))
+    {
+        munmap(map, (size_t)st.st_size);
+        return 0;
+    }
+
+    replace_snapshot(map, (size_t)st.st_size, -1);
+    return 1;
+}
+
+static int publish_snapshot(const struct stat *passwd,
+                            const struct stat *group)
+{
+    snapshot_builder_t builder = {0};
+    void *map = MAP_FAILED;
+    size_t size = 0;
+    int fd = -1;
+    if (read_users(&builder) && read_groups(&builder))
+        map = write_snapshot(&builder, &size, &fd);
+
+    free(builder.users.entries);
+    free(builder.groups.entries);
+    free(builder.names);
+    if (map == MAP_FAILED) return 0;
+
+    /* Kept for workers, session processes close it with the others */
+    if (!track_parent_fd(fd))
+    {
+        close(fd);
+        fd = -1;
+    }
+    replace_snapshot(map, size, fd);
+    g_snapshot.passwd = *passwd;
+    g_snapshot.group = *group;
+    return 1;
+}
+
+/* Sessions forked before keep their own mapping of the old one */
+static void replace_snapshot(const snapshot_t *map, size_t size, int fd)
+{
+    if (g_snapshot.map) munmap((void *)g_snapshot.map, g_snapshot.size);
+    /* Not ours to close once close_parent_fds took it in a child */
+    if (untrack_parent_fd(g_snapshot.fd)) close(g_snapshot.fd);
+    g_snapshot.map = map;
+    g_snapshot.size = size;
+    g_snapshot.fd = fd;
+    g_snapshot.generation++;
+}
+
+/* Every entry and name within size, as write_snapshot lays them out */
+static int valid_snapshot(const snapshot_t *snapshot, size_t size)
+{
+    if (size < sizeof(snapshot_t) || ((const char *)snapshot)[size - 1])
+        return 0;
+
+    size_t entries = (size_t)snapshot->users + snapshot->groups;
+    if (entries > (size - sizeof(snapshot_t)) / sizeof(snapshot_entry_t))
+        return 0;
+
+    size_t names = sizeof(snapshot_t) + entries * sizeof(snapshot_entry_t);
+    for (size_t i = 0; i < entries; i++)
+        if (snapshot->entries[i].name < names ||
+            snapshot->entries[i].name >= size)
+            return 0;
+    return 1;
+}
+
+static int read_users(snapshot_builder_t *builder)
+{
+    FILE *file = fopen(NAME_SNAPSHOT_PASSWD, "re");
+    if (!file)
+    {
+        ERROR("Cannot open %s: %s", NAME_SNAPSHOT_PASSWD, strerror(errno));
+        return 0;
+    }
+
+    static char line[NAME_SNAPSHOT_LINE_LENGTH];
+    struct passwd pwd, *result;
+    int error;
+    while ((error = fgetpwent_r(file, &pwd, line, sizeof(line), &result)) ==
+           0)
+        if (!add_name(builder, &builder->users, pwd.pw_uid, pwd.pw_name))
+            break;
+
+    fclose(file);
+    if (error != ENOENT)
+        ERROR("Cannot read %s: %s", NAME_SNAPSHOT_PASSWD, strerror(error));
+    return error == ENOENT;
+}
+
+static int read_groups(snapshot_builder_t *builder)
+{
+    FILE *file = fopen(NAME_SNAPSHOT_GROUP, "re");
+    if (!file)
+    {
+        ERROR("Cannot open %s: %s", NAME_SNAPSHOT_GROUP, strerror(errno));
+        return 0;
+    }
+
+    static char line[NAME_SNAPSHOT_LINE_LENGTH];
+    struct group grp, *result;
+    int error;
+    while ((error = fgetgrent_r(file, &grp, line, sizeof(line), &result)) ==
+           0)
+        if (!add_name(builder, &builder->groups, grp.gr_gid, grp.gr_name))
+            break;
+
+    fclose(file);
+    if (error != ENOENT)
+        ERROR("Cannot read %s: %s", NAME_SNAPSHOT_GROUP, strerror(error));
+    return error == ENOENT;
+}
+
+static int add_name(snapshot_builder_t *builder,
+                    entry_list_t *list,
+                    uint32_t id,
+                    const char *name)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2
+                                         : NAME_SNAPSHOT_INITIAL_ENTRIES;
+        snapshot_entry_t *entries =
+            realloc(list->entries, capacity * sizeof(snapshot_entry_t));
+        if (!entries) return 0;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    size_t length = strlen(name) + 1;
+    if (builder->length + length > builder->capacity)
+    {
+        size_t capacity = builder->capacity ? builder->capacity : 4096;
+        while (capacity < builder->length + length) capacity *= 2;
+        char *names = realloc(builder->names, capacity);
+        if (!names) return 0;
+        builder->names = names;
+        builder->capacity = capacity;
+    }
+
+    memcpy(builder->names + builder->length, name, length);
+    list->entries[list->count].id = id;
+    list->entries[list->count].name = (uint32_t)builder->length;
+    list->count++;
+    builder->length += length;
+    return 1;
+}
+
+/* Lays the snapshot out in a new memfd, seals it and maps it read only,
+ * the memfd is left open in fd_out */
+static void *write_snapshot(snapshot_builder_t *builder,
+                            size_t *size,
+                            int *fd_out)
+{
+    sort_entries(&builder->users);
+    sort_entries(&builder->groups);
+
+    size_t entries = builder->users.count + builder->groups.count;
+    size_t names_offset =
+        sizeof(snapshot_t) + entries * sizeof(snapshot_entry_t);
+    *size = names_offset + builder->length;
+
+    int fd = memfd_create("cftp_names", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate(fd, (off_t)*size) < 0)
+    {
+        ERROR("Cannot create name snapshot: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return MAP_FAILED;
+    }
+
+    snapshot_t *snapshot =
+        mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (snapshot == MAP_FAILED)
+    {
+        ERROR("Cannot map name snapshot: %s", strerror(errno));
+        close(fd);
+        return MAP_FAILED;
+    }
+
+    snapshot->users = (uint32_t)builder->users.count;
+    snapshot->groups = (uint32_t)builder->groups.count;
+    memcpy(snapshot->entries,
+           builder->users.entries,
+           builder->users.count * sizeof(snapshot_entry_t));
+    memcpy(snapshot->entries + builder->users.count,
+           builder->groups.entries,
+           builder->groups.count * sizeof(snapshot_entry_t));
+    for (size_t i = 0; i < entries; i++)
+        snapshot->entries[i].name += (uint32_t)names_offset;
+    memcpy((char *)snapshot + names_offset, builder->names, builder->length);
+    munmap(snapshot, *size);
+
+    /* No writable mapping is left, so the write seal takes */
+    void *map = MAP_FAILED;
+    if (fcntl(fd,
+              F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+        ERROR("Cannot seal name snapshot: %s", strerror(errno));
+    else
+    {
+        map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            ERROR("Cannot map name snapshot: %s", strerror(errno));
+    }
+
+    if (map == MAP_FAILED)
+        close(fd);
+    else
+        *fd_out = fd;
+    return map;
+}
+
+static void sort_entries(entry_list_t *list)
+{
+    qsort(list->entries, list->count, sizeof(snapshot_entry_t),
+          compare_entries);
+
+    /* Of repeated ids the first line wins, as with getpwuid */
+    size_t unique = 0;
+    for (size_t i = 0; i < list->count; i++)
+        if (!unique || list->entries[unique - 1].id != list->entries[i].id)
+            list->entries[unique++] = list->entries[i];
+    list->count = unique;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    /* Names were added in file order, so their offsets keep it */
+    const snapshot_entry_t *x = a, *y = b;
+    if (x->id != y->id) return x->id < y->id ? -1 : 1;
+    return (x->name > y->name) - (x->name < y->name);
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
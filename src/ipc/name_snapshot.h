@@ -0,0 +1,54 @@
+/*
+    Uid and gid names of /etc/passwd and /etc/group as sorted tables in a
+    sealed memfd, mapped read only by every process that forks sessions.
+    Session processes inherit the mapping, so they look names up with a
+    binary search and no syscall, chrooted or not, and ask the parent only
+    for ids the files do not have (names from other NSS sources).
+
+    The forking process checks the files before it forks, at most every
+    name_snapshot_interval seconds, and swaps in a new snapshot when they
+    changed. A session keeps the snapshot it was forked with. User and
+    anonymous workers serve sessions for as long as they have any, so they
+    are sent the memfd of each new snapshot instead, see user_workers.h.
+*/
+
+#ifndef NAME_SNAPSHOT_H
+#define NAME_SNAPSHOT_H
+
+#include <stdint.h>
+
+/*!
+ * @brief Builds the first snapshot, called once before any session process
+ * is forked. Nothing is built with name_snapshot_interval 0 or the threads
+ * session model.
+ */
+void start_name_snapshot(void);
+
+/*!
+ * @brief Rebuilds the snapshot if the files changed, called before forking
+ * a session process. Keeps the current one if that fails.
+ */
+void refresh_name_snapshot(void);
+
+/*!
+ * @brief Sealed memfd of the current snapshot, to pass to a process that
+ * runs from an older one.
+ * @param generation Set to a number that changes with every new snapshot.
+ * @return The descriptor, still owned by the snapshot, -1 without one.
+ */
+int name_snapshot_fd(uint32_t *generation);
+
+/*!
+ * @brief Maps a snapshot passed by name_snapshot_fd in place of the current
+ * one, in a process that does not read the files itself. Closes fd.
+ * @return 1 on success, 0 if fd holds no sealed snapshot, the current one
+ * is kept then.
+ */
+int adopt_name_snapshot(int fd);
+
+/*!
+ * @return Name of the uid or gid in the snapshot, NULL if it has none.
+ */
+const char *lookup_snapshot_name(int is_group, uint32_t id);
+
+#endif /* NAME_SNAPSHOT_H */
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE /* pipe2 */
+#include "nss_helper.h"
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "error.h"
+#include "nss_resolver.h"
+#include "server_state.h"
+#include "session_supervisor.h"
+
+extern server_state_t g_server_state;
+
+static struct
+{
+    ipc_channel_t *channel; /* NULL without a helper */
+    int fd;                 /* Of channel, tracked while it is open */
+    int broken;             /* The helper went away, channel is still set */
+    int stopped;            /* See stop_nss_helper */
+} g_helper = {.fd = -1};
+
+static void run_nss_helper(int channel_fd, int kill_fd)
+    __attribute__((noreturn));
+static void on_accepting_process_gone(evutil_socket_t fd,
+                                      short what,
+                                      void *ctx);
+static void answer_helper_request(struct bufferevent *bev,
+                                  const ipc_header_t *request,
+                                  const void *payload);
+static void on_names_resolved(const nss_name_t *names,
+                              size_t count,
+                              void *ctx);
+static void on_helper_closed(void *ctx);
+static void on_helper_reply(int status,
+                            const void *payload,
+                            size_t length,
+                            void *ctx);
+static void drop_helper(void);
+static int single_threaded(void);
+
+void start_nss_helper(void)
+{
+    if (g_helper.stopped) return;
+
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0)
+    {
+        ERROR("Failed to create name resolver socket: %s", strerror(errno));
+        return;
+    }
+
+    int kill_switch[2]; /* Owned by the supervisor, see on_parent_dead */
+    if (pipe2(kill_switch, O_CLOEXEC) < 0)
+    {
+        ERROR("Failed to create name resolver kill switch: %s",
+              strerror(errno));
+        close(channel[0]);
+        close(channel[1]);
+        return;
+    }
+
+    fflush(stdout); /* Do not duplicate pending log lines in the helper */
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERROR("Failed to fork name resolver: %s", strerror(errno));
+        close(channel[0]);
+        close(channel[1]);
+        close(kill_switch[0]);
+        close(kill_switch[1]);
+        return;
+    }
+
+    if (pid == 0)
+    {
+        close(channel[0]);
+        close(kill_switch[1]);
+        run_nss_helper(channel[1], kill_switch[0]);
+    }
+
+    close(channel[1]);
+    close(kill_switch[0]);
+    supervise_process(
+        g_server_state.base, pid, kill_switch[1], "name resolver", NULL, NULL);
+
+    /* Sessions must not write into it */
+    track_parent_fd(channel[0]);
+    g_helper.fd = channel[0];
+    g_helper.broken = 0;
+    g_helper.channel = open_ipc_channel(g_server_state.base, channel[0]);
+    if (!g_helper.channel)
+    {
+        untrack_parent_fd(g_helper.fd);
+        g_helper.fd = -1;
+        return;
+    }
+    watch_ipc_channel(g_helper.channel, on_helper_closed, NULL);
+    INFO("Name resolver running as process %d", pid);
+}
+
+void stop_nss_helper(void)
+{
+    g_helper.stopped = 1;
+    drop_helper();
+}
+
+void forward_to_nss_helper(ipc_deferred_reply_t *reply,
+                           const ipc_header_t *request,
+                           const void *payload)
+{
+    /* Forking the helper again is only safe while no thread could hold an
+     * NSS lock, see nss_helper.h */
+    if (g_helper.broken)
+    {
+        drop_helper();
+        if (!g_helper.stopped && single_threaded())
+            start_nss_helper();
+        else if (!g_helper.stopped)
+            WARN("Name resolver is gone, showing owners as ids");
+    }
+
+    if (!g_helper.channel ||
+        !send_ipc_request(g_helper.channel,
+                          request->type,
+                          payload,
+                          request->length,
+                          on_helper_reply,
+                          reply))
+        finish_ipc_reply(reply, IPC_STATUS_UNSUPPORTED, NULL);
+}
+
+static void run_nss_helper(int channel_fd, int kill_fd)
+{
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    /* The base shares its epoll instance with the parent, detach it first */
+    event_reinit(g_server_state.base);
+    event_base_free(g_server_state.base);
+    g_server_state.base = NULL;
+    close_parent_fds(-1);
+
+    /* An accepting process that is gone reads nothing more */
+    signal(SIGPIPE, SIG_IGN);
+
+    g_server_state.base = event_base_new();
+    if (!g_server_state.base) exit(1);
+
+    struct event *kill_event = event_new(g_server_state.base,
+                                         kill_fd,
+                                         EV_READ | EV_PERSIST,
+                                         on_accepting_process_gone,
+                                         NULL);
+    event_add(kill_event, NULL);
+
+    nss_resolver_options_t options = {
+        .threads = g_server_state.config.nss_threads,
+        .ttl = g_server_state.config.nss_cache_ttl,
+        .negative_ttl = g_server_state.config.nss_negative_cache_ttl};
+    if (!start_nss_resolver(g_server_state.base, &options))
+        WARN("Owner names are looked up on the name resolver loop");
+
+    serve_ipc_channel(g_server_state.base, channel_fd, answer_helper_request);
+    event_base_dispatch(g_server_state.base);
+    exit(0);
+}
+
+static void on_accepting_process_gone(evutil_socket_t fd,
+                                      short what __attribute__((unused)),
+                                      void *ctx __attribute__((unused)))
+{
+    char dummy;
+    if (read(fd, &dummy, sizeof(dummy)) < 0 && errno == EINTR) return;
+    exit(0);
+}
+
+/* [HELPER] Requests passed on by forward_to_nss_helper */
+static void answer_helper_request(struct bufferevent *bev,
+                                  const ipc_header_t *request,
+                                  const void *payload)
+{
+    ipc_deferred_reply_t *reply = NULL;
+    if (request->type != IPC_RESOLVE_NAMES ||
+        request->length % sizeof(ipc_owner_t) ||
+        !(reply = defer_ipc_reply(bev, request)))
+    {
+        ERROR("Cannot answer name request of %" PRIu32 " bytes",
+              request->length);
+        send_ipc_reply(bev, request, IPC_STATUS_UNSUPPORTED, NULL);
+        return;
+    }
+
+    /* The payload is gone once this returns, the owners are copied */
+    if (!resolve_nss_names((const ipc_owner_t *)payload,
+                           request->length / sizeof(ipc_owner_t),
+                           on_names_resolved,
+                           reply))
+        finish_ipc_reply(reply, IPC_STATUS_UNSUPPORTED, NULL);
+}
+
+static void on_names_resolved(const nss_name_t *names,
+                              size_t count,
+                              void *ctx)
+{
+    ipc_deferred_reply_t *reply = (ipc_deferred_reply_t *)ctx;
+    struct evbuffer *payload = evbuffer_new();
+    if (!payload)
+    {
+        finish_ipc_reply(reply, IPC_STATUS_UNSUPPORTED, NULL);
+        return;
+    }
+
+    /* Ids without a name come as "unknown" as they always did, lookups
+     * that failed as the number, see NSS_NAME_FAILED */
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *name = names[i].status == NSS_NAME_MISSING
+                               ? "unknown"
+                               : names[i].name;
+        evbuffer_add(payload, name, strlen(name) + 1);
+    }
+
+    finish_ipc_reply(reply, IPC_STATUS_OK, payload);
+    evbuffer_free(payload);
+}
+
+/* The descriptor is closed already, its number may come back any time */
+static void on_helper_closed(void *ctx __attribute__((unused)))
+{
+    untrack_parent_fd(g_helper.fd);
+    g_helper.fd = -1;
+    g_helper.broken = 1;
+}
+
+static void on_helper_reply(int status,
+                            const void *payload,
+                            size_t length,
+                            void *ctx)
+{
+    ipc_deferred_reply_t *reply = (ipc_deferred_reply_t *)ctx;
+    struct evbuffer *answer =
+        status == IPC_STATUS_OK ? evbuffer_new() : NULL;
+    if (!answer || (length && evbuffer_add(answer, payload, length) < 0))
+    {
+        /* The session's own request times out at about the same time */
+        finish_ipc_reply(reply, IPC_STATUS_UNSUPPORTED, NULL);
+        if (answer) evbuffer_free(answer);
+        return;
+    }
+
+    finish_ipc_reply(reply, IPC_STATUS_OK, answer);
+    evbuffer_free(answer);
+}
+
+/* Pending requests are answered IPC_STATUS_UNSUPPORTED */
+static void drop_helper(void)
+{
+    untrack_parent_fd(g_helper.fd);
+    g_helper.fd = -1;
+    g_helper.broken = 0;
+
+    ipc_channel_t *channel = g_helper.channel;
+    g_helper.channel = NULL;
+    close_ipc_channel(channel);
+}
+
+static int single_threaded(void)
+{
+    FILE *status = fopen("/proc/self/status", "re");
+    if (!status) return 0;
+
+    char line[128];
+    int threads = 0;
+    while (fgets(line, sizeof(line), status))
+        if (sscanf(line, "Threads: %d", &threads) == 1) break;
+    fclose(status);
+    return threads == 1;
+}
@@ -0,0 +1,46 @@
+/*
+    Name resolver helper process.
+
+    The lookup threads of nss_resolver.h must not run in the accepting
+    process: it forks session processes, and a lock an NSS module (sssd,
+    LDAP) held in a lookup thread at that moment stays held in the child.
+    So every accepting process of the process model forks a helper before
+    it starts any thread of its own. The helper runs the lookup threads on
+    a loop of its own and never forks. The accepting process passes the
+    sessions' IPC_RESOLVE_NAMES requests on to it over an ipc_channel and
+    relays the replies.
+
+    The helper exits with the accepting process or when draining orphans
+    it, sessions show ids the snapshot does not name as numbers from then
+    on. A helper that died is only forked again while the accepting process
+    runs no other thread.
+*/
+
+#ifndef NSS_HELPER_H
+#define NSS_HELPER_H
+
+#include <stddef.h>
+
+#include "ipc_channel.h"
+
+/*!
+ * @brief Forks the helper of the calling accepting process, which must not
+ * run any thread yet.
+ */
+void start_nss_helper(void);
+
+/*!
+ * @brief Stops passing requests on and forks no new helper, called when
+ * the accepting process drains.
+ */
+void stop_nss_helper(void);
+
+/*!
+ * @brief Passes an IPC_RESOLVE_NAMES request on to the helper and finishes
+ * reply with its answer, or with IPC_STATUS_UNSUPPORTED without a helper.
+ */
+void forward_to_nss_helper(ipc_deferred_reply_t *reply,
+                           const ipc_header_t *request,
+                           const void *payload);
+
+#endif
@@ -0,0 +1,516 @@
+#define _GNU_SOURCE /* pipe2 */
+#include "nss_resolver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "structures/flat_table.h"
+
+#define NSS_LOOKUP_BUFFER 0x4000
+
+struct nss_query;
+
+/* A slot of a query waiting for a lookup */
+typedef struct nss_waiter
+{
+    struct nss_query *query;
+    size_t index;
+    struct nss_waiter *next;
+} nss_waiter_t;
+
+typedef struct nss_job
+{
+    uint32_t id;
+    int is_group;
+    nss_waiter_t *waiters; /* Touched by the loop only */
+
+    /* Set by the lookup thread */
+    int status;
+    char name[NAME_CACHE_NAME_LENGTH];
+    unsigned long elapsed_us;
+
+    struct nss_job *next;
+} nss_job_t;
+
+typedef struct nss_query
+{
+    nss_names_cb_t done;
+    void *ctx;
+    size_t count;
+    size_t remaining; /* Names still looked up, and 1 while being set up */
+    nss_name_t names[];
+} nss_query_t;
+
+/* Cached under its ipc_owner_t, is_group 0 or 1 so equal owners compare
+ * equal as bytes */
+typedef struct
+{
+    int64_t expires_ms; /* Monotonic, 0 before the first answer */
+    nss_job_t *job;     /* Lookup in progress */
+    uint8_t status;     /* NSS_NAME_FOUND or NSS_NAME_MISSING */
+    char name[NAME_CACHE_NAME_LENGTH];
+} nss_entry_t;
+
+DEFINE_FLAT_TABLE(nss_cache, ipc_owner_t, nss_entry_t)
+
+/* Filled by keep_entry while pruning */
+typedef struct
+{
+    flat_table_t *kept;
+    int64_t now;
+    int keep_answered; /* Entries that have not expired yet */
+} nss_prune_t;
+
+static struct
+{
+    int started;
+    nss_resolver_options_t options;
+    flat_table_t *cache; /* Only used from the loop, NULL before a name */
+    nss_stats_t stats;
+    unsigned long logged_names; /* stats.names at the last log line */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    nss_job_t *queue_head; /* Jobs waiting for a thread */
+    nss_job_t *queue_tail;
+    nss_job_t *finished; /* Done by the threads, not yet by the loop */
+
+    int wakeup_fd[2]; /* A byte whenever finished stops being empty */
+    struct event *wakeup_event;
+    struct event *stats_event;
+} g_nss = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .wakeup = PTHREAD_COND_INITIALIZER,
+           .wakeup_fd = {-1, -1}};
+
+static void *run_lookup_thread(void *arg);
+static int lookup_nss(int is_group, uint32_t id, char *name, size_t name_size);
+static void run_lookup(nss_job_t *job);
+static void on_finished(evutil_socket_t fd, short events, void *ctx);
+static void finish_job(nss_job_t *job, int64_t now);
+static int wait_for_job(nss_job_t *job, nss_query_t *query, size_t index);
+static void fill_name(nss_query_t *query,
+                      size_t index,
+                      int status,
+                      const char *name);
+static nss_entry_t *find_entry(int is_group, uint32_t id);
+static int prune_cache(void);
+static void keep_entry(void *key, void *value, void *ctx);
+static void on_stats_timer(evutil_socket_t fd, short events, void *ctx);
+static int64_t monotonic_ms(void);
+static unsigned long monotonic_us(void);
+
+int start_nss_resolver(struct event_base *base,
+                       const nss_resolver_options_t *options)
+{
+    if (g_nss.started) return 1;
+
+    g_nss.options = *options;
+
+    if (pipe2(g_nss.wakeup_fd, O_CLOEXEC) != 0)
+    {
+        ERROR("Failed to create NSS wakeup pipe: %s", strerror(errno));
+        return 0;
+    }
+    evutil_make_socket_nonblocking(g_nss.wakeup_fd[0]);
+    evutil_make_socket_nonblocking(g_nss.wakeup_fd[1]);
+    g_nss.wakeup_event = event_new(
+        base, g_nss.wakeup_fd[0], EV_READ | EV_PERSIST, on_finished, NULL);
+    event_add(g_nss.wakeup_event, NULL);
+
+    int threads = 0;
+    for (int i = 0; i < g_nss.options.threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_lookup_thread, NULL) != 0)
+        {
+            ERROR("Failed to start NSS lookup thread %d", i);
+            break;
+        }
+        pthread_detach(thread);
+        threads++;
+    }
+    if (!threads)
+    {
+        /* resolve_nss_names looks names up on the loop then */
+        event_free(g_nss.wakeup_event);
+        close(g_nss.wakeup_fd[0]);
+        close(g_nss.wakeup_fd[1]);
+        return 0;
+    }
+
+    struct timeval interval = {NSS_STATS_INTERVAL, 0};
+    g_nss.stats_event = event_new(base, -1, EV_PERSIST, on_stats_timer, NULL);
+    if (g_nss.stats_event) event_add(g_nss.stats_event, &interval);
+
+    g_nss.started = 1;
+    INFO("Owner names are looked up on %d threads, kept %d seconds, %d "
+         "without a name",
+         threads,
+         g_nss.options.ttl,
+         g_nss.options.negative_ttl);
+    return 1;
+}
+
+int nss_resolver_started(void) { return g_nss.started; }
+
+int resolve_nss_names(const ipc_owner_t *owners,
+                      size_t count,
+                      nss_names_cb_t done,
+                      void *ctx)
+{
+    nss_query_t *query =
+        malloc(sizeof(nss_query_t) + count * sizeof(nss_name_t));
+    if (!query) return 0;
+    query->done = done;
+    query->ctx = ctx;
+    query->count = count;
+    query->remaining = count + 1;
+
+    int64_t now = monotonic_ms();
+    nss_job_t *jobs = NULL, *last = NULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        /* Straight from an IPC payload, not necessarily aligned */
+        ipc_owner_t owner;
+        memcpy(&owner,
+               (const char *)owners + i * sizeof(ipc_owner_t),
+               sizeof(owner));
+        uint32_t id = owner.id;
+        int is_group = owner.is_group ? 1 : 0;
+        g_nss.stats.names++;
+
+        nss_entry_t *entry = find_entry(is_group, id);
+        if (entry && entry->job)
+        {
+            if (wait_for_job(entry->job, query, i)) g_nss.stats.joined++;
+            continue;
+        }
+        if (entry && entry->expires_ms > now)
+        {
+            g_nss.stats.hits++;
+            if (entry->status == NSS_NAME_MISSING) g_nss.stats.negative_hits++;
+            fill_name(query, i, entry->status, entry->name);
+            continue;
+        }
+
+        nss_job_t *job = calloc(1, sizeof(nss_job_t));
+        if (!job)
+        {
+            char number[16];
+            snprintf(number, sizeof(number), "%" PRIu32, id);
+            fill_name(query, i, NSS_NAME_FAILED, number);
+            continue;
+        }
+        job->id = id;
+        job->is_group = is_group;
+        if (!wait_for_job(job, query, i))
+        {
+            free(job);
+            continue;
+        }
+
+        if (!g_nss.started)
+        {
+            /* No threads, as it was before them */
+            run_lookup(job);
+            finish_job(job, now);
+            continue;
+        }
+
+        if (entry) entry->job = job;
+        if (last)
+            last->next = job;
+        else
+            jobs = job;
+        last = job;
+    }
+
+    if (jobs)
+    {
+        pthread_mutex_lock(&g_nss.lock);
+        if (g_nss.queue_tail)
+            g_nss.queue_tail->next = jobs;
+        else
+            g_nss.queue_head = jobs;
+        g_nss.queue_tail = last;
+        pthread_cond_broadcast(&g_nss.wakeup);
+        pthread_mutex_unlock(&g_nss.lock);
+    }
+
+    /* Everything was cached, or looked up right here */
+    if (!--query->remaining)
+    {
+        query->done(query->names, query->count, query->ctx);
+        free(query);
+    }
+    return 1;
+}
+
+void get_nss_stats(nss_stats_t *stats) { *stats = g_nss.stats; }
+
+static void *run_lookup_thread(void *arg __attribute__((unused)))
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&g_nss.lock);
+        while (!g_nss.queue_head)
+            pthread_cond_wait(&g_nss.wakeup, &g_nss.lock);
+
+        nss_job_t *job = g_nss.queue_head;
+        g_nss.queue_head = job->next;
+        if (!g_nss.queue_head) g_nss.queue_tail = NULL;
+        pthread_mutex_unlock(&g_nss.lock);
+
+        run_lookup(job);
+
+        pthread_mutex_lock(&g_nss.lock);
+        int was_empty = !g_nss.finished;
+        job->next = g_nss.finished;
+        g_nss.finished = job;
+        pthread_mutex_unlock(&g_nss.lock);
+
+        /* A full pipe already has the loop's attention */
+        if (was_empty && write(g_nss.wakeup_fd[1], "", 1) < 0 &&
+            errno != EAGAIN)
+            ERROR("Cannot wake the loop for NSS results: %s",
+                  strerror(errno));
+    }
+    return NULL;
+}
+
+static int lookup_nss(int is_group, uint32_t id, char *name, size_t name_size)
+{
+    char buffer[NSS_LOOKUP_BUFFER];
+    const char *found = NULL;
+    int error;
+
+    if (is_group)
+    {
+        struct group grp, *result = NULL;
+        error = getgrgid_r(id, &grp, buffer, sizeof(buffer), &result);
+        if (!error && result) found = result->gr_name;
+    }
+    else
+    {
+        struct passwd pwd, *result = NULL;
+        error = getpwuid_r(id, &pwd, buffer, sizeof(buffer), &result);
+        if (!error && result) found = result->pw_name;
+    }
+
+    if (found)
+    {
+        snprintf(name, name_size, "%s", found);
+        return NSS_NAME_FOUND;
+    }
+
+    /* The errors getpwuid_r(3) lists for a name that does not exist */
+    if (!error || error == ENOENT || error == ESRCH || error == EBADF ||
+        error == EPERM)
+        return NSS_NAME_MISSING;
+    return NSS_NAME_FAILED;
+}
+
+static void run_lookup(nss_job_t *job)
+{
+    nss_lookup_t lookup =
+        g_nss.options.lookup ? g_nss.options.lookup : lookup_nss;
+
+    unsigned long start = monotonic_us();
+    job->status = lookup(job->is_group, job->id, job->name, sizeof(job->name));
+    job->elapsed_us = monotonic_us() - start;
+}
+
+static void on_finished(evutil_socket_t fd,
+                        short events __attribute__((unused)),
+                        void *ctx __attribute__((unused)))
+{
+    char drain[64];
+    while (read(fd, drain, sizeof(drain)) > 0) continue;
+
+    pthread_mutex_lock(&g_nss.lock);
+    nss_job_t *job = g_nss.finished;
+    g_nss.finished = NULL;
+    pthread_mutex_unlock(&g_nss.lock);
+
+    int64_t now = monotonic_ms();
+    while (job)
+    {
+        nss_job_t *next = job->next;
+        finish_job(job, now);
+        job = next;
+    }
+}
+
+/* Caches the result of a lookup and hands it to every query waiting */
+static void finish_job(nss_job_t *job, int64_t now)
+{
+    g_nss.stats.lookups++;
+    g_nss.stats.lookup_us += job->elapsed_us;
+    if (job->elapsed_us > g_nss.stats.slowest_us)
+        g_nss.stats.slowest_us = job->elapsed_us;
+
+    if (job->status == NSS_NAME_FAILED)
+    {
+        g_nss.stats.failures++;
+        snprintf(job->name, sizeof(job->name), "%" PRIu32, job->id);
+    }
+    else if (job->status == NSS_NAME_MISSING)
+        job->name[0] = '\0';
+
+    nss_entry_t *entry = find_entry(job->is_group, job->id);
+    if (entry)
+    {
+        if (entry->job == job) entry->job = NULL;
+
+        /* A failure leaves the entry expired, the next request retries */
+        int ttl = job->status == NSS_NAME_FOUND ? g_nss.options.ttl
+                                                : g_nss.options.negative_ttl;
+        if (job->status != NSS_NAME_FAILED && ttl > 0)
+        {
+            entry->status = (uint8_t)job->status;
+            entry->expires_ms = now + (int64_t)ttl * 1000;
+            snprintf(entry->name, sizeof(entry->name), "%s", job->name);
+        }
+    }
+
+    nss_waiter_t *waiter = job->waiters;
+    while (waiter)
+    {
+        nss_waiter_t *next = waiter->next;
+        fill_name(waiter->query, waiter->index, job->status, job->name);
+        free(waiter);
+        waiter = next;
+    }
+    free(job);
+}
+
+static int wait_for_job(nss_job_t *job, nss_query_t *query, size_t index)
+{
+    nss_waiter_t *waiter = malloc(sizeof(nss_waiter_t));
+    if (!waiter)
+    {
+        char number[16];
+        snprintf(number, sizeof(number), "%" PRIu32, job->id);
+        fill_name(query, index, NSS_NAME_FAILED, number);
+        return 0;
+    }
+
+    waiter->query = query;
+    waiter->index = index;
+    waiter->next = job->waiters;
+    job->waiters = waiter;
+    return 1;
+}
+
+/* Finishes the query with its last name */
+static void fill_name(nss_query_t *query,
+                      size_t index,
+                      int status,
+                      const char *name)
+{
+    query->names[index].status = status;
+    snprintf(query->names[index].name,
+             sizeof(query->names[index].name),
+             "%s",
+             name);
+
+    if (--query->remaining) return;
+    query->done(query->names, query->count, query->ctx);
+    free(query);
+}
+
+/* The entry of the owner, added if missing, NULL if out of memory. Valid
+ * until the next find_entry. */
+static nss_entry_t *find_entry(int is_group, uint32_t id)
+{
+    if (!g_nss.cache && !(g_nss.cache = nss_cache_create())) return NULL;
+
+    ipc_owner_t owner = {.id = id, .is_group = is_group ? 1 : 0};
+    nss_entry_t *entry = nss_cache_lookup(g_nss.cache, owner);
+    if (entry) return entry;
+
+    if (g_nss.cache->count >= NSS_CACHE_MAX_ENTRIES && !prune_cache())
+        return NULL;
+    return flat_table_insert(g_nss.cache, &owner, NULL);
+}
+
+/* Drops expired entries, and all answered ones if that is not enough.
+ * Entries with a lookup in progress stay, their job finds them. */
+static int prune_cache(void)
+{
+    nss_prune_t prune = {.now = monotonic_ms(), .keep_answered = 1};
+    for (;;)
+    {
+        if (!(prune.kept = nss_cache_create())) return 0;
+        flat_table_foreach(g_nss.cache, keep_entry, &prune);
+        if (!prune.keep_answered ||
+            prune.kept->count < NSS_CACHE_MAX_ENTRIES * 3 / 4)
+            break;
+        free_flat_table(prune.kept);
+        prune.keep_answered = 0;
+    }
+
+    INFO("Owner name cache full, kept %zu of %zu entries",
+         prune.kept->count,
+         g_nss.cache->count);
+    free_flat_table(g_nss.cache);
+    g_nss.cache = prune.kept;
+    return 1;
+}
+
+static void keep_entry(void *key, void *value, void *ctx)
+{
+    nss_prune_t *prune = (nss_prune_t *)ctx;
+    const nss_entry_t *entry = (const nss_entry_t *)value;
+    if (!entry->job &&
+        (!prune->keep_answered || entry->expires_ms <= prune->now))
+        return;
+
+    /* Out of memory drops it, as if it had expired */
+    flat_table_insert(prune->kept, key, value);
+}
+
+static void on_stats_timer(evutil_socket_t fd __attribute__((unused)),
+                           short events __attribute__((unused)),
+                           void *ctx __attribute__((unused)))
+{
+    const nss_stats_t *stats = &g_nss.stats;
+    if (stats->names == g_nss.logged_names) return;
+    g_nss.logged_names = stats->names;
+
+    INFO("Owner names: %lu asked, %lu cached (%lu without a name), %lu "
+         "joined a lookup, %lu lookups averaging %llu us, slowest %lu us, "
+         "%lu failed",
+         stats->names,
+         stats->hits,
+         stats->negative_hits,
+         stats->joined,
+         stats->lookups,
+         stats->lookups ? stats->lookup_us / stats->lookups : 0,
+         stats->slowest_us,
+         stats->failures);
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long monotonic_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
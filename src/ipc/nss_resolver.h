@@ -0,0 +1,99 @@
+/*
+    Owner names for the answers to IPC_RESOLVE_NAMES, looked up without
+    blocking the loop. getpwuid_r and getgrgid_r run on a few threads of
+    their own, so a slow directory service behind NSS (sssd, LDAP) delays
+    the sessions that asked for those names, not every other session. The
+    threads run in the name resolver helper, never in a process that forks,
+    see nss_helper.h.
+
+    Answers are cached for a time to live, ids without a name for a shorter
+    one, and an id being looked up is looked up once however many requests
+    want it. Lookups that failed are not cached.
+*/
+
+#ifndef NSS_RESOLVER_H
+#define NSS_RESOLVER_H
+
+#include <event2/event.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ipc_channel.h"
+#include "name_cache.h"
+
+#define NSS_CACHE_MAX_ENTRIES 65536 /* Expired entries go first past this */
+#define NSS_STATS_INTERVAL 300      /* Seconds between counter log lines */
+
+/* Result of a lookup */
+#define NSS_NAME_FOUND 0
+#define NSS_NAME_MISSING 1 /* The id has no name */
+#define NSS_NAME_FAILED 2  /* NSS could not say, name holds the number */
+
+/*!
+ * @brief Looks one id up, called on a resolver thread.
+ * @return NSS_NAME_FOUND with the name in name, NSS_NAME_MISSING or
+ * NSS_NAME_FAILED.
+ */
+typedef int (*nss_lookup_t)(int is_group,
+                            uint32_t id,
+                            char *name,
+                            size_t name_size);
+
+typedef struct
+{
+    int threads;
+    int ttl;          /* Seconds a name is kept, 0 not at all */
+    int negative_ttl; /* Seconds an id without a name is */
+    nss_lookup_t lookup; /* NULL for getpwuid_r and getgrgid_r */
+} nss_resolver_options_t;
+
+typedef struct
+{
+    int status; /* NSS_NAME_* */
+    char name[NAME_CACHE_NAME_LENGTH];
+} nss_name_t;
+
+/* Since start_nss_resolver */
+typedef struct
+{
+    unsigned long names;         /* Asked for by resolve_nss_names */
+    unsigned long hits;          /* Answered from the cache */
+    unsigned long negative_hits; /* Of those, ids without a name */
+    unsigned long joined;        /* Waited for a lookup already running */
+    unsigned long lookups;       /* Done on the threads */
+    unsigned long failures;
+    unsigned long long lookup_us; /* Time spent in lookups, all threads */
+    unsigned long slowest_us;
+} nss_stats_t;
+
+/*!
+ * @brief Starts the lookup threads, results are delivered on base. Once per
+ * process, later calls do nothing. The process must not fork afterwards.
+ * @return 0 if the threads or their result pipe could not be created.
+ */
+int start_nss_resolver(struct event_base *base,
+                       const nss_resolver_options_t *options);
+
+int nss_resolver_started(void);
+
+/*!
+ * @param names One per owner of resolve_nss_names, valid during the call.
+ */
+typedef void (*nss_names_cb_t)(const nss_name_t *names,
+                               size_t count,
+                               void *ctx);
+
+/*!
+ * @brief Names count owners, from the cache or the lookup threads.
+ * @return 0 if out of memory, done is never called then. Otherwise done is
+ * called exactly once, before returning if every name was cached, from the
+ * loop of start_nss_resolver when the last lookup finished if not.
+ */
+int resolve_nss_names(const ipc_owner_t *owners,
+                      size_t count,
+                      nss_names_cb_t done,
+                      void *ctx);
+
+void get_nss_stats(nss_stats_t *stats);
+
+#endif /* NSS_RESOLVER_H */
@@ -6,34 +6,89 @@
 #include <pwd.h>
 #include <shadow.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "auth_throttle.h"
+#include "error.h"
+#include "server_state.h"
+#include "session_cgroup.h"
+#include "session_fs.h"
+
 #define ROOT "root"
+#define NSS_BUFFER_LENGTH 0x4000
+
+extern server_state_t g_server_state;
 
 /*
     TODO: Port send_control_message instead of passing a raw buffer to format
    using snprintf and send
 */
 
+/* Reentrant lookups only, sessions of the threaded model authenticate
+ * concurrently from several threads. */
+static struct passwd *lookup_user(const char *username,
+                                  struct passwd *pwd,
+                                  char *buffer,
+                                  size_t buffer_size);
+static int login_anonymous(connection_t *connection);
+
+static struct passwd *lookup_user(const char *username,
+                                  struct passwd *pwd,
+                                  char *buffer,
+                                  size_t buffer_size)
+{
+    struct passwd *result = NULL;
+    if (getpwnam_r(username, pwd, buffer, buffer_size, &result) != 0)
+        return NULL;
+    return result;
+}
+
 int user_exists(const char *username, connection_t *connection)
 {
+    struct passwd pwd;
+    char buffer[NSS_BUFFER_LENGTH];
+
     if ((strncmp(username, ROOT, strlen(ROOT)) != 0) &&
-        (getpwnam(username) != NULL))
+        (lookup_user(username, &pwd, buffer, sizeof(buffer)) != NULL))
     {
-        strncpy(connection->username, username, 256);
+        snprintf(connection->username,
+                 sizeof(connection->username),
+                 "%s",
+                 username);
         return 1;
     }
     return 0;
 }
 
-int authenticate_and_switch_user(const char *username,
-                                 const char *password,
-                                 char *error_buf)
+int is_anonymous_user(const char *username)
+{
+    if (!g_server_state.config.anonymous_root[0]) return 0;
+    return strcasecmp(username, "anonymous") == 0 ||
+           strcasecmp(username, "ftp") == 0;
+}
+
+int lookup_user_ids(const char *username, uint32_t *uid, uint32_t *gid)
 {
-    struct passwd *pwd = getpwnam(username);
-    if (!pwd)
+    struct passwd pwd;
+    char buffer[NSS_BUFFER_LENGTH];
+    if (!lookup_user(username, &pwd, buffer, sizeof(buffer))) return 0;
+
+    *uid = pwd.pw_uid;
+    *gid = pwd.pw_gid;
+    return 1;
+}
+
+int verify_user_password(const char *username,
+                         const char *password,
+                         char *error_buf)
+{
+    struct passwd pwd;
+    char buffer[NSS_BUFFER_LENGTH];
+    if (!lookup_user(username, &pwd, buffer, sizeof(buffer)))
     {
         if (error_buf)
         {
@@ -42,9 +97,10 @@ int authenticate_and_switch_user(const char *username,
         return 0;
     }
 
-    struct spwd *shadow_entry;
+    struct spwd shadow_buf;
+    struct spwd *shadow_entry = NULL;
 
-    shadow_entry = getspnam(username);
+    getspnam_r(username, &shadow_buf, buffer, sizeof(buffer), &shadow_entry);
     if (!shadow_entry)
     {
         if (error_buf)
@@ -54,10 +110,23 @@ int authenticate_and_switch_user(const char *username,
         return 0;
     }
 
+    struct crypt_data *crypt_state = calloc(1, sizeof(struct crypt_data));
+    if (!crypt_state)
+    {
+        if (error_buf)
+            snprintf(error_buf, 256, "530 Out of memory for '%s'\r\n", username);
+        return 0;
+    }
+
     char *salt = shadow_entry->sp_pwdp;
-    char *encrypted_passwd = crypt(password, salt);
+    int slot = acquire_crypt_slot();
+    char *encrypted_passwd = crypt_r(password, salt, crypt_state);
+    int matches = encrypted_passwd &&
+                  strcmp(encrypted_passwd, shadow_entry->sp_pwdp) == 0;
+    release_crypt_slot(slot);
+    free(crypt_state);
 
-    if (strcmp(encrypted_passwd, shadow_entry->sp_pwdp) != 0)
+    if (!matches)
     {
         if (error_buf)
         {
@@ -69,46 +138,235 @@ int authenticate_and_switch_user(const char *username,
         return 0;
     }
 
+    return 1;
+}
+
+int lookup_user_identity(const char *username, user_identity_t *identity)
+{
+    struct passwd pwd;
+    char buffer[NSS_BUFFER_LENGTH];
+    if (!lookup_user(username, &pwd, buffer, sizeof(buffer))) return 0;
+
+    snprintf(identity->name, sizeof(identity->name), "%s", username);
+    snprintf(identity->root, sizeof(identity->root), "%s", pwd.pw_dir);
+    identity->uid = pwd.pw_uid;
+    identity->gid = pwd.pw_gid;
+
+    /* What initgroups would set, within CFTP_MAX_USER_GROUPS */
+    int ngroups = CFTP_MAX_USER_GROUPS;
+    if (getgrouplist(username, pwd.pw_gid, identity->groups, &ngroups) < 0)
+    {
+        WARN("%s is in more than %d groups, extra groups are ignored",
+             username,
+             CFTP_MAX_USER_GROUPS);
+        ngroups = CFTP_MAX_USER_GROUPS;
+    }
+    identity->ngroups = ngroups;
+    return 1;
+}
+
+int lookup_anonymous_identity(user_identity_t *identity)
+{
+    if (!lookup_user_identity(g_server_state.config.anonymous_user, identity))
+        return 0;
+
+    /* No supplementary groups, the account only needs to read the tree */
+    identity->ngroups = 0;
+    snprintf(identity->root,
+             sizeof(identity->root),
+             "%s",
+             g_server_state.config.anonymous_root);
+    return 1;
+}
+
+int switch_to_identity(const user_identity_t *identity, char *error_buf)
+{
+    if (setgroups(identity->ngroups, identity->groups) != 0)
+    {
+        perror("setgroups failed");
+        if (error_buf)
+            snprintf(error_buf,
+                     256,
+                     "530 permission denied for '%.200s'\r\n",
+                     identity->name);
+        return 0;
+    }
+
+    /* Still root and /sys still visible */
+    enter_session_cgroup(identity->uid);
+
     /*  Set up chroot jail to user's home directory */
-    if (chroot(pwd->pw_dir) != 0)
+    if (chroot(identity->root) != 0 || chdir("/") != 0)
     {
         perror("chroot failed");
         if (error_buf)
-        {
-            snprintf(
-                error_buf, 256, "530 chroot failed for '%s'\r\n", username);
-        }
+            snprintf(error_buf,
+                     256,
+                     "530 chroot failed for '%.200s'\r\n",
+                     identity->name);
         return 0;
     }
 
-    /*  Change working directory to new root */
-    if (chdir("/") != 0)
+    if (setgid(identity->gid) != 0 || setuid(identity->uid) != 0)
     {
-        perror("chdir failed");
+        perror("setgid/setuid failed");
         if (error_buf)
-        {
-            snprintf(error_buf, 256, "530 chdir failed for '%s'\r\n", username);
-        }
+            snprintf(error_buf,
+                     256,
+                     "530 permission denied for '%.200s'\r\n",
+                     identity->name);
         return 0;
     }
 
-    if (setgid(pwd->pw_gid) != 0 || setuid(pwd->pw_uid) != 0)
+    if (error_buf)
+        snprintf(error_buf,
+                 256,
+                 "230 User '%.200s' authenticated successfully\r\n",
+                 identity->name);
+    return 1;
+}
+
+void set_session_identity(connection_t *connection,
+                          const user_identity_t *identity)
+{
+    connection->uid = identity->uid;
+    connection->gid = identity->gid;
+
+    int ngroups = identity->ngroups < CFTP_MAX_SESSION_GROUPS
+                      ? identity->ngroups
+                      : CFTP_MAX_SESSION_GROUPS;
+    memcpy(connection->groups, identity->groups, ngroups * sizeof(gid_t));
+    connection->ngroups = ngroups;
+}
+
+int switch_to_user(const char *username, char *error_buf)
+{
+    user_identity_t identity;
+    if (!lookup_user_identity(username, &identity))
     {
-        perror("setgid/setuid failed");
         if (error_buf)
         {
-            snprintf(
-                error_buf, 256, "530 permission denied for '%s'\r\n", username);
+            snprintf(error_buf, 256, "530 User '%s' not found\r\n", username);
         }
         return 0;
     }
 
-    if (error_buf)
+    return switch_to_identity(&identity, error_buf);
+}
+
+int switch_to_anonymous(char *error_buf)
+{
+    user_identity_t identity;
+    if (!lookup_anonymous_identity(&identity))
     {
-        snprintf(error_buf,
-                 256,
-                 "230 User '%s' authenticated successfully\r\n",
-                 username);
+        if (error_buf)
+            snprintf(error_buf,
+                     256,
+                     "530 Anonymous account '%.200s' not found\r\n",
+                     g_server_state.config.anonymous_user);
+        return 0;
+    }
+
+    return switch_to_identity(&identity, error_buf);
+}
+
+int authenticate_and_switch_user(const char *username,
+                                 const char *password,
+                                 char *error_buf)
+{
+    return verify_user_password(username, password, error_buf) &&
+           switch_to_user(username, error_buf);
+}
+
+int load_session_identity(connection_t *connection, char *error_buf)
+{
+    struct passwd pwd;
+    char buffer[NSS_BUFFER_LENGTH];
+    if (!lookup_user(connection->username, &pwd, buffer, sizeof(buffer)))
+    {
+        if (error_buf)
+            snprintf(error_buf,
+                     256,
+                     "530 User '%.200s' not found\r\n",
+                     connection->username);
+        return 0;
     }
+
+    connection->uid = pwd.pw_uid;
+    connection->gid = pwd.pw_gid;
+
+    int ngroups = CFTP_MAX_SESSION_GROUPS;
+    if (getgrouplist(
+            connection->username, pwd.pw_gid, connection->groups, &ngroups) <
+        0)
+    {
+        WARN("%s is in more than %d groups, extra groups are ignored",
+             connection->username,
+             CFTP_MAX_SESSION_GROUPS);
+        ngroups = CFTP_MAX_SESSION_GROUPS;
+    }
+    connection->ngroups = ngroups;
+
+    /* Without a chroot the home directory itself becomes the session root */
+    if (connection->shared_loop &&
+        session_fs_open_root(connection, pwd.pw_dir) < 0)
+    {
+        if (error_buf)
+            snprintf(error_buf,
+                     256,
+                     "530 chroot failed for '%.200s'\r\n",
+                     connection->username);
+        return 0;
+    }
+
     return 1;
 }
+
+int authenticate_session(connection_t *connection, const char *password)
+{
+    if (connection->anonymous) return login_anonymous(connection);
+
+    if (!verify_user_password(
+            connection->username, password, connection->error_buf))
+        return 0;
+
+    if (!load_session_identity(connection, connection->error_buf)) return 0;
+
+    if (connection->shared_loop) return 1;
+
+    return switch_to_user(connection->username, connection->error_buf) &&
+           session_fs_open_root(connection, "/") == 0;
+}
+
+/* Any password is accepted, the session only gets the anonymous account's
+ * identity and the read only tree */
+static int login_anonymous(connection_t *connection)
+{
+    if (!lookup_user_ids(g_server_state.config.anonymous_user,
+                         &connection->uid,
+                         &connection->gid))
+    {
+        snprintf(connection->error_buf,
+                 sizeof(connection->error_buf),
+                 "530 Anonymous account '%.200s' not found\r\n",
+                 g_server_state.config.anonymous_user);
+        return 0;
+    }
+    connection->ngroups = 0;
+
+    if (connection->shared_loop)
+    {
+        if (session_fs_open_root(connection,
+                                 g_server_state.config.anonymous_root) == 0)
+            return 1;
+
+        snprintf(connection->error_buf,
+                 sizeof(connection->error_buf),
+                 "530 Cannot open anonymous root '%.200s'\r\n",
+                 g_server_state.config.anonymous_root);
+        return 0;
+    }
+
+    return switch_to_anonymous(connection->error_buf) &&
+           session_fs_open_root(connection, "/") == 0;
+}
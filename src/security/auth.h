@@ -1,11 +1,99 @@
 #ifndef AUTH_H
 #define AUTH_H
 
+#include <limits.h>
+
 #include "connection.h"
 
+#define CFTP_MAX_USER_GROUPS 1024 /* Supplementary groups a process gets */
+
+/* Everything a process needs to become a user, looked up ahead so that a
+ * process forked from one running threads makes no NSS call, see
+ * fork_session */
+typedef struct
+{
+    char name[256];
+    uint32_t uid;
+    uint32_t gid;
+    gid_t groups[CFTP_MAX_USER_GROUPS];
+    int ngroups;         /* 0 drops every supplementary group */
+    char root[PATH_MAX]; /* Home directory, or anonymous_root */
+} user_identity_t;
+
 int user_exists(const char *username, connection_t *connection);
+
+/*!
+ * @brief Tells whether USER asks for an anonymous login, only ever true
+ * with anonymous_root configured.
+ */
+int is_anonymous_user(const char *username);
+
+/*!
+ * @brief Resolves the uid and gid of a user without touching any session.
+ * @return 1 if the user exists, 0 otherwise.
+ */
+int lookup_user_ids(const char *username, uint32_t *uid, uint32_t *gid);
+
+/*!
+ * @brief Looks up the uid, gid, groups and home directory of a user.
+ * @return 1 if the user exists, 0 otherwise.
+ */
+int lookup_user_identity(const char *username, user_identity_t *identity);
+
+/*!
+ * @brief Looks up anonymous_user, jailed in anonymous_root without
+ * supplementary groups.
+ * @return 1 if the account exists, 0 otherwise.
+ */
+int lookup_anonymous_identity(user_identity_t *identity);
+
+/*!
+ * @brief Chroots the whole process into identity->root and drops to it
+ * without any NSS call.
+ */
+int switch_to_identity(const user_identity_t *identity, char *error_buf);
+
+/*!
+ * @brief Copies uid, gid and supplementary groups of identity to the
+ * session, as load_session_identity does for a process model session.
+ */
+void set_session_identity(connection_t *connection,
+                          const user_identity_t *identity);
+
+/*!
+ * @brief Checks the password against the shadow database, no side effects.
+ */
+int verify_user_password(const char *username,
+                         const char *password,
+                         char *error_buf);
+
+/*!
+ * @brief Chroots the whole process into the user's home and drops to the user.
+ */
+int switch_to_user(const char *username, char *error_buf);
+
+/*!
+ * @brief Chroots the whole process into anonymous_root and drops to the
+ * unprivileged anonymous_user without supplementary groups.
+ */
+int switch_to_anonymous(char *error_buf);
+
 int authenticate_and_switch_user(const char *username,
                                  const char *password,
                                  char *error_buf);
 
+/*!
+ * @brief Fills uid, gid and supplementary groups of the session, in the
+ * threaded model also opens the home directory as session root.
+ */
+int load_session_identity(connection_t *connection, char *error_buf);
+
+/*!
+ * @brief Authenticates the PASS of a session for the configured session model.
+ * @details Process model sessions switch the whole process to the user,
+ * threaded sessions only record the identity for session_fs_enter.
+ * Anonymous sessions accept any password.
+ */
+int authenticate_session(connection_t *connection, const char *password);
+
 #endif
@@ -0,0 +1,266 @@
+#include "auth_throttle.h"
+
+#include <errno.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "control_handler.h"
+#include "error.h"
+#include "ftp_status_codes.h"
+#include "server_state.h"
+
+#define AUTH_THROTTLE_BUCKETS 1024
+#define AUTH_THROTTLE_WAYS 8 /* Entries per bucket, the oldest is evicted */
+#define AUTH_CRYPT_RETRY_MS 50 /* Waits on one slot before looking again */
+#define AUTH_MAX_DELAY_SHIFT 20
+
+extern server_state_t g_server_state;
+
+typedef struct
+{
+    uint64_t key; /* Hash of the address or user name, 0 marks a free entry */
+    uint32_t failures;
+    uint32_t reserved;
+    int64_t last_failure; /* Milliseconds on CLOCK_MONOTONIC */
+} auth_failure_t;
+
+/* Shared by every process forked after start_auth_throttle */
+typedef struct
+{
+    pthread_mutex_t lock; /* Robust, for the failure table */
+    auth_failure_t failures[AUTH_THROTTLE_BUCKETS][AUTH_THROTTLE_WAYS];
+    uint32_t next_slot; /* Where the next hash starts looking */
+    int crypt_slots;
+    pthread_mutex_t crypt[]; /* Held while hashing, robust */
+} auth_throttle_t;
+
+static auth_throttle_t *g_throttle;
+
+static void lock_robust(pthread_mutex_t *lock);
+static void init_robust(pthread_mutex_t *lock);
+static auth_failure_t *find_failures(uint64_t key, int64_t now, int create);
+static uint64_t hash_key(char kind, const char *value);
+static int64_t now_ms(void);
+static void on_login_delay(evutil_socket_t fd, short what, void *arg);
+
+void start_auth_throttle(void)
+{
+    int slots = g_server_state.config.auth_crypt_concurrency;
+    if (slots == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        slots = cpus > 1 ? (int)(cpus / 2) : 1;
+    }
+
+    size_t size = sizeof(auth_throttle_t) + slots * sizeof(pthread_mutex_t);
+    void *shared = mmap(NULL,
+                        size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS,
+                        -1,
+                        0);
+    if (shared == MAP_FAILED)
+    {
+        ERROR("Cannot map login throttle: %s, failed logins are not delayed",
+              strerror(errno));
+        return;
+    }
+
+    g_throttle = (auth_throttle_t *)shared;
+    init_robust(&g_throttle->lock);
+    g_throttle->crypt_slots = slots;
+    for (int i = 0; i < slots; i++) init_robust(&g_throttle->crypt[i]);
+
+    INFO("At most %d password hashes at a time, failed logins wait %d to %d "
+         "seconds",
+         slots,
+         g_server_state.config.auth_failure_delay,
+         g_server_state.config.auth_failure_delay_max);
+}
+
+int auth_throttle_failed(const char *source_ip, const char *username)
+{
+    int delay = g_server_state.config.auth_failure_delay;
+    if (!g_throttle || !delay) return 0;
+
+    uint64_t keys[2] = {hash_key('a', source_ip), hash_key('u', username)};
+    int64_t now = now_ms();
+    uint32_t failures = 0;
+
+    lock_robust(&g_throttle->lock);
+    for (int i = 0; i < 2; i++)
+    {
+        if (!keys[i]) continue;
+        auth_failure_t *entry = find_failures(keys[i], now, 1);
+        entry->failures++;
+        entry->last_failure = now;
+        if (entry->failures > failures) failures = entry->failures;
+    }
+    pthread_mutex_unlock(&g_throttle->lock);
+
+    /* Doubles with every failure of the address or the user */
+    uint32_t shift = failures - 1;
+    if (shift > AUTH_MAX_DELAY_SHIFT) shift = AUTH_MAX_DELAY_SHIFT;
+    int64_t delay_ms = ((int64_t)delay * 1000) << shift;
+    int64_t max_ms = (int64_t)g_server_state.config.auth_failure_delay_max *
+                     1000;
+    if (delay_ms > max_ms) delay_ms = max_ms;
+
+    return (int)delay_ms;
+}
+
+void auth_throttle_succeeded(const char *username)
+{
+    uint64_t key = hash_key('u', username);
+    if (!g_throttle || !key) return;
+
+    lock_robust(&g_throttle->lock);
+    auth_failure_t *entry = find_failures(key, now_ms(), 0);
+    if (entry) entry->key = 0;
+    pthread_mutex_unlock(&g_throttle->lock);
+}
+
+int acquire_crypt_slot(void)
+{
+    if (!g_throttle) return -1;
+
+    int slots = g_throttle->crypt_slots;
+    uint32_t start = __sync_fetch_and_add(&g_throttle->next_slot, 1);
+    for (;;)
+    {
+        for (int i = 0; i < slots; i++)
+        {
+            int slot = (int)((start + i) % slots);
+            int result = pthread_mutex_trylock(&g_throttle->crypt[slot]);
+            if (result == EOWNERDEAD)
+                pthread_mutex_consistent(&g_throttle->crypt[slot]);
+            if (result == 0 || result == EOWNERDEAD) return slot;
+        }
+
+        /* All taken, queue on one for a while and look again */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += AUTH_CRYPT_RETRY_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int slot = (int)(start % slots);
+        int result =
+            pthread_mutex_timedlock(&g_throttle->crypt[slot], &deadline);
+        if (result == EOWNERDEAD)
+            pthread_mutex_consistent(&g_throttle->crypt[slot]);
+        if (result == 0 || result == EOWNERDEAD) return slot;
+    }
+}
+
+void release_crypt_slot(int slot)
+{
+    if (slot >= 0) pthread_mutex_unlock(&g_throttle->crypt[slot]);
+}
+
+void reject_login(connection_t *connection, int delay_ms)
+{
+    if (!connection->bev) return;
+
+    if (delay_ms <= 0)
+    {
+        send_control_message(
+            connection, FTP_STATUS_NOT_LOGGED_IN, "Invalid credentials");
+        bufferevent_enable(connection->bev, EV_READ);
+        resume_control_input(connection);
+        return;
+    }
+
+    if (!connection->login_delay_event)
+        connection->login_delay_event =
+            evtimer_new(connection->base, on_login_delay, connection);
+    if (!connection->login_delay_event)
+    {
+        reject_login(connection, 0);
+        return;
+    }
+
+    bufferevent_disable(connection->bev, EV_READ);
+    struct timeval delay = {delay_ms / 1000, (delay_ms % 1000) * 1000};
+    evtimer_add(connection->login_delay_event, &delay);
+}
+
+static void on_login_delay(evutil_socket_t fd __attribute__((unused)),
+                           short what __attribute__((unused)),
+                           void *arg)
+{
+    reject_login((connection_t *)arg, 0);
+}
+
+static void lock_robust(pthread_mutex_t *lock)
+{
+    /* The holder died mid update, an entry may be off by one failure */
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) pthread_mutex_consistent(lock);
+}
+
+static void init_robust(pthread_mutex_t *lock)
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+static auth_failure_t *find_failures(uint64_t key, int64_t now, int create)
+{
+    auth_failure_t *bucket =
+        g_throttle->failures[key % AUTH_THROTTLE_BUCKETS];
+    int64_t window = (int64_t)g_server_state.config.auth_failure_window * 1000;
+
+    auth_failure_t *victim = &bucket[0];
+    for (int i = 0; i < AUTH_THROTTLE_WAYS; i++)
+    {
+        auth_failure_t *entry = &bucket[i];
+        if (entry->key && now - entry->last_failure > window) entry->key = 0;
+
+        if (entry->key == key) return entry;
+        if (victim->key && (!entry->key ||
+                            entry->last_failure < victim->last_failure))
+            victim = entry;
+    }
+
+    if (!create) return NULL;
+
+    memset(victim, 0, sizeof(*victim));
+    victim->key = key;
+    return victim;
+}
+
+static uint64_t hash_key(char kind, const char *value)
+{
+    /* Unknown users all log in with an empty name, only the address counts
+     * for them */
+    if (!value || !value[0]) return 0;
+
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ (unsigned char)kind) * 1099511628211ULL;
+    for (const char *c = value; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+static int64_t now_ms(void)
+{
+    /* The same clock in every process */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,56 @@
+/*
+    Failed login backoff and the cap on concurrent password hashing.
+
+    Failed logins are counted per client address and per user name in
+    memory shared by every process of the server. Each failure delays its
+    530 exponentially, starting at auth_failure_delay seconds and doubling
+    up to auth_failure_delay_max, and the connection reads nothing more
+    until then. Every password is still checked, a correct one logs in
+    whatever failed before, so nobody can lock a user or an address out
+    with wrong passwords. Counts are forgotten auth_failure_window seconds
+    after the last failure, a good login forgets the failures of its user.
+
+    crypt() with yescrypt or sha512 takes tens of milliseconds of CPU, at
+    most auth_crypt_concurrency hashes run at the same time across all
+    processes so that transfers keep their CPU during a password spray.
+
+    The counts do not survive an upgrade.
+*/
+
+#ifndef AUTH_THROTTLE_H
+#define AUTH_THROTTLE_H
+
+#include "connection.h"
+
+/*!
+ * @brief Allocates the shared tables, called once in the main process
+ * before anything is forked.
+ */
+void start_auth_throttle(void);
+
+/*!
+ * @brief Counts a failed login.
+ * @return Milliseconds its 530 is delayed.
+ */
+int auth_throttle_failed(const char *source_ip, const char *username);
+
+/*!
+ * @brief Forgets the failures of a user after a good login.
+ */
+void auth_throttle_succeeded(const char *username);
+
+/*!
+ * @brief Waits for one of the auth_crypt_concurrency hashing slots.
+ * @return The slot for release_crypt_slot, -1 without a cap.
+ */
+int acquire_crypt_slot(void);
+
+void release_crypt_slot(int slot);
+
+/*!
+ * @brief Answers PASS with 530 after delay_ms, nothing is read from the
+ * client until then.
+ */
+void reject_login(connection_t *connection, int delay_ms);
+
+#endif
@@ -63,6 +63,34 @@ def test_invalid_password(ftp_test_user):
         try_ftp_tls_login(username, "wrongpassword")
 
 
+def test_invalid_password_is_delayed(ftp_test_user):
+    # auth_failure_delay=1 holds back the 530 for at least a second
+    username, _ = ftp_test_user
+    start = time.time()
+    with pytest.raises(error_perm):
+        try_ftp_tls_login(username, "wrongpassword")
+    assert time.time() - start >= 0.9
+
+
+def test_correct_login_after_failures(ftp_test_user):
+    # Failures delay their own 530, they never refuse the right password
+    username, password = ftp_test_user
+
+    def login(password):
+        ftps = FTP_TLS()
+        ftps.connect(FTP_HOST, FTP_PORT, timeout=60)
+        ftps.auth()
+        ftps.login(username, password)
+        ftps.quit()
+
+    for _ in range(3):
+        with pytest.raises(error_perm):
+            login("wrongpassword")
+    start = time.time()
+    login(password)
+    assert time.time() - start < 2
+
+
 def test_invalid_user():
     with pytest.raises(error_perm):
         try_ftp_tls_login("nonexistent_user", "fakepass")
@@ -0,0 +1,185 @@
+/*
+    Owner name lookups in the parent, see src/ipc/nss_resolver.h, against a
+    stand-in for NSS that takes SLOW_LOOKUP_MS per id the way an overloaded
+    LDAP server would. Checks that the loop keeps running while names are
+    looked up, that requests for an id being looked up wait for that lookup,
+    and that names and missing ids are cached until their time to live ends.
+    Run from the build directory:
+
+        ctest -R nss_resolver
+*/
+
+#include <event2/event.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+#include "nss_resolver.h"
+
+#define SLOW_LOOKUP_MS 200
+#define TICK_MS 10
+#define MISSING_ID 5000 /* Ids from here have no name */
+#define FAILING_ID 666  /* NSS cannot say */
+
+#define CHECK(condition)                                          \
+    do                                                            \
+    {                                                             \
+        if (!(condition))                                         \
+        {                                                         \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__,    \
+                    #condition);                                  \
+            g_failures++;                                         \
+        }                                                         \
+    } while (0)
+
+typedef struct
+{
+    int answered;
+    nss_name_t names[8];
+    size_t count;
+} answer_t;
+
+static int g_failures;
+static int g_slow_calls; /* Updated from the lookup threads */
+static int g_ticks;
+static int g_waiting;
+static struct event_base *g_base;
+
+static int slow_lookup(int is_group, uint32_t id, char *name, size_t size);
+static void on_answer(const nss_name_t *names, size_t count, void *ctx);
+static void on_tick(evutil_socket_t fd, short events, void *ctx);
+static void log_to_stderr(const char *message);
+static void wait_for_answers(void);
+static int ask(answer_t *answer, const ipc_owner_t *owners, size_t count);
+
+int main(void)
+{
+    initialize_logger(log_to_stderr);
+    g_base = event_base_new();
+    nss_resolver_options_t options = {
+        .threads = 2, .ttl = 1, .negative_ttl = 1, .lookup = slow_lookup};
+    CHECK(start_nss_resolver(g_base, &options));
+
+    struct event *tick = event_new(g_base, -1, EV_PERSIST, on_tick, NULL);
+    struct timeval interval = {0, TICK_MS * 1000};
+    event_add(tick, &interval);
+
+    /* Five slow lookups on two threads, one asked for twice */
+    ipc_owner_t first[] = {
+        {1, 0}, {2, 0}, {1, 1}, {MISSING_ID, 0}, {FAILING_ID, 0}};
+    ipc_owner_t second[] = {{1, 0}};
+    answer_t a = {0}, b = {0};
+    CHECK(ask(&a, first, 5) == 0);
+    CHECK(ask(&b, second, 1) == 0);
+    wait_for_answers();
+
+    CHECK(a.answered && b.answered);
+    CHECK(a.names[0].status == NSS_NAME_FOUND &&
+          !strcmp(a.names[0].name, "user1"));
+    CHECK(!strcmp(a.names[1].name, "user2"));
+    CHECK(!strcmp(a.names[2].name, "group1"));
+    CHECK(a.names[3].status == NSS_NAME_MISSING);
+    CHECK(a.names[4].status == NSS_NAME_FAILED &&
+          !strcmp(a.names[4].name, "666"));
+    CHECK(b.names[0].status == NSS_NAME_FOUND &&
+          !strcmp(b.names[0].name, "user1"));
+    CHECK(__sync_fetch_and_add(&g_slow_calls, 0) == 5);
+
+    /* At least ~3 slow lookups in a row, a blocked loop would not tick */
+    CHECK(g_ticks >= 2 * SLOW_LOOKUP_MS / TICK_MS);
+
+    nss_stats_t stats;
+    get_nss_stats(&stats);
+    CHECK(stats.names == 6 && stats.hits == 0 && stats.joined == 1);
+    CHECK(stats.lookups == 5 && stats.failures == 1);
+    CHECK(stats.slowest_us >= SLOW_LOOKUP_MS * 1000UL);
+
+    /* Cached names and missing ids are answered before returning, the
+     * failed id is looked up again */
+    ipc_owner_t third[] = {{1, 0}, {MISSING_ID, 0}};
+    answer_t c = {0};
+    CHECK(ask(&c, third, 2) == 1);
+    CHECK(!strcmp(c.names[0].name, "user1"));
+    CHECK(c.names[1].status == NSS_NAME_MISSING);
+
+    ipc_owner_t failing[] = {{FAILING_ID, 0}};
+    answer_t d = {0};
+    CHECK(ask(&d, failing, 1) == 0);
+    wait_for_answers();
+    CHECK(__sync_fetch_and_add(&g_slow_calls, 0) == 6);
+
+    /* Past the time to live, looked up again */
+    struct timespec ttl = {1, 100 * 1000 * 1000};
+    nanosleep(&ttl, NULL);
+    answer_t e = {0};
+    CHECK(ask(&e, third, 2) == 0);
+    wait_for_answers();
+    CHECK(!strcmp(e.names[0].name, "user1"));
+    CHECK(__sync_fetch_and_add(&g_slow_calls, 0) == 8);
+
+    get_nss_stats(&stats);
+    printf("%lu names, %lu cached (%lu without a name), %lu joined, %lu "
+           "lookups averaging %llu us, slowest %lu us, %lu failed\n",
+           stats.names,
+           stats.hits,
+           stats.negative_hits,
+           stats.joined,
+           stats.lookups,
+           stats.lookups ? stats.lookup_us / stats.lookups : 0,
+           stats.slowest_us,
+           stats.failures);
+    CHECK(stats.hits == 2 && stats.negative_hits == 1);
+
+    event_free(tick);
+    if (g_failures) fprintf(stderr, "%d checks failed\n", g_failures);
+    return g_failures ? 1 : 0;
+}
+
+static int slow_lookup(int is_group, uint32_t id, char *name, size_t size)
+{
+    __sync_fetch_and_add(&g_slow_calls, 1);
+    struct timespec delay = {0, SLOW_LOOKUP_MS * 1000 * 1000};
+    nanosleep(&delay, NULL);
+
+    if (id == FAILING_ID) return NSS_NAME_FAILED;
+    if (id >= MISSING_ID) return NSS_NAME_MISSING;
+    snprintf(name, size, "%s%" PRIu32, is_group ? "group" : "user", id);
+    return NSS_NAME_FOUND;
+}
+
+static void on_answer(const nss_name_t *names, size_t count, void *ctx)
+{
+    answer_t *answer = (answer_t *)ctx;
+    answer->answered = 1;
+    answer->count = count;
+    memcpy(answer->names, names, count * sizeof(nss_name_t));
+    g_waiting--;
+}
+
+static void on_tick(evutil_socket_t fd __attribute__((unused)),
+                    short events __attribute__((unused)),
+                    void *ctx __attribute__((unused)))
+{
+    g_ticks++;
+}
+
+static void log_to_stderr(const char *message) { fputs(message, stderr); }
+
+/* 1 if answered before returning */
+static int ask(answer_t *answer, const ipc_owner_t *owners, size_t count)
+{
+    g_waiting++;
+    CHECK(resolve_nss_names(owners, count, on_answer, answer));
+    return answer->answered;
+}
+
+static void wait_for_answers(void)
+{
+    g_ticks = 0;
+    while (g_waiting > 0 && g_ticks < 10 * 1000 / TICK_MS)
+        event_base_loop(g_base, EVLOOP_ONCE);
+    CHECK(g_waiting == 0);
+}